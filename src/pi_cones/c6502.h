@@ -389,4 +389,17 @@ static const c6502_op_code_t C6502_OP_CODE[C6502_NUM_OPCODES] = {
 	{C6502_INS_ISB, "ISB", C6502_ADDR_ABSOLUTE_X, 3, 7, 0, C6502_FL_UNDOCUMENTED }   // opcode: 0xFF
 };
 
+// true if the instruction reads the memory its operand addresses; stores only write it, and jumps only take the address
+static inline bool c6502_reads_operand(c6502_instr ins)
+{
+	switch (ins) {
+	case C6502_INS_STA: case C6502_INS_STX: case C6502_INS_STY: case C6502_INS_SAX:
+	case C6502_INS_SHA: case C6502_INS_SHS: case C6502_INS_SHX: case C6502_INS_SHY:
+	case C6502_INS_JMP: case C6502_INS_JSR:
+		return false;
+	default:
+		return true;
+	}
+}
+
 #endif
@@ -42,7 +42,7 @@ typedef struct {
 	uint8_t flags15;
 } ines_header;
 
-bool ines_load_cart(const void* cart);
-void ines_unload_cart();
+bool ines_load_cart(nessys_t* nes, const void* cart);
+void ines_unload_cart(nessys_t* nes);
 
 #endif
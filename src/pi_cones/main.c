@@ -6,14 +6,41 @@
 #endif
 #include "font/font.h"
 #include "nessys.h"
+#include "mapper.h"
+#include "nesaudio.h"
+#include "nescache.h"
+#include "nessave.h"
+#include "nesstate.h"
+#include "nesrewind.h"
+#include "nesmovie.h"
+#include "nesenv.h"
 #include <stdio.h>
 
 #define PPU_MULTI_THREAD 1
 
+// Build the cpu loop once per mapper family, with that family's hooks called directly, and the ones it doesn't use
+// left out; with this off, every cart runs the generic loop, which calls the hooks through nes
+#define CPU_LOOP_SPECIALIZE 1
+
+#ifdef _MSC_VER
+#define CPU_LOOP_INLINE __forceinline
+#else
+#define CPU_LOOP_INLINE inline __attribute__((always_inline))
+#endif
+
 #ifdef WIN32
 #define FB_FLIP_XY 0
+// battery backed ram is saved to a file named after the rom
+#define SAV_FILE sav_file
 #else
 #define SYS_CLK_KHZ 250000
+// battery backed ram is journaled to flash
+#define SAV_FILE NULL
+// joypad 0 is an nes controller; the pico drives its latch and clock, and reads its data back, which is low while
+// a button is down; with nothing plugged in, the pull up reads as no buttons
+#define JOYPAD_PIN_LATCH 27
+#define JOYPAD_PIN_CLK 28
+#define JOYPAD_PIN_DATA 16
 
 // Flip XY causes image to be addressed in column major order
 // When sent to the display controller, we set the orientation
@@ -55,20 +82,47 @@
 // Single or double buffering
 #define FB_BUFFERS 2
 
-// additional memory used for some mappers for 4 screen, or additional cpu/ppu ram
+// cart scoped arena, for 4 screen vram, prg/chr ram, mapper state, the run ahead state and the bank cache; sized
+// from the cart header at load
+// the pico only has sram left for a small one; carts that need more fail to load, unless the instance sets
+// lend_back_buffer, which lets the arena take the back framebuffer and drops the display to single buffering
+#ifdef WIN32
+#define NES_AUX_MEMORY_SIZE (256 * 1024)
+#else
 #define NES_AUX_MEMORY_SIZE 2048
+#endif
+// allocations are aligned for word and dma access
+#define NES_AUX_ALIGN 8
+#define NES_AUX_ALIGN_UP(s) (((s) + NES_AUX_ALIGN - 1) & ~(NES_AUX_ALIGN - 1))
 
+// the instance on the screen, and its framebuffer, textbox and cart arena
+nessys_t main_nes;
 uint16_t framebuffer[FB_BUFFERS * FB_PIXELS];
+TEXTBOX_T tbox;
+uint64_t aux_mem[NES_AUX_MEMORY_SIZE / sizeof(uint64_t)];
+nessys_snd_ring_t snd_ring;
 
-uint16_t* draw_frame = framebuffer;
-uint16_t* disp_frame = framebuffer + (FB_BUFFERS-1) * FB_PIXELS;
+static void cpu_loop_select(nessys_t* nes, uint16_t mapper_id);
 
-nessys_t nes;
-TEXTBOX_T tbox;
+// persist the session's battery backed ram; off for benches and movies, so they neither restore nor overwrite the save
+bool session_save = true;
+#ifdef WIN32
+// movie to record the session to, or to play back, from the command line
+const char* movie_record_path = NULL;
+const char* movie_play_path = NULL;
+// file the sound is written to, from the command line
+const char* wav_path = NULL;
+// rom file run in place of the built in rom, from the command line, and the file its save goes to: <rom>.sav, or
+// pi_cones.sav for the built in rom, so each cart keeps its own
+const char* rom_path = NULL;
+char sav_file[MAX_PATH] = "pi_cones.sav";
+#endif
 
-uint8_t aux_mem[NES_AUX_MEMORY_SIZE];
-uint8_t* aux_ptr = aux_mem;
-uint32_t free_aux = NES_AUX_MEMORY_SIZE;
+// Run ahead: each frame, the frames after the real one are emulated too, and the last of them is displayed, so input
+// shows up that many frames sooner; 0 is off. The state they run from is kept in what the cart leaves of its arena,
+// ahead of the bank cache; it never makes a cart borrow the back framebuffer, so where it doesn't fit, run ahead is off
+#define RUN_AHEAD_FRAMES 0
+uint run_ahead_frames = RUN_AHEAD_FRAMES;
 
 // Number of pixels each core attempts to render each pass
 #define RENDER_PIXEL_INC_LOG2 4
@@ -77,32 +131,168 @@ uint32_t free_aux = NES_AUX_MEMORY_SIZE;
 // number of frames until we rerender the textbox
 #define TBOX_RENDER_FRAME_PERIOD 15
 
-void* alloc_aux(uint32_t size)
+// Turbo: runs as fast as it can, muted, rendering and sending only every turbo.skip'th frame; the frames between
+// are logic only. skip is picked from the measured frame times, so the display still updates TURBO_DISPLAY_FPS
+// times a second. Holding select and pressing right turns it on and off
+#define TURBO_DISPLAY_FPS 30
+#define TURBO_MAX_SKIP 32
+#define TURBO_START_SKIP 4
+#define TURBO_COMBO ((1 << NESSYS_STD_CONTROLLER_BUTTON_SELECT) | (1 << NESSYS_STD_CONTROLLER_BUTTON_RIGHT))
+
+typedef struct {
+	bool enable;
+	bool combo_held;  // from when the combo is pressed until both its buttons are let go
+	uint skip;
+	// frame times, in us, of the frames rendered and of the ones in between
+	uint32_t render_us;
+	uint32_t logic_us;
+	uint32_t render_us_sum;
+	uint32_t logic_us_sum;
+	uint32_t render_count;
+	uint32_t logic_count;
+} turbo_t;
+
+// for the session instance (nessys_t.session)
+turbo_t turbo;
+
+// Sets up the arena for a cart that needs size bytes; returns false if there's nowhere it fits
+bool init_aux(nessys_t* nes, uint32_t size)
+{
+    nes->aux_used = 0;
+    nes->aux_base = nes->aux_mem;
+    nes->aux_size = NES_AUX_MEMORY_SIZE;
+    if (size <= nes->aux_size) return true;
+#if FB_BUFFERS > 1
+    if (!nes->lend_back_buffer) return false;
+    // the framebuffer array is only 2 byte aligned
+    nes->aux_base = (uint8_t*)NES_AUX_ALIGN_UP((uintptr_t)(nes->framebuffer + (FB_BUFFERS - 1) * FB_PIXELS));
+    nes->aux_size = (uint32_t)((uint8_t*)(nes->framebuffer + FB_BUFFERS * FB_PIXELS) - nes->aux_base);
+    if (size <= nes->aux_size) {
+        printf("Cart needs %d bytes of ram; the back framebuffer is lent to it, and the display is single buffered\n", size);
+        nes->draw_frame = nes->framebuffer;
+        nes->disp_frame = nes->framebuffer;
+        return true;
+    }
+#endif
+    nes->aux_base = nes->aux_mem;
+    nes->aux_size = NES_AUX_MEMORY_SIZE;
+    return false;
+}
+
+void* alloc_aux(nessys_t* nes, uint32_t size)
 {
-    if (size > free_aux) {
+    size = NES_AUX_ALIGN_UP(size);
+    if (size > nes->aux_size - nes->aux_used) {
         return NULL;
     }
 
-    void* new_mem = aux_ptr;
-    aux_ptr += size;
-    free_aux -= size;
+    void* new_mem = nes->aux_base + nes->aux_used;
+    nes->aux_used += size;
     return new_mem;
 }
 
-void dealloc_aux()
+// releases everything the cart allocated, and gives back the framebuffer if the cart borrowed it
+void dealloc_aux(nessys_t* nes)
+{
+    if (nes->aux_base != nes->aux_mem) {
+        memset(nes->aux_base, 0, nes->aux_size);
+        nes->draw_frame = nes->framebuffer;
+        nes->disp_frame = nes->framebuffer + (FB_BUFFERS - 1) * FB_PIXELS;
+    }
+    nes->aux_base = nes->aux_mem;
+    nes->aux_size = NES_AUX_MEMORY_SIZE;
+    nes->aux_used = 0;
+}
+
+// Sets up an instance, with the framebuffer of FB_BUFFERS frames it renders to, the textbox drawn over it and its
+// NES_AUX_MEMORY_SIZE byte cart arena
+void nes_instance_init(nessys_t* nes, uint16_t* fb, TEXTBOX_T* tb, uint64_t* aux)
+{
+    nes->framebuffer = fb;
+    nes->draw_frame = fb;
+    nes->disp_frame = fb + (FB_BUFFERS - 1) * FB_PIXELS;
+    nes->tbox = tb;
+    nes->index_frame = NULL;
+    nes->render_inline = false;
+    nes->logic_only = false;
+    nes->lend_back_buffer = false;
+    nes->session = false;
+    nes->save_enable = false;
+    nes->sram_budget_report = false;
+    nes->aux_mem = (uint8_t*)aux;
+    nes->aux_base = nes->aux_mem;
+    nes->aux_size = NES_AUX_MEMORY_SIZE;
+    nes->aux_used = 0;
+    nes->cpu_loop = CPU_LOOP_GENERIC;
+    nes->run_ahead_state = NULL;
+    nes->run_ahead_size = 0;
+    nes->cache = NULL;
+    nes->c1_started = false;
+    nes->c1_park = false;
+    nes->c1_parked = false;
+    nessys_init(nes);
+}
+
+#ifdef WIN32
+// an instance and its memory in one block, for running several at once; its textbox stays empty
+typedef struct {
+    nessys_t nes;
+    uint16_t framebuffer[FB_BUFFERS * FB_PIXELS];
+    TEXTBOX_T tbox;
+    uint64_t aux_mem[NES_AUX_MEMORY_SIZE / sizeof(uint64_t)];
+} nes_instance_t;
+
+// Makes an instance on the heap; returns NULL if there's no memory for it
+nessys_t* nes_instance_create()
+{
+    nes_instance_t* inst = calloc(1, sizeof(nes_instance_t));
+    if (inst == NULL) return NULL;
+    nes_instance_init(&inst->nes, inst->framebuffer, &inst->tbox, inst->aux_mem);
+    return &inst->nes;
+}
+
+// Frees an instance made by nes_instance_create, once its cart is unloaded
+void nes_instance_destroy(nessys_t* nes)
+{
+    free((nes_instance_t*)nes);
+}
+#endif
+
+#ifndef WIN32
+// start of the heap and stack, from the linker script
+extern char __end__, __StackLimit;
+#endif
+
+// Prints where the sram goes, with the loaded cart
+void print_sram_budget(nessys_t* nes)
 {
-    aux_ptr = aux_mem;
-    free_aux = NES_AUX_MEMORY_SIZE;
+    uint32_t cart_ram = nes->prg_ram_size + nes->ppu.chr_ram_size + ((nes->ppu.mem_4screen) ? NESSYS_PPU_MEM_SIZE : 0);
+    uint32_t run_ahead = (nes->run_ahead_state) ? NES_AUX_ALIGN_UP(nes->run_ahead_size) : 0;
+    uint32_t bank_cache = nescache_arena_size(nes);
+
+    printf("sram budget, mapper %d:\n", nes->mapper_id);
+    printf("  framebuffer   %6d%s\n", (uint32_t)(FB_BUFFERS * FB_PIXELS * sizeof(uint16_t)), (nes->aux_base != nes->aux_mem) ? " (back buffer lent to the cart arena)" : "");
+    printf("  nes state     %6d\n", (uint32_t)sizeof(nessys_t));
+    printf("  sound ring    %6d\n", (uint32_t)sizeof(nessys_snd_ring_t));
+    printf("  cart arena    %6d: cart ram %d (prg %d, chr %d, 4 screen %d), mapper state %d, run ahead %d, bank cache %d, free %d\n",
+        nes->aux_size, cart_ram, nes->prg_ram_size, nes->ppu.chr_ram_size, (nes->ppu.mem_4screen) ? NESSYS_PPU_MEM_SIZE : 0,
+        nes->aux_used - cart_ram - run_ahead - bank_cache, run_ahead, bank_cache, nes->aux_size - nes->aux_used);
+#ifndef WIN32
+    printf("  headroom      %6d (between static data and the stack)\n", (uint32_t)(&__StackLimit - &__end__));
+#endif
 }
 
 static const
 #include "rom.h"
 
-void flip_framebuffer()
+// cart the session runs
+const uint8_t* session_rom = rom_nes;
+
+void flip_framebuffer(nessys_t* nes)
 {
-    uint16_t* temp = draw_frame;
-    draw_frame = disp_frame;
-    disp_frame = temp;
+    uint16_t* temp = nes->draw_frame;
+    nes->draw_frame = nes->disp_frame;
+    nes->disp_frame = temp;
 }
 
 #ifndef WIN32
@@ -128,9 +318,42 @@ void lcd_init(bool serial)
     }
     st7789_init(&cfg, SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_ORIENT);
 }
+
+void pico_joypad_init()
+{
+    gpio_init(JOYPAD_PIN_LATCH);
+    gpio_set_dir(JOYPAD_PIN_LATCH, GPIO_OUT);
+    gpio_put(JOYPAD_PIN_LATCH, 0);
+    gpio_init(JOYPAD_PIN_CLK);
+    gpio_set_dir(JOYPAD_PIN_CLK, GPIO_OUT);
+    gpio_put(JOYPAD_PIN_CLK, 1);
+    gpio_init(JOYPAD_PIN_DATA);
+    gpio_set_dir(JOYPAD_PIN_DATA, GPIO_IN);
+    gpio_pull_up(JOYPAD_PIN_DATA);
+}
+
+// the controller's buttons, latched, then shifted out A first, the same order as the nes reads them
+uint8_t pico_joypad()
+{
+    uint8_t joypad = 0;
+    uint i;
+
+    gpio_put(JOYPAD_PIN_LATCH, 1);
+    busy_wait_us_32(12);
+    gpio_put(JOYPAD_PIN_LATCH, 0);
+    busy_wait_us_32(6);
+    for (i = 0; i < 8; i++) {
+        if (!gpio_get(JOYPAD_PIN_DATA)) joypad |= 1 << i;
+        gpio_put(JOYPAD_PIN_CLK, 0);
+        busy_wait_us_32(6);
+        gpio_put(JOYPAD_PIN_CLK, 1);
+        busy_wait_us_32(6);
+    }
+    return joypad;
+}
 #endif
 
-bool ines_load_cart(const void* cart)
+bool ines_load_cart(nessys_t* nes, const void* cart)
 {
     const uint8_t* cur_pos = cart;
 
@@ -151,49 +374,90 @@ bool ines_load_cart(const void* cart)
     bool nes2 = (hdr->flags7 & INES_FLAGS7_NES2) ? true : false;
 
     // get mirroring mode
-    nes.ppu.name_tbl_vert_mirror = hdr->flags6 & INES_FLAGS6_MIRRORING;
+    nes->ppu.name_tbl_vert_mirror = hdr->flags6 & INES_FLAGS6_MIRRORING;
 
     // get mapper id
-    nes.mapper_id = ((hdr->flags6 & INES_FLAGS6_MAPPER) >> 4) | (hdr->flags7 & INES_FLAGS7_MAPPER);
-
-    // allocate space for 4 screen vram
-    if (hdr->flags6 & INES_FLAGS6_MIRROR_CTRL_DISABLE) {
-        nes.ppu.mem_4screen = alloc_aux(NESSYS_PPU_MEM_SIZE);
+    nes->mapper_id = ((hdr->flags6 & INES_FLAGS6_MAPPER) >> 4) | (hdr->flags7 & INES_FLAGS7_MAPPER);
+    if (!nessys_mapper_supported(nes->mapper_id)) {
+        printf("Mapper %d isn't supported\n", nes->mapper_id);
+        return false;
     }
 
-    // allocate space for prg rom/ram and chr rom
+    // prg rom and chr rom are used in place
     if (hdr->prg_rom_size) {
-        nes.prg_rom_size = hdr->prg_rom_size;
-        if (nes2) nes.prg_rom_size |= (hdr->flags9 & 0xf) << 8;
-        nes.prg_rom_size *= 0x4000;
-        nes.prg_rom_base = cur_pos;
-        cur_pos += nes.prg_rom_size;
+        nes->prg_rom_size = hdr->prg_rom_size;
+        if (nes2) nes->prg_rom_size |= (hdr->flags9 & 0xf) << 8;
+        nes->prg_rom_size *= 0x4000;
+        nes->prg_rom_base = cur_pos;
+        cur_pos += nes->prg_rom_size;
+    }
+    if (hdr->chr_rom_size) {
+        nes->ppu.chr_rom_size = hdr->chr_rom_size;
+        if (nes2) nes->ppu.chr_rom_size |= (hdr->flags9 & 0xf0) << 4;
+        nes->ppu.chr_rom_size *= 0x2000;
+        nes->ppu.chr_rom_base = cur_pos;
+        cur_pos += nes->ppu.chr_rom_size;
+    }
+
+    // nes 2.0 gives the volatile and battery backed ram sizes as shift counts, in the low and high nibbles
+    // ines 1.0 headers nearly always give 0, so a cart without a battery gets what its mapper's boards have; nrom and
+    // the discrete boards have none, which keeps them in the arena, and the display double buffered, on the pico
+    uint32_t ram_size = (nes2) ? (((hdr->flags10 & 0xf) ? 64 << (hdr->flags10 & 0xf) : 0) +
+        ((hdr->flags10 >> 4) ? 64 << (hdr->flags10 >> 4) : 0)) :
+        (hdr->prg_ram_size) ? hdr->prg_ram_size * 0x2000 :
+        (hdr->flags6 & INES_FLAGS6_PERS_PRG_RAM) ? 0x2000 : nessys_mapper_find(nes->mapper_id)->prg_ram_default;
+    uint32_t chr_ram_size = 0;
+    if (!hdr->chr_rom_size) {
+        chr_ram_size = (nes2 && (hdr->flags11 & 0xf)) ? 64 << (hdr->flags11 & 0xf) : 0x2000;
+    }
+    bool mem_4screen = (hdr->flags6 & INES_FLAGS6_MIRROR_CTRL_DISABLE) != 0;
+
+    // size the arena for everything the cart allocates, before allocating any of it
+    uint32_t aux_need = NES_AUX_ALIGN_UP(ram_size) + NES_AUX_ALIGN_UP(chr_ram_size) +
+        ((mem_4screen) ? NES_AUX_ALIGN_UP(NESSYS_PPU_MEM_SIZE) : 0) + NES_AUX_ALIGN_UP(nessys_mapper_state_size(nes));
+    if (!init_aux(nes, aux_need)) {
+        printf("Cart needs %d bytes of ram, more than is available\n", aux_need);
+        nes->prg_rom_base = NULL;
+        nes->prg_rom_size = 0;
+        nes->ppu.chr_rom_base = NULL;
+        nes->ppu.chr_rom_size = 0;
+        return false;
+    }
+
+    if (mem_4screen) {
+        nes->ppu.mem_4screen = alloc_aux(nes, NESSYS_PPU_MEM_SIZE);
     }
-    uint32_t ram_size = (nes2) ? ((hdr->flags10 & 0xf) ? 64 << (hdr->flags10 & 0xf) : 0) :
-        ((hdr->prg_ram_size) ? hdr->prg_ram_size * 0x2000 : 0x2000);
     if (ram_size) {
-        nes.prg_ram_size = ram_size;
-        nes.prg_ram_base = alloc_aux(ram_size);
+        nes->prg_ram_size = ram_size;
+        nes->prg_ram_base = alloc_aux(nes, ram_size);
     }
-    if (hdr->chr_rom_size) {
-        nes.ppu.chr_rom_size = hdr->chr_rom_size;
-        if (nes2) nes.ppu.chr_rom_size |= (hdr->flags9 & 0xf0) << 4;
-        nes.ppu.chr_rom_size *= 0x2000;
-        nes.ppu.chr_rom_base = cur_pos;
-        cur_pos += nes.ppu.chr_rom_size;
-        //} else if (hdr.flags11 & 0xf) {
-        //	nes.ppu.chr_ram_size = 64 << (hdr.flags11 & 0xf);
-        //	nes.ppu.chr_ram_base = (uint8_t*)malloc(nes.ppu.chr_ram_size);
-        //	if (nes.ppu.chr_ram_base == NULL) return false;
-    } else {
-        nes.ppu.chr_ram_size = 0x2000;  // 8KB of ram
-        nes.ppu.chr_ram_base = alloc_aux(nes.ppu.chr_ram_size);
+    if (chr_ram_size) {
+        nes->ppu.chr_ram_size = chr_ram_size;
+        nes->ppu.chr_ram_base = alloc_aux(nes, chr_ram_size);
     }
 
 	nessys_default_memmap(nes);
 	bool success = nessys_init_mapper(nes);
 	if (success) {
+		cpu_loop_select(nes, nes->mapper_id);
+		nes->cart_id = nessys_cart_id(nes);
 		nessys_power_cycle(nes);
+		// other instances, such as environments or batch runs, leave the session's save and rewind history alone
+		if (nes->session) {
+			if (nes->save_enable && (hdr->flags6 & INES_FLAGS6_PERS_PRG_RAM) && nes->prg_ram_base) nessave_load(nes, SAV_FILE);
+			nesrewind_reset(nes);
+		}
+		if (run_ahead_frames) {
+			nes->run_ahead_size = nesstate_size(nes);
+			nes->run_ahead_state = alloc_aux(nes, nes->run_ahead_size);
+			if (nes->run_ahead_state == NULL) {
+				printf("Run ahead is off; its state needs %d bytes, and the cart arena has %d left\n", nes->run_ahead_size, nes->aux_size - nes->aux_used);
+				nes->run_ahead_size = 0;
+			}
+		}
+		// last, so the cache gets whatever the cart left
+		nescache_init(nes);
+		if (nes->sram_budget_report) print_sram_budget(nes);
 	} else {
 		nessys_unload_cart(nes);
 	}
@@ -201,16 +465,19 @@ bool ines_load_cart(const void* cart)
 	return success;
 }
 
-void ines_unload_cart()
+void ines_unload_cart(nessys_t* nes)
 {
-	nessys_cleanup_mapper();
-
-	nes.ppu.mem_4screen = NULL;
-    nes.prg_ram_base = NULL;
-    nes.prg_ram_size = 0;
-    nes.ppu.chr_ram_base = NULL;
-    nes.ppu.chr_ram_size = 0;
-    dealloc_aux();
+	if (nes->session) nessave_close();
+	nessys_cleanup_mapper(nes);
+	nes->run_ahead_state = NULL;
+	nes->run_ahead_size = 0;
+
+	nes->ppu.mem_4screen = NULL;
+    nes->prg_ram_base = NULL;
+    nes->prg_ram_size = 0;
+    nes->ppu.chr_ram_base = NULL;
+    nes->ppu.chr_ram_size = 0;
+    dealloc_aux(nes);
 }
 
 #ifdef WIN32
@@ -266,6 +533,9 @@ LRESULT WINAPI win32_msg_proc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
 		//	CloseHandle(h_thread);
 		//	h_thread = NULL;
 		//}
+		nesaudio_cleanup();
+		nessave_close();
+		if (movie_record_path) nesmovie_record_stop(&main_nes, movie_record_path);
 		exit(0);
 	}
 
@@ -336,20 +606,35 @@ uint time_us_32()
 	return timeGetTime() * 1000;
 }
 
+// the keyboard, as joypad 0: arrows, x for A, z for B, right shift for select, and enter for start
+uint8_t win32_joypad()
+{
+	static const int key[8] = { 'X', 'Z', VK_RSHIFT, VK_RETURN, VK_UP, VK_DOWN, VK_LEFT, VK_RIGHT };
+	uint8_t joypad = 0;
+	uint i;
+
+	if (GetForegroundWindow() != hwnd) return 0;
+	for (i = 0; i < 8; i++) {
+		if (GetAsyncKeyState(key[i]) & 0x8000) joypad |= 1 << i;
+	}
+	return joypad;
+}
+
 void win32_ppu_entry(LPVOID d)
 {
-	process_ppu();
+	process_ppu((nessys_t*)d);
 }
 
 #endif
 
 
 #ifdef WIN32
-void process_pixels(uint min_x, uint max_x, uint y, render_state_t* rstate)
+void process_pixels(nessys_t* nes, uint min_x, uint max_x, uint y, render_state_t* rstate)
 #else
-void __no_inline_not_in_flash_func(process_pixels)(uint min_x, uint max_x, uint y, render_state_t* rstate)
+void __no_inline_not_in_flash_func(process_pixels)(nessys_t* nes, uint min_x, uint max_x, uint y, render_state_t* rstate)
 #endif
 {
+	TEXTBOX_T* tbox = nes->tbox;
 	uint16_t text_color = 0xf800;
 
 	bool sprite_hit;
@@ -368,110 +653,112 @@ void __no_inline_not_in_flash_func(process_pixels)(uint min_x, uint max_x, uint
 	uint x;
 
 	bool enable_background, enable_sprite;
-	//uint tile_base_x = (nes.ppu.reg[0] << 8) & 0x100;
-	uint tile_base_y = (nes.ppu.reg[0] << 7) & 0x100;
+	// the mapper gives each tile its own palette, instead of each 16x16
+	bool tile_attrib = nes->ppu.attrib_per_row;
+	//uint tile_base_x = (nes->ppu.reg[0] << 8) & 0x100;
+	uint tile_base_y = (nes->ppu.reg[0] << 7) & 0x100;
 
-	//tile_base_x += nes.ppu.scroll[0];
-	tile_base_y += nes.ppu.scroll_y;
+	//tile_base_x += nes->ppu.scroll[0];
+	tile_base_y += nes->ppu.scroll_y;
 
 	for (x = min_x; x < max_x; x++) {
-		bool in_text = x >= tbox.start_x && x < tbox.end_x && y >= tbox.start_y && y < tbox.end_y;
-		//in_text = in_text && (nes.rendered_frames == 0);
+		bool in_text = x >= tbox->start_x && x < tbox->end_x && y >= tbox->start_y && y < tbox->end_y;
+		//in_text = in_text && (nes->rendered_frames == 0);
 		if (in_text) {
-			//if(rstate == &nes.c1_rstate) text_color = 0x07e0;
-			if (!tbox.line_done) {
+			//if(rstate == &nes->c1_rstate) text_color = 0x07e0;
+			if (!tbox->line_done) {
 				// We're in the text bounding box
 				// Now check if we hit the glyph
-				in_text = (tbox.cur_glyph << tbox.offset_x) & 0x80;
+				in_text = (tbox->cur_glyph << tbox->offset_x) & 0x80;
 			} else {
 				in_text = false;
 			}
-			if (x == tbox.end_x - 1) {
+			if (x == tbox->end_x - 1) {
 				// end of row
-				tbox.offset_x = 0;
-				tbox.char_index = 0;
-				tbox.offset_y++;
-				tbox.line_done = false;
-				if (tbox.offset_y >= tbox.font->height) {
+				tbox->offset_x = 0;
+				tbox->char_index = 0;
+				tbox->offset_y++;
+				tbox->line_done = false;
+				if (tbox->offset_y >= tbox->font->height) {
 					// end of a line
-					tbox.offset_y = 0;
-					tbox.line++;
+					tbox->offset_y = 0;
+					tbox->line++;
 				}
-				textbox_set_cur_glyph(&tbox);
+				textbox_set_cur_glyph(tbox);
 			} else {
-				tbox.offset_x++;
-				if (tbox.offset_x >= tbox.font->width) {
+				tbox->offset_x++;
+				if (tbox->offset_x >= tbox->font->width) {
 					// end of a character
-					tbox.offset_x = 0;
-					tbox.char_index++;
-					textbox_set_cur_glyph(&tbox);
+					tbox->offset_x = 0;
+					tbox->char_index++;
+					textbox_set_cur_glyph(tbox);
 				}
 			}
 		}
 
 		// PPU processing
 		// determine if we need to process sprites or thte background
-		enable_background = (nes.ppu.reg[1] & 0x8) && ((x >= 8) || (nes.ppu.reg[1] & 0x2));
-		enable_sprite = (nes.ppu.reg[1] & 0x10) && ((x >= 8) || (nes.ppu.reg[1] & 0x4)) &&
-			(x >= nes.ppu.scan_line_min_sprite_x) && (x <= nes.ppu.scan_line_max_sprite_x);
+		enable_background = (nes->ppu.reg[1] & 0x8) && ((x >= 8) || (nes->ppu.reg[1] & 0x2));
+		enable_sprite = (nes->ppu.reg[1] & 0x10) && ((x >= 8) || (nes->ppu.reg[1] & 0x4)) &&
+			(x >= nes->ppu.scan_line_min_sprite_x) && (x <= nes->ppu.scan_line_max_sprite_x);
 
 		// First check for sprite hit
 		sprite_hit = false;
-		if (enable_sprite && (nes.ppu.scan_line_sprite[x] & 0x3)) {
-			if (rstate->sprite_index != (nes.ppu.scan_line_sprite[x] & 0xfc)) {
-				rstate->sprite_index = (nes.ppu.scan_line_sprite[x] & 0xfc);
-				//sprite_y = y - nes.ppu.oam[rstate->sprite_index];
+		if (enable_sprite && (nes->ppu.scan_line_sprite[x] & 0x3)) {
+			if (rstate->sprite_index != (nes->ppu.scan_line_sprite[x] & 0xfc)) {
+				rstate->sprite_index = (nes->ppu.scan_line_sprite[x] & 0xfc);
+				//sprite_y = y - nes->ppu.oam[rstate->sprite_index];
 				//// Flip y if vertical flip bit is set
-				//sprite_y = (nes.ppu.oam[rstate->sprite_index + 2] & 0x80) ? (7 + ((nes.ppu.reg[0] >> 1) & 0x8)) - sprite_y : sprite_y;
-				//pat_addr = nes.ppu.oam[rstate->sprite_index + 1];
+				//sprite_y = (nes->ppu.oam[rstate->sprite_index + 2] & 0x80) ? (7 + ((nes->ppu.reg[0] >> 1) & 0x8)) - sprite_y : sprite_y;
+				//pat_addr = nes->ppu.oam[rstate->sprite_index + 1];
 				//// for 8x16 sprites, lsb is the bank select
 				//// otherwise, bank select is bit 3 ppu reg0
-				//pat_addr |= 0x100 & (((pat_addr << 8) & (((uint16_t)nes.ppu.reg[0]) << 3)) |
-				//	((((uint16_t)nes.ppu.reg[0]) << 5) & ~(((uint16_t)nes.ppu.reg[0]) << 3)));
+				//pat_addr |= 0x100 & (((pat_addr << 8) & (((uint16_t)nes->ppu.reg[0]) << 3)) |
+				//	((((uint16_t)nes->ppu.reg[0]) << 5) & ~(((uint16_t)nes->ppu.reg[0]) << 3)));
 				//// clear out lsb for 8x16, and fill it in based on whether sprite y is 8 or above
-				//pat_addr &= 0xfffe | ~(((uint16_t)nes.ppu.reg[0]) >> 5);
-				//pat_addr |= (((uint16_t)nes.ppu.reg[0]) >> 5) & (sprite_y >= 8);
+				//pat_addr &= 0xfffe | ~(((uint16_t)nes->ppu.reg[0]) >> 5);
+				//pat_addr |= (((uint16_t)nes->ppu.reg[0]) >> 5) & (sprite_y >= 8);
 				//// shift up the address and fill in the y offset
 				//pat_addr <<= 4;
 				//pat_addr |= sprite_y & 0x7;
 
 				// get the pattern plane bits
-				//rstate->sp_pat_planes = *(nessys_ppu_mem(pat_addr));
-				//rstate->sp_pat_planes |= (*(nessys_ppu_mem(pat_addr | 0x8)) << 8);
-				//rstate->sp_pat_planes = nes.ppu.oam_pix[(NESSYS_PPU_OAM_PIXEL_ROWS / 4) * rstate->sprite_index + sprite_y];
-				rstate->sp_pal_base = ((nes.ppu.oam[rstate->sprite_index + 2]) & 0x3) << 2;
+				//rstate->sp_pat_planes = *(nessys_ppu_mem(nes, pat_addr));
+				//rstate->sp_pat_planes |= (*(nessys_ppu_mem(nes, pat_addr | 0x8)) << 8);
+				//rstate->sp_pat_planes = nes->ppu.oam_pix[(NESSYS_PPU_OAM_PIXEL_ROWS / 4) * rstate->sprite_index + sprite_y];
+				rstate->sp_pal_base = ((nes->ppu.oam[rstate->sprite_index + 2]) & 0x3) << 2;
 				rstate->sp_pal_base |= 0x10;
-				rstate->sprite_background = (nes.ppu.oam[rstate->sprite_index + 2] & 0x20) != 0;
+				rstate->sprite_background = (nes->ppu.oam[rstate->sprite_index + 2] & 0x20) != 0;
 
-				//rstate->sprite_x = x - nes.ppu.oam[rstate->sprite_index + 3];
+				//rstate->sprite_x = x - nes->ppu.oam[rstate->sprite_index + 3];
 				// flip x if horizontal flip bit is set
-				//rstate->sprite_x = (nes.ppu.oam[rstate->sprite_index + 2] & 0x40) ? 7 - rstate->sprite_x : rstate->sprite_x;
-				//rstate->sprite_x_inc = (nes.ppu.oam[rstate->sprite_index + 2] & 0x40) ? -1 : 1;
-				//sprite_x = x - nes.ppu.oam[rstate->sprite_index + 3];
-				//rstate->sprite_h_flip = (nes.ppu.oam[rstate->sprite_index + 2] & 0x40);
+				//rstate->sprite_x = (nes->ppu.oam[rstate->sprite_index + 2] & 0x40) ? 7 - rstate->sprite_x : rstate->sprite_x;
+				//rstate->sprite_x_inc = (nes->ppu.oam[rstate->sprite_index + 2] & 0x40) ? -1 : 1;
+				//sprite_x = x - nes->ppu.oam[rstate->sprite_index + 3];
+				//rstate->sprite_h_flip = (nes->ppu.oam[rstate->sprite_index + 2] & 0x40);
 				//rstate->sprite_plane_shift = (rstate->sprite_h_flip) ? sprite_x : (7 - sprite_x);
 			}
 
 			//pal_index = ((rstate->sp_pat_planes >> (7 - rstate->sprite_x)) & 0x1) | ((rstate->sp_pat_planes >> (14 - rstate->sprite_x)) & 0x2);
 			//pal_index = ((rstate->sp_pat_planes >> (rstate->sprite_plane_shift)) & 0x1) | ((rstate->sp_pat_planes >> (7 + rstate->sprite_plane_shift)) & 0x2);
-			pal_index = nes.ppu.scan_line_sprite[x] & 0x3;
+			pal_index = nes->ppu.scan_line_sprite[x] & 0x3;
 			sprite_hit = (pal_index != 0);
 			if (sprite_hit) {
 				pal_index |= rstate->sp_pal_base;
-				pal = nes.ppu.pal[pal_index] & 0x3f;
+				pal = nes->ppu.pal[pal_index] & 0x3f;
 				sprite_color = NESSYS_PPU_PALETTE[pal];
 			}
-			nes.ppu.scan_line_sprite[x] = 0x0;
+			nes->ppu.scan_line_sprite[x] = 0x0;
 			//rstate->sprite_x += rstate->sprite_x_inc;
 			rstate->sp_pat_planes = (rstate->sprite_h_flip) ? (rstate->sp_pat_planes >> 1) : (rstate->sp_pat_planes << 1);
 		}
-		//for (sp = 0; sp < nes.ppu.num_scan_line_oam; sp++) {
-		//	sp_x = *(nes.ppu.scan_line_oam[sp] + 3);
+		//for (sp = 0; sp < nes->ppu.num_scan_line_oam; sp++) {
+		//	sp_x = *(nes->ppu.scan_line_oam[sp] + 3);
 		//	if (x >= sp_x && x < sp_x + 8) {
 		//		// TODO: implement sprite evaluation
 		//		sprite_color = 0xf81f;
 		//		sprite_hit = true;
-		//		sp = nes.ppu.num_scan_line_oam;  // to break out of for loop
+		//		sp = nes->ppu.num_scan_line_oam;  // to break out of for loop
 		//	}
 		//}
 		// Evaluate tile
@@ -481,7 +768,7 @@ void __no_inline_not_in_flash_func(process_pixels)(uint min_x, uint max_x, uint
 			tile_y = y;
 			//tile_x += tile_base_x;
 			tile_y += tile_base_y;
-			if (nes.ppu.scroll_y < NESSYS_PPU_SCANLINES_RENDERED && tile_y > NESSYS_PPU_SCANLINES_RENDERED) {
+			if (nes->ppu.scroll_y < NESSYS_PPU_SCANLINES_RENDERED && tile_y > NESSYS_PPU_SCANLINES_RENDERED) {
 				// skip over attribute section of table
 				tile_y += 16;
 			}
@@ -496,8 +783,8 @@ void __no_inline_not_in_flash_func(process_pixels)(uint min_x, uint max_x, uint
 			//// Add base of name table
 			//tile_addr += NESSYS_CHR_NTB_WIN_MIN;
 
-			tile_x = (x + (nes.ppu.scroll[0] & 0x1f));
-			if ((rstate->tile_x & 0xf) == 0x0) {
+			tile_x = (x + (nes->ppu.scroll[0] & 0x1f));
+			if ((rstate->tile_x & 0xf) == 0x0 && !tile_attrib) {
 				//// the attr addr is similar, except each byte corresponds to a 32x32 region, instea of 8x8
 				//attr_addr = 0x3c0 + (((tile_y & 0xe0) >> 2) | ((tile_x & 0xe0) >> 5));
 				//
@@ -506,9 +793,9 @@ void __no_inline_not_in_flash_func(process_pixels)(uint min_x, uint max_x, uint
 				//attr_addr += ((tile_y << 3) & 0x800);
 				//// Add base of name table
 				//attr_addr += NESSYS_CHR_NTB_WIN_MIN;
-				//attr_addr = *(nessys_ppu_mem(attr_addr));
+				//attr_addr = *(nessys_ppu_mem(nes, attr_addr));
 				//rstate->attr_bits = (attr_addr << 2);
-				rstate->attr_bits = (nes.ppu.disp_attrib_pix[tile_x >> 5] << 2);
+				rstate->attr_bits = (nes->ppu.disp_attrib_pix[tile_x >> 5] << 2);
 
 				// attribute offset is which 16x16 within the 32x32 we are in
 				// each 16x16 uses 2 bits
@@ -523,9 +810,9 @@ void __no_inline_not_in_flash_func(process_pixels)(uint min_x, uint max_x, uint
 			// each 16x16 uses 2 bits
 			//attr_offset = ((rstate->tile_x & 0x10) >> 3) | ((rstate->tile_y & 0x10) >> 2);
 
-			//pat_addr = (*(nessys_ppu_mem(tile_addr)) << 4) | (tile_y & 0x7) | ((nes.ppu.reg[0] & 0x10) << 8);
-			//planes = *(nessys_ppu_mem(pat_addr));
-			//planes |= (*(nessys_ppu_mem(pat_addr | 0x8)) << 8);
+			//pat_addr = (*(nessys_ppu_mem(nes, tile_addr)) << 4) | (tile_y & 0x7) | ((nes->ppu.reg[0] & 0x10) << 8);
+			//planes = *(nessys_ppu_mem(nes, pat_addr));
+			//planes |= (*(nessys_ppu_mem(nes, pat_addr | 0x8)) << 8);
 
 			// interleave the 2 bytes
 			//planes = (planes & 0xf00f) | ((planes & 0x0f00) >> 4) | ((planes & 0x00f0) << 4);
@@ -538,13 +825,18 @@ void __no_inline_not_in_flash_func(process_pixels)(uint min_x, uint max_x, uint
 			//planes = (planes & 0x6666) | ((planes & 0x8888) >> 3) | ((planes & 0x1111) << 3);
 
 			//rstate->pat_planes = (planes << (tile_x & 0x7));
-			tile_x = (x + (nes.ppu.scroll[0] & 0x7));
-			rstate->pat_planes = nes.ppu.disp_tile_pix[(tile_x & 0x1f8) + (y + nes.ppu.scroll_y & 0x7)];
+			tile_x = (x + (nes->ppu.scroll[0] & 0x7));
+			rstate->pat_planes = nes->ppu.disp_tile_pix[(tile_x & 0x1f8) + (y + nes->ppu.scroll_y & 0x7)];
 			if (x == min_x) {
 				rstate->pat_planes >>= (2 * (tile_x & 0x7));
 			}
+			if (tile_attrib) {
+				// 2 bits per tile, 4 tiles to a byte, in the same order as the tile pixels
+				attr_offset = (tile_x & 0x1f8) >> 3;
+				rstate->pal_base = ((nes->ppu.disp_attrib_pix[attr_offset >> 2] >> ((attr_offset & 0x3) << 1)) & 0x3) << 2;
+			}
 
-			//rstate->pal_base = (*(nessys_ppu_mem(attr_addr) >> attr_offset) & 0x3) << 2;
+			//rstate->pal_base = (*(nessys_ppu_mem(nes, attr_addr) >> attr_offset) & 0x3) << 2;
 		}
 		if (enable_background) {
 			pal_index = rstate->pat_planes & 0x3;// ((rstate->pat_planes >> 7) & 0x1) | ((rstate->pat_planes >> 14) & 0x2);
@@ -560,10 +852,14 @@ void __no_inline_not_in_flash_func(process_pixels)(uint min_x, uint max_x, uint
 			pal_index = 0;
 		}
 		if (!sprite_hit) {
-			pal = nes.ppu.pal[pal_index] & 0x3f;
+			pal = nes->ppu.pal[pal_index] & 0x3f;
 			background_color = NESSYS_PPU_PALETTE[pal];
 		}
-		draw_frame[FB_ADDRESS(x, y)] = (in_text) ? text_color : ((sprite_hit) ? sprite_color : background_color);
+		nes->draw_frame[FB_ADDRESS(x, y)] = (in_text) ? text_color : ((sprite_hit) ? sprite_color : background_color);
+#ifdef WIN32
+		// pal is the colour of whichever of the sprite and background was drawn
+		if (nes->index_frame) nes->index_frame[FB_ADDRESS_NORMAL(x, y)] = pal;
+#endif
 		rstate->tile_x++;
 		//rstate->tile_x &= 0x7;
 		//rstate->pat_planes <<= 1;
@@ -573,60 +869,105 @@ void __no_inline_not_in_flash_func(process_pixels)(uint min_x, uint max_x, uint
 }
 
 #ifdef WIN32
-void process_ppu()
+void process_ppu(nessys_t* nes)
 #else
-void __no_inline_not_in_flash_func(process_ppu)()
+void __no_inline_not_in_flash_func(process_ppu)(nessys_t* nes)
 #endif
 {
 	uint y, min_x, max_x;
+#if defined(PPU_MULTI_THREAD) && !defined(WIN32)
+	// lets core 0 pause this core while it writes saves to flash
+	flash_safe_execute_core_init();
+#endif
 #ifdef PPU_MULTI_THREAD
 	while (1)
 #endif
 	{
+#ifdef PPU_MULTI_THREAD
+		// waits here while core 0 changes the state underneath, see ppu_park
+		if (nes->c1_park) {
+			nes->c1_parked = true;
+			while (nes->c1_park);
+			nes->c1_parked = false;
+			continue;
+		}
+#endif
 
 		// Check if we are in a renderable portion of the frame
-		if (nes.scan_line >= NESSYS_PPU_SCANLINES_START_RENDER && (nes.frame_delta_time <= 0)) {
-			//if (nes.ppu.scroll_y != 0) {
+		if (nes->scan_line >= NESSYS_PPU_SCANLINES_START_RENDER && (nes->frame_delta_time <= 0)) {
+			//if (nes->ppu.scroll_y != 0) {
 			//	printf("pause\n");
 			//}
-			y = nes.scan_line - NESSYS_PPU_SCANLINES_START_RENDER;
-			nes.c1_render_done = (nes.rendered_scan_clk >= nes.scan_clk) || (nes.rendered_scan_clk >= FB_WIDTH) || (y >= FB_HEIGHT);
-			if (!nes.c1_render_done) {
-				min_x = nes.rendered_scan_clk;
-				nes.rendered_scan_clk += RENDER_PIXEL_INC;
-				max_x = nes.scan_clk;
-				nes.rendered_scan_clk = (nes.rendered_scan_clk > FB_WIDTH) ? FB_WIDTH : nes.rendered_scan_clk;
-				nes.rendered_scan_clk = (nes.rendered_scan_clk > max_x) ? max_x : nes.rendered_scan_clk;
-
-				//max_x = nes.scan_clk;
+			y = nes->scan_line - NESSYS_PPU_SCANLINES_START_RENDER;
+			nes->c1_render_done = (nes->rendered_scan_clk >= nes->scan_clk) || (nes->rendered_scan_clk >= FB_WIDTH) || (y >= FB_HEIGHT);
+			if (!nes->c1_render_done) {
+				min_x = nes->rendered_scan_clk;
+				nes->rendered_scan_clk += RENDER_PIXEL_INC;
+				max_x = nes->scan_clk;
+				nes->rendered_scan_clk = (nes->rendered_scan_clk > FB_WIDTH) ? FB_WIDTH : nes->rendered_scan_clk;
+				nes->rendered_scan_clk = (nes->rendered_scan_clk > max_x) ? max_x : nes->rendered_scan_clk;
+
+				//max_x = nes->scan_clk;
 				//max_x = (max_x > FB_WIDTH) ? FB_WIDTH : max_x;
-				//max_x = (max_x > nes.rendered_scan_clk + RENDER_PIXEL_INC) ? nes.rendered_scan_clk + RENDER_PIXEL_INC : max_x;
-				//nes.rendered_scan_clk = max_x;
+				//max_x = (max_x > nes->rendered_scan_clk + RENDER_PIXEL_INC) ? nes->rendered_scan_clk + RENDER_PIXEL_INC : max_x;
+				//nes->rendered_scan_clk = max_x;
 
-				process_pixels(min_x, nes.rendered_scan_clk, y, &nes.c1_rstate);
+				process_pixels(nes, min_x, nes->rendered_scan_clk, y, &nes->c1_rstate);
 
 			}
-			//nes.rendered_scan_clk = nes.scan_clk;
+			//nes->rendered_scan_clk = nes->scan_clk;
 		}
 	}
 }
 
-//#ifdef WIN32
-void main_loop()
-//#else
-//void __no_inline_not_in_flash_func(main_loop)()
-//#endif
+#if defined(PPU_MULTI_THREAD) && !defined(WIN32)
+// core 1 renders the instance core 0 sends it
+void core1_entry()
 {
-	uint16_t clear_color = 0x07e0;
-	char text_str[64];
-	memset(&tbox, 0, sizeof(TEXTBOX_T));
-	textbox_set_font(&tbox, font[FONT_ID_AIXOID9_F16]);
-	textbox_set_position(&tbox, 0, 0);
+	process_ppu((nessys_t*)(uintptr_t)multicore_fifo_pop_blocking());
+}
+#endif
 
-	uint in_text_line = 0;
-	uint32_t cur_time, last_time = 0;
-	float fps;
+// Mapper hooks as each cpu loop instance calls them
+// loop is a constant in every instance, so these fold down to a direct call, or nothing
+static CPU_LOOP_INLINE void cpu_loop_mapper_update(nessys_t* nes, const uint loop)
+{
+	if (loop == CPU_LOOP_MMC3 || loop == CPU_LOOP_MMC5 || loop == CPU_LOOP_FME7) {
+		nes->mapper_update(nes);
+	} else if (loop == CPU_LOOP_GENERIC) {
+		if (nes->mapper_update) nes->mapper_update(nes);
+	}
+}
+
+static CPU_LOOP_INLINE uint8_t* cpu_loop_mapper_read(nessys_t* nes, const uint loop, uint16_t addr)
+{
+	// only MMC5 maps anything readable into 0x4018-0x5FFF
+	if (loop == CPU_LOOP_MMC5) return nes->mapper_read(nes, addr);
+	if (loop == CPU_LOOP_GENERIC && nes->mapper_read) return nes->mapper_read(nes, addr);
+	return NULL;
+}
+
+static CPU_LOOP_INLINE void cpu_loop_mapper_write(nessys_t* nes, const uint loop, uint16_t addr, uint8_t data)
+{
+	switch (loop) {
+	case CPU_LOOP_NROM: break;
+	case CPU_LOOP_DISCRETE: mapper_discrete_write(nes, addr, data); break;
+	case CPU_LOOP_MMC1: mapper1_write(nes, addr, data); break;
+	case CPU_LOOP_MMC3: mapper4_write(nes, addr, data); break;
+	case CPU_LOOP_MMC5: mapper5_write(nes, addr, data); break;
+	case CPU_LOOP_MMC2: mapper9_write(nes, addr, data); break;
+	case CPU_LOOP_FME7: mapper69_write(nes, addr, data); break;
+	default:
+		if (nes->mapper_write) nes->mapper_write(nes, addr, data);
+		break;
+	}
+}
 
+// Runs the cpu and ppu for one frame, starting at vblank
+// Pixels are only rendered if frame_delta_time <= 0
+// Only ever called with a constant loop, from the emulate_frame_* instances below
+static CPU_LOOP_INLINE void emulate_frame_loop(nessys_t* nes, const uint loop)
+{
 	const uint8_t* pc_ptr = NULL;
 	const uint8_t* pc_ptr_next = NULL;
 	const c6502_op_code_t* op = NULL;
@@ -649,1134 +990,1423 @@ void main_loop()
 	uint loop_count = 0;
 
 	uint y, min_x, max_x;
-	uint32_t next_line_scan_clk;
 	uint next_scan_line;
+	// nothing drawn, so no tiles are generated, unless the mapper's tile fetches have side effects; sprite evaluation
+	// only sets the status flags
+	const bool logic_only = nes->logic_only && nes->frame_delta_time > 0;
 
-#ifdef WIN32
-	MSG msg;
-
-	win32_fill(clear_color);
-#else
-	st7789_fill(clear_color);
-	st7789_wait_for_write();
-	st7789_set_window(SCREEN_WIN_X, SCREEN_WIN_Y, SCREEN_WIN_X + SCREEN_WIN_WIDTH - 1, SCREEN_WIN_Y + SCREEN_WIN_HEIGHT - 1);
-#endif
-	nessys_init();
-	bool rom_ok = ines_load_cart(rom_nes);
-	nes.scan_clk = 0;
-	nes.rendered_scan_clk = 0;
-	next_line_scan_clk = 0;
-	next_scan_line = 0;
-	pc_ptr_next = nessys_mem(nes.reg.pc, &bank, &offset);
+	pc_ptr_next = nessys_mem(nes, nes->reg.pc, &bank, &offset);
 	op_next = C6502_OP_CODE + *pc_ptr_next;
-	uint skipped_frames = 0;
-	uint total_skipped_frames = 0;
-	nes.frame_delta_time = 0;
-	last_time = time_us_32();
-
-#ifdef PPU_MULTI_THREAD
-#ifdef WIN32
-	CreateThread(NULL, 0, win32_ppu_entry, NULL, 0, &h_thread);
-#else
-	multicore_launch_core1(process_ppu);
-#endif
-#endif
-
-	while (1) {
-		cur_time = time_us_32();
-
-		nes.frame_delta_time += 0;// cur_time - last_time - 16667;
-		if (skipped_frames > 1) {
-			nes.frame_delta_time = 0;
-		}
-		//nes.frame_delta_time = ((nes.frame & 0x1) == 0) ? 1 : 0;
-
-		// Wait for 16.667 ms, to render at roughly 60fps
-		// May still cause tearing artifiact, since this is not synchronized
-		// to display controller
-		while (cur_time - last_time < 16667 && skipped_frames == 0) {
-			cur_time = time_us_32();
-		}
-
-		//if (nes.frame_delta_time <= 0 && skipped_frames != 0) {
-		//	for (y = 0; y < 256; y++) {
-		//		nes.ppu.scan_line_sprite[y] = 0;
-		//	}
-		//}
-
-		//if(skip_render == 0) skip_render += (cur_time - last_time) / 16666;
 
-		nes.rendered_time += cur_time - last_time;
-		last_time = cur_time;
+	nes->scan_line = 0;
+	// set vblank irq status
+	nes->ppu.reg[2] |= 0x80;
+	if (nes->ppu.reg[0] & 0x80) {
+		// if NMI is enabled, take the IRQ
+		nessys_irq(nes, NESSYS_NMI_VECTOR, C6502_P_B);
+		pc_ptr_next = nessys_mem(nes, nes->reg.pc, &bank, &offset);
+		op_next = C6502_OP_CODE + *pc_ptr_next;
+		nes->next_line_scan_clk += NESSYS_PPU_PER_CPU_CLK * 7;
+	}
+	nes->sprite0_hit_scan_clk = ~0;  // don't enable sprite 0 hit now
+	while (nes->scan_line < NESSYS_PPU_SCANLINES_PER_FRAME) {
+		// reset tile_x to ensure that a new tile address is computed
+		nes->c0_rstate.tile_x = 0x100;
+		nes->c1_rstate.tile_x = 0x100;
+		// reset sprite index to NULL value
+		nes->c0_rstate.sprite_index = 0xff;
+		//nes->c0_rstate.sprite_x_inc = 1;
+		nes->c1_rstate.sprite_index = 0xff;
+		//nes->c1_rstate.sprite_x_inc = 1;
+		// restart this line's clk
+		nes->scan_clk = 0;
+		nes->rendered_scan_clk = 0; // reset to 0 to render the full scan line
+		cpu_loop_mapper_update(nes, loop);
+		nessys_update_events(nes);
+		nescache_sample(nes);
+		while (nes->scan_clk < NESSYS_PPU_CLK_PER_SCANLINE) {
+			pc_ptr = pc_ptr_next;
+			op = op_next;
+			ram_ptr = NULL;
+			ppu_write = false;
+			apu_write = false;
+			rom_write = false;
+			data_change = 0;
+			penalty_cycles = 0;
+			bank = 0;
+			switch (op->addr) {
+			case C6502_ADDR_NONE:
+				break;
+			case C6502_ADDR_ACCUM:
+				operand = &nes->reg.a;
+				ram_ptr = &nes->reg.a;
+				break;
+			case C6502_ADDR_IMMED:
+				operand = nessys_mem(nes, nes->reg.pc + 1, &bank, &offset);
+				break;
+			case C6502_ADDR_ZEROPAGE:
+				addr = *nessys_mem(nes, nes->reg.pc + 1, &bank, &offset);
+				operand = nessys_mem(nes, addr, &bank, &offset);
+				break;
+			case C6502_ADDR_ABSOLUTE:
+				addr = *nessys_mem(nes, nes->reg.pc + 1, &bank, &offset);
+				addr |= ((uint16_t)*nessys_mem(nes, nes->reg.pc + 2, &bank, &offset)) << 8;
+				operand = nessys_mem(nes, addr, &bank, &offset);
+				break;
+			case C6502_ADDR_RELATIVE:
+				indirect_addr = nes->reg.pc + op->num_bytes;
+				addr = indirect_addr + ((int8_t)*nessys_mem(nes, nes->reg.pc + 1, &bank, &offset));
+				// branch penalty of 2 cycles if page changes, otherwise just 1 cycle
+				penalty_cycles += 1;
+				penalty_cycles += ((addr & 0xFF00) != (indirect_addr & 0xFF00));
+				break;
+			case C6502_ADDR_INDIRECT:
+				indirect_addr = *nessys_mem(nes, nes->reg.pc + 1, &bank, &offset);
+				indirect_addr |= ((uint16_t)*nessys_mem(nes, nes->reg.pc + 2, &bank, &offset)) << 8;
+				addr = *nessys_mem(nes, indirect_addr, &bank, &offset);
+				indirect_addr++;
+				if ((indirect_addr & 0xff) == 0) indirect_addr -= 0x100;
+				addr |= ((uint16_t)*nessys_mem(nes, indirect_addr, &bank, &offset)) << 8;
+				break;
+			case C6502_ADDR_ZEROPAGE_X:
+				addr = *nessys_mem(nes, nes->reg.pc + 1, &bank, &offset);
+				addr += nes->reg.x;
+				addr &= 0xFF;
+				operand = nessys_mem(nes, addr, &bank, &offset);
+				break;
+			case C6502_ADDR_ZEROPAGE_Y:
+				addr = *nessys_mem(nes, nes->reg.pc + 1, &bank, &offset);
+				addr += nes->reg.y;
+				addr &= 0xFF;
+				operand = nessys_mem(nes, addr, &bank, &offset);
+				break;
+			case C6502_ADDR_ABSOLUTE_X:
+				addr = *nessys_mem(nes, nes->reg.pc + 1, &bank, &offset);
+				penalty_cycles += (addr + nes->reg.x >= 0x100) * op->penalty_cycles;
+				addr |= ((uint16_t)*nessys_mem(nes, nes->reg.pc + 2, &bank, &offset)) << 8;
+				addr += nes->reg.x;
+				operand = nessys_mem(nes, addr, &bank, &offset);
+				break;
+			case C6502_ADDR_ABSOLUTE_Y:
+				addr = *nessys_mem(nes, nes->reg.pc + 1, &bank, &offset);
+				penalty_cycles += (addr + nes->reg.y >= 0x100) * op->penalty_cycles;
+				addr |= ((uint16_t)*nessys_mem(nes, nes->reg.pc + 2, &bank, &offset)) << 8;
+				addr += nes->reg.y;
+				operand = nessys_mem(nes, addr, &bank, &offset);
+				break;
+			case C6502_ADDR_INDIRECT_X:
+				indirect_addr = *nessys_mem(nes, nes->reg.pc + 1, &bank, &offset);
+				indirect_addr += nes->reg.x;
+				indirect_addr &= 0xFF;
+				addr = *nessys_mem(nes, indirect_addr, &bank, &offset);
+				indirect_addr++;
+				indirect_addr &= 0xFF;
+				addr |= ((uint16_t)*nessys_mem(nes, indirect_addr, &bank, &offset)) << 8;
+				operand = nessys_mem(nes, addr, &bank, &offset);
+				break;
+			case C6502_ADDR_INDIRECT_Y:
+				indirect_addr = *nessys_mem(nes, nes->reg.pc + 1, &bank, &offset);
+				addr = *nessys_mem(nes, indirect_addr, &bank, &offset);
+				penalty_cycles += (addr + nes->reg.y >= 0x100) * op->penalty_cycles;
+				indirect_addr++;
+				indirect_addr &= 0xFF;
+				addr |= ((uint16_t)*nessys_mem(nes, indirect_addr, &bank, &offset)) << 8;
+				addr += nes->reg.y;
+				operand = nessys_mem(nes, addr, &bank, &offset);
+				break;
+			}
 
-		if (nes.rendered_frames >= TBOX_RENDER_FRAME_PERIOD) {
-			// Calculate and report out the frames per second
-			fps = nes.rendered_time;
-			fps = (nes.rendered_frames * 1000000) / fps;
-			sprintf(text_str, "%0.2f %d", fps, total_skipped_frames);
-			textbox_set_text(&tbox, text_str, 0);
-			nes.rendered_frames = 0;
-			nes.rendered_time = 0;
-			loop_count = 0;
-			total_skipped_frames = 0;
-		}
+			// if operand is writeable, get its address
+			if (ram_ptr == NULL) ram_ptr = (addr < 0x4018 ||
+				(bank == NESSYS_PRG_RAM_START_BANK && !(nes->mapper_flags & NESSYS_MAPPER_FLAG_PRG_RAM_READ_ONLY))) ? (uint8_t*)operand : NULL;
 
-		textbox_reset(&tbox);
+			// increment pc
+			nes->reg.pc += op->num_bytes;
 
-		nes.scan_line = 0;
-		// set vblank irq status
-		nes.ppu.reg[2] |= 0x80;
-		if (nes.ppu.reg[0] & 0x80) {
-			// if NMI is enabled, take the IRQ
-			nessys_irq(NESSYS_NMI_VECTOR, C6502_P_B);
-			pc_ptr_next = nessys_mem(nes.reg.pc, &bank, &offset);
-			op_next = C6502_OP_CODE + *pc_ptr_next;
-			next_line_scan_clk += NESSYS_PPU_PER_CPU_CLK * 7;
-		}
-		nes.sprite0_hit_scan_clk = ~0;  // don't enable sprite 0 hit now
-		while (nes.scan_line < NESSYS_PPU_SCANLINES_PER_FRAME) {
-			// reset tile_x to ensure that a new tile address is computed
-			nes.c0_rstate.tile_x = 0x100;
-			nes.c1_rstate.tile_x = 0x100;
-			// reset sprite index to NULL value
-			nes.c0_rstate.sprite_index = 0xff;
-			//nes.c0_rstate.sprite_x_inc = 1;
-			nes.c1_rstate.sprite_index = 0xff;
-			//nes.c1_rstate.sprite_x_inc = 1;
-			// restart this line's clk
-			nes.scan_clk = 0;
-			nes.rendered_scan_clk = 0; // reset to 0 to render the full scan line
-			while (nes.scan_clk < NESSYS_PPU_CLK_PER_SCANLINE) {
-				pc_ptr = pc_ptr_next;
-				op = op_next;
-				ram_ptr = NULL;
-				ppu_write = false;
-				penalty_cycles = 0;
-				bank = 0;
-				switch (op->addr) {
-				case C6502_ADDR_NONE:
-					break;
-				case C6502_ADDR_ACCUM:
-					operand = &nes.reg.a;
-					ram_ptr = &nes.reg.a;
-					break;
-				case C6502_ADDR_IMMED:
-					operand = nessys_mem(nes.reg.pc + 1, &bank, &offset);
+			switch (bank) {
+			case NESSYS_PPU_REG_START_BANK:
+				switch (offset) {
+				case 2:
+					nes->ppu.status &= ~0x80;
 					break;
-				case C6502_ADDR_ZEROPAGE:
-					addr = *nessys_mem(nes.reg.pc + 1, &bank, &offset);
-					operand = nessys_mem(addr, &bank, &offset);
+				case 4:
+					nes->ppu.reg[4] = nes->ppu.oam[nes->ppu.reg[3]];
 					break;
-				case C6502_ADDR_ABSOLUTE:
-					addr = *nessys_mem(nes.reg.pc + 1, &bank, &offset);
-					addr |= ((uint16_t)*nessys_mem(nes.reg.pc + 2, &bank, &offset)) << 8;
-					operand = nessys_mem(addr, &bank, &offset);
-					break;
-				case C6502_ADDR_RELATIVE:
-					indirect_addr = nes.reg.pc + op->num_bytes;
-					addr = indirect_addr + ((int8_t)*nessys_mem(nes.reg.pc + 1, &bank, &offset));
-					// branch penalty of 2 cycles if page changes, otherwise just 1 cycle
-					penalty_cycles += 1;
-					penalty_cycles += ((addr & 0xFF00) != (indirect_addr & 0xFF00));
-					break;
-				case C6502_ADDR_INDIRECT:
-					indirect_addr = *nessys_mem(nes.reg.pc + 1, &bank, &offset);
-					indirect_addr |= ((uint16_t)*nessys_mem(nes.reg.pc + 2, &bank, &offset)) << 8;
-					addr = *nessys_mem(indirect_addr, &bank, &offset);
-					indirect_addr++;
-					if ((indirect_addr & 0xff) == 0) indirect_addr -= 0x100;
-					addr |= ((uint16_t)*nessys_mem(indirect_addr, &bank, &offset)) << 8;
-					break;
-				case C6502_ADDR_ZEROPAGE_X:
-					addr = *nessys_mem(nes.reg.pc + 1, &bank, &offset);
-					addr += nes.reg.x;
-					addr &= 0xFF;
-					operand = nessys_mem(addr, &bank, &offset);
-					break;
-				case C6502_ADDR_ZEROPAGE_Y:
-					addr = *nessys_mem(nes.reg.pc + 1, &bank, &offset);
-					addr += nes.reg.y;
-					addr &= 0xFF;
-					operand = nessys_mem(addr, &bank, &offset);
-					break;
-				case C6502_ADDR_ABSOLUTE_X:
-					addr = *nessys_mem(nes.reg.pc + 1, &bank, &offset);
-					penalty_cycles += (addr + nes.reg.x >= 0x100) * op->penalty_cycles;
-					addr |= ((uint16_t)*nessys_mem(nes.reg.pc + 2, &bank, &offset)) << 8;
-					addr += nes.reg.x;
-					operand = nessys_mem(addr, &bank, &offset);
-					break;
-				case C6502_ADDR_ABSOLUTE_Y:
-					addr = *nessys_mem(nes.reg.pc + 1, &bank, &offset);
-					penalty_cycles += (addr + nes.reg.y >= 0x100) * op->penalty_cycles;
-					addr |= ((uint16_t)*nessys_mem(nes.reg.pc + 2, &bank, &offset)) << 8;
-					addr += nes.reg.y;
-					operand = nessys_mem(addr, &bank, &offset);
-					break;
-				case C6502_ADDR_INDIRECT_X:
-					indirect_addr = *nessys_mem(nes.reg.pc + 1, &bank, &offset);
-					indirect_addr += nes.reg.x;
-					indirect_addr &= 0xFF;
-					addr = *nessys_mem(indirect_addr, &bank, &offset);
-					indirect_addr++;
-					indirect_addr &= 0xFF;
-					addr |= ((uint16_t)*nessys_mem(indirect_addr, &bank, &offset)) << 8;
-					operand = nessys_mem(addr, &bank, &offset);
-					break;
-				case C6502_ADDR_INDIRECT_Y:
-					indirect_addr = *nessys_mem(nes.reg.pc + 1, &bank, &offset);
-					addr = *nessys_mem(indirect_addr, &bank, &offset);
-					penalty_cycles += (addr + nes.reg.y >= 0x100) * op->penalty_cycles;
-					indirect_addr++;
-					indirect_addr &= 0xFF;
-					addr |= ((uint16_t)*nessys_mem(indirect_addr, &bank, &offset)) << 8;
-					addr += nes.reg.y;
-					operand = nessys_mem(addr, &bank, &offset);
+				case 7:
+					// immediately update data if reading from palette data; otherwise defer until after this instruction
+					if ((nes->ppu.mem_addr & 0x3f00) == 0x3f00) nes->ppu.reg[7] = *nessys_ppu_mem(nes, nes->ppu.mem_addr);
 					break;
 				}
-
-				// if operand is writeable, get its address
-				if (ram_ptr == NULL) ram_ptr = (addr < 0x4018) ? (uint8_t*)operand : NULL;
-
-				// increment pc
-				nes.reg.pc += op->num_bytes;
-
-				switch (bank) {
-				case NESSYS_PPU_REG_START_BANK:
-					switch (offset) {
-					case 2:
-						nes.ppu.status &= ~0x80;
-						break;
-					case 4:
-						nes.ppu.reg[4] = nes.ppu.oam[nes.ppu.reg[3]];
-						break;
-					case 7:
-						// immediately update data if reading from palette data; otherwise defer until after this instruction
-						if ((nes.ppu.mem_addr & 0x3f00) == 0x3f00) nes.ppu.reg[7] = *nessys_ppu_mem(nes.ppu.mem_addr);
-						break;
-					}
-					break;
-				//case NESSYS_APU_REG_START_BANK:
-				//	if (offset >= NESSYS_APU_JOYPAD0_OFFSET && offset <= NESSYS_APU_JOYPAD1_OFFSET) {
-				//		uint8_t j = offset - NESSYS_APU_JOYPAD0_OFFSET;
-				//		nes->apu.reg[offset] = (nes->apu.latched_joypad[j] & 0x1) | (0x40);
-				//	} else if (offset == NESSYS_APU_STATUS_OFFSET) {
-				//		nessys_gen_sound(nes);
-				//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] &= 0xc0;
-				//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->apu.pulse[0].length) ? 0x1 : 0x0;
-				//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->apu.pulse[1].length) ? 0x2 : 0x0;
-				//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->apu.triangle.length) ? 0x4 : 0x0;
-				//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->apu.noise.length) ? 0x8 : 0x0;
-				//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->dmc_bits_to_play >= 8) ? 0x10 : 0x0;
-				//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->frame_irq) ? 0x40 : 0x0;
-				//		clear_frame_irq = true;
-				//	} else if (offset >= NESSYS_APU_SIZE) {
-				//		uint8_t* op = nes->mapper_read(nes, addr);
-				//		if (op) operand = op;
-				//	}
-				//	break;
+				break;
+			case NESSYS_APU_REG_START_BANK:
+				if (addr > NESSYS_APU_WIN_MAX) {
+					// 0x4018-0x5FFF belongs to the cart; moving offset past the apu registers sends stores down the mapper path
+					offset = NESSYS_APU_SIZE;
+					uint8_t* op = cpu_loop_mapper_read(nes, loop, addr);
+					if (op) operand = op;
+				} else if (c6502_reads_operand(op->ins)) {
+					// rmw instructions read too; stores don't, so a store to 0x4017 is only the frame counter
+					nessys_apu_read(nes, offset);
 				}
+				break;
+			//case NESSYS_APU_REG_START_BANK:
+			//	if (offset >= NESSYS_APU_JOYPAD0_OFFSET && offset <= NESSYS_APU_JOYPAD1_OFFSET) {
+			//		uint8_t j = offset - NESSYS_APU_JOYPAD0_OFFSET;
+			//		nes->apu.reg[offset] = (nes->apu.latched_joypad[j] & 0x1) | (0x40);
+			//	} else if (offset == NESSYS_APU_STATUS_OFFSET) {
+			//		nessys_gen_sound(nes);
+			//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] &= 0xc0;
+			//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->apu.pulse[0].length) ? 0x1 : 0x0;
+			//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->apu.pulse[1].length) ? 0x2 : 0x0;
+			//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->apu.triangle.length) ? 0x4 : 0x0;
+			//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->apu.noise.length) ? 0x8 : 0x0;
+			//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->dmc_bits_to_play >= 8) ? 0x10 : 0x0;
+			//		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] |= (nes->frame_irq) ? 0x40 : 0x0;
+			//		clear_frame_irq = true;
+			//	} else if (offset >= NESSYS_APU_SIZE) {
+			//		uint8_t* op = nes->mapper_read(nes, addr);
+			//		if (op) operand = op;
+			//	}
+			//	break;
+			}
 
-				// execute instruction
-				switch (op->ins) {
-				case C6502_INS_ADC:
-				case C6502_INS_SBC:
-					result = *operand;
-					if (op->ins == C6502_INS_SBC) result = ~result;
-					// overflow possible if bit 7 of two operands are the same
-					overflow = (result & 0x80) == (nes.reg.a & 0x80);
-					result += nes.reg.a + ((nes.reg.p & C6502_P_C) >> C6502_P_C_SHIFT);
-					overflow &= (result & 0x80) != (nes.reg.a & 0x80);
-					nes.reg.a = (uint8_t)result;
-					// clear N/V/Z/C
-					nes.reg.p &= ~(C6502_P_N | C6502_P_V | C6502_P_Z | C6502_P_C);
-					nes.reg.p |= (nes.reg.a == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= overflow << C6502_P_V_SHIFT;
-					overflow = (result & 0x100) >> 8;  // carry bit
-					if (op->ins == C6502_INS_SBC) overflow = !overflow;
-					nes.reg.p |= overflow << C6502_P_C_SHIFT;
-					nes.reg.p |= (nes.reg.a & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_AND:
-					nes.reg.a &= *operand;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= (nes.reg.a == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (nes.reg.a & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_ASL:
-					overflow = ((*operand & 0x80) != 0x00);
-					result = *operand << 1;
-					// clear N/Z/C
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
-					nes.reg.p |= overflow << C6502_P_C_SHIFT;
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
-						ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
-						apu_write = (bank == NESSYS_APU_REG_START_BANK);
-						if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
-							switch (offset) {
-							case NESSYS_APU_STATUS_OFFSET:
-								nes.apu.status = (uint8_t)result;
-								break;
-							case NESSYS_APU_JOYPAD0_OFFSET:
-								nes.apu.joy_control = (uint8_t)result;
-								break;
-							case NESSYS_APU_FRAME_COUNTER_OFFSET:
-								nes.apu.frame_counter = (uint8_t)result;
-								break;
-							}
-						} else if (ram_ptr) {
-							data_change = (*operand ^ (uint8_t)result);
-							*ram_ptr = (uint8_t)result;
+			// execute instruction
+			switch (op->ins) {
+			case C6502_INS_ADC:
+			case C6502_INS_SBC:
+				result = *operand;
+				if (op->ins == C6502_INS_SBC) result = ~result;
+				// overflow possible if bit 7 of two operands are the same
+				overflow = (result & 0x80) == (nes->reg.a & 0x80);
+				result += nes->reg.a + ((nes->reg.p & C6502_P_C) >> C6502_P_C_SHIFT);
+				overflow &= (result & 0x80) != (nes->reg.a & 0x80);
+				nes->reg.a = (uint8_t)result;
+				// clear N/V/Z/C
+				nes->reg.p &= ~(C6502_P_N | C6502_P_V | C6502_P_Z | C6502_P_C);
+				nes->reg.p |= (nes->reg.a == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= overflow << C6502_P_V_SHIFT;
+				overflow = (result & 0x100) >> 8;  // carry bit
+				if (op->ins == C6502_INS_SBC) overflow = !overflow;
+				nes->reg.p |= overflow << C6502_P_C_SHIFT;
+				nes->reg.p |= (nes->reg.a & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_AND:
+				nes->reg.a &= *operand;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= (nes->reg.a == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (nes->reg.a & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_ASL:
+				overflow = ((*operand & 0x80) != 0x00);
+				result = *operand << 1;
+				// clear N/Z/C
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
+				nes->reg.p |= overflow << C6502_P_C_SHIFT;
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
+					ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
+					apu_write = (bank == NESSYS_APU_REG_START_BANK);
+					if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
+						switch (offset) {
+						case NESSYS_APU_STATUS_OFFSET:
+							nes->apu.status = (uint8_t)result;
+							break;
+						case NESSYS_APU_JOYPAD0_OFFSET:
+							nes->apu.joy_control = (uint8_t)result;
+							break;
+						case NESSYS_APU_FRAME_COUNTER_OFFSET:
+							nes->apu.frame_counter = (uint8_t)result;
+							break;
 						}
-					} else {
-						rom_write = true;
-						if (nes.mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
-					}
-					break;
-				case C6502_INS_BCC:
-					if ((nes.reg.p & C6502_P_C) == 0x00) {
-						// take the branch
-						nes.reg.pc = addr;
-					} else {
-						// if we don't take the branch, there is no penalty
-						penalty_cycles = 0;
-					}
-					break;
-				case C6502_INS_BCS:
-					if ((nes.reg.p & C6502_P_C) != 0x00) {
-						// take the branch
-						nes.reg.pc = addr;
-					} else {
-						// if we don't take the branch, there is no penalty
-						penalty_cycles = 0;
-					}
-					break;
-				case C6502_INS_BEQ:
-					if ((nes.reg.p & C6502_P_Z) != 0x00) {
-						// take the branch
-						nes.reg.pc = addr;
-					} else {
-						// if we don't take the branch, there is no penalty
-						penalty_cycles = 0;
-					}
-					break;
-				case C6502_INS_BIT:
-					// clear N/V/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_V | C6502_P_Z);
-					result = *operand;
-					nes.reg.p |= (result & 0xC0);  // bit 7 & 6 go into the N/V bits respectively
-					result &= nes.reg.a;
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					break;
-				case C6502_INS_BMI:
-					if ((nes.reg.p & C6502_P_N) != 0x00) {
-						// take the branch
-						nes.reg.pc = addr;
-					} else {
-						// if we don't take the branch, there is no penalty
-						penalty_cycles = 0;
-					}
-					break;
-				case C6502_INS_BNE:
-					if ((nes.reg.p & C6502_P_Z) == 0x00) {
-						// take the branch
-						nes.reg.pc = addr;
-					} else {
-						// if we don't take the branch, there is no penalty
-						penalty_cycles = 0;
-					}
-					break;
-				case C6502_INS_BPL:
-					if ((nes.reg.p & C6502_P_N) == 0x00) {
-						// take the branch
-						nes.reg.pc = addr;
-					} else {
-						// if we don't take the branch, there is no penalty
-						penalty_cycles = 0;
-					}
-					break;
-				case C6502_INS_BRK:
-					nessys_irq(NESSYS_IRQ_VECTOR, 0);
-					break;
-				case C6502_INS_BVC:
-					if ((nes.reg.p & C6502_P_V) == 0x00) {
-						// take the branch
-						nes.reg.pc = addr;
-					} else {
-						// if we don't take the branch, there is no penalty
-						penalty_cycles = 0;
-					}
-					break;
-				case C6502_INS_BVS:
-					if ((nes.reg.p & C6502_P_V) != 0x00) {
-						// take the branch
-						nes.reg.pc = addr;
-					} else {
-						// if we don't take the branch, there is no penalty
-						penalty_cycles = 0;
+					} else if (ram_ptr) {
+						data_change = (*operand ^ (uint8_t)result);
+						*ram_ptr = (uint8_t)result;
 					}
-					break;
-				case C6502_INS_CLC:
-					nes.reg.p &= ~C6502_P_C;
-					break;
-				case C6502_INS_CLD:
-					nes.reg.p &= ~C6502_P_D;
-					break;
-				case C6502_INS_CLI:
-					nes.iflag_delay = nes.reg.p;
-					nes.reg.p &= ~C6502_P_I;
-					nes.iflag_delay ^= nes.reg.p;
-					nes.iflag_delay &= C6502_P_I;
-					break;
-				case C6502_INS_CLV:
-					nes.reg.p &= ~C6502_P_V;
-					break;
-				case C6502_INS_CMP:
-					overflow = (nes.reg.a >= *operand);
-					result = nes.reg.a - *operand;
-					// clear N/Z/C
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
-					nes.reg.p |= overflow << C6502_P_C_SHIFT;
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_CPX:
-					overflow = (nes.reg.x >= *operand);
-					result = nes.reg.x - *operand;
-					// clear N/Z/C
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
-					nes.reg.p |= overflow << C6502_P_C_SHIFT;
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_CPY:
-					overflow = (nes.reg.y >= *operand);
-					result = nes.reg.y - *operand;
-					// clear N/Z/C
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
-					nes.reg.p |= overflow << C6502_P_C_SHIFT;
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_DEC:
-					result = *operand - 1;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
-						ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
-						apu_write = (bank == NESSYS_APU_REG_START_BANK);
-						if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
-							switch (offset) {
-							case NESSYS_APU_STATUS_OFFSET:
-								nes.apu.status = (uint8_t)result;
-								break;
-							case NESSYS_APU_JOYPAD0_OFFSET:
-								nes.apu.joy_control = (uint8_t)result;
-								break;
-							case NESSYS_APU_FRAME_COUNTER_OFFSET:
-								nes.apu.frame_counter = (uint8_t)result;
-								break;
-							}
-						} else if (ram_ptr) {
-							data_change = (*operand ^ (uint8_t)result);
-							*ram_ptr = (uint8_t)result;
+				} else {
+					rom_write = true;
+					if (nes->mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
+				}
+				break;
+			case C6502_INS_BCC:
+				if ((nes->reg.p & C6502_P_C) == 0x00) {
+					// take the branch
+					nes->reg.pc = addr;
+				} else {
+					// if we don't take the branch, there is no penalty
+					penalty_cycles = 0;
+				}
+				break;
+			case C6502_INS_BCS:
+				if ((nes->reg.p & C6502_P_C) != 0x00) {
+					// take the branch
+					nes->reg.pc = addr;
+				} else {
+					// if we don't take the branch, there is no penalty
+					penalty_cycles = 0;
+				}
+				break;
+			case C6502_INS_BEQ:
+				if ((nes->reg.p & C6502_P_Z) != 0x00) {
+					// take the branch
+					nes->reg.pc = addr;
+				} else {
+					// if we don't take the branch, there is no penalty
+					penalty_cycles = 0;
+				}
+				break;
+			case C6502_INS_BIT:
+				// clear N/V/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_V | C6502_P_Z);
+				result = *operand;
+				nes->reg.p |= (result & 0xC0);  // bit 7 & 6 go into the N/V bits respectively
+				result &= nes->reg.a;
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				break;
+			case C6502_INS_BMI:
+				if ((nes->reg.p & C6502_P_N) != 0x00) {
+					// take the branch
+					nes->reg.pc = addr;
+				} else {
+					// if we don't take the branch, there is no penalty
+					penalty_cycles = 0;
+				}
+				break;
+			case C6502_INS_BNE:
+				if ((nes->reg.p & C6502_P_Z) == 0x00) {
+					// take the branch
+					nes->reg.pc = addr;
+				} else {
+					// if we don't take the branch, there is no penalty
+					penalty_cycles = 0;
+				}
+				break;
+			case C6502_INS_BPL:
+				if ((nes->reg.p & C6502_P_N) == 0x00) {
+					// take the branch
+					nes->reg.pc = addr;
+				} else {
+					// if we don't take the branch, there is no penalty
+					penalty_cycles = 0;
+				}
+				break;
+			case C6502_INS_BRK:
+				nessys_irq(nes, NESSYS_IRQ_VECTOR, 0);
+				break;
+			case C6502_INS_BVC:
+				if ((nes->reg.p & C6502_P_V) == 0x00) {
+					// take the branch
+					nes->reg.pc = addr;
+				} else {
+					// if we don't take the branch, there is no penalty
+					penalty_cycles = 0;
+				}
+				break;
+			case C6502_INS_BVS:
+				if ((nes->reg.p & C6502_P_V) != 0x00) {
+					// take the branch
+					nes->reg.pc = addr;
+				} else {
+					// if we don't take the branch, there is no penalty
+					penalty_cycles = 0;
+				}
+				break;
+			case C6502_INS_CLC:
+				nes->reg.p &= ~C6502_P_C;
+				break;
+			case C6502_INS_CLD:
+				nes->reg.p &= ~C6502_P_D;
+				break;
+			case C6502_INS_CLI:
+				nes->iflag_delay = nes->reg.p;
+				nes->reg.p &= ~C6502_P_I;
+				nes->iflag_delay ^= nes->reg.p;
+				nes->iflag_delay &= C6502_P_I;
+				// recheck for a pending irq
+				nes->event_scan_clk = 0;
+				break;
+			case C6502_INS_CLV:
+				nes->reg.p &= ~C6502_P_V;
+				break;
+			case C6502_INS_CMP:
+				overflow = (nes->reg.a >= *operand);
+				result = nes->reg.a - *operand;
+				// clear N/Z/C
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
+				nes->reg.p |= overflow << C6502_P_C_SHIFT;
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_CPX:
+				overflow = (nes->reg.x >= *operand);
+				result = nes->reg.x - *operand;
+				// clear N/Z/C
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
+				nes->reg.p |= overflow << C6502_P_C_SHIFT;
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_CPY:
+				overflow = (nes->reg.y >= *operand);
+				result = nes->reg.y - *operand;
+				// clear N/Z/C
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
+				nes->reg.p |= overflow << C6502_P_C_SHIFT;
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_DEC:
+				result = *operand - 1;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
+					ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
+					apu_write = (bank == NESSYS_APU_REG_START_BANK);
+					if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
+						switch (offset) {
+						case NESSYS_APU_STATUS_OFFSET:
+							nes->apu.status = (uint8_t)result;
+							break;
+						case NESSYS_APU_JOYPAD0_OFFSET:
+							nes->apu.joy_control = (uint8_t)result;
+							break;
+						case NESSYS_APU_FRAME_COUNTER_OFFSET:
+							nes->apu.frame_counter = (uint8_t)result;
+							break;
 						}
-					} else {
-						rom_write = true;
-						if (nes.mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
+					} else if (ram_ptr) {
+						data_change = (*operand ^ (uint8_t)result);
+						*ram_ptr = (uint8_t)result;
 					}
-					break;
-				case C6502_INS_DEX:
-					nes.reg.x--;
-					result = nes.reg.x;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_DEY:
-					nes.reg.y--;
-					result = nes.reg.y;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_EOR:
-					nes.reg.a ^= *operand;
-					result = nes.reg.a;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_INC:
-					result = *operand + 1;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
-						ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
-						apu_write = (bank == NESSYS_APU_REG_START_BANK);
-						if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
-							switch (offset) {
-							case NESSYS_APU_STATUS_OFFSET:
-								nes.apu.status = (uint8_t)result;
-								break;
-							case NESSYS_APU_JOYPAD0_OFFSET:
-								nes.apu.joy_control = (uint8_t)result;
-								break;
-							case NESSYS_APU_FRAME_COUNTER_OFFSET:
-								nes.apu.frame_counter = (uint8_t)result;
-								break;
-							}
-						} else if (ram_ptr) {
-							data_change = (*operand ^ (uint8_t)result);
-							*ram_ptr = (uint8_t)result;
+				} else {
+					rom_write = true;
+					if (nes->mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
+				}
+				break;
+			case C6502_INS_DEX:
+				nes->reg.x--;
+				result = nes->reg.x;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_DEY:
+				nes->reg.y--;
+				result = nes->reg.y;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_EOR:
+				nes->reg.a ^= *operand;
+				result = nes->reg.a;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_INC:
+				result = *operand + 1;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
+					ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
+					apu_write = (bank == NESSYS_APU_REG_START_BANK);
+					if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
+						switch (offset) {
+						case NESSYS_APU_STATUS_OFFSET:
+							nes->apu.status = (uint8_t)result;
+							break;
+						case NESSYS_APU_JOYPAD0_OFFSET:
+							nes->apu.joy_control = (uint8_t)result;
+							break;
+						case NESSYS_APU_FRAME_COUNTER_OFFSET:
+							nes->apu.frame_counter = (uint8_t)result;
+							break;
 						}
-					} else {
-						rom_write = true;
-						if (nes.mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
+					} else if (ram_ptr) {
+						data_change = (*operand ^ (uint8_t)result);
+						*ram_ptr = (uint8_t)result;
 					}
-					break;
-				case C6502_INS_INX:
-					nes.reg.x++;
-					result = nes.reg.x;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_INY:
-					nes.reg.y++;
-					result = nes.reg.y;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_JMP:
-					nes.reg.pc = addr;
-					break;
-				case C6502_INS_JSR:
-					result = nes.reg.pc - 1;
-					// get the stack base
-					ram_ptr = nessys_ram(0x100);
-					*(ram_ptr + nes.reg.s) = result >> 8;   nes.reg.s--;
-					*(ram_ptr + nes.reg.s) = result & 0xFF; nes.reg.s--;
+				} else {
+					rom_write = true;
+					if (nes->mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
+				}
+				break;
+			case C6502_INS_INX:
+				nes->reg.x++;
+				result = nes->reg.x;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_INY:
+				nes->reg.y++;
+				result = nes->reg.y;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_JMP:
+				nes->reg.pc = addr;
+				break;
+			case C6502_INS_JSR:
+				result = nes->reg.pc - 1;
+				// get the stack base
+				ram_ptr = nessys_ram(nes, 0x100);
+				*(ram_ptr + nes->reg.s) = result >> 8;   nes->reg.s--;
+				*(ram_ptr + nes->reg.s) = result & 0xFF; nes->reg.s--;
 #ifdef _DEBUG
-					nes.stack_trace[nes.stack_trace_entry].scanline = nes.scanline;
-					nes.stack_trace[nes.stack_trace_entry].scanline_cycle = nes.scanline_cycle;
-					nes.stack_trace[nes.stack_trace_entry].frame = nes.frame;
-					nes.stack_trace[nes.stack_trace_entry].return_addr = nes.reg.pc;
-					nes.stack_trace[nes.stack_trace_entry].jump_addr = addr;
-					nes.stack_trace_entry++;
-					if (nes.stack_trace_entry >= NESSYS_STACK_TRACE_ENTRIES) nes.stack_trace_entry = 0;
+				nes->stack_trace[nes->stack_trace_entry].scanline = nes->scanline;
+				nes->stack_trace[nes->stack_trace_entry].scanline_cycle = nes->scanline_cycle;
+				nes->stack_trace[nes->stack_trace_entry].frame = nes->frame;
+				nes->stack_trace[nes->stack_trace_entry].return_addr = nes->reg.pc;
+				nes->stack_trace[nes->stack_trace_entry].jump_addr = addr;
+				nes->stack_trace_entry++;
+				if (nes->stack_trace_entry >= NESSYS_STACK_TRACE_ENTRIES) nes->stack_trace_entry = 0;
 #endif
-					nes.reg.pc = addr;
-					break;
-				case C6502_INS_LDA:
-					nes.reg.a = *operand;
-					result = nes.reg.a;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_LDX:
-					nes.reg.x = *operand;
-					result = nes.reg.x;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_LDY:
-					nes.reg.y = *operand;
-					result = nes.reg.y;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_LSR:
-					overflow = *operand & 0x01;
-					result = *operand >> 1;
-					// clear N/Z/C
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
-					nes.reg.p |= overflow << C6502_P_C_SHIFT;
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
-						ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
-						apu_write = (bank == NESSYS_APU_REG_START_BANK);
-						if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
-							switch (offset) {
-							case NESSYS_APU_STATUS_OFFSET:
-								nes.apu.status = (uint8_t)result;
-								break;
-							case NESSYS_APU_JOYPAD0_OFFSET:
-								nes.apu.joy_control = (uint8_t)result;
-								break;
-							case NESSYS_APU_FRAME_COUNTER_OFFSET:
-								nes.apu.frame_counter = (uint8_t)result;
-								break;
-							}
-						} else if (ram_ptr) {
-							data_change = (*operand ^ (uint8_t)result);
-							*ram_ptr = (uint8_t)result;
+				nes->reg.pc = addr;
+				break;
+			case C6502_INS_LDA:
+				nes->reg.a = *operand;
+				result = nes->reg.a;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_LDX:
+				nes->reg.x = *operand;
+				result = nes->reg.x;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_LDY:
+				nes->reg.y = *operand;
+				result = nes->reg.y;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_LSR:
+				overflow = *operand & 0x01;
+				result = *operand >> 1;
+				// clear N/Z/C
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
+				nes->reg.p |= overflow << C6502_P_C_SHIFT;
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
+					ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
+					apu_write = (bank == NESSYS_APU_REG_START_BANK);
+					if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
+						switch (offset) {
+						case NESSYS_APU_STATUS_OFFSET:
+							nes->apu.status = (uint8_t)result;
+							break;
+						case NESSYS_APU_JOYPAD0_OFFSET:
+							nes->apu.joy_control = (uint8_t)result;
+							break;
+						case NESSYS_APU_FRAME_COUNTER_OFFSET:
+							nes->apu.frame_counter = (uint8_t)result;
+							break;
 						}
-					} else {
-						rom_write = true;
-						if (nes.mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
+					} else if (ram_ptr) {
+						data_change = (*operand ^ (uint8_t)result);
+						*ram_ptr = (uint8_t)result;
 					}
-					break;
-				case C6502_INS_ORA:
-					nes.reg.a |= *operand;
-					result = nes.reg.a;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_PHA:
-					// get the stack base
-					ram_ptr = nessys_ram(0x100);
-					*(ram_ptr + nes.reg.s) = nes.reg.a;   nes.reg.s--;
-					break;
-				case C6502_INS_PHP:
-					// get the stack base
-					ram_ptr = nessys_ram(0x100);
-					*(ram_ptr + nes.reg.s) = nes.reg.p;   nes.reg.s--;
-					break;
-				case C6502_INS_PLA:
-					// get the stack base
-					operand = nessys_mem(0x100, &bank, &offset);
-					nes.reg.s++; nes.reg.a = *(operand + nes.reg.s);
-					result = nes.reg.a;
-					// clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_PLP:
-					// get the stack base
-					operand = nessys_mem(0x100, &bank, &offset);
-					nes.iflag_delay = nes.reg.p;
-					nes.reg.s++; nes.reg.p = *(operand + nes.reg.s) | C6502_P_U | C6502_P_B;
-					nes.iflag_delay ^= nes.reg.p;
-					nes.iflag_delay &= C6502_P_I;
-					break;
-				case C6502_INS_ROL:
-					result = (*operand << 1) | ((nes.reg.p & C6502_P_C) >> C6502_P_C_SHIFT);
-					// clear N/Z/C
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
-					nes.reg.p |= (result & 0x100) >> (8 - C6502_P_C_SHIFT);
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
-						ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
-						apu_write = (bank == NESSYS_APU_REG_START_BANK);
-						if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
-							switch (offset) {
-							case NESSYS_APU_STATUS_OFFSET:
-								nes.apu.status = (uint8_t)result;
-								break;
-							case NESSYS_APU_JOYPAD0_OFFSET:
-								nes.apu.joy_control = (uint8_t)result;
-								break;
-							case NESSYS_APU_FRAME_COUNTER_OFFSET:
-								nes.apu.frame_counter = (uint8_t)result;
-								break;
-							}
-						} else if (ram_ptr) {
-							data_change = (*operand ^ (uint8_t)result);
-							*ram_ptr = (uint8_t)result;
+				} else {
+					rom_write = true;
+					if (nes->mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
+				}
+				break;
+			case C6502_INS_ORA:
+				nes->reg.a |= *operand;
+				result = nes->reg.a;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_PHA:
+				// get the stack base
+				ram_ptr = nessys_ram(nes, 0x100);
+				*(ram_ptr + nes->reg.s) = nes->reg.a;   nes->reg.s--;
+				break;
+			case C6502_INS_PHP:
+				// get the stack base
+				ram_ptr = nessys_ram(nes, 0x100);
+				*(ram_ptr + nes->reg.s) = nes->reg.p;   nes->reg.s--;
+				break;
+			case C6502_INS_PLA:
+				// get the stack base
+				operand = nessys_mem(nes, 0x100, &bank, &offset);
+				nes->reg.s++; nes->reg.a = *(operand + nes->reg.s);
+				result = nes->reg.a;
+				// clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_PLP:
+				// get the stack base
+				operand = nessys_mem(nes, 0x100, &bank, &offset);
+				nes->iflag_delay = nes->reg.p;
+				nes->reg.s++; nes->reg.p = *(operand + nes->reg.s) | C6502_P_U | C6502_P_B;
+				nes->iflag_delay ^= nes->reg.p;
+				nes->iflag_delay &= C6502_P_I;
+				// recheck for a pending irq
+				nes->event_scan_clk = 0;
+				break;
+			case C6502_INS_ROL:
+				result = (*operand << 1) | ((nes->reg.p & C6502_P_C) >> C6502_P_C_SHIFT);
+				// clear N/Z/C
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
+				nes->reg.p |= (result & 0x100) >> (8 - C6502_P_C_SHIFT);
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
+					ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
+					apu_write = (bank == NESSYS_APU_REG_START_BANK);
+					if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
+						switch (offset) {
+						case NESSYS_APU_STATUS_OFFSET:
+							nes->apu.status = (uint8_t)result;
+							break;
+						case NESSYS_APU_JOYPAD0_OFFSET:
+							nes->apu.joy_control = (uint8_t)result;
+							break;
+						case NESSYS_APU_FRAME_COUNTER_OFFSET:
+							nes->apu.frame_counter = (uint8_t)result;
+							break;
 						}
-					} else {
-						rom_write = true;
-						if (nes.mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
+					} else if (ram_ptr) {
+						data_change = (*operand ^ (uint8_t)result);
+						*ram_ptr = (uint8_t)result;
 					}
-					break;
-				case C6502_INS_ROR:
-					result = (*operand >> 1) | ((nes.reg.p & C6502_P_C) << (7 - C6502_P_C_SHIFT));
-					// clear N/Z/C
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
-					nes.reg.p |= (*operand & 0x1) << C6502_P_C_SHIFT;
-					nes.reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
-					if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
-						ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
-						apu_write = (bank == NESSYS_APU_REG_START_BANK);
-						if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
-							switch (offset) {
-							case NESSYS_APU_STATUS_OFFSET:
-								nes.apu.status = (uint8_t)result;
-								break;
-							case NESSYS_APU_JOYPAD0_OFFSET:
-								nes.apu.joy_control = (uint8_t)result;
-								break;
-							case NESSYS_APU_FRAME_COUNTER_OFFSET:
-								nes.apu.frame_counter = (uint8_t)result;
-								break;
-							}
-						} else if (ram_ptr) {
-							data_change = (*operand ^ (uint8_t)result);
-							*ram_ptr = (uint8_t)result;
+				} else {
+					rom_write = true;
+					if (nes->mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
+				}
+				break;
+			case C6502_INS_ROR:
+				result = (*operand >> 1) | ((nes->reg.p & C6502_P_C) << (7 - C6502_P_C_SHIFT));
+				// clear N/Z/C
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z | C6502_P_C);
+				nes->reg.p |= (*operand & 0x1) << C6502_P_C_SHIFT;
+				nes->reg.p |= ((result & 0xFF) == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (result & 0x80) >> (7 - C6502_P_N_SHIFT);
+				if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
+					ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
+					apu_write = (bank == NESSYS_APU_REG_START_BANK);
+					if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
+						switch (offset) {
+						case NESSYS_APU_STATUS_OFFSET:
+							nes->apu.status = (uint8_t)result;
+							break;
+						case NESSYS_APU_JOYPAD0_OFFSET:
+							nes->apu.joy_control = (uint8_t)result;
+							break;
+						case NESSYS_APU_FRAME_COUNTER_OFFSET:
+							nes->apu.frame_counter = (uint8_t)result;
+							break;
 						}
-					} else {
-						rom_write = true;
-						if (nes.mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
-					}
-					break;
-				case C6502_INS_RTI:
-					// get the stack base
-					ram_ptr = nessys_ram(0x100);
-					nes.reg.s++; nes.reg.p = *(ram_ptr + nes.reg.s) | C6502_P_U | C6502_P_B;
-					nes.reg.s++; nes.reg.pc = *(ram_ptr + nes.reg.s);
-					nes.reg.s++; nes.reg.pc |= ((uint16_t) * (ram_ptr + nes.reg.s)) << 8;
-					if (nes.in_nmi) {
-						nes.in_nmi--;
-						//nes.ppu.reg[2] = nes.ppu.old_status;
-						//reset_ppu_status_after_nmi = 3;
+					} else if (ram_ptr) {
+						data_change = (*operand ^ (uint8_t)result);
+						*ram_ptr = (uint8_t)result;
 					}
+				} else {
+					rom_write = true;
+					if (nes->mapper_flags & NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE) result = *operand;
+				}
+				break;
+			case C6502_INS_RTI:
+				// get the stack base
+				ram_ptr = nessys_ram(nes, 0x100);
+				nes->reg.s++; nes->reg.p = *(ram_ptr + nes->reg.s) | C6502_P_U | C6502_P_B;
+				nes->reg.s++; nes->reg.pc = *(ram_ptr + nes->reg.s);
+				nes->reg.s++; nes->reg.pc |= ((uint16_t) * (ram_ptr + nes->reg.s)) << 8;
+				// recheck for a pending irq
+				nes->event_scan_clk = 0;
+				if (nes->in_nmi) {
+					nes->in_nmi--;
+					//nes->ppu.reg[2] = nes->ppu.old_status;
+					//reset_ppu_status_after_nmi = 3;
+				}
 #ifdef _DEBUG
-					if (nes.stack_trace_entry == 0) nes.stack_trace_entry = NESSYS_STACK_TRACE_ENTRIES;
-					nes.stack_trace_entry--;
-					if (nes.irq_trace_entry == 0) nes.irq_trace_entry = NESSYS_STACK_TRACE_ENTRIES;
-					nes.irq_trace_entry--;
+				if (nes->stack_trace_entry == 0) nes->stack_trace_entry = NESSYS_STACK_TRACE_ENTRIES;
+				nes->stack_trace_entry--;
+				if (nes->irq_trace_entry == 0) nes->irq_trace_entry = NESSYS_STACK_TRACE_ENTRIES;
+				nes->irq_trace_entry--;
 #endif
-					break;
-				case C6502_INS_RTS:
-					// get the stack base
-					ram_ptr = nessys_ram(0x100);
-					nes.reg.s++; result = *(ram_ptr + nes.reg.s);
-					nes.reg.s++; result |= ((uint16_t) * (ram_ptr + nes.reg.s)) << 8;
-					nes.reg.pc = result + 1;
+				break;
+			case C6502_INS_RTS:
+				// get the stack base
+				ram_ptr = nessys_ram(nes, 0x100);
+				nes->reg.s++; result = *(ram_ptr + nes->reg.s);
+				nes->reg.s++; result |= ((uint16_t) * (ram_ptr + nes->reg.s)) << 8;
+				nes->reg.pc = result + 1;
 #ifdef _DEBUG
-					if (nes.stack_trace_entry == 0) nes.stack_trace_entry = NESSYS_STACK_TRACE_ENTRIES;
-					nes.stack_trace_entry--;
+				if (nes->stack_trace_entry == 0) nes->stack_trace_entry = NESSYS_STACK_TRACE_ENTRIES;
+				nes->stack_trace_entry--;
 #endif
-					break;
-				case C6502_INS_SEC:
-					nes.reg.p |= C6502_P_C;
-					break;
-				case C6502_INS_SED:
-					nes.reg.p |= C6502_P_D;
-					break;
-				case C6502_INS_SEI:
-					nes.iflag_delay = nes.reg.p;
-					nes.reg.p |= C6502_P_I;
-					nes.iflag_delay ^= nes.reg.p;
-					nes.iflag_delay &= C6502_P_I;
-					break;
-				case C6502_INS_STA:
-					if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
-						ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
-						apu_write = (bank == NESSYS_APU_REG_START_BANK);
-						if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
-							switch (offset) {
-							case NESSYS_APU_STATUS_OFFSET:
-								nes.apu.status = nes.reg.a;
-								break;
-							case NESSYS_APU_JOYPAD0_OFFSET:
-								nes.apu.joy_control = nes.reg.a;
-								break;
-							case NESSYS_APU_FRAME_COUNTER_OFFSET:
-								nes.apu.frame_counter = nes.reg.a;
-								break;
-							}
-						} else if (ram_ptr) {
-							data_change = (*operand ^ nes.reg.a);
-							*ram_ptr = nes.reg.a;
+				break;
+			case C6502_INS_SEC:
+				nes->reg.p |= C6502_P_C;
+				break;
+			case C6502_INS_SED:
+				nes->reg.p |= C6502_P_D;
+				break;
+			case C6502_INS_SEI:
+				nes->iflag_delay = nes->reg.p;
+				nes->reg.p |= C6502_P_I;
+				nes->iflag_delay ^= nes->reg.p;
+				nes->iflag_delay &= C6502_P_I;
+				// recheck for a pending irq
+				nes->event_scan_clk = 0;
+				break;
+			case C6502_INS_STA:
+				if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
+					ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
+					apu_write = (bank == NESSYS_APU_REG_START_BANK);
+					if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
+						switch (offset) {
+						case NESSYS_APU_STATUS_OFFSET:
+							nes->apu.status = nes->reg.a;
+							break;
+						case NESSYS_APU_JOYPAD0_OFFSET:
+							nes->apu.joy_control = nes->reg.a;
+							break;
+						case NESSYS_APU_FRAME_COUNTER_OFFSET:
+							nes->apu.frame_counter = nes->reg.a;
+							break;
 						}
-					} else {
-						rom_write = true;
-						result = nes.reg.a;
+					} else if (ram_ptr) {
+						data_change = (*operand ^ nes->reg.a);
+						*ram_ptr = nes->reg.a;
 					}
-					break;
-				case C6502_INS_STX:
-					if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
-						ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
-						apu_write = (bank == NESSYS_APU_REG_START_BANK);
-						if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
-							switch (offset) {
-							case NESSYS_APU_STATUS_OFFSET:
-								nes.apu.status = nes.reg.x;
-								break;
-							case NESSYS_APU_JOYPAD0_OFFSET:
-								nes.apu.joy_control = nes.reg.x;
-								break;
-							case NESSYS_APU_FRAME_COUNTER_OFFSET:
-								nes.apu.frame_counter = nes.reg.x;
-								break;
-							}
-						} else if (ram_ptr) {
-							data_change = (*operand ^ nes.reg.x);
-							*ram_ptr = nes.reg.x;
+				} else {
+					rom_write = true;
+					result = nes->reg.a;
+				}
+				break;
+			case C6502_INS_STX:
+				if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
+					ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
+					apu_write = (bank == NESSYS_APU_REG_START_BANK);
+					if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
+						switch (offset) {
+						case NESSYS_APU_STATUS_OFFSET:
+							nes->apu.status = nes->reg.x;
+							break;
+						case NESSYS_APU_JOYPAD0_OFFSET:
+							nes->apu.joy_control = nes->reg.x;
+							break;
+						case NESSYS_APU_FRAME_COUNTER_OFFSET:
+							nes->apu.frame_counter = nes->reg.x;
+							break;
 						}
-					} else {
-						rom_write = true;
-						result = nes.reg.x;
+					} else if (ram_ptr) {
+						data_change = (*operand ^ nes->reg.x);
+						*ram_ptr = nes->reg.x;
 					}
-					break;
-				case C6502_INS_STY:
-					if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
-						ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
-						apu_write = (bank == NESSYS_APU_REG_START_BANK);
-						if (apu_write && offset >= NESSYS_APU_JOYPAD0_OFFSET) {
-							switch (offset) {
-							case NESSYS_APU_STATUS_OFFSET:
-								nes.apu.status = nes.reg.y;
-								break;
-							case NESSYS_APU_JOYPAD0_OFFSET:
-								nes.apu.joy_control = nes.reg.y;
-								break;
-							case NESSYS_APU_FRAME_COUNTER_OFFSET:
-								nes.apu.frame_counter = nes.reg.y;
-								break;
-							}
-						} else if (ram_ptr) {
-							data_change = (*operand ^ nes.reg.y);
-							*ram_ptr = nes.reg.y;
+				} else {
+					rom_write = true;
+					result = nes->reg.x;
+				}
+				break;
+			case C6502_INS_STY:
+				if (bank < NESSYS_PRG_ROM_START_BANK && !(bank == NESSYS_APU_REG_START_BANK && offset >= NESSYS_APU_SIZE)) {
+					ppu_write = (bank == NESSYS_PPU_REG_START_BANK) || (bank == NESSYS_APU_REG_START_BANK && offset == 0x14);
+					apu_write = (bank == NESSYS_APU_REG_START_BANK);
+					if (apu_write && offset >= NESSYS_APU_STATUS_OFFSET) {
+						switch (offset) {
+						case NESSYS_APU_STATUS_OFFSET:
+							nes->apu.status = nes->reg.y;
+							break;
+						case NESSYS_APU_JOYPAD0_OFFSET:
+							nes->apu.joy_control = nes->reg.y;
+							break;
+						case NESSYS_APU_FRAME_COUNTER_OFFSET:
+							nes->apu.frame_counter = nes->reg.y;
+							break;
 						}
-					} else {
-						rom_write = true;
-						result = nes.reg.y;
+					} else if (ram_ptr) {
+						data_change = (*operand ^ nes->reg.y);
+						*ram_ptr = nes->reg.y;
+					}
+				} else {
+					rom_write = true;
+					result = nes->reg.y;
+				}
+				break;
+			case C6502_INS_TAX:
+				nes->reg.x = nes->reg.a;
+				//clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= (nes->reg.x == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (nes->reg.x & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_TAY:
+				nes->reg.y = nes->reg.a;
+				//clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= (nes->reg.y == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (nes->reg.y & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_TSX:
+				nes->reg.x = nes->reg.s;
+				//clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= (nes->reg.x == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (nes->reg.x & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_TXA:
+				nes->reg.a = nes->reg.x;
+				//clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= (nes->reg.a == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (nes->reg.a & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			case C6502_INS_TXS:
+				nes->reg.s = nes->reg.x;
+				break;
+			case C6502_INS_TYA:
+				nes->reg.a = nes->reg.y;
+				//clear N/Z
+				nes->reg.p &= ~(C6502_P_N | C6502_P_Z);
+				nes->reg.p |= (nes->reg.a == 0x00) << C6502_P_Z_SHIFT;
+				nes->reg.p |= (nes->reg.a & 0x80) >> (7 - C6502_P_N_SHIFT);
+				break;
+			default:
+				// everything not decoded is a NOP
+				// TODO: undocumented instructions
+				// TODO: handle writing to memory mappers (writing to rom space)
+				break;
+			}
+
+			if (bank == NESSYS_PPU_REG_START_BANK) {
+				switch (offset) {
+				case 2:
+					// if we read or write ppu status, update it's value from the master status reg
+					//nes->ppu.reg[2] &= 0x1F;
+					//nes->ppu.reg[2] |= nes->ppu.status;
+					nes->ppu.addr_toggle = 0;
+					break;
+				case 7:
+					// latch read data after the instruction
+					if (!ppu_write) {
+						nes->ppu.reg[7] = *nessys_ppu_mem(nes, nes->ppu.mem_addr);
+						// if bit 2 is 0, increment address by 1 (one step horizontal), otherwise, increment by 32 (one step vertical)
+						nes->ppu.mem_addr += !((nes->ppu.reg[0] & 0x4) >> 1) + ((nes->ppu.reg[0] & 0x4) << 3);
+						nes->ppu.mem_addr &= NESSYS_PPU_WIN_MAX;
 					}
 					break;
-				case C6502_INS_TAX:
-					nes.reg.x = nes.reg.a;
-					//clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= (nes.reg.x == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (nes.reg.x & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_TAY:
-					nes.reg.y = nes.reg.a;
-					//clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= (nes.reg.y == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (nes.reg.y & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_TSX:
-					nes.reg.x = nes.reg.s;
-					//clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= (nes.reg.x == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (nes.reg.x & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_TXA:
-					nes.reg.a = nes.reg.x;
-					//clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= (nes.reg.a == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (nes.reg.a & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				case C6502_INS_TXS:
-					nes.reg.s = nes.reg.x;
-					break;
-				case C6502_INS_TYA:
-					nes.reg.a = nes.reg.y;
-					//clear N/Z
-					nes.reg.p &= ~(C6502_P_N | C6502_P_Z);
-					nes.reg.p |= (nes.reg.a == 0x00) << C6502_P_Z_SHIFT;
-					nes.reg.p |= (nes.reg.a & 0x80) >> (7 - C6502_P_N_SHIFT);
-					break;
-				default:
-					// everything not decoded is a NOP
-					// TODO: undocumented instructions
-					// TODO: handle writing to memory mappers (writing to rom space)
-					break;
 				}
+			}
 
-				if (bank == NESSYS_PPU_REG_START_BANK) {
-					switch (offset) {
-					case 2:
-						// if we read or write ppu status, update it's value from the master status reg
-						//nes.ppu.reg[2] &= 0x1F;
-						//nes.ppu.reg[2] |= nes->ppu.status;
-						nes.ppu.addr_toggle = 0;
-						break;
-					case 7:
-						// latch read data after the instruction
-						if (!ppu_write) {
-							nes.ppu.reg[7] = *nessys_ppu_mem(nes.ppu.mem_addr);
-							// if bit 2 is 0, increment address by 1 (one step horizontal), otherwise, increment by 32 (one step vertical)
-							nes.ppu.mem_addr += !((nes.ppu.reg[0] & 0x4) >> 1) + ((nes.ppu.reg[0] & 0x4) << 3);
-							nes.ppu.mem_addr &= NESSYS_PPU_WIN_MAX;
-						}
-						break;
-					}
+			// process APU writes; oam dma is handled with the ppu writes, and the joypad strobe latches the buttons
+			if (apu_write && offset == NESSYS_APU_JOYPAD0_OFFSET) {
+				if (nes->apu.joy_control & 0x1) {
+					nes->apu.latched_joypad[0] = nes->apu.joypad[0];
+					nes->apu.latched_joypad[1] = nes->apu.joypad[1];
+				}
+			} else if (apu_write && offset != 0x14) {
+				nessys_apu_write(nes, (uint8_t)offset);
+			}
+
+			// a store changed battery backed ram; its page is saved once the game stops writing
+			if (data_change && bank == NESSYS_PRG_RAM_START_BANK) nessave_mark(ram_ptr);
+
+			// process mapper register writes; this only swaps bank pointers, and the next opcode is fetched through the new map below
+			if (rom_write) {
+				// read-modify-write instructions write the unmodified value back the cycle before the result
+				if (op->ins != C6502_INS_STA && op->ins != C6502_INS_STX && op->ins != C6502_INS_STY) {
+					cpu_loop_mapper_write(nes, loop, addr, *operand);
 				}
+				cpu_loop_mapper_write(nes, loop, addr, (uint8_t)result);
+			}
 
-				// process PPU writes
-				if (ppu_write) {
-					if (bank == NESSYS_PPU_REG_START_BANK) {
-						nes.ppu.reg[2] = (nes.ppu.status & 0xE0) | (nes.ppu.reg[offset & 0x7] & 0x1F);
+			// process PPU writes
+			if (ppu_write) {
+				if (bank == NESSYS_PPU_REG_START_BANK) {
+					nes->ppu.reg[2] = (nes->ppu.status & 0xE0) | (nes->ppu.reg[offset & 0x7] & 0x1F);
+				}
+				switch (offset) {
+				case 0x0:
+					// if the app toggles vblank enable from 0 to 1 while in vblank, retrigger a vblank
+					if ((nes->ppu.reg[2] & 0x80) && (data_change & 0x80) && (nes->ppu.reg[0] & 0x80)) {
+						nessys_irq(nes, NESSYS_NMI_VECTOR, C6502_P_B);
+						nes->next_line_scan_clk += NESSYS_PPU_PER_CPU_CLK * 7;
 					}
-					switch (offset) {
-					case 0x0:
-						// if the app toggles vblank enable from 0 to 1 while in vblank, retrigger a vblank
-						if ((nes.ppu.reg[2] & 0x80) && (data_change & 0x80) && (nes.ppu.reg[0] & 0x80)) {
-							nessys_irq(NESSYS_NMI_VECTOR, C6502_P_B);
-							next_line_scan_clk += NESSYS_PPU_PER_CPU_CLK * 7;
-						}
-						break;
-					case 0x4:
-						nes.ppu.oam[nes.ppu.reg[3]] = nes.ppu.reg[4];
-						if (nes.scan_line >= NESSYS_PPU_SCANLINES_START_RENDER &&
-							(((nes.ppu.reg[3] & 0x3) == 0x1) || ((nes.ppu.reg[3] & 0x3) == 0x2))) {
-							// Changing sprite in the middle of a frame should be very rare, but in case, regenerate that sprite
-							nessys_gen_oam_pix(nes.ppu.reg[3] >> 2);
-						}
-						nes.ppu.reg[3]++;
-						break;
-					case 0x5:
-						// update the vram address as well
-						if (nes.ppu.addr_toggle) {
-							nes.ppu.t_mem_addr &= 0x0c1f;
-							nes.ppu.t_mem_addr |= ((uint16_t)nes.ppu.reg[5] << 2) & 0x03e0;
-							nes.ppu.t_mem_addr |= ((uint16_t)nes.ppu.reg[5] << 12) & 0x7000;
-						} else {
-							nes.ppu.t_mem_addr &= 0xffe0;
-							nes.ppu.t_mem_addr |= (nes.ppu.reg[5] >> 3) & 0x1f;
-						}
-						nes.ppu.scroll[nes.ppu.addr_toggle] = nes.ppu.reg[5];
-						nes.ppu.addr_toggle = !nes.ppu.addr_toggle;
-						break;
-					case 0x6:
-						mem_addr_mask = 0xFF00 >> 8 * (nes.ppu.addr_toggle);
-						nes.ppu.t_mem_addr &= ~mem_addr_mask;
-						nes.ppu.t_mem_addr |= (((uint16_t)nes.ppu.reg[6] << 8) | nes.ppu.reg[6]) & mem_addr_mask;
-						// update scroll and nametable select signals
-						if (nes.ppu.addr_toggle) {
-							nes.ppu.scroll[0] &= 0x07;
-							nes.ppu.scroll[0] |= (nes.ppu.reg[6] << 3) & 0xf8;
-							nes.ppu.scroll[1] &= 0xc7;
-							nes.ppu.scroll[1] |= (nes.ppu.reg[6] >> 2) & 0x38;
-						} else {
-							nes.ppu.scroll[1] &= 0x38;
-							nes.ppu.scroll[1] |= (nes.ppu.reg[6] << 6) & 0xc0;
-							nes.ppu.scroll[1] |= (nes.ppu.reg[6] >> 4) & 0x03;
-							nes.ppu.reg[0] &= 0xfc;
-							nes.ppu.reg[0] |= (nes.ppu.reg[6] >> 2) & 0x3;
-						}
-						if (nes.ppu.addr_toggle) {
-							nes.ppu.mem_addr = nes.ppu.t_mem_addr;
-							nes.ppu.mem_addr &= NESSYS_PPU_WIN_MAX;
-							nes.ppu.scroll_y = ((nes.ppu.reg[0] & 0x2) << 7) | nes.ppu.scroll[1];
-							//nes.ppu.max_y = 240 + (nes.ppu.scroll_y & 0x100);
-							nes.ppu.scroll_y_changed = true;
-						}
-						nes.ppu.addr_toggle = !nes.ppu.addr_toggle;
-						break;
-					case 0x7:
-						*nessys_ppu_ram(nes.ppu.mem_addr) = nes.ppu.reg[7];
-						if (nes.ppu.mem_addr >= NESSYS_CHR_PAL_WIN_MIN) {
-							// alias 3f10, 3f14, 3f18 and 3f1c to corresponding 3f0x
-							// and vice versa
-							if ((nes.ppu.mem_addr & 0x3) == 0x0) {
-								nes.ppu.pal[(nes.ppu.mem_addr & NESSYS_PPU_PAL_MASK) ^ 0x10] = nes.ppu.reg[7];
-							}
+					break;
+				case 0x4:
+					nes->ppu.oam[nes->ppu.reg[3]] = nes->ppu.reg[4];
+					if (nes->scan_line >= NESSYS_PPU_SCANLINES_START_RENDER &&
+						(((nes->ppu.reg[3] & 0x3) == 0x1) || ((nes->ppu.reg[3] & 0x3) == 0x2))) {
+						// Changing sprite in the middle of a frame should be very rare, but in case, regenerate that sprite
+						nessys_gen_oam_pix(nes, nes->ppu.reg[3] >> 2);
+					}
+					nes->ppu.reg[3]++;
+					break;
+				case 0x5:
+					// update the vram address as well
+					if (nes->ppu.addr_toggle) {
+						nes->ppu.t_mem_addr &= 0x0c1f;
+						nes->ppu.t_mem_addr |= ((uint16_t)nes->ppu.reg[5] << 2) & 0x03e0;
+						nes->ppu.t_mem_addr |= ((uint16_t)nes->ppu.reg[5] << 12) & 0x7000;
+					} else {
+						nes->ppu.t_mem_addr &= 0xffe0;
+						nes->ppu.t_mem_addr |= (nes->ppu.reg[5] >> 3) & 0x1f;
+					}
+					nes->ppu.scroll[nes->ppu.addr_toggle] = nes->ppu.reg[5];
+					nes->ppu.addr_toggle = !nes->ppu.addr_toggle;
+					break;
+				case 0x6:
+					mem_addr_mask = 0xFF00 >> 8 * (nes->ppu.addr_toggle);
+					nes->ppu.t_mem_addr &= ~mem_addr_mask;
+					nes->ppu.t_mem_addr |= (((uint16_t)nes->ppu.reg[6] << 8) | nes->ppu.reg[6]) & mem_addr_mask;
+					// update scroll and nametable select signals
+					if (nes->ppu.addr_toggle) {
+						nes->ppu.scroll[0] &= 0x07;
+						nes->ppu.scroll[0] |= (nes->ppu.reg[6] << 3) & 0xf8;
+						nes->ppu.scroll[1] &= 0xc7;
+						nes->ppu.scroll[1] |= (nes->ppu.reg[6] >> 2) & 0x38;
+					} else {
+						nes->ppu.scroll[1] &= 0x38;
+						nes->ppu.scroll[1] |= (nes->ppu.reg[6] << 6) & 0xc0;
+						nes->ppu.scroll[1] |= (nes->ppu.reg[6] >> 4) & 0x03;
+						nes->ppu.reg[0] &= 0xfc;
+						nes->ppu.reg[0] |= (nes->ppu.reg[6] >> 2) & 0x3;
+					}
+					if (nes->ppu.addr_toggle) {
+						nes->ppu.mem_addr = nes->ppu.t_mem_addr;
+						nes->ppu.mem_addr &= NESSYS_PPU_WIN_MAX;
+						nes->ppu.scroll_y = ((nes->ppu.reg[0] & 0x2) << 7) | nes->ppu.scroll[1];
+						//nes->ppu.max_y = 240 + (nes->ppu.scroll_y & 0x100);
+						nes->ppu.scroll_y_changed = true;
+					}
+					nes->ppu.addr_toggle = !nes->ppu.addr_toggle;
+					break;
+				case 0x7:
+					*nessys_ppu_ram(nes, nes->ppu.mem_addr) = nes->ppu.reg[7];
+					if (nes->ppu.mem_addr >= NESSYS_CHR_PAL_WIN_MIN) {
+						// alias 3f10, 3f14, 3f18 and 3f1c to corresponding 3f0x
+						// and vice versa
+						if ((nes->ppu.mem_addr & 0x3) == 0x0) {
+							nes->ppu.pal[(nes->ppu.mem_addr & NESSYS_PPU_PAL_MASK) ^ 0x10] = nes->ppu.reg[7];
 						}
-						// if bit 2 is 0, increment address by 1 (one step horizontal), otherwise, increment by 32 (one step vertical)
-						nes.ppu.mem_addr += !((nes.ppu.reg[0] & 0x4) >> 1) + ((nes.ppu.reg[0] & 0x4) << 3);
-						nes.ppu.mem_addr &= NESSYS_PPU_WIN_MAX;
-						break;
-					case 0x14:
-						addr = nes.apu.reg[0x14] << 8;
-						operand = nessys_mem(addr, &bank, &offset);
-						memcpy(nes.ppu.oam, operand, NESSYS_PPU_OAM_SIZE);
-						if (nes.scan_line >= NESSYS_PPU_SCANLINES_START_RENDER) {
-							// Changing sprite in the middle of a frame should be very rare, but in case, regenerate sprites
-							for (sp = 0; sp < NESSYS_PPU_NUM_SPRITES; sp++) {
-								nessys_gen_oam_pix(sp);
-							}
+					}
+					// if bit 2 is 0, increment address by 1 (one step horizontal), otherwise, increment by 32 (one step vertical)
+					nes->ppu.mem_addr += !((nes->ppu.reg[0] & 0x4) >> 1) + ((nes->ppu.reg[0] & 0x4) << 3);
+					nes->ppu.mem_addr &= NESSYS_PPU_WIN_MAX;
+					break;
+				case 0x14:
+					addr = nes->apu.reg[0x14] << 8;
+					operand = nessys_mem(nes, addr, &bank, &offset);
+					memcpy(nes->ppu.oam, operand, NESSYS_PPU_OAM_SIZE);
+					if (nes->scan_line >= NESSYS_PPU_SCANLINES_START_RENDER) {
+						// Changing sprite in the middle of a frame should be very rare, but in case, regenerate sprites
+						for (sp = 0; sp < NESSYS_PPU_NUM_SPRITES; sp++) {
+							nessys_gen_oam_pix(nes, sp);
 						}
-						penalty_cycles += 514;
-						break;
 					}
+					penalty_cycles += 514;
+					break;
 				}
+			}
 
-				// increment pc
-				pc_ptr_next = nessys_mem(nes.reg.pc, &bank, &offset);
-				op_next = C6502_OP_CODE + *pc_ptr_next;
-				nes.scan_clk += NESSYS_PPU_PER_CPU_CLK * (op->num_cycles + penalty_cycles) + next_line_scan_clk;  // add the extra cycles from the prior line, or IRQ
-				next_line_scan_clk = 0;
-				if (nes.scan_clk >= nes.sprite0_hit_scan_clk) {
-					nes.ppu.reg[2] |= 0x40;
-					nes.sprite0_hit_scan_clk = ~0;
+			// increment pc
+			pc_ptr_next = nessys_mem(nes, nes->reg.pc, &bank, &offset);
+			op_next = C6502_OP_CODE + *pc_ptr_next;
+			nes->scan_clk += NESSYS_PPU_PER_CPU_CLK * (op->num_cycles + penalty_cycles) + nes->next_line_scan_clk;  // add the extra cycles from the prior line, or IRQ
+			nes->next_line_scan_clk = 0;
+			// sprite 0 hit, dmc fetches and irqs are all scheduled, so there's only one compare per instruction
+			if (nes->scan_clk >= nes->event_scan_clk) {
+				if (nessys_process_events(nes)) {
+					pc_ptr_next = nessys_mem(nes, nes->reg.pc, &bank, &offset);
+					op_next = C6502_OP_CODE + *pc_ptr_next;
+					nes->scan_clk += NESSYS_PPU_PER_CPU_CLK * 7;
 				}
+			}
 
-				// if we are not in the renderable part of the frame, copy the vertical scroll value
-				if (nes.scan_line < NESSYS_PPU_SCANLINES_START_RENDER) {
-					nes.ppu.scroll_y = ((nes.ppu.reg[0] & 0x2) << 7) | nes.ppu.scroll[1];
-					//nes.ppu.max_y = 240 + (nes.ppu.scroll_y & 0x100);
-					nes.ppu.scroll_y_changed = true;
-				}
+			// if we are not in the renderable part of the frame, copy the vertical scroll value
+			if (nes->scan_line < NESSYS_PPU_SCANLINES_START_RENDER) {
+				nes->ppu.scroll_y = ((nes->ppu.reg[0] & 0x2) << 7) | nes->ppu.scroll[1];
+				//nes->ppu.max_y = 240 + (nes->ppu.scroll_y & 0x100);
+				nes->ppu.scroll_y_changed = true;
+			}
 #ifndef PPU_MULTI_THREAD
-				process_ppu();
+			process_ppu(nes);
 #endif
 
-			}
+		}
 
-			next_line_scan_clk = nes.scan_clk - NESSYS_PPU_CLK_PER_SCANLINE;
-			next_scan_line = nes.scan_line + 1;
-			y = next_scan_line - NESSYS_PPU_SCANLINES_START_RENDER;
+		nes->next_line_scan_clk = nes->scan_clk - NESSYS_PPU_CLK_PER_SCANLINE;
+		next_scan_line = nes->scan_line + 1;
+		y = next_scan_line - NESSYS_PPU_SCANLINES_START_RENDER;
 
-			// if background is enabled and we're going to the first rendered line, or we're at the beginning of a new row of tiles,
-			// regenerate the tile pixels
-			bool gen_tile_pix = (nes.ppu.reg[1] & 0x8) &&
-				((next_scan_line == NESSYS_PPU_SCANLINES_START_RENDER) || (((y + nes.ppu.scroll_y) & 0x7) == 0x0));
+		// if background is enabled and we're going to the first rendered line, or we're at the beginning of a new row of tiles,
+		// regenerate the tile pixels
+		bool gen_tile_pix = (nes->ppu.reg[1] & 0x8) && (!logic_only || nes->mapper_bg_setup) &&
+			((next_scan_line == NESSYS_PPU_SCANLINES_START_RENDER) || (((y + nes->ppu.scroll_y) & 0x7) == 0x0));
 
-			if (next_scan_line >= NESSYS_PPU_SCANLINES_START_RENDER) {
-				if (gen_tile_pix) {
-					nessys_gen_tile_pix(y);
-				}
+		if (next_scan_line >= NESSYS_PPU_SCANLINES_START_RENDER) {
+			if (gen_tile_pix) {
+				nessys_gen_tile_pix(nes, y);
 			}
+		}
 
 #ifdef PPU_MULTI_THREAD
-			// check if we rendered a scanline
-			if (nes.scan_line >= NESSYS_PPU_SCANLINES_START_RENDER && (nes.frame_delta_time <= 0) &&
-				nes.scan_line < NESSYS_PPU_SCANLINES_START_RENDER + FB_HEIGHT) {
+		// an instance with no ppu thread renders the whole line here
+		if (nes->render_inline && nes->scan_line >= NESSYS_PPU_SCANLINES_START_RENDER && (nes->frame_delta_time <= 0) &&
+			nes->scan_line < NESSYS_PPU_SCANLINES_START_RENDER + FB_HEIGHT) {
+			nes->c0_rstate.tile_x = 0;  // force tile re-evaluation
+			process_pixels(nes, 0, FB_WIDTH, nes->scan_line - NESSYS_PPU_SCANLINES_START_RENDER, &nes->c0_rstate);
+		}
+		// check if we rendered a scanline
+		if (!nes->render_inline && nes->scan_line >= NESSYS_PPU_SCANLINES_START_RENDER && (nes->frame_delta_time <= 0) &&
+			nes->scan_line < NESSYS_PPU_SCANLINES_START_RENDER + FB_HEIGHT) {
+
+			//bool c0_render_done = false;
+			//nes->scan_clk = FB_WIDTH;
+			//
+			//y = nes->scan_line - NESSYS_PPU_SCANLINES_START_RENDER;
+			//while (!c0_render_done) {
+			//	nes->scan_clk -= RENDER_PIXEL_INC;
+			//	if (nes->scan_clk > nes->rendered_scan_clk) {
+			//		min_x = nes->scan_clk;
+			//		max_x = nes->scan_clk + RENDER_PIXEL_INC;
+			//		max_x = (max_x > FB_WIDTH) ? FB_WIDTH : max_x;
+			//
+			//		process_pixels(nes, min_x, max_x, y, &nes->c0_rstate);
+			//	} else {
+			//		nes->scan_clk += RENDER_PIXEL_INC;
+			//		c0_render_done = true;
+			//	}
+			//}
 
-				//bool c0_render_done = false;
-				//nes.scan_clk = FB_WIDTH;
-				//
-				//y = nes.scan_line - NESSYS_PPU_SCANLINES_START_RENDER;
-				//while (!c0_render_done) {
-				//	nes.scan_clk -= RENDER_PIXEL_INC;
-				//	if (nes.scan_clk > nes.rendered_scan_clk) {
-				//		min_x = nes.scan_clk;
-				//		max_x = nes.scan_clk + RENDER_PIXEL_INC;
-				//		max_x = (max_x > FB_WIDTH) ? FB_WIDTH : max_x;
-				//
-				//		process_pixels(min_x, max_x, y, &nes.c0_rstate);
-				//	} else {
-				//		nes.scan_clk += RENDER_PIXEL_INC;
-				//		c0_render_done = true;
-				//	}
-				//}
-
-				// This first assign is to prevent c1 from getting into the right half of the screen while the mid point is being computed
-				nes.scan_clk = FB_WIDTH / 2;  
-				nes.scan_clk = ((FB_WIDTH / 2 + RENDER_PIXEL_INC - 1) + (nes.rendered_scan_clk >> 1)) & ~(RENDER_PIXEL_INC - 1);
-				uint y = nes.scan_line - NESSYS_PPU_SCANLINES_START_RENDER;
-				nes.c0_rstate.tile_x = 0;  // force tile re-evaluation
-				process_pixels(nes.scan_clk, FB_WIDTH, y, &nes.c0_rstate);
-
-				loop_count = nes.scan_clk;
-				while (!nes.c1_render_done)
-					;
+			// This first assign is to prevent c1 from getting into the right half of the screen while the mid point is being computed
+			nes->scan_clk = FB_WIDTH / 2;  
+			nes->scan_clk = ((FB_WIDTH / 2 + RENDER_PIXEL_INC - 1) + (nes->rendered_scan_clk >> 1)) & ~(RENDER_PIXEL_INC - 1);
+			uint y = nes->scan_line - NESSYS_PPU_SCANLINES_START_RENDER;
+			nes->c0_rstate.tile_x = 0;  // force tile re-evaluation
+			process_pixels(nes, nes->scan_clk, FB_WIDTH, y, &nes->c0_rstate);
 
-			}
+			loop_count = nes->scan_clk;
+			while (!nes->c1_render_done)
+				;
+
+		}
 #endif
 
-			nes.scan_line++;
-
-			// if we're going into the renderable part of the frame, reload the scan_line oam at the end of each scan line
-			if (nes.scan_line >= NESSYS_PPU_SCANLINES_START_RENDER) {
-				uint i, sp_height = (nes.ppu.reg[0] & 0x20) ? 16 : 8;
-				uint sp_y;
-
-				// if background is enabled and we're going to the first rendered line, or we're at the beginning of a new row of tiles,
-				// regenerate the tile pixels
-				if (gen_tile_pix) {
-					//nessys_gen_tile_pix(y);
-					uint16_t* temp = nes.ppu.draw_tile_pix;
-					nes.ppu.draw_tile_pix = nes.ppu.disp_tile_pix;
-					nes.ppu.disp_tile_pix = temp;
-					if (((y + nes.ppu.scroll_y) & 0x1f) == 0x0) {
-						uint8_t* temp = nes.ppu.draw_attrib_pix;
-						nes.ppu.draw_attrib_pix = nes.ppu.disp_attrib_pix;
-						nes.ppu.disp_attrib_pix = temp;
-					}
+		nes->scan_line++;
+		nes->line_start_clk += NESSYS_PPU_CLK_PER_SCANLINE;
+
+		// if we're going into the renderable part of the frame, reload the scan_line oam at the end of each scan line
+		if (nes->scan_line >= NESSYS_PPU_SCANLINES_START_RENDER) {
+			uint i, sp_height = (nes->ppu.reg[0] & 0x20) ? 16 : 8;
+			uint sp_y;
+
+			// the mapper moved pattern banks since the sprites were generated
+			if (nes->ppu.oam_pix_dirty) {
+				for (sp = 0; sp < ((logic_only) ? 1 : NESSYS_PPU_NUM_SPRITES); sp++) {
+					nessys_gen_oam_pix(nes, sp);
+				}
+				nes->ppu.oam_pix_dirty = false;
+			}
+
+			// if background is enabled and we're going to the first rendered line, or we're at the beginning of a new row of tiles,
+			// regenerate the tile pixels
+			if (gen_tile_pix) {
+				//nessys_gen_tile_pix(nes, y);
+				uint16_t* temp = nes->ppu.draw_tile_pix;
+				nes->ppu.draw_tile_pix = nes->ppu.disp_tile_pix;
+				nes->ppu.disp_tile_pix = temp;
+				if (((y + nes->ppu.scroll_y) & 0x1f) == 0x0 || nes->ppu.attrib_per_row) {
+					uint8_t* temp = nes->ppu.draw_attrib_pix;
+					nes->ppu.draw_attrib_pix = nes->ppu.disp_attrib_pix;
+					nes->ppu.disp_attrib_pix = temp;
 				}
+			}
 
-				// needed for sprite0 hit evaluation
-				uint sprite_x, sprite_y, pat_addr, sp_planes, pal_index;
-				uint max_sprites = (nes.frame_delta_time <= 0) ? NESSYS_PPU_NUM_SPRITES : 1;
-				//bool h_flip;
-
-				// initialize to crossed range to indicate no sprites
-				nes.ppu.scan_line_min_sprite_x = 0xff;
-				nes.ppu.scan_line_max_sprite_x = 0;
-				for (i = 0, sp = 0; i < max_sprites && sp < NESSYS_PPU_MAX_SPRITES_PER_SCAN_LINE; i++) {
-					sp_y = nes.ppu.oam[4 * i];
-					// Get y coordinate in sprite space
-					sprite_y = y - sp_y;
-					if (y >= sp_y && sprite_y < sp_height) {
-						//if (i == 0) {
-						//	// determine pattern planes for sprite 0
-						//	sprite_y = y - sp_y;
-						//	// Flip y if vetinal bit is set
-						//	sprite_y = (nes.ppu.oam[2] & 0x80) ? (7 + ((nes.ppu.reg[0] >> 1) & 0x8)) - sprite_y : sprite_y;
-						//	pat_addr = nes.ppu.oam[1];
-						//	// for 8x16 sprites, lsb is the bank select
-						//	// otherwise, bank select is bit 3 ppu reg0
-						//	pat_addr |= 0x100 & (((pat_addr << 8) & (((uint16_t)nes.ppu.reg[0]) << 3)) |
-						//		((((uint16_t)nes.ppu.reg[0]) << 5) & ~(((uint16_t)nes.ppu.reg[0]) << 3)));
-						//	// clear out lsb for 8x16, and fill it in based on whether sprite y is 8 or above
-						//	pat_addr &= 0xfffe | ~(((uint16_t)nes.ppu.reg[0]) >> 5);
-						//	pat_addr |= (((uint16_t)nes.ppu.reg[0]) >> 5) & (sprite_y >= 8);
-						//	// shift up the address and fill in the y offset
-						//	pat_addr <<= 4;
-						//	pat_addr |= sprite_y & 0x7;
-						//	sp_planes = *(nessys_ppu_mem(pat_addr));
-						//	sp_planes |= (*(nessys_ppu_mem(pat_addr | 0x8)) << 8);
-						//	h_flip = ((nes.ppu.oam[2] & 0x40) != 0);
-						//	sp_plane_shift = (h_flip) ? 0 : 7;
-						//}
-
-						// Flip y if vertical bit is set
-						//sprite_y = (nes.ppu.oam[4 * i + 2] & 0x80) ? (7 + ((nes.ppu.reg[0] >> 1) & 0x8)) - sprite_y : sprite_y;
-						sp_planes = nes.ppu.oam_pix[NESSYS_PPU_OAM_PIXEL_ROWS * i | sprite_y];
-						//h_flip = ((nes.ppu.oam[4 * i + 2] & 0x40) != 0);
-						//sp_plane_shift = 0;// (h_flip) ? 14 : 0;
-
-						sp_x = *(nes.ppu.oam + 4 * i + 3);
-						offset = sp_x + 8;
-						offset = (offset >= 256) ? 256 : offset;
-						nes.ppu.scan_line_min_sprite_x = (sp_x < nes.ppu.scan_line_min_sprite_x) ? sp_x : nes.ppu.scan_line_min_sprite_x;
-						nes.ppu.scan_line_max_sprite_x = (offset > nes.ppu.scan_line_max_sprite_x) ? offset-1 : nes.ppu.scan_line_max_sprite_x;
-						for (; sp_x < offset; sp_x++) {
-							if ((nes.ppu.scan_line_sprite[sp_x] & 0x3) == 0) {
-								pal_index = sp_planes & 0x3;// (sp_planes >> sp_plane_shift) & 0x3;
-								if(nes.frame_delta_time <= 0) nes.ppu.scan_line_sprite[sp_x] = (i << 2) | pal_index;
-								// TODO: need to check if sprite 0 actually overlaps background
-								if (i == 0 && nes.sprite0_hit_scan_clk == ~0 && pal_index != 0) {
-									nes.sprite0_hit_scan_clk = sp_x;
-								}
-								sp_planes = (sp_planes >> 2);// (h_flip) ? (sp_planes << 2) : (sp_planes >> 2);
-							}
+			// sprite 0 hit and overflow are the same whether the line is drawn or not; the sprite pixels are only for drawing
+			// a drawn line finds overflow in its own sprite loop, so only the others scan oam for it
+			uint sprite_x, sprite_y, pat_addr, sp_planes, pal_index;
+			bool drawn = (nes->frame_delta_time <= 0);
+			uint max_sprites = (drawn) ? NESSYS_PPU_NUM_SPRITES : 0;
+			nessys_sprite_status(nes, y, !drawn);
+			//bool h_flip;
+
+			// initialize to crossed range to indicate no sprites
+			nes->ppu.scan_line_min_sprite_x = 0xff;
+			nes->ppu.scan_line_max_sprite_x = 0;
+			for (i = 0, sp = 0; i < max_sprites; i++) {
+				sp_y = nes->ppu.oam[4 * i];
+				// Get y coordinate in sprite space
+				sprite_y = y - sp_y;
+				if (y >= sp_y && sprite_y < sp_height) {
+					// a ninth sprite in range; sprites aren't evaluated while rendering is off, nor for the post render line
+					if (sp == NESSYS_PPU_MAX_SPRITES_PER_SCAN_LINE) {
+						if ((nes->ppu.reg[1] & 0x18) && y < NESSYS_PPU_SCANLINES_RENDERED) nes->ppu.reg[2] |= 0x20;
+						break;
+					}
+					//if (i == 0) {
+					//	// determine pattern planes for sprite 0
+					//	sprite_y = y - sp_y;
+					//	// Flip y if vetinal bit is set
+					//	sprite_y = (nes->ppu.oam[2] & 0x80) ? (7 + ((nes->ppu.reg[0] >> 1) & 0x8)) - sprite_y : sprite_y;
+					//	pat_addr = nes->ppu.oam[1];
+					//	// for 8x16 sprites, lsb is the bank select
+					//	// otherwise, bank select is bit 3 ppu reg0
+					//	pat_addr |= 0x100 & (((pat_addr << 8) & (((uint16_t)nes->ppu.reg[0]) << 3)) |
+					//		((((uint16_t)nes->ppu.reg[0]) << 5) & ~(((uint16_t)nes->ppu.reg[0]) << 3)));
+					//	// clear out lsb for 8x16, and fill it in based on whether sprite y is 8 or above
+					//	pat_addr &= 0xfffe | ~(((uint16_t)nes->ppu.reg[0]) >> 5);
+					//	pat_addr |= (((uint16_t)nes->ppu.reg[0]) >> 5) & (sprite_y >= 8);
+					//	// shift up the address and fill in the y offset
+					//	pat_addr <<= 4;
+					//	pat_addr |= sprite_y & 0x7;
+					//	sp_planes = *(nessys_ppu_mem(nes, pat_addr));
+					//	sp_planes |= (*(nessys_ppu_mem(nes, pat_addr | 0x8)) << 8);
+					//	h_flip = ((nes->ppu.oam[2] & 0x40) != 0);
+					//	sp_plane_shift = (h_flip) ? 0 : 7;
+					//}
+
+					// Flip y if vertical bit is set
+					//sprite_y = (nes->ppu.oam[4 * i + 2] & 0x80) ? (7 + ((nes->ppu.reg[0] >> 1) & 0x8)) - sprite_y : sprite_y;
+					sp_planes = nes->ppu.oam_pix[NESSYS_PPU_OAM_PIXEL_ROWS * i | sprite_y];
+					//h_flip = ((nes->ppu.oam[4 * i + 2] & 0x40) != 0);
+					//sp_plane_shift = 0;// (h_flip) ? 14 : 0;
+
+					sp_x = *(nes->ppu.oam + 4 * i + 3);
+					offset = sp_x + 8;
+					offset = (offset >= 256) ? 256 : offset;
+					nes->ppu.scan_line_min_sprite_x = (sp_x < nes->ppu.scan_line_min_sprite_x) ? sp_x : nes->ppu.scan_line_min_sprite_x;
+					nes->ppu.scan_line_max_sprite_x = (offset > nes->ppu.scan_line_max_sprite_x) ? offset-1 : nes->ppu.scan_line_max_sprite_x;
+					for (; sp_x < offset; sp_x++) {
+						if ((nes->ppu.scan_line_sprite[sp_x] & 0x3) == 0) {
+							pal_index = sp_planes & 0x3;// (sp_planes >> sp_plane_shift) & 0x3;
+							nes->ppu.scan_line_sprite[sp_x] = (i << 2) | pal_index;
+							sp_planes = (sp_planes >> 2);// (h_flip) ? (sp_planes << 2) : (sp_planes >> 2);
 						}
-						//nes.ppu.scan_line_oam[sp] = nes.ppu.oam + 4 * i;
-						sp++;
 					}
+					//nes->ppu.scan_line_oam[sp] = nes->ppu.oam + 4 * i;
+					sp++;
 				}
-				//nes.ppu.num_scan_line_oam = sp;
 			}
+			//nes->ppu.num_scan_line_oam = sp;
+		}
 
-			if (nes.scan_line == NESSYS_PPU_SCANLINES_START_RENDER) {
-				// clear ppu status flag as we begin rendering
-				nes.ppu.reg[2] &= ~0xE0;
-				// regenerate the sprites
-				for (sp = 0; sp < NESSYS_PPU_NUM_SPRITES; sp++) {
-					nessys_gen_oam_pix(sp);
-				}
+		if (nes->scan_line == NESSYS_PPU_SCANLINES_START_RENDER) {
+			// clear ppu status flag as we begin rendering
+			nes->ppu.reg[2] &= ~0xE0;
+			// regenerate the sprites; only sprite 0 is looked at in logic only frames
+			for (sp = 0; sp < ((logic_only) ? 1 : NESSYS_PPU_NUM_SPRITES); sp++) {
+				nessys_gen_oam_pix(nes, sp);
+			}
+			nes->ppu.oam_pix_dirty = false;
+		}
+	}
+
+	// finish this frame's sound
+	nessys_gen_sound(nes);
+	nescache_end_frame(nes);
+}
+
+static void emulate_frame_generic(nessys_t* nes) { emulate_frame_loop(nes, CPU_LOOP_GENERIC); }
+#if CPU_LOOP_SPECIALIZE
+static void emulate_frame_nrom(nessys_t* nes) { emulate_frame_loop(nes, CPU_LOOP_NROM); }
+static void emulate_frame_discrete(nessys_t* nes) { emulate_frame_loop(nes, CPU_LOOP_DISCRETE); }
+static void emulate_frame_mmc1(nessys_t* nes) { emulate_frame_loop(nes, CPU_LOOP_MMC1); }
+static void emulate_frame_mmc3(nessys_t* nes) { emulate_frame_loop(nes, CPU_LOOP_MMC3); }
+static void emulate_frame_mmc5(nessys_t* nes) { emulate_frame_loop(nes, CPU_LOOP_MMC5); }
+static void emulate_frame_mmc2(nessys_t* nes) { emulate_frame_loop(nes, CPU_LOOP_MMC2); }
+static void emulate_frame_fme7(nessys_t* nes) { emulate_frame_loop(nes, CPU_LOOP_FME7); }
+#endif
+
+typedef struct {
+	const char* name;
+	void (*emulate_frame)(nessys_t* nes);
+} cpu_loop_t;
+
+static const cpu_loop_t CPU_LOOPS[CPU_LOOP_COUNT] = {
+	{ "generic", emulate_frame_generic },
+#if CPU_LOOP_SPECIALIZE
+	{ "nrom", emulate_frame_nrom },
+	{ "discrete", emulate_frame_discrete },
+	{ "mmc1", emulate_frame_mmc1 },
+	{ "mmc3", emulate_frame_mmc3 },
+	{ "mmc5", emulate_frame_mmc5 },
+	{ "mmc2", emulate_frame_mmc2 },
+	{ "fme7", emulate_frame_fme7 },
+#endif
+};
+
+// Picks the cpu loop instance for a mapper, from the mapper table
+static void cpu_loop_select(nessys_t* nes, uint16_t mapper_id)
+{
+	nes->cpu_loop = CPU_LOOP_GENERIC;
+#if CPU_LOOP_SPECIALIZE
+	const nessys_mapper_t* mapper = nessys_mapper_find(mapper_id);
+	if (mapper) nes->cpu_loop = mapper->cpu_loop;
+#endif
+}
+
+// Runs one frame on the cpu loop instance selected at cart load
+void emulate_frame(nessys_t* nes)
+{
+	CPU_LOOPS[nes->cpu_loop].emulate_frame(nes);
+}
+
+// Parks the ppu thread, returning once it's out of process_pixels and waiting, or lets it go again; does nothing if
+// it was never started
+// The multicore fifo can't carry this, as the flash lockout handler on core 1 takes everything sent through it
+static void ppu_park(nessys_t* nes, bool park)
+{
+#ifdef PPU_MULTI_THREAD
+	if (!nes->c1_started) return;
+	nes->c1_park = park;
+	while (nes->c1_parked != park);
+#endif
+}
+
+// Emulates the run_ahead_frames after the real frame just run, rendering only the last, with frame_delta_time,
+// then puts the state back to the real frame's
+// The real frame already made this frame's sound, and dirtied its save pages, so the frames run ahead do neither
+static void run_ahead(nessys_t* nes, int frame_delta_time)
+{
+	nessys_snd_ring_t* ring = nes->snd_ring;
+	uint32_t dirty[NESSAVE_MAX_PAGES / 32];
+	bool written = nessave.written;
+	uint i;
+
+	nesstate_save(nes, nes->run_ahead_state, nes->run_ahead_size);
+	memcpy(dirty, nessave.dirty, sizeof(dirty));
+	nes->snd_ring = NULL;
+	for (i = 1; i <= run_ahead_frames; i++) {
+		nes->frame_delta_time = (i == run_ahead_frames) ? frame_delta_time : 1;
+		nessys_apu_start_frame(nes, nes->apu.rate);
+		emulate_frame(nes);
+		nes->frame++;
+	}
+	// core 1 reads the ppu state as it renders, so it's parked while the state goes back
+	ppu_park(nes, true);
+	nes->frame_delta_time = 1;
+	nesstate_load(nes, nes->run_ahead_state, nes->run_ahead_size);
+	nes->frame_delta_time = frame_delta_time;
+	ppu_park(nes, false);
+	nes->snd_ring = ring;
+	memcpy(nessave.dirty, dirty, sizeof(dirty));
+	nessave.written = written;
+}
+
+void turbo_set(nessys_t* nes, bool enable)
+{
+	memset(&turbo, 0, sizeof(turbo_t));
+	turbo.enable = enable;
+	turbo.skip = (enable) ? TURBO_START_SKIP : 1;
+	nes->logic_only = enable;
+	// sound would only fall further and further behind
+	nes->snd_ring = (enable) ? NULL : &snd_ring;
+}
+
+// toggles turbo when the combo is pressed on joypad 0; the game doesn't see the combo's buttons from then until
+// both are let go
+void turbo_check_combo(nessys_t* nes)
+{
+	uint8_t combo = nes->apu.joypad[0] & TURBO_COMBO;
+	if (combo == TURBO_COMBO && !turbo.combo_held) turbo_set(nes, !turbo.enable);
+	turbo.combo_held = (combo == TURBO_COMBO) || (turbo.combo_held && combo);
+	if (turbo.combo_held) nes->apu.joypad[0] &= ~TURBO_COMBO;
+}
+
+void turbo_frame_time(bool rendered, uint32_t us)
+{
+	if (rendered) {
+		turbo.render_us_sum += us;
+		turbo.render_count++;
+	} else {
+		turbo.logic_us_sum += us;
+		turbo.logic_count++;
+	}
+}
+
+// Picks skip from the frame times since it was last picked: as many logic only frames after each rendered one as
+// fit in a display period
+void turbo_pick_skip()
+{
+	const uint32_t period_us = 1000000 / TURBO_DISPLAY_FPS;
+
+	if (turbo.render_count) turbo.render_us = turbo.render_us_sum / turbo.render_count;
+	if (turbo.logic_count) turbo.logic_us = turbo.logic_us_sum / turbo.logic_count;
+	turbo.render_us_sum = turbo.logic_us_sum = 0;
+	turbo.render_count = turbo.logic_count = 0;
+	// with skip 1 there's nothing to time the logic only frames by, so the last time they were timed stands
+	if (turbo.render_us == 0 || turbo.logic_us == 0) return;
+	turbo.skip = (turbo.render_us >= period_us) ? 1 : 1 + (period_us - turbo.render_us) / turbo.logic_us;
+	if (turbo.skip > TURBO_MAX_SKIP) turbo.skip = TURBO_MAX_SKIP;
+}
+
+//#ifdef WIN32
+void main_loop()
+//#else
+//void __no_inline_not_in_flash_func(main_loop)()
+//#endif
+{
+	nessys_t* nes = &main_nes;
+	uint16_t clear_color = 0x07e0;
+	char text_str[64];
+	char stats_str[64];
+	memset(&tbox, 0, sizeof(TEXTBOX_T));
+	textbox_set_font(&tbox, font[FONT_ID_AIXOID9_F16]);
+	textbox_set_position(&tbox, 0, 0);
+
+	uint in_text_line = 0;
+	uint32_t cur_time, last_time = 0;
+	uint32_t snd_rate;
+	float fps;
+
+#ifdef WIN32
+	MSG msg;
+
+	win32_fill(clear_color);
+#else
+	st7789_fill(clear_color);
+	st7789_wait_for_write();
+	st7789_set_window(SCREEN_WIN_X, SCREEN_WIN_Y, SCREEN_WIN_X + SCREEN_WIN_WIDTH - 1, SCREEN_WIN_Y + SCREEN_WIN_HEIGHT - 1);
+#endif
+	nes_instance_init(nes, framebuffer, &tbox, aux_mem);
+	nes->session = true;
+	nes->save_enable = session_save;
+	nes->sram_budget_report = true;
+#ifdef WIN32
+	nesaudio_init(&snd_ring, wav_path);
+#else
+	// only carts whose prg or chr ram overflows the 2KB arena borrow the back buffer; the rest stay double buffered
+	nes->lend_back_buffer = true;
+	nesaudio_init(&snd_ring, NULL);
+#endif
+	nes->snd_ring = &snd_ring;
+	turbo_set(nes, false);
+	bool rom_ok = ines_load_cart(nes, session_rom);
+	nes->scan_clk = 0;
+	nes->rendered_scan_clk = 0;
+	nes->next_line_scan_clk = 0;
+	uint skipped_frames = 0;
+	uint total_skipped_frames = 0;
+	nes->frame_delta_time = 0;
+	last_time = time_us_32();
+#ifdef WIN32
+	if (movie_play_path) nesmovie_play_start(nes, movie_play_path);
+	if (movie_record_path && !nesmovie_record_start(nes)) movie_record_path = NULL;
+#endif
+
+#ifdef PPU_MULTI_THREAD
+	nes->c1_started = true;
+#ifdef WIN32
+	CreateThread(NULL, 0, win32_ppu_entry, nes, 0, &h_thread);
+#else
+	multicore_launch_core1(core1_entry);
+	multicore_fifo_push_blocking((uintptr_t)nes);
+#endif
+#endif
+
+	while (1) {
+		// every frame is rendered, but in turbo
+		nes->frame_delta_time = (turbo.enable && skipped_frames + 1 < turbo.skip) ? 1 : 0;
+
+		// The audio output is the master clock: sleep until the sound ring drains to its target level,
+		// then trim the number of samples generated this frame to keep it there
+		// May still cause tearing artifiact, since this is not synchronized
+		// to display controller
+		// Turbo doesn't wait at all
+		snd_rate = (turbo.enable) ? NESSYS_SND_RATE_ONE : nesaudio_pace();
+#ifdef WIN32
+		// a movie replays at the rates it was recorded with, since the apu timing the game sees follows them
+		snd_rate = nesmovie_play_rate(snd_rate);
+#endif
+		nessys_apu_start_frame(nes, snd_rate);
+		cur_time = time_us_32();
+
+		//if (nes->frame_delta_time <= 0 && skipped_frames != 0) {
+		//	for (y = 0; y < 256; y++) {
+		//		nes->ppu.scan_line_sprite[y] = 0;
+		//	}
+		//}
+
+		//if(skip_render == 0) skip_render += (cur_time - last_time) / 16666;
+
+		nes->rendered_time += cur_time - last_time;
+		last_time = cur_time;
+
+		// in turbo, as often on the display as otherwise
+		if (nes->rendered_frames >= TBOX_RENDER_FRAME_PERIOD * turbo.skip) {
+			// Calculate and report out the frames per second
+			fps = nes->rendered_time;
+			fps = (nes->rendered_frames * 1000000) / fps;
+			if (turbo.enable) {
+				// the speed against the nes, and the rendered and logic only frame times skip was picked from
+				turbo_pick_skip();
+				sprintf(text_str, "%0.2f %d %0.1fx", fps, total_skipped_frames,
+					fps * NESSYS_NTSC_FRAME_RATE_DEN / NESSYS_NTSC_FRAME_RATE_NUM);
+				sprintf(stats_str, "1/%d %dus %dus", turbo.skip, turbo.render_us, turbo.logic_us);
+			} else {
+				sprintf(text_str, "%0.2f %d", fps, total_skipped_frames);
+				// sound ring fill range, frame time jitter, and the current rate adjustment
+				sprintf(stats_str, "%d-%d %dus %+0.2f%%", nesaudio_stats.fill_min, nesaudio_stats.fill_max,
+					nesaudio_stats.frame_us_max - nesaudio_stats.frame_us_min,
+					((int32_t)nesaudio_stats.rate - NESSYS_SND_RATE_ONE) * 100.0f / NESSYS_SND_RATE_ONE);
 			}
+			textbox_set_text(&tbox, text_str, 0);
+			textbox_set_text(&tbox, stats_str, 1);
+			nesaudio_reset_stats();
+			nes->rendered_frames = 0;
+			nes->rendered_time = 0;
+			total_skipped_frames = 0;
+		}
+
+		textbox_reset(&tbox);
+
+#ifdef WIN32
+		// the keyboard is joypad 0, unless a movie is playing
+		if (!nesmovie_play_input(nes)) {
+			nes->apu.joypad[0] = win32_joypad();
+			turbo_check_combo(nes);
 		}
+#else
+		nes->apu.joypad[0] = pico_joypad();
+		turbo_check_combo(nes);
+#endif
+
+		// with run ahead, the real frame isn't displayed
+		int frame_delta_time = nes->frame_delta_time;
+		if (nes->run_ahead_state) nes->frame_delta_time = 1;
+		emulate_frame(nes);
+		// flushes saves during vblank
+		nessave_end_frame();
+		nesrewind_push(nes);
+#ifdef WIN32
+		nesmovie_record_frame(nes);
+		nesmovie_play_check(nes);
+#endif
+		if (nes->run_ahead_state) run_ahead(nes, frame_delta_time);
 
-		if (nes.frame_delta_time <= 0) {
+		if (nes->frame_delta_time <= 0) {
 			skipped_frames = 0;
-			flip_framebuffer();
+			flip_framebuffer(nes);
 		} else {
 			skipped_frames++;
 			total_skipped_frames++;
@@ -1791,24 +2421,1113 @@ void main_loop()
 			DispatchMessage(&msg);
 			got_msg = (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE) != 0);
 		}
-		win32_write(disp_frame);
-		InvalidateRect(hwnd, NULL, false);
+		// only frames rendered are sent
+		if (nes->frame_delta_time <= 0) {
+			win32_write(nes->disp_frame);
+			InvalidateRect(hwnd, NULL, false);
+		}
 		//win32_display(hwnd);
 #else
 		// Wait for prior DMA before issuing the next frame's
 		//if ((frame & 0x3f) == 0) {
-		st7789_wait_for_write();
-		st7789_write(disp_frame, FB_SIZE);
+		if (nes->frame_delta_time <= 0) {
+			st7789_wait_for_write();
+			st7789_write(nes->disp_frame, FB_SIZE);
+		}
 		//}
 #endif
-		nes.frame++;
-		nes.rendered_frames++;
+		if (turbo.enable) turbo_frame_time(nes->frame_delta_time <= 0, time_us_32() - cur_time);
+		nes->frame++;
+		nes->rendered_frames++;
+	}
+}
+
+#ifdef WIN32
+// reads a whole rom file into memory; the caller frees it
+uint8_t* load_rom_file(const char* rom_file)
+{
+	FILE* f;
+	long size;
+	uint8_t* rom;
+
+	f = fopen(rom_file, "rb");
+	if (f == NULL) {
+		printf("Can't open %s\n", rom_file);
+		return NULL;
 	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	rom = (size > 0) ? malloc(size) : NULL;
+	// an empty file, or one that can't be allocated, fails the same as a short read
+	if (rom == NULL || fread(rom, 1, size, f) != (size_t)size) {
+		printf("Can't read %s\n", rom_file);
+		free(rom);
+		rom = NULL;
+	}
+	fclose(f);
+	return rom;
 }
 
+// Renders a rom's sound to a wav file as fast as possible, with no pixel rendering, display or pacing
+// Usage: pi_cones -audio_bench <rom.nes> [out.wav] [seconds]
+void audio_bench(const char* rom_file, const char* wav_file, uint seconds)
+{
+	nessys_t* nes = &main_nes;
+	uint8_t* rom;
+	// the ntsc frame rate is 60.0988 hz, not 60
+	uint frame, frames = (uint)((uint64_t)seconds * NESSYS_NTSC_FRAME_RATE_NUM / NESSYS_NTSC_FRAME_RATE_DEN);
+	uint32_t samples = 0;
+	LARGE_INTEGER freq, start, end;
+	float wall_time, audio_time;
+#if NESSYS_SND_PROFILE
+	const char* channel_name[NESSYS_SND_PROFILE_CHANNELS] = { "pulse0", "pulse1", "triangle", "noise", "dmc" };
+	uint64_t start_ticks, ticks;
+	uint i;
+#endif
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+
+	nes_instance_init(nes, framebuffer, &tbox, aux_mem);
+	nes->sram_budget_report = true;
+	nesaudio_init_offline(&snd_ring, wav_file);
+	nes->snd_ring = &snd_ring;
+	if (!ines_load_cart(nes, rom)) {
+		printf("Can't load %s\n", rom_file);
+		nesaudio_cleanup();
+		free(rom);
+		return;
+	}
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+#if NESSYS_SND_PROFILE
+	start_ticks = __rdtsc();
+#endif
+	for (frame = 0; frame < frames; frame++) {
+		// skip pixel rendering
+		nes->frame_delta_time = 1;
+		nessys_apu_start_frame(nes, NESSYS_SND_RATE_ONE);
+		emulate_frame(nes);
+		samples += nesaudio_drain();
+		nes->frame++;
+	}
+	QueryPerformanceCounter(&end);
+
+	wall_time = (float)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+	audio_time = (float)samples / NESSYS_SND_SAMPLES_PER_SECOND;
+	printf("%d frames, %0.2f s audio in %0.3f s: %0.2f audio s / wall s\n", frames, audio_time, wall_time, audio_time / wall_time);
+#if NESSYS_SND_PROFILE
+	// convert cycle counts to time with the rate measured over the run
+	ticks = __rdtsc() - start_ticks;
+	for (i = 0; i < NESSYS_SND_PROFILE_CHANNELS; i++) {
+		printf("  %-8s %0.3f s (%0.1f ns / sample)\n", channel_name[i],
+			wall_time * nes->apu.profile_ticks[i] / ticks,
+			1e9f * wall_time * nes->apu.profile_ticks[i] / ticks / samples);
+	}
+#endif
+
+	nesaudio_cleanup();
+	ines_unload_cart(nes);
+	free(rom);
+}
+
+#define MAPPER_BENCH_READS 10000000
+#define MAPPER_BENCH_WRITES 1000000
+
+// times prg reads across 0x8000-0xFFFF
+static float mapper_bench_reads(nessys_t* nes, uint32_t* sum)
+{
+	LARGE_INTEGER freq, start, end;
+	uint16_t bank, offset;
+	uint32_t i;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	for (i = 0; i < MAPPER_BENCH_READS; i++) {
+		*sum += *nessys_mem(nes, 0x8000 | ((i * 0x1F3) & 0x7FFF), &bank, &offset);
+	}
+	QueryPerformanceCounter(&end);
+	return 1e9f * (end.QuadPart - start.QuadPart) / freq.QuadPart / MAPPER_BENCH_READS;
+}
+
+// Measures the cost of mapper register writes, and checks that the read path costs the same before and after bank switching
+// Usage: pi_cones -mapper_bench <rom.nes>
+void mapper_bench(const char* rom_file)
+{
+	nessys_t* nes = &main_nes;
+	uint8_t* rom;
+	LARGE_INTEGER freq, start, end;
+	uint32_t i, seed, switches, sum;
+	float read_before, read_after, write_time;
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+
+	nes_instance_init(nes, framebuffer, &tbox, aux_mem);
+	nes->sram_budget_report = true;
+	if (!ines_load_cart(nes, rom)) {
+		printf("Can't load %s\n", rom_file);
+		free(rom);
+		return;
+	}
+	if (nes->mapper_write == NULL) {
+		printf("Mapper %d has no bank switching\n", nes->mapper_id);
+		ines_unload_cart(nes);
+		free(rom);
+		return;
+	}
+
+	sum = 0;
+	read_before = mapper_bench_reads(nes, &sum);
+
+	// random register writes; writes that complete a register update count as a bank switch
+	seed = 1;
+	switches = 0;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	for (i = 0; i < MAPPER_BENCH_WRITES; i++) {
+		seed = seed * 1103515245 + 12345;
+		// as far apart as back to back sta abs, so mmc1 doesn't drop them as consecutive
+		nes->scan_clk += NESSYS_PPU_PER_CPU_CLK * 4;
+		switches += nes->mapper_write(nes, 0x8000 | ((seed >> 8) & 0x7FFF), (seed >> 24) & 0x7F);
+	}
+	QueryPerformanceCounter(&end);
+	write_time = 1e9f * (end.QuadPart - start.QuadPart) / freq.QuadPart;
+
+	read_after = mapper_bench_reads(nes, &sum);
+
+	printf("mapper %d: %d writes, %d bank switches\n", nes->mapper_id, MAPPER_BENCH_WRITES, switches);
+	printf("  write  %0.1f ns / write, %0.1f ns / switch\n", write_time / MAPPER_BENCH_WRITES, (switches) ? write_time / switches : 0.0f);
+	printf("  read   %0.2f ns before switching, %0.2f ns after (checksum %08x)\n", read_before, read_after, sum);
+
+	ines_unload_cart(nes);
+	free(rom);
+}
+
+#define CPU_BENCH_FRAMES 1200
+
+// Runs a rom from power on with no pixel rendering, and returns frames per second
+// generic forces the generic cpu loop, instead of the instance picked for the mapper; loop returns the one used
+static float cpu_bench_run(const uint8_t* rom, bool generic, uint* loop)
+{
+	nessys_t* nes = &main_nes;
+	LARGE_INTEGER freq, start, end;
+	uint frame;
+
+	nes_instance_init(nes, framebuffer, &tbox, aux_mem);
+	if (!ines_load_cart(nes, rom)) return 0.0f;
+	if (generic) nes->cpu_loop = CPU_LOOP_GENERIC;
+	*loop = nes->cpu_loop;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	for (frame = 0; frame < CPU_BENCH_FRAMES; frame++) {
+		nes->frame_delta_time = 1;
+		nessys_apu_start_frame(nes, NESSYS_SND_RATE_ONE);
+		emulate_frame(nes);
+		nes->frame++;
+	}
+	QueryPerformanceCounter(&end);
+
+	ines_unload_cart(nes);
+	return CPU_BENCH_FRAMES * (float)freq.QuadPart / (end.QuadPart - start.QuadPart);
+}
+
+// Compares each rom's mapper specific cpu loop instance against the generic loop
+// Usage: pi_cones -cpu_bench <rom.nes> [<rom.nes> ...]
+void cpu_bench(int num_roms, char** rom_files)
+{
+	nessys_t* nes = &main_nes;
+	uint8_t* rom;
+	float generic_fps, fps;
+	uint loop;
+	int i;
+
+	printf("%-32s %6s %-10s %12s %12s %8s\n", "rom", "mapper", "instance", "generic fps", "instance fps", "speedup");
+	for (i = 0; i < num_roms; i++) {
+		rom = load_rom_file(rom_files[i]);
+		if (rom == NULL) continue;
+		generic_fps = cpu_bench_run(rom, true, &loop);
+		fps = cpu_bench_run(rom, false, &loop);
+		if (fps == 0.0f) {
+			printf("%-32s can't load\n", rom_files[i]);
+		} else {
+			printf("%-32s %6d %-10s %12.1f %12.1f %7.2fx\n", rom_files[i], nes->mapper_id, CPU_LOOPS[loop].name,
+				generic_fps, fps, fps / generic_fps);
+		}
+		free(rom);
+	}
+}
+
+#define STATE_BENCH_REPEAT 1000
+#define STATE_BENCH_REPLAY_FRAMES 120
+
+static void state_bench_run(nessys_t* nes, uint frames)
+{
+	uint frame;
+	for (frame = 0; frame < frames; frame++) {
+		nes->frame_delta_time = 1;
+		nessys_apu_start_frame(nes, NESSYS_SND_RATE_ONE);
+		emulate_frame(nes);
+		nes->frame++;
+	}
+}
+
+// Times save state writes and loads, and checks that frames run from a loaded state match the original run
+// Usage: pi_cones -state_bench <rom.nes> [frames]
+void state_bench(const char* rom_file, uint frames)
+{
+	nessys_t* nes = &main_nes;
+	uint8_t* rom;
+	uint8_t* state;
+	uint32_t size, hash;
+	LARGE_INTEGER freq, start, end;
+	float save_us, load_us;
+	uint i;
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+
+	nes_instance_init(nes, framebuffer, &tbox, aux_mem);
+	if (!ines_load_cart(nes, rom)) {
+		printf("Can't load %s\n", rom_file);
+		free(rom);
+		return;
+	}
+	state_bench_run(nes, frames);
+	size = nesstate_size(nes);
+	state = malloc(size);
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	for (i = 0; i < STATE_BENCH_REPEAT; i++) nesstate_save(nes, state, size);
+	QueryPerformanceCounter(&end);
+	save_us = (end.QuadPart - start.QuadPart) * 1000000.0f / freq.QuadPart / STATE_BENCH_REPEAT;
+	state_bench_run(nes, STATE_BENCH_REPLAY_FRAMES);
+	hash = nesmovie_frame_hash(nes);
+
+	QueryPerformanceCounter(&start);
+	for (i = 0; i < STATE_BENCH_REPEAT; i++) nesstate_load(nes, state, size);
+	QueryPerformanceCounter(&end);
+	load_us = (end.QuadPart - start.QuadPart) * 1000000.0f / freq.QuadPart / STATE_BENCH_REPEAT;
+	state_bench_run(nes, STATE_BENCH_REPLAY_FRAMES);
+
+	printf("%s: %d byte state after %d frames; save %0.1f us, load %0.1f us; replay of %d frames %s\n", rom_file, size,
+		frames, save_us, load_us, STATE_BENCH_REPLAY_FRAMES, (nesmovie_frame_hash(nes) == hash) ? "matches" : "differs");
+	free(state);
+	ines_unload_cart(nes);
+	free(rom);
+}
+
+// Replays a movie at full speed, and checks every frame against the hash it was recorded with
+// Usage: pi_cones -movie_bench <rom.nes> <movie>
+void movie_bench(const char* rom_file, const char* movie_file)
+{
+	nessys_t* nes = &main_nes;
+	uint8_t* rom;
+	LARGE_INTEGER freq, start, end;
+	float us;
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+
+	nes_instance_init(nes, framebuffer, &tbox, aux_mem);
+	if (!ines_load_cart(nes, rom)) {
+		printf("Can't load %s\n", rom_file);
+		free(rom);
+		return;
+	}
+	if (nesmovie_play_start(nes, movie_file)) {
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&start);
+		while (nesmovie_play_input(nes)) {
+			nes->frame_delta_time = 1;
+			nessys_apu_start_frame(nes, nesmovie_play_rate(NESSYS_SND_RATE_ONE));
+			emulate_frame(nes);
+			nesmovie_play_check(nes);
+			nes->frame++;
+		}
+		QueryPerformanceCounter(&end);
+		us = (end.QuadPart - start.QuadPart) * 1000000.0f / freq.QuadPart;
+		printf("%s: %d frames in %0.1f ms, %0.1f fps\n", rom_file, nesmovie.frames, us / 1000.0f, nesmovie.frames * 1000000.0f / us);
+	}
+	nesmovie_close();
+	ines_unload_cart(nes);
+	free(rom);
+}
+
+#define RUN_AHEAD_BENCH_MAX 3
+
+// runs frames real frames, with run ahead as set up at cart load; returns the time taken in us
+static float run_ahead_bench_run(nessys_t* nes, uint frames)
+{
+	LARGE_INTEGER freq, start, end;
+	uint frame;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	for (frame = 0; frame < frames; frame++) {
+		nes->frame_delta_time = 1;
+		nessys_apu_start_frame(nes, NESSYS_SND_RATE_ONE);
+		emulate_frame(nes);
+		if (nes->run_ahead_state) run_ahead(nes, 1);
+		nes->frame++;
+	}
+	QueryPerformanceCounter(&end);
+	return (end.QuadPart - start.QuadPart) * 1000000.0f / freq.QuadPart;
+}
+
+// Times frames with 0 to RUN_AHEAD_BENCH_MAX frames of run ahead, reporting the cost of each frame run ahead, and
+// checks run ahead leaves the real frames as they were
+// Usage: pi_cones -run_ahead_bench <rom.nes> [frames]
+void run_ahead_bench(const char* rom_file, uint frames)
+{
+	nessys_t* nes = &main_nes;
+	uint8_t* rom;
+	uint32_t hash = 0;
+	float base_us = 0.0f, us;
+	uint n;
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+
+	for (n = 0; n <= RUN_AHEAD_BENCH_MAX; n++) {
+		run_ahead_frames = n;
+		nes_instance_init(nes, framebuffer, &tbox, aux_mem);
+		if (!ines_load_cart(nes, rom)) {
+			printf("Can't load %s\n", rom_file);
+			break;
+		}
+		us = run_ahead_bench_run(nes, frames) / frames;
+		if (n == 0) {
+			base_us = us;
+			hash = nesmovie_frame_hash(nes);
+			printf("%s: %d frames, %0.1f us per frame; %d byte run ahead state\n", rom_file, frames, us, nesstate_size(nes));
+		} else {
+			printf("  run ahead %d: %0.1f us per frame, %0.1f us per frame run ahead; real frames %s\n", n, us,
+				(us - base_us) / n, (nesmovie_frame_hash(nes) == hash) ? "match" : "differ");
+		}
+		ines_unload_cart(nes);
+	}
+	run_ahead_frames = RUN_AHEAD_FRAMES;
+	free(rom);
+}
+
+// Runs a rom from power on rendering every frame, then skipping the rendering, then logic only, and reports the frames
+// per second of each, and whether what the cpu sees ends up where it did with rendering
+// Usage: pi_cones -logic_bench <rom.nes> [frames]
+void logic_bench(const char* rom_file, uint frames)
+{
+	static const char* mode_name[3] = { "rendered", "skipped", "logic only" };
+	nessys_t* nes;
+	LARGE_INTEGER freq, start, end;
+	uint8_t* rom;
+	uint32_t hash = 0;
+	float fps, rendered_fps = 0.0f;
+	uint mode, frame;
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+
+	QueryPerformanceFrequency(&freq);
+	for (mode = 0; mode < 3; mode++) {
+		// no ppu thread, so the rendered frames are drawn on this one, as they would be without a second core
+		nes = nes_instance_create();
+		if (nes == NULL || !ines_load_cart(nes, rom)) {
+			printf("Can't load %s\n", rom_file);
+			if (nes) nes_instance_destroy(nes);
+			break;
+		}
+		nes->render_inline = true;
+		nes->logic_only = (mode == 2);
+		QueryPerformanceCounter(&start);
+		for (frame = 0; frame < frames; frame++) {
+			nes->apu.joypad[0] = (frame / 7) & 0xff;
+			nes->frame_delta_time = (mode == 0) ? 0 : 1;
+			nessys_apu_start_frame(nes, NESSYS_SND_RATE_ONE);
+			emulate_frame(nes);
+			nes->frame++;
+		}
+		QueryPerformanceCounter(&end);
+		fps = frames * (float)freq.QuadPart / (end.QuadPart - start.QuadPart);
+		if (mode == 0) {
+			rendered_fps = fps;
+			hash = nesmovie_frame_hash(nes);
+			printf("%s: %d frames\n", rom_file, frames);
+		}
+		printf("  %-10s %8.1f fps (%0.2fx); state %s\n", mode_name[mode], fps, fps / rendered_fps,
+			(nesmovie_frame_hash(nes) == hash) ? "matches rendered" : "differs from rendered");
+		ines_unload_cart(nes);
+		nes_instance_destroy(nes);
+	}
+	free(rom);
+}
+
+// Runs a rom in turbo, the way the main loop does but with nothing to send the frames to, and reports the skip it
+// settles on, how often frames would be displayed, and the speed against the nes
+// Usage: pi_cones -turbo_bench <rom.nes> [seconds]
+void turbo_bench(const char* rom_file, uint seconds)
+{
+	nessys_t* nes;
+	uint8_t* rom;
+	uint32_t start, frame_start, end, rendered = 0, skipped = 0;
+	uint frame = 0;
+	float wall_time;
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+	nes = nes_instance_create();
+	if (nes == NULL || !ines_load_cart(nes, rom)) {
+		printf("Can't load %s\n", rom_file);
+		if (nes) nes_instance_destroy(nes);
+		free(rom);
+		return;
+	}
+	nes->render_inline = true;
+	turbo_set(nes, true);
+	start = end = time_us_32();
+	while (end - start < seconds * 1000000) {
+		nes->frame_delta_time = (skipped + 1 < turbo.skip) ? 1 : 0;
+		frame_start = time_us_32();
+		nes->apu.joypad[0] = (frame / 7) & 0xff;
+		nessys_apu_start_frame(nes, NESSYS_SND_RATE_ONE);
+		emulate_frame(nes);
+		nes->frame++;
+		frame++;
+		if (nes->frame_delta_time <= 0) {
+			skipped = 0;
+			rendered++;
+		} else {
+			skipped++;
+		}
+		end = time_us_32();
+		turbo_frame_time(nes->frame_delta_time <= 0, end - frame_start);
+		if (frame % (TBOX_RENDER_FRAME_PERIOD * turbo.skip) == 0) turbo_pick_skip();
+	}
+	wall_time = (end - start) / 1000000.0f;
+	printf("%s: %d frames in %0.2f s, 1 in %d rendered (%d us rendered, %d us logic only)\n", rom_file, frame,
+		wall_time, turbo.skip, turbo.render_us, turbo.logic_us);
+	printf("  %0.1f frames displayed a second (target %d), %0.1fx the nes\n", rendered / wall_time, TURBO_DISPLAY_FPS,
+		frame / wall_time * NESSYS_NTSC_FRAME_RATE_DEN / NESSYS_NTSC_FRAME_RATE_NUM);
+	ines_unload_cart(nes);
+	nes_instance_destroy(nes);
+	free(rom);
+}
+
+#define INSTANCE_BENCH_MAX 16
+
+typedef struct {
+	nessys_t* nes;
+	uint frames;
+} instance_bench_job_t;
+
+static DWORD WINAPI instance_bench_thread(LPVOID param)
+{
+	instance_bench_job_t* job = (instance_bench_job_t*)param;
+	state_bench_run(job->nes, job->frames);
+	return 0;
+}
+
+// Runs a rom on one instance, then on several at once, a thread each, and checks every instance ends up where the
+// single one did
+// Usage: pi_cones -instance_bench <rom.nes> [instances] [frames]
+void instance_bench(const char* rom_file, uint instances, uint frames)
+{
+	nessys_t* nes[INSTANCE_BENCH_MAX];
+	instance_bench_job_t job[INSTANCE_BENCH_MAX];
+	HANDLE thread[INSTANCE_BENCH_MAX];
+	LARGE_INTEGER freq, start, end;
+	uint8_t* rom;
+	uint32_t hash;
+	float single_fps, fps;
+	uint i, n, matches;
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+
+	if (instances > INSTANCE_BENCH_MAX) instances = INSTANCE_BENCH_MAX;
+	QueryPerformanceFrequency(&freq);
+	nes[0] = nes_instance_create();
+	if (nes[0] == NULL || !ines_load_cart(nes[0], rom)) {
+		printf("Can't load %s\n", rom_file);
+		if (nes[0]) nes_instance_destroy(nes[0]);
+		free(rom);
+		return;
+	}
+	QueryPerformanceCounter(&start);
+	state_bench_run(nes[0], frames);
+	QueryPerformanceCounter(&end);
+	single_fps = frames * (float)freq.QuadPart / (end.QuadPart - start.QuadPart);
+	hash = nesmovie_frame_hash(nes[0]);
+	ines_unload_cart(nes[0]);
+	nes_instance_destroy(nes[0]);
+
+	// set up one at a time, then run together
+	for (n = 0; n < instances; n++) {
+		nes[n] = nes_instance_create();
+		if (nes[n] == NULL) break;
+		if (!ines_load_cart(nes[n], rom)) {
+			nes_instance_destroy(nes[n]);
+			break;
+		}
+	}
+	QueryPerformanceCounter(&start);
+	for (i = 0; i < n; i++) {
+		job[i].nes = nes[i];
+		job[i].frames = frames;
+		thread[i] = CreateThread(NULL, 0, instance_bench_thread, &job[i], 0, NULL);
+	}
+	WaitForMultipleObjects(n, thread, TRUE, INFINITE);
+	QueryPerformanceCounter(&end);
+	fps = n * frames * (float)freq.QuadPart / (end.QuadPart - start.QuadPart);
+
+	matches = 0;
+	for (i = 0; i < n; i++) {
+		CloseHandle(thread[i]);
+		if (nesmovie_frame_hash(nes[i]) == hash) matches++;
+		ines_unload_cart(nes[i]);
+		nes_instance_destroy(nes[i]);
+	}
+	printf("%s: %d frames; 1 instance %0.1f fps; %d instances, a thread each, %0.1f fps in all (%0.2fx); %d of %d match\n",
+		rom_file, frames, single_fps, n, fps, fps / single_fps, matches, n);
+	free(rom);
+}
+
+// hash of what an environment step hands back: the frame, if any, and ram
+static uint32_t env_bench_hash(const pi_cones_env_obs_t* obs, uint obs_type)
+{
+	uint32_t size = (obs_type == PI_CONES_ENV_OBS_RGB565) ? 2 * PI_CONES_ENV_PIXELS :
+		(obs_type == PI_CONES_ENV_OBS_INDEX) ? PI_CONES_ENV_PIXELS : 0;
+	const uint8_t* p = obs->frame;
+	uint32_t h = 0x811C9DC5;
+	uint32_t i;
+
+	for (i = 0; i < size; i++) h = (h ^ p[i]) * 0x01000193;
+	for (i = 0; i < NESSYS_RAM_SIZE; i++) h = (h ^ obs->ram[i]) * 0x01000193;
+	return h;
+}
+
+// Steps an environment with the same run of random actions twice, resetting in between, for each kind of
+// observation; reports steps per second on one core, and checks both runs hand back the same frame and ram
+// Usage: pi_cones -env_bench <rom.nes> [frames per step] [steps]
+void env_bench(const char* rom_file, uint frames, uint steps)
+{
+	static const char* obs_name[3] = { "ram", "rgb565", "index" };
+	pi_cones_env_t* env;
+	const pi_cones_env_obs_t* obs = NULL;
+	LARGE_INTEGER freq, start, end;
+	uint8_t* rom;
+	uint32_t seed, hash[2];
+	float sps = 0.0f;
+	uint type, pass, i;
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+
+	QueryPerformanceFrequency(&freq);
+	for (type = PI_CONES_ENV_OBS_RAM; type <= PI_CONES_ENV_OBS_INDEX; type++) {
+		env = pi_cones_env_create(rom, type, NULL);
+		if (env == NULL) {
+			printf("Can't load %s\n", rom_file);
+			break;
+		}
+		for (pass = 0; pass < 2; pass++) {
+			seed = 1;
+			QueryPerformanceCounter(&start);
+			for (i = 0; i < steps; i++) {
+				seed = seed * 1103515245 + 12345;
+				obs = pi_cones_env_step(env, (uint8_t)(seed >> 16), frames);
+			}
+			QueryPerformanceCounter(&end);
+			hash[pass] = env_bench_hash(obs, type);
+			if (pass == 0) {
+				sps = steps * (float)freq.QuadPart / (end.QuadPart - start.QuadPart);
+				pi_cones_env_reset(env);
+			}
+		}
+		printf("%s: %-6s %0.1f steps/s, %0.1f frames/s, %d frames a step; after reset %s\n", rom_file, obs_name[type],
+			sps, sps * frames, frames, (hash[0] == hash[1]) ? "matches" : "differs");
+		pi_cones_env_destroy(env);
+	}
+	free(rom);
+}
+
+// Steps lockstep environments, 1, 8, 64 and 256 of them, with the same random actions on every one, and reports the
+// frames per second of all of them together; checks every frame of the batch matches the one from a single env
+// Usage: pi_cones -vec_env_bench <rom.nes> [frames] [workers]
+void vec_env_bench(const char* rom_file, uint frames, uint workers)
+{
+	static const uint num_envs[4] = { 1, 8, 64, 256 };
+	pi_cones_vec_env_t* vec;
+	const uint8_t* batch = NULL;
+	uint8_t* actions;
+	LARGE_INTEGER freq, start, end;
+	uint8_t* rom;
+	uint32_t seed, hash = 0, ref_hash = 0;
+	float fps, single_fps = 0.0f;
+	uint n, i, j, frame, matches;
+
+	rom = load_rom_file(rom_file);
+	actions = malloc(num_envs[3]);
+	if (rom == NULL || actions == NULL) {
+		free(rom);
+		free(actions);
+		return;
+	}
+
+	QueryPerformanceFrequency(&freq);
+	for (n = 0; n < 4; n++) {
+		vec = pi_cones_vec_env_create(rom, num_envs[n], workers);
+		if (vec == NULL) {
+			printf("Can't make %d environments for %s\n", num_envs[n], rom_file);
+			break;
+		}
+		seed = 1;
+		QueryPerformanceCounter(&start);
+		for (frame = 0; frame < frames; frame++) {
+			// a new action every 8 frames
+			if ((frame & 0x7) == 0) seed = seed * 1103515245 + 12345;
+			memset(actions, (uint8_t)(seed >> 16), vec->num_envs);
+			batch = pi_cones_vec_env_step(vec, actions);
+		}
+		QueryPerformanceCounter(&end);
+		fps = vec->num_envs * frames * (float)freq.QuadPart / (end.QuadPart - start.QuadPart);
+
+		matches = 0;
+		for (i = 0; i < vec->num_envs; i++) {
+			hash = 0x811C9DC5;
+			for (j = 0; j < PI_CONES_ENV_PIXELS; j++) hash = (hash ^ batch[i * PI_CONES_ENV_PIXELS + j]) * 0x01000193;
+			if (n == 0) ref_hash = hash;
+			if (hash == ref_hash) matches++;
+		}
+		if (n == 0) single_fps = fps;
+		printf("%s: %3d envs, %d workers: %0.1f frames/s in all (%0.2fx), %0.1f us a step; %d of %d frames match\n",
+			rom_file, vec->num_envs, vec->num_workers, fps, fps / single_fps, 1000000.0f * vec->num_envs / fps,
+			matches, vec->num_envs);
+		pi_cones_vec_env_destroy(vec);
+	}
+	free(actions);
+	free(rom);
+}
+
+#if NESREWIND_ENABLE
+#define REWIND_BENCH_BACK 300
+
+// Runs a rom recording rewind history, then steps back, and checks the state matches the one recorded going forward
+// Usage: pi_cones -rewind_bench <rom.nes> [frames]
+void rewind_bench(const char* rom_file, uint frames)
+{
+	nessys_t* nes = &main_nes;
+	uint8_t* rom;
+	uint32_t hash = 0;
+	uint frame, back;
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+
+	nes_instance_init(nes, framebuffer, &tbox, aux_mem);
+	nes->session = true;
+	if (!ines_load_cart(nes, rom)) {
+		printf("Can't load %s\n", rom_file);
+		free(rom);
+		return;
+	}
+	back = (frames > REWIND_BENCH_BACK) ? REWIND_BENCH_BACK : frames;
+	for (frame = 1; frame <= frames; frame++) {
+		state_bench_run(nes, 1);
+		nesrewind_push(nes);
+		if (frame == frames - back) hash = nesmovie_frame_hash(nes);
+	}
+	printf("%s: %d frames recorded\n", rom_file, frames);
+	nesrewind_print_stats();
+	for (frame = 0; frame < back; frame++) {
+		if (!nesrewind_pop(nes)) break;
+	}
+	printf("  rewound %d frames, state %s\n", frame, (nesmovie_frame_hash(nes) == hash) ? "matches" : "differs");
+	nesrewind_print_stats();
+	ines_unload_cart(nes);
+	free(rom);
+}
+#endif
+
+#if NESCACHE_ENABLE && NESSYS_FLASH_SIM
+// Runs a rom with the xip flash model, without and then with the sram bank cache, and reports the simulated stalls
+// Usage: pi_cones -bank_cache_bench <rom.nes> [frames]
+void bank_cache_bench(const char* rom_file, uint frames)
+{
+	nessys_t* nes = &main_nes;
+	uint8_t* rom;
+	uint frame, pass;
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+
+	nescache_flash_sim = true;
+	for (pass = 0; pass < 2; pass++) {
+		nes_instance_init(nes, framebuffer, &tbox, aux_mem);
+		if (!ines_load_cart(nes, rom)) {
+			printf("Can't load %s\n", rom_file);
+			break;
+		}
+		if (nes->cache == NULL) {
+			printf("%s: no room for the bank cache in the cart arena\n", rom_file);
+			ines_unload_cart(nes);
+			break;
+		}
+		// nothing has been copied yet, so the first pass runs all from flash
+		nes->cache->enable = (pass != 0);
+		for (frame = 0; frame < frames; frame++) {
+			nes->frame_delta_time = 1;
+			nessys_apu_start_frame(nes, NESSYS_SND_RATE_ONE);
+			emulate_frame(nes);
+			nes->frame++;
+		}
+		printf("%s: %d frames, bank cache %s\n", rom_file, frames, (nes->cache->enable) ? "on" : "off");
+		printf("  xip misses / frame: prg %0.1f, chr %0.1f; stall %0.1f us / frame\n",
+			(float)nes->cache->sim_prg_misses / frames, (float)nes->cache->sim_chr_misses / frames,
+			(float)nes->cache->sim_stall_cycles / NESCACHE_SIM_SYS_CLK_MHZ / frames);
+		if (nes->cache->enable) nescache_print_stats(nes);
+		ines_unload_cart(nes);
+	}
+	nescache_flash_sim = false;
+	free(rom);
+}
+#endif
+
+// the batch runner checks each header itself, so only carts that can run get a worker
+#define BATCH_STATUS_SIZE 96
+// a worker running slower than real time is taken to have hung
+#define BATCH_MS_PER_FRAME 17
+#define BATCH_MIN_TIMEOUT_MS 10000
+#define BATCH_POLL_MS 100
+
+typedef struct {
+	char name[MAX_PATH];
+	int mapper;                      // -1 if it isn't an ines file
+	char result[BATCH_STATUS_SIZE];  // status, frames, seconds, fps and hash columns
+} batch_rom_t;
+
+typedef struct {
+	uint rom;
+	PROCESS_INFORMATION pi;
+	ULONGLONG start_ms;
+	char result_file[MAX_PATH];
+} batch_worker_t;
+
+// Runs one rom from power on, with no pixel rendering, and writes its status, frames, seconds, fps and the hash of
+// its final state to result_file; a worker that crashes or hangs never writes it
+// Usage: pi_cones -batch_worker <rom.nes> <frames> <result_file>
+void batch_worker(const char* rom_file, uint frames, const char* result_file)
+{
+	nessys_t* nes = &main_nes;
+	LARGE_INTEGER freq, start, end;
+	uint8_t* rom;
+	float seconds;
+	FILE* f;
+
+	rom = load_rom_file(rom_file);
+	if (rom == NULL) return;
+
+	nes_instance_init(nes, framebuffer, &tbox, aux_mem);
+	if (!ines_load_cart(nes, rom)) {
+		f = fopen(result_file, "w");
+		if (f) fprintf(f, "load_failed,0,0,0,\n");
+	} else {
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&start);
+		state_bench_run(nes, frames);
+		QueryPerformanceCounter(&end);
+		seconds = (float)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+		f = fopen(result_file, "w");
+		if (f) fprintf(f, "ok,%d,%0.3f,%0.1f,%08X\n", frames, seconds, frames / seconds, nesmovie_frame_hash(nes));
+		ines_unload_cart(nes);
+	}
+	if (f) fclose(f);
+	free(rom);
+}
+
+// Reads a rom's header; returns its mapper, or -1 if it isn't an ines file, and sets status if it can't be run
+static int batch_check_rom(const char* rom_file, char* status)
+{
+	ines_header hdr;
+	uint32_t prg_size, chr_size;
+	int mapper;
+	long size;
+	FILE* f;
+
+	f = fopen(rom_file, "rb");
+	if (f == NULL) {
+		strcpy(status, "unreadable,0,0,0,\n");
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.signature != INES_SIGNATURE) {
+		fclose(f);
+		strcpy(status, "not_ines,0,0,0,\n");
+		return -1;
+	}
+	fclose(f);
+	mapper = ((hdr.flags6 & INES_FLAGS6_MAPPER) >> 4) | (hdr.flags7 & INES_FLAGS7_MAPPER);
+	// carts are used in place, so one shorter than its header says would run off the end of the file
+	prg_size = hdr.prg_rom_size;
+	chr_size = hdr.chr_rom_size;
+	if (hdr.flags7 & INES_FLAGS7_NES2) {
+		prg_size |= (hdr.flags9 & 0xf) << 8;
+		chr_size |= (hdr.flags9 & 0xf0) << 4;
+	}
+	if (size < (long)(sizeof(hdr) + ((hdr.flags6 & INES_FLAGS6_TRAINER) ? 512 : 0) + prg_size * 0x4000 + chr_size * 0x2000)) {
+		strcpy(status, "truncated,0,0,0,\n");
+	} else if (!nessys_mapper_supported(mapper)) {
+		strcpy(status, "unsupported_mapper,0,0,0,\n");
+	}
+	return mapper;
+}
+
+// Writes s as a quoted csv field, with its quotes doubled, so a rom name with commas or quotes stays one field
+static void batch_csv_field(FILE* f, const char* s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"') fputc('"', f);
+		fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static int batch_rom_compare(const void* a, const void* b)
+{
+	return strcmp(((const batch_rom_t*)a)->name, ((const batch_rom_t*)b)->name);
+}
+
+// Runs every .nes file in a directory for a number of frames, each in a worker process of its own, as many at once
+// as there are processors, and writes a csv line per rom: throughput, the hash of its final state, or why it didn't
+// finish. A rom that crashes or hangs only takes its worker down
+// Usage: pi_cones -batch <dir> [frames] [out.csv] [workers]
+void batch(const char* dir, uint frames, const char* csv_file, uint workers)
+{
+	WIN32_FIND_DATA fd;
+	SYSTEM_INFO si;
+	STARTUPINFO start_info;
+	HANDLE find;
+	HANDLE handle[MAXIMUM_WAIT_OBJECTS];
+	batch_worker_t worker[MAXIMUM_WAIT_OBJECTS];
+	batch_rom_t* roms = NULL;
+	batch_rom_t* r;
+	char path[MAX_PATH], exe[MAX_PATH], cmd[3 * MAX_PATH];
+	DWORD code, timeout_ms;
+	uint num_roms = 0, next = 0, running = 0, done = 0, i, ok = 0;
+	FILE* f;
+
+	snprintf(path, MAX_PATH, "%s\\*.nes", dir);
+	find = FindFirstFile(path, &fd);
+	if (find != INVALID_HANDLE_VALUE) {
+		do {
+			r = realloc(roms, (num_roms + 1) * sizeof(batch_rom_t));
+			if (r == NULL) break;
+			roms = r;
+			snprintf(roms[num_roms].name, MAX_PATH, "%s", fd.cFileName);
+			num_roms++;
+		} while (FindNextFile(find, &fd));
+		FindClose(find);
+	}
+	if (num_roms == 0) {
+		printf("No .nes files in %s\n", dir);
+		return;
+	}
+	qsort(roms, num_roms, sizeof(batch_rom_t), batch_rom_compare);
+	for (i = 0; i < num_roms; i++) {
+		roms[i].result[0] = '\0';
+		snprintf(path, MAX_PATH, "%s\\%s", dir, roms[i].name);
+		roms[i].mapper = batch_check_rom(path, roms[i].result);
+	}
+
+	if (workers == 0) {
+		GetSystemInfo(&si);
+		workers = si.dwNumberOfProcessors;
+	}
+	if (workers > MAXIMUM_WAIT_OBJECTS) workers = MAXIMUM_WAIT_OBJECTS;
+	timeout_ms = frames * BATCH_MS_PER_FRAME;
+	if (timeout_ms < BATCH_MIN_TIMEOUT_MS) timeout_ms = BATCH_MIN_TIMEOUT_MS;
+	GetModuleFileName(NULL, exe, MAX_PATH);
+	memset(&start_info, 0, sizeof(start_info));
+	start_info.cb = sizeof(start_info);
+	printf("%d roms, %d frames each, %d workers\n", num_roms, frames, workers);
+
+	while (next < num_roms || running) {
+		// keep every worker busy
+		while (running < workers && next < num_roms) {
+			r = &roms[next];
+			if (r->result[0]) {
+				done++;
+				printf("[%d/%d] %s: %.*s\n", done, num_roms, r->name, (int)strcspn(r->result, ",\n"), r->result);
+				next++;
+				continue;
+			}
+			batch_worker_t* w = &worker[running];
+			w->rom = next;
+			snprintf(w->result_file, MAX_PATH, "%s.%d.tmp", csv_file, next);
+			remove(w->result_file);
+			snprintf(path, MAX_PATH, "%s\\%s", dir, r->name);
+			snprintf(cmd, sizeof(cmd), "\"%s\" -batch_worker \"%s\" %d \"%s\"", exe, path, frames, w->result_file);
+			if (!CreateProcess(NULL, cmd, NULL, NULL, FALSE, 0, NULL, NULL, &start_info, &w->pi)) {
+				printf("Can't start a worker for %s\n", r->name);
+				strcpy(r->result, "no_worker,0,0,0,\n");
+				done++;
+				next++;
+				continue;
+			}
+			w->start_ms = GetTickCount64();
+			handle[running++] = w->pi.hProcess;
+			next++;
+		}
+		if (running == 0) break;
+
+		WaitForMultipleObjects(running, handle, FALSE, BATCH_POLL_MS);
+		for (i = 0; i < running; ) {
+			batch_worker_t* w = &worker[i];
+			r = &roms[w->rom];
+			GetExitCodeProcess(w->pi.hProcess, &code);
+			if (code == STILL_ACTIVE) {
+				if (GetTickCount64() - w->start_ms < timeout_ms) {
+					i++;
+					continue;
+				}
+				TerminateProcess(w->pi.hProcess, 1);
+				WaitForSingleObject(w->pi.hProcess, INFINITE);
+				strcpy(r->result, "timeout,0,0,0,\n");
+			} else {
+				f = fopen(w->result_file, "r");
+				if (code != 0 || f == NULL || fgets(r->result, BATCH_STATUS_SIZE, f) == NULL) {
+					strcpy(r->result, "crash,0,0,0,\n");
+				}
+				if (f) fclose(f);
+			}
+			remove(w->result_file);
+			CloseHandle(w->pi.hProcess);
+			CloseHandle(w->pi.hThread);
+			done++;
+			printf("[%d/%d] %s: %.*s\n", done, num_roms, r->name, (int)strcspn(r->result, ",\n"), r->result);
+			// the last worker fills the gap
+			running--;
+			worker[i] = worker[running];
+			handle[i] = handle[running];
+		}
+	}
+
+	f = fopen(csv_file, "w");
+	if (f == NULL) {
+		printf("Can't write %s\n", csv_file);
+		free(roms);
+		return;
+	}
+	fprintf(f, "rom,mapper,status,frames,seconds,fps,hash\n");
+	for (i = 0; i < num_roms; i++) {
+		batch_csv_field(f, roms[i].name);
+		if (roms[i].mapper < 0) {
+			fprintf(f, ",,%s", roms[i].result);
+		} else {
+			fprintf(f, ",%d,%s", roms[i].mapper, roms[i].result);
+		}
+		// a result cut short by its buffer still ends its row
+		if (strchr(roms[i].result, '\n') == NULL) fputc('\n', f);
+		if (strncmp(roms[i].result, "ok,", 3) == 0) ok++;
+	}
+	fclose(f);
+	printf("%d of %d roms ran; results in %s\n", ok, num_roms, csv_file);
+	free(roms);
+}
+#endif
+
+#ifndef PI_CONES_LIB
 void main()
 {
 #ifdef WIN32
+	int i;
+	// benches don't touch the save
+	session_save = false;
+	if (__argc >= 3 && strcmp(__argv[1], "-audio_bench") == 0) {
+		audio_bench(__argv[2], (__argc >= 4) ? __argv[3] : "audio_bench.wav", (__argc >= 5) ? atoi(__argv[4]) : 60);
+		return;
+	}
+	if (__argc >= 3 && strcmp(__argv[1], "-mapper_bench") == 0) {
+		mapper_bench(__argv[2]);
+		return;
+	}
+	if (__argc >= 3 && strcmp(__argv[1], "-cpu_bench") == 0) {
+		cpu_bench(__argc - 2, __argv + 2);
+		return;
+	}
+	if (__argc >= 3 && strcmp(__argv[1], "-state_bench") == 0) {
+		state_bench(__argv[2], (__argc >= 4) ? atoi(__argv[3]) : 600);
+		return;
+	}
+	if (__argc >= 4 && strcmp(__argv[1], "-movie_bench") == 0) {
+		movie_bench(__argv[2], __argv[3]);
+		return;
+	}
+	if (__argc >= 3 && strcmp(__argv[1], "-run_ahead_bench") == 0) {
+		run_ahead_bench(__argv[2], (__argc >= 4) ? atoi(__argv[3]) : 600);
+		return;
+	}
+	if (__argc >= 3 && strcmp(__argv[1], "-logic_bench") == 0) {
+		logic_bench(__argv[2], (__argc >= 4) ? atoi(__argv[3]) : 1200);
+		return;
+	}
+	if (__argc >= 3 && strcmp(__argv[1], "-turbo_bench") == 0) {
+		turbo_bench(__argv[2], (__argc >= 4) ? atoi(__argv[3]) : 10);
+		return;
+	}
+	if (__argc >= 3 && strcmp(__argv[1], "-instance_bench") == 0) {
+		instance_bench(__argv[2], (__argc >= 4) ? atoi(__argv[3]) : 4, (__argc >= 5) ? atoi(__argv[4]) : 1200);
+		return;
+	}
+	if (__argc >= 3 && strcmp(__argv[1], "-env_bench") == 0) {
+		env_bench(__argv[2], (__argc >= 4) ? atoi(__argv[3]) : 4, (__argc >= 5) ? atoi(__argv[4]) : 5000);
+		return;
+	}
+	if (__argc >= 3 && strcmp(__argv[1], "-vec_env_bench") == 0) {
+		vec_env_bench(__argv[2], (__argc >= 4) ? atoi(__argv[3]) : 300, (__argc >= 5) ? atoi(__argv[4]) : 0);
+		return;
+	}
+#if NESREWIND_ENABLE
+	if (__argc >= 3 && strcmp(__argv[1], "-rewind_bench") == 0) {
+		rewind_bench(__argv[2], (__argc >= 4) ? atoi(__argv[3]) : 3600);
+		return;
+	}
+#endif
+#if NESCACHE_ENABLE && NESSYS_FLASH_SIM
+	if (__argc >= 3 && strcmp(__argv[1], "-bank_cache_bench") == 0) {
+		bank_cache_bench(__argv[2], (__argc >= 4) ? atoi(__argv[3]) : 3600);
+		return;
+	}
+#endif
+	if (__argc >= 3 && strcmp(__argv[1], "-batch") == 0) {
+		batch(__argv[2], (__argc >= 4) ? atoi(__argv[3]) : 3600, (__argc >= 5) ? __argv[4] : "batch.csv",
+			(__argc >= 6) ? atoi(__argv[5]) : 0);
+		return;
+	}
+	if (__argc >= 5 && strcmp(__argv[1], "-batch_worker") == 0) {
+		batch_worker(__argv[2], atoi(__argv[3]), __argv[4]);
+		return;
+	}
+	// run a rom file, record or play a movie of the session, and write its sound to a wav file
+	for (i = 1; i + 1 < __argc; i += 2) {
+		if (strcmp(__argv[i], "-rom") == 0) rom_path = __argv[i + 1];
+		if (strcmp(__argv[i], "-movie_record") == 0) movie_record_path = __argv[i + 1];
+		if (strcmp(__argv[i], "-movie_play") == 0) movie_play_path = __argv[i + 1];
+		if (strcmp(__argv[i], "-wav") == 0) wav_path = __argv[i + 1];
+	}
+	if (rom_path) {
+		session_rom = load_rom_file(rom_path);
+		if (session_rom == NULL) return;
+		snprintf(sav_file, sizeof(sav_file), "%s.sav", rom_path);
+	}
+	// movies start from power on without the save, so they play back the same
+	session_save = (movie_record_path == NULL && movie_play_path == NULL);
 	win32_init();
 #else
     //uint vco_freq, postdiv1, postdiv2;
@@ -1821,8 +3540,10 @@ void main()
         SYS_CLK_KHZ * 1000);
     stdio_init_all();
     lcd_init(true);
+    pico_joypad_init();
 #endif
 
 
 	main_loop();
 }
+#endif
@@ -0,0 +1,1090 @@
+// mapper.c
+// NES memory mappers
+
+#include "mapper.h"
+#include "nescache.h"
+#include "nessave.h"
+
+// which 1KB of ppu memory backs each of the 4 nametables, for each mirroring mode
+static const uint8_t MAPPER_MIRROR_NTB[4][4] = {
+	{ 0, 0, 0, 0 },  // one screen, lower
+	{ 1, 1, 1, 1 },  // one screen, upper
+	{ 0, 1, 0, 1 },  // vertical
+	{ 0, 0, 1, 1 },  // horizontal
+};
+
+// ------------------------------------------------------------
+// common mapper helpers
+// banking only rewrites the bank pointer tables, so the cpu and ppu keep doing a plain pointer lookup on every access;
+// each window remembers its source, so a remap that leaves it where it is costs a compare, and a bank switch costs
+// a store or two per window it moves
+
+// maps an 8KB cpu window (b is the bank index, addr >> 13) to an offset into prg rom; wraps around the rom size
+void mapper_map_prg(nessys_t* nes, uint b, uint32_t offset)
+{
+	offset %= nes->prg_rom_size;
+	if (nes->prg_bank_src[b] == offset) return;
+	nes->prg_bank_src[b] = offset;
+	nes->prg_rom_bank[b] = nescache_map_prg(nes, b, offset);
+	nes->prg_rom_bank_mask[b] = NESSYS_PRG_MEM_MASK;
+}
+
+// maps count consecutive 8KB cpu windows, starting at b, to consecutive prg rom
+void mapper_map_prg_window(nessys_t* nes, uint b, uint count, uint32_t offset)
+{
+	uint i;
+	for (i = 0; i < count; i++) mapper_map_prg(nes, b + i, offset + (i << NESSYS_PRG_BANK_SIZE_LOG2));
+}
+
+// maps an 8KB cpu window to an offset into prg ram, or to a junk location if there is no ram, or it's disabled
+void mapper_map_prg_ram(nessys_t* nes, uint b, uint32_t offset, bool enable)
+{
+	uint32_t src = (enable && nes->prg_ram_base) ? NESSYS_BANK_SRC_RAM | (offset % nes->prg_ram_size) : NESSYS_BANK_SRC_NONE;
+
+	if (nes->prg_bank_src[b] == src) return;
+	nes->prg_bank_src[b] = src;
+	nescache_unmap_prg(nes, b);
+	if (src != NESSYS_BANK_SRC_NONE) {
+		nes->prg_rom_bank[b] = nes->prg_ram_base + (src & ~NESSYS_BANK_SRC_RAM);
+		nes->prg_rom_bank_mask[b] = NESSYS_PRG_MEM_MASK;
+	} else {
+		nes->prg_rom_bank[b] = &nes->reg.pad0;
+		nes->prg_rom_bank_mask[b] = 0x0;
+	}
+}
+
+// maps a 1KB ppu pattern window to an offset into chr rom, or chr ram if the cart has no rom
+// returns whether the window moved, so callers only regenerate sprites when the patterns changed
+bool mapper_map_chr(nessys_t* nes, uint b, uint32_t offset)
+{
+	if (nes->ppu.chr_ram_base) {
+		offset %= nes->ppu.chr_ram_size;
+		if (nes->ppu.chr_bank_src[b] == offset) return false;
+		nes->ppu.chr_ram_bank[b] = nes->ppu.chr_ram_base + offset;
+		nes->ppu.chr_rom_bank[b] = nes->ppu.chr_ram_bank[b];
+	} else if (nes->ppu.chr_rom_base) {
+		offset %= nes->ppu.chr_rom_size;
+		if (nes->ppu.chr_bank_src[b] == offset) return false;
+		nes->ppu.chr_rom_bank[b] = nescache_map_chr(nes, b, offset);
+	} else {
+		return false;
+	}
+	nes->ppu.chr_bank_src[b] = offset;
+	return true;
+}
+
+// maps count consecutive 1KB pattern windows, starting at b, to consecutive chr memory
+bool mapper_map_chr_window(nessys_t* nes, uint b, uint count, uint32_t offset)
+{
+	bool moved = false;
+	uint i;
+	for (i = 0; i < count; i++) moved |= mapper_map_chr(nes, b + i, offset + (i << NESSYS_CHR_BANK_SIZE_LOG2));
+	return moved;
+}
+
+// maps the nametables, and their mirror at 0x3000
+void mapper_map_ntb(nessys_t* nes, uint8_t mirror)
+{
+	uint b;
+	// 4 screen carts have no mirroring to control
+	if (nes->ppu.mem_4screen || nes->ppu.ntb_mirror == mirror) return;
+	nes->ppu.ntb_mirror = mirror;
+	for (b = 0; b < 4; b++) {
+		nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + b] = nes->ppu.mem + (MAPPER_MIRROR_NTB[mirror][b] << NESSYS_CHR_BANK_SIZE_LOG2);
+		nes->ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + b] = nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + b];
+		nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 4 + b] = nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + b];
+		nes->ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 4 + b] = nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + b];
+	}
+}
+
+// sprite pixels are generated once at the start of the frame; if pattern banks move while rendering, they are
+// regenerated before the next scan line's sprites are evaluated, so several bank writes in a row cost one regeneration
+void mapper_chr_changed(nessys_t* nes)
+{
+	if (nes->scan_line >= NESSYS_PPU_SCANLINES_START_RENDER) nes->ppu.oam_pix_dirty = true;
+}
+
+// ------------------------------------------------------------
+// mapper 1 (MMC1)
+
+// returns whether a pattern window moved
+static bool mapper1_update(nessys_t* nes, struct mapper1_data* data)
+{
+	uint32_t outer, last, lo, hi, chr0, chr1;
+	bool chr_moved;
+
+	// SUROM/SXROM use bit 4 of the chr bank to select the 256KB half of a 512KB prg rom
+	outer = 0;
+	last = nes->prg_rom_size;
+	if (nes->prg_rom_size > 0x40000) {
+		outer = (data->chr_bank0 & 0x10) << 14;
+		last = 0x40000;
+	}
+	last -= (1 << MAPPER1_PRG_BANK_SIZE_LOG2);
+
+	switch ((data->control >> 2) & 0x3) {
+	case 0:
+	case 1:
+		// switch 32KB at 0x8000, ignoring the low bit of the bank
+		lo = (data->prg_bank & 0xE) << MAPPER1_PRG_BANK_SIZE_LOG2;
+		hi = lo + (1 << MAPPER1_PRG_BANK_SIZE_LOG2);
+		break;
+	case 2:
+		// fix first bank at 0x8000, switch 16KB at 0xC000
+		lo = 0;
+		hi = (data->prg_bank & 0xF) << MAPPER1_PRG_BANK_SIZE_LOG2;
+		break;
+	default:
+		// switch 16KB at 0x8000, fix last bank at 0xC000
+		lo = (data->prg_bank & 0xF) << MAPPER1_PRG_BANK_SIZE_LOG2;
+		hi = last;
+		break;
+	}
+	mapper_map_prg_window(nes, NESSYS_PRG_ROM_START_BANK + 0, 2, outer + lo);
+	mapper_map_prg_window(nes, NESSYS_PRG_ROM_START_BANK + 2, 2, outer + hi);
+
+	// SXROM selects 8KB of its 32KB prg ram with bits 2-3 of the chr bank; bit 4 of the prg bank disables the ram
+	mapper_map_prg_ram(nes, NESSYS_PRG_RAM_START_BANK, ((data->chr_bank0 >> 2) & 0x3) << NESSYS_PRG_BANK_SIZE_LOG2, !(data->prg_bank & 0x10));
+
+	if (data->control & 0x10) {
+		// two 4KB banks
+		chr0 = data->chr_bank0 << MAPPER1_CHR_BANK_SIZE_LOG2;
+		chr1 = data->chr_bank1 << MAPPER1_CHR_BANK_SIZE_LOG2;
+	} else {
+		// one 8KB bank, ignoring the low bit
+		chr0 = (data->chr_bank0 & 0x1E) << MAPPER1_CHR_BANK_SIZE_LOG2;
+		chr1 = chr0 + (1 << MAPPER1_CHR_BANK_SIZE_LOG2);
+	}
+	chr_moved = mapper_map_chr_window(nes, NESSYS_CHR_ROM_START_BANK + 0, 4, chr0);
+	chr_moved |= mapper_map_chr_window(nes, NESSYS_CHR_ROM_START_BANK + 4, 4, chr1);
+
+	mapper_map_ntb(nes, data->control & 0x3);
+	return chr_moved;
+}
+
+bool mapper1_init(nessys_t* nes)
+{
+	struct mapper1_data* data = alloc_aux(nes, sizeof(struct mapper1_data));
+	if (data == NULL) return false;
+	memset(data, 0, sizeof(struct mapper1_data));
+	data->shift_reg = MAPPER1_SHIFT_REG_RESET;
+	// far enough back that the first write isn't taken as consecutive
+	data->write_clk = nes->line_start_clk + nes->scan_clk - NESSYS_PPU_CLK_PER_SCANLINE;
+	// power up with the last bank fixed at 0xC000, so the reset vector is valid
+	data->control = 0x0C;
+	nes->mapper_data = data;
+	nes->mapper_write = mapper1_write;
+	mapper1_update(nes, data);
+	return true;
+}
+
+bool mapper1_write(nessys_t* nes, uint16_t addr, uint8_t data)
+{
+	struct mapper1_data* m = (struct mapper1_data*)nes->mapper_data;
+	uint32_t clk = nes->line_start_clk + nes->scan_clk;
+	// the serial port ignores a write on the cycle after another, such as the second write of a read-modify-write
+	// instruction; both of those are made at the same instruction clock here
+	bool consecutive = (clk - m->write_clk <= NESSYS_PPU_PER_CPU_CLK);
+	uint8_t value;
+
+	m->write_clk = clk;
+	if (consecutive) return false;
+
+	if (data & 0x80) {
+		// reset the shift register, and fix the last prg bank
+		m->shift_reg = MAPPER1_SHIFT_REG_RESET;
+		m->control |= 0x0C;
+		mapper1_update(nes, m);
+		return true;
+	}
+
+	// the reset bit marks when 5 bits have been shifted in
+	value = m->shift_reg;
+	m->shift_reg = (m->shift_reg >> 1) | ((data & 0x1) << 4);
+	if (!(value & 0x1)) return false;
+	value = m->shift_reg;
+	m->shift_reg = MAPPER1_SHIFT_REG_RESET;
+
+	addr &= MAPPER1_ADDR_MASK;
+	if (addr == MAPPER1_ADDR_CONTROL) {
+		m->control = value;
+	} else if (addr == MAPPER1_ADDR_CHR_BANK0) {
+		m->chr_bank0 = value;
+	} else if (addr == MAPPER1_ADDR_CHR_BANK1) {
+		m->chr_bank1 = value;
+	} else {
+		m->prg_bank = value;
+	}
+	if (mapper1_update(nes, m)) mapper_chr_changed(nes);
+	return true;
+}
+
+// ------------------------------------------------------------
+// discrete logic mappers
+
+static const mapper_discrete_t MAPPER_DISCRETE[] = {
+	// UxROM: 16KB at 0x8000, last bank fixed at 0xC000
+	{ 2, 1, 0, {
+		{ 0x8000, 0x8000, 0xFF, 14, NESSYS_PRG_ROM_START_BANK, 0, 0x00 } } },
+	// CNROM: 8KB chr
+	{ 3, 1, 0, {
+		{ 0x8000, 0x8000, 0xFF, 13, NESSYS_CHR_ROM_START_BANK, 1, 0x00 } } },
+	// AxROM: 32KB at 0x8000, one screen mirroring
+	{ 7, 1, 0, {
+		{ 0x8000, 0x8000, 0x07, 15, NESSYS_PRG_ROM_START_BANK, 0, 0x10 } } },
+	// Camerica: 16KB at 0x8000, last bank fixed at 0xC000, one screen mirroring at 0x9000-0x9FFF on Fire Hawk
+	{ 71, 2, 0, {
+		{ 0xC000, 0xC000, 0xFF, 14, NESSYS_PRG_ROM_START_BANK, 0, 0x00 },
+		{ 0xF000, 0x9000, 0x00, 0, 0, 0, 0x10 } } },
+	// UNROM variant (Crazy Climber): first bank fixed at 0x8000, switchable 16KB bank at 0xC000
+	{ 180, 1, NESSYS_PRG_ROM_START_BANK, {
+		{ 0x8000, 0x8000, 0xFF, 14, NESSYS_PRG_ROM_START_BANK + 2, 0, 0x00 } } },
+};
+
+static void mapper_discrete_apply(nessys_t* nes, const mapper_discrete_reg_t* reg, uint8_t data)
+{
+	uint32_t offset = (uint32_t)(data & reg->bank_bits) << reg->bank_size_log2;
+
+	if (reg->bank_bits) {
+		if (reg->chr) {
+			if (mapper_map_chr_window(nes, reg->window, 1 << (reg->bank_size_log2 - NESSYS_CHR_BANK_SIZE_LOG2), offset)) mapper_chr_changed(nes);
+		} else {
+			mapper_map_prg_window(nes, reg->window, 1 << (reg->bank_size_log2 - NESSYS_PRG_BANK_SIZE_LOG2), offset);
+		}
+	}
+	if (reg->mirror_bit) {
+		mapper_map_ntb(nes, (data & reg->mirror_bit) ? MAPPER_MIRROR_ONE_UPPER : MAPPER_MIRROR_ONE_LOWER);
+	}
+}
+
+bool mapper_discrete_init(nessys_t* nes, uint16_t mapper_id)
+{
+	const mapper_discrete_t* desc = NULL;
+	struct mapper_discrete_data* data;
+	uint i;
+
+	for (i = 0; i < sizeof(MAPPER_DISCRETE) / sizeof(mapper_discrete_t); i++) {
+		if (MAPPER_DISCRETE[i].mapper_id == mapper_id) desc = &MAPPER_DISCRETE[i];
+	}
+	if (desc == NULL) return false;
+
+	data = alloc_aux(nes, sizeof(struct mapper_discrete_data));
+	if (data == NULL) return false;
+	memset(data, 0, sizeof(struct mapper_discrete_data));
+	data->desc = desc;
+	nes->mapper_data = data;
+	nes->mapper_write = mapper_discrete_write;
+
+	if (desc->fixed_first) {
+		mapper_map_prg_window(nes, desc->fixed_first, 2, 0);
+	}
+	// power up with bank 0 in each switched window; mirroring only registers keep the header's mirroring
+	for (i = 0; i < desc->num_regs; i++) {
+		if (desc->reg[i].bank_bits) mapper_discrete_apply(nes, &desc->reg[i], 0);
+	}
+	return true;
+}
+
+bool mapper_discrete_write(nessys_t* nes, uint16_t addr, uint8_t data)
+{
+	struct mapper_discrete_data* m = (struct mapper_discrete_data*)nes->mapper_data;
+	const mapper_discrete_t* desc = m->desc;
+	uint r;
+
+	for (r = 0; r < desc->num_regs; r++) {
+		if ((addr & desc->reg[r].addr_mask) == desc->reg[r].addr_match) {
+			m->value[r] = data;
+			mapper_discrete_apply(nes, &desc->reg[r], data);
+			return true;
+		}
+	}
+	return false;
+}
+
+// ------------------------------------------------------------
+// mapper 4 (MMC3)
+
+// maps the windows of one bank register; returns whether a pattern window moved
+static bool mapper4_map_reg(nessys_t* nes, struct mapper4_data* data, uint r)
+{
+	// bit 7 swaps the 2KB and 1KB halves of the pattern tables
+	uint chr_inv = (data->bank_select & 0x80) ? 4 : 0;
+
+	if (r < 2) return mapper_map_chr_window(nes, NESSYS_CHR_ROM_START_BANK + ((2 * r) ^ chr_inv), 2, data->r[r] << MAPPER4_CHR_BANK_SIZE_LOG2);
+	if (r < 6) return mapper_map_chr(nes, NESSYS_CHR_ROM_START_BANK + ((r + 2) ^ chr_inv), data->r[r] << MAPPER4_CHR_BANK_SIZE_LOG2);
+	// bit 6 swaps which of 0x8000 and 0xC000 is fixed to the second last bank
+	if (r == 6) {
+		mapper_map_prg(nes, NESSYS_PRG_ROM_START_BANK + ((data->bank_select & 0x40) ? 2 : 0), data->r[6] << MAPPER4_PRG_BANK_SIZE_LOG2);
+	} else {
+		mapper_map_prg(nes, NESSYS_PRG_ROM_START_BANK + 1, data->r[7] << MAPPER4_PRG_BANK_SIZE_LOG2);
+	}
+	return false;
+}
+
+// maps every window; bank data writes only remap their own register's windows
+static bool mapper4_update(nessys_t* nes, struct mapper4_data* data)
+{
+	uint32_t second_last = nes->prg_rom_size - 2 * NESSYS_PRG_BANK_SIZE;
+	bool chr_moved = false;
+	uint r;
+
+	mapper_map_prg(nes, NESSYS_PRG_ROM_START_BANK + ((data->bank_select & 0x40) ? 0 : 2), second_last);
+	mapper_map_prg(nes, NESSYS_PRG_ROM_START_BANK + 3, second_last + NESSYS_PRG_BANK_SIZE);
+	for (r = 0; r < 8; r++) chr_moved |= mapper4_map_reg(nes, data, r);
+	return chr_moved;
+}
+
+// whether this line's 8x16 sprite fetches touch $1000; each sprite's tile bit 0 picks its table, and the slots
+// left over when fewer than 8 sprites are in range fetch tile $FF, which is in $1000
+static bool mapper4_sprites_high(nessys_t* nes)
+{
+	int y = (int)nes->scan_line - NESSYS_PPU_SCANLINES_START_RENDER;
+	uint i, sp;
+
+	for (i = 0, sp = 0; i < NESSYS_PPU_NUM_SPRITES && sp < NESSYS_PPU_MAX_SPRITES_PER_SCAN_LINE; i++) {
+		int sprite_y = y - nes->ppu.oam[4 * i];
+		if (sprite_y < 0 || sprite_y >= 16) continue;
+		if (nes->ppu.oam[4 * i + 1] & 0x1) return true;
+		sp++;
+	}
+	return sp < NESSYS_PPU_MAX_SPRITES_PER_SCAN_LINE;
+}
+
+// schedules this line's irq counter clock, if the ppu is rendering and fetching from both pattern tables
+static bool mapper4_line_start(nessys_t* nes)
+{
+	uint8_t ctrl = nes->ppu.reg[0];
+	bool bg_high = (ctrl & 0x10) != 0;
+	bool sprite_high = (ctrl & 0x20) ? mapper4_sprites_high(nes) : (ctrl & 0x08) != 0;
+
+	nes->mapper_event_scan_clk = ~0;
+	if (!(nes->ppu.reg[1] & 0x18)) return false;
+	// the pre-render line and all rendered lines clock the counter
+	if (nes->scan_line < NESSYS_PPU_SCANLINES_START_RENDER - NESSYS_PPU_SCANLINES_PRE_RENDER ||
+		nes->scan_line >= NESSYS_PPU_SCANLINES_START_RENDER + NESSYS_PPU_SCANLINES_RENDERED) return false;
+	if (sprite_high && !bg_high) {
+		nes->mapper_event_scan_clk = MAPPER4_IRQ_SCAN_CLK_SPRITE_FETCH;
+	} else if (bg_high && !sprite_high) {
+		nes->mapper_event_scan_clk = MAPPER4_IRQ_SCAN_CLK_BG_FETCH;
+	} else {
+		// A12 doesn't toggle during the line
+		return false;
+	}
+	return true;
+}
+
+static void mapper4_irq_clock(nessys_t* nes)
+{
+	struct mapper4_data* m = (struct mapper4_data*)nes->mapper_data;
+
+	if (m->irq_counter == 0 || m->counter_write_pending) {
+		m->irq_counter = m->irq_latch;
+		m->counter_write_pending = 0;
+	} else {
+		m->irq_counter--;
+	}
+	if (m->irq_counter == 0 && m->irq_enable) nes->mapper_irq = true;
+}
+
+bool mapper4_init(nessys_t* nes)
+{
+	struct mapper4_data* data = alloc_aux(nes, sizeof(struct mapper4_data));
+	if (data == NULL) return false;
+	memset(data, 0, sizeof(struct mapper4_data));
+	data->r[0] = 0;
+	data->r[1] = 2;
+	data->r[2] = 4;
+	data->r[3] = 5;
+	data->r[4] = 6;
+	data->r[5] = 7;
+	data->r[6] = 0;
+	data->r[7] = 1;
+	nes->mapper_data = data;
+	nes->mapper_write = mapper4_write;
+	nes->mapper_update = mapper4_line_start;
+	nes->mapper_event = mapper4_irq_clock;
+	mapper4_update(nes, data);
+	return true;
+}
+
+bool mapper4_write(nessys_t* nes, uint16_t addr, uint8_t data)
+{
+	struct mapper4_data* m = (struct mapper4_data*)nes->mapper_data;
+	uint8_t r;
+
+	addr &= MAPPER4_ADDR_MASK;
+	if (addr == MAPPER4_ADDR_BANK_SELECT) {
+		m->bank_select = data;
+		if (mapper4_update(nes, m)) mapper_chr_changed(nes);
+	} else if (addr == MAPPER4_ADDR_BANK_DATA) {
+		r = m->bank_select & 0x7;
+		m->r[r] = data & MAPPER4_REG_MASK[r];
+		if (mapper4_map_reg(nes, m, r)) mapper_chr_changed(nes);
+	} else if (addr == MAPPER4_ADDR_MIRROR) {
+		mapper_map_ntb(nes, (data & 0x1) ? MAPPER_MIRROR_HORIZ : MAPPER_MIRROR_VERT);
+	} else if (addr == MAPPER4_ADDR_PRG_RAM_PROTECT) {
+		// kept, but not enforced; MMC6 carts reuse this register differently, and games don't depend on it
+		m->prg_ram_protect = data;
+	} else if (addr == MAPPER4_ADDR_IRQ_LATCH) {
+		m->irq_latch = data;
+	} else if (addr == MAPPER4_ADDR_IRQ_RELOAD) {
+		m->irq_counter = 0;
+		m->counter_write_pending = 1;
+	} else if (addr == MAPPER4_ADDR_IRQ_DISABLE) {
+		// disabling also acknowledges a pending irq
+		m->irq_enable = 0;
+		nes->mapper_irq = false;
+	} else {
+		m->irq_enable = 1;
+	}
+	return true;
+}
+
+// ------------------------------------------------------------
+// mapper 5 (MMC5)
+
+// interleaves and reverses one row of 2 pattern planes into the 2bpp tile_pix format
+static inline uint16_t mapper_pat_row(uint8_t plane0, uint8_t plane1)
+{
+	uint32_t pat_planes = plane0 | (plane1 << 8);
+	pat_planes = (pat_planes & 0x0ff0) | ((pat_planes & 0xf000) >> 12) | ((pat_planes & 0x000f) << 12);
+	pat_planes = (pat_planes & 0x3c3c) | ((pat_planes & 0xc0c0) >> 6) | ((pat_planes & 0x0303) << 6);
+	pat_planes = (pat_planes & 0x6666) | ((pat_planes & 0x8888) >> 3) | ((pat_planes & 0x1111) << 3);
+	pat_planes = ((pat_planes & 0xaaaa) >> 1) | ((pat_planes & 0x5555) << 1);
+	return (uint16_t)pat_planes;
+}
+
+// maps a prg window of 2^size_log2 bytes starting at bank table entry b; bit 7 of the bank selects rom over ram
+static void mapper5_map_prg_window(nessys_t* nes, struct mapper5_data* m, uint b, uint8_t bank, uint size_log2)
+{
+	uint32_t offset = ((uint32_t)(bank & 0x7f) << MAPPER5_PRG_BANK_BASE_SIZE_LOG2) & ~((1 << size_log2) - 1);
+	uint i, num_banks = 1 << (size_log2 - NESSYS_PRG_BANK_SIZE_LOG2);
+
+	if (bank & 0x80) {
+		mapper_map_prg_window(nes, b, num_banks, offset);
+		return;
+	}
+	for (i = 0; i < num_banks; i++) {
+		mapper_map_prg_ram(nes, b + i, offset + (i << NESSYS_PRG_BANK_SIZE_LOG2), true);
+		m->prg_ram_windows |= 1 << (b + i - NESSYS_PRG_ROM_START_BANK);
+	}
+}
+
+static void mapper5_update_prg(nessys_t* nes, struct mapper5_data* m)
+{
+	m->prg_ram_windows = 0;
+	// 0x6000 is always ram
+	mapper_map_prg_ram(nes, NESSYS_PRG_RAM_START_BANK, (m->prg_bank[0] & 0x7) << NESSYS_PRG_BANK_SIZE_LOG2, true);
+	// 0xE000 is always rom
+	switch (m->prg_mode & 0x3) {
+	case 0:
+		mapper5_map_prg_window(nes, m, NESSYS_PRG_ROM_START_BANK, m->prg_bank[4] | 0x80, 15);
+		break;
+	case 1:
+		mapper5_map_prg_window(nes, m, NESSYS_PRG_ROM_START_BANK, m->prg_bank[2], 14);
+		mapper5_map_prg_window(nes, m, NESSYS_PRG_ROM_START_BANK + 2, m->prg_bank[4] | 0x80, 14);
+		break;
+	case 2:
+		mapper5_map_prg_window(nes, m, NESSYS_PRG_ROM_START_BANK, m->prg_bank[2], 14);
+		mapper5_map_prg_window(nes, m, NESSYS_PRG_ROM_START_BANK + 2, m->prg_bank[3], 13);
+		mapper5_map_prg_window(nes, m, NESSYS_PRG_ROM_START_BANK + 3, m->prg_bank[4] | 0x80, 13);
+		break;
+	default:
+		mapper5_map_prg_window(nes, m, NESSYS_PRG_ROM_START_BANK, m->prg_bank[1], 13);
+		mapper5_map_prg_window(nes, m, NESSYS_PRG_ROM_START_BANK + 1, m->prg_bank[2], 13);
+		mapper5_map_prg_window(nes, m, NESSYS_PRG_ROM_START_BANK + 2, m->prg_bank[3], 13);
+		mapper5_map_prg_window(nes, m, NESSYS_PRG_ROM_START_BANK + 3, m->prg_bank[4] | 0x80, 13);
+		break;
+	}
+}
+
+// maps the pattern tables from chr set A (0x5120-0x5127, 8 registers) or set B (0x5128-0x512B, repeated in both halves)
+// returns whether a window moved
+static bool mapper5_map_chr_set(nessys_t* nes, struct mapper5_data* m, bool set_b)
+{
+	uint mode = m->chr_mode & 0x3;
+	// registers used per window, and 1KB banks per window, shrink as the mode goes from 8KB to 1KB windows
+	uint window_size = 8 >> mode;
+	uint b, reg;
+	bool moved = false;
+
+	for (b = 0; b < 8; b += window_size) {
+		reg = (set_b) ? 8 + (((b & 0x3) | (window_size - 1)) & 0x3) : (b | (window_size - 1));
+		moved |= mapper_map_chr_window(nes, NESSYS_CHR_ROM_START_BANK + b, window_size,
+			(uint32_t)m->chr_bank[reg] << (NESSYS_CHR_BANK_SIZE_LOG2 + 3 - mode));
+	}
+	return moved;
+}
+
+// with 8x16 sprites, sprites use set A and the background uses set B; with 8x8 sprites, the last set written is used for both
+static bool mapper5_map_chr(nessys_t* nes, struct mapper5_data* m)
+{
+	return mapper5_map_chr_set(nes, m, !(nes->ppu.reg[0] & 0x20) && m->upper_reg_touched);
+}
+
+static void mapper5_map_ntb(nessys_t* nes, struct mapper5_data* m)
+{
+	uint i, b, sel;
+	uint8_t* ntb;
+
+	nes->ppu.ntb_mirror = MAPPER_MIRROR_NONE;
+	for (i = 0; i < 4; i++) {
+		sel = (m->ntb_map >> (2 * i)) & 0x3;
+		switch (sel) {
+		case 0: ntb = nes->ppu.mem; break;
+		case 1: ntb = nes->ppu.mem + 0x400; break;
+		case 2: ntb = m->mem + MAPPER5_ADDR_EXP_RAM_START_OFFSET; break;
+		default: ntb = m->mem + MAPPER5_ADDR_FILL_DATA_OFFSET; break;
+		}
+		for (b = NESSYS_CHR_NTB_START_BANK + i; b <= NESSYS_CHR_NTB_END_BANK; b += 4) {
+			nes->ppu.chr_rom_bank[b] = ntb;
+			// the fill nametable can't be written through the ppu
+			nes->ppu.chr_ram_bank[b] = (sel == 3) ? &nes->reg.pad0 : ntb;
+			nes->ppu.chr_ram_bank_mask[b] = (sel == 3) ? 0x0 : NESSYS_CHR_MEM_MASK;
+		}
+	}
+}
+
+// builds the fill mode nametable, so fill reads are ordinary nametable reads
+static void mapper5_update_fill(struct mapper5_data* m, uint8_t tile, uint8_t color)
+{
+	uint8_t* fill = m->mem + MAPPER5_ADDR_FILL_DATA_OFFSET;
+	memset(fill, tile, 0x3c0);
+	memset(fill + 0x3c0, (color & 0x3) * 0x55, 0x40);
+}
+
+static void mapper5_update_attrib_mode(nessys_t* nes, struct mapper5_data* m)
+{
+	nes->ppu.attrib_per_row = (m->exp_ram_mode == 1) || (m->vsplit_mode & 0x80);
+}
+
+// generates a tile row with extended attributes and/or the vertical split
+// with attrib_per_row set, draw_attrib_pix holds a palette for each tile rather than each 16 pixels
+static void mapper5_gen_tile_row(nessys_t* nes, struct mapper5_data* m, uint y)
+{
+	const uint8_t* exp_ram = m->mem + MAPPER5_ADDR_EXP_RAM_START_OFFSET;
+	uint16_t* tile_pix = nes->ppu.draw_tile_pix;
+	uint tile_base_addr, tile_addr, attr_addr;
+	uint tile_x, tile_y;
+	uint x, r, s, tile, pal, fine_y, line, split_y;
+	uint32_t pat_addr;
+	const uint8_t* pat;
+	bool ex_attr = (m->exp_ram_mode == 1);
+	bool split = (m->vsplit_mode & 0x80) != 0;
+	bool split_right = (m->vsplit_mode & 0x40) != 0;
+	uint split_tile = m->vsplit_mode & 0x1f;
+	bool in_split;
+
+	// same scrolled nametable addressing as nessys_gen_ntb_tile_pix
+	tile_x = nes->ppu.scroll[0];
+	tile_y = nes->ppu.scroll_y + y;
+	if (nes->ppu.scroll_y < NESSYS_PPU_SCANLINES_RENDERED && tile_y > NESSYS_PPU_SCANLINES_RENDERED) {
+		tile_y += 16;
+	}
+	tile_x |= (nes->ppu.reg[0] << 8) & 0x100;
+	tile_y |= (nes->ppu.reg[0] << 7) & 0x100;
+	tile_x &= 0x1f8;
+	tile_y &= 0x1f8;
+	tile_base_addr = NESSYS_CHR_NTB_WIN_MIN | ((tile_y << 3) & 0x800) | ((tile_y & 0xf8) << 2);
+	fine_y = (nes->ppu.scroll_y + y) & 0x7;
+
+	memset(nes->ppu.draw_attrib_pix, 0, NESSYS_PPU_ATTRIB_BYTES_PER_ROW);
+	for (x = 0; x < NESSYS_PPU_TILES_PER_ROW; x++) {
+		in_split = split && ((split_right) ? (x >= split_tile) : (x < split_tile));
+		if (in_split) {
+			// the split has its own vertical scroll, so its tile row boundaries don't line up with this row;
+			// fetch each of the 8 pixel rows for the screen line that will display it
+			for (s = 0; s < NESSYS_PPU_PIXEL_ROW_PER_TILE; s++) {
+				line = y + ((s - fine_y) & 0x7);
+				split_y = (line + m->vsplit_scroll) % NESSYS_PPU_SCANLINES_RENDERED;
+				tile = exp_ram[((split_y >> 3) << 5) | (x & 0x1f)];
+				pat_addr = ((uint32_t)m->vsplit_bank << 12) + (tile << 4) + (split_y & 0x7);
+				pat = nes->ppu.chr_rom_base + (pat_addr % nes->ppu.chr_rom_size);
+				tile_pix[s] = mapper_pat_row(pat[0], pat[8]);
+			}
+			split_y = (y + m->vsplit_scroll) % NESSYS_PPU_SCANLINES_RENDERED;
+			pal = exp_ram[0x3c0 | ((split_y >> 5) << 3) | ((x & 0x1f) >> 2)];
+			pal = (pal >> ((x & 0x2) | ((split_y & 0x10) >> 2))) & 0x3;
+		} else {
+			tile_addr = tile_base_addr | ((tile_x & 0xf8) >> 3);
+			tile_addr += ((tile_x << 2) & 0x400);
+			tile = *nessys_ppu_mem(nes, tile_addr);
+			if (ex_attr) {
+				// each tile picks its own 4KB chr bank and palette from exp ram
+				r = exp_ram[tile_addr & 0x3ff];
+				pat_addr = ((uint32_t)(((m->msb_chr_bank & 0x3) << 6) | (r & 0x3f)) << 12) + (tile << 4);
+				pat = nes->ppu.chr_rom_base + (pat_addr % nes->ppu.chr_rom_size);
+				for (s = 0; s < NESSYS_PPU_PIXEL_ROW_PER_TILE; s++) {
+					tile_pix[s] = mapper_pat_row(pat[s], pat[s | 0x8]);
+				}
+				pal = r >> 6;
+			} else {
+				pat_addr = (tile << 4) | ((nes->ppu.reg[0] & 0x10) << 8);
+				for (s = 0; s < NESSYS_PPU_PIXEL_ROW_PER_TILE; s++) {
+					tile_pix[s] = mapper_pat_row(*nessys_ppu_mem(nes, pat_addr | s), *nessys_ppu_mem(nes, pat_addr | s | 0x8));
+				}
+				attr_addr = NESSYS_CHR_NTB_WIN_MIN | 0x3c0 | ((tile_y & 0xe0) >> 2) | ((tile_y << 3) & 0x800);
+				attr_addr |= ((tile_x & 0xe0) >> 5) | ((tile_x << 2) & 0x400);
+				pal = (*nessys_ppu_mem(nes, attr_addr) >> (((tile_x & 0x10) >> 3) | ((tile_y & 0x10) >> 2))) & 0x3;
+			}
+		}
+		tile_pix += NESSYS_PPU_PIXEL_ROW_PER_TILE;
+
+		// 2 bits per tile, 4 tiles to a byte, in the same order as the tile pixels
+		nes->ppu.draw_attrib_pix[x >> 2] |= pal << ((x & 0x3) << 1);
+		tile_x += 8;
+	}
+}
+
+static bool mapper5_bg_setup(nessys_t* nes, uint y)
+{
+	struct mapper5_data* m = (struct mapper5_data*)nes->mapper_data;
+	bool sprites_8x16 = (nes->ppu.reg[0] & 0x20) != 0;
+
+	if (sprites_8x16) mapper5_map_chr_set(nes, m, true);
+	if (nes->ppu.attrib_per_row) {
+		mapper5_gen_tile_row(nes, m, y);
+	} else {
+		nessys_gen_ntb_tile_pix(nes, y);
+	}
+	// leave the sprite banks mapped for sprite and $2007 fetches
+	if (sprites_8x16) mapper5_map_chr_set(nes, m, false);
+	return true;
+}
+
+static bool mapper5_line_start(nessys_t* nes)
+{
+	struct mapper5_data* m = (struct mapper5_data*)nes->mapper_data;
+	uint line;
+
+	nes->mapper_event_scan_clk = ~0;
+	if (!(nes->ppu.reg[1] & 0x18) || nes->scan_line < NESSYS_PPU_SCANLINES_START_RENDER ||
+		nes->scan_line >= NESSYS_PPU_SCANLINES_START_RENDER + NESSYS_PPU_SCANLINES_RENDERED) {
+		// out of frame
+		m->scanline_irq_status &= ~0x40;
+		return false;
+	}
+	m->scanline_irq_status |= 0x40;
+	line = nes->scan_line - NESSYS_PPU_SCANLINES_START_RENDER;
+	if (line != 0 && line == m->scanline_irq_cmp) {
+		nes->mapper_event_scan_clk = MAPPER5_IRQ_SCAN_CLK;
+		return true;
+	}
+	return false;
+}
+
+static void mapper5_irq_event(nessys_t* nes)
+{
+	struct mapper5_data* m = (struct mapper5_data*)nes->mapper_data;
+	m->scanline_irq_status |= 0x80;
+	if (m->scanline_irq_enable) nes->mapper_irq = true;
+}
+
+static uint8_t* mapper5_read(nessys_t* nes, uint16_t addr)
+{
+	struct mapper5_data* m = (struct mapper5_data*)nes->mapper_data;
+	uint32_t offset = addr - NESSYS_APU_WIN_MIN;
+	uint16_t product;
+
+	if (offset >= MAPPER5_ADDR_EXP_RAM_START_OFFSET) {
+		// exp ram is only readable in modes 2 and 3
+		return (m->exp_ram_mode & 0x2) ? m->mem + offset : &nes->reg.pad0;
+	}
+	if (offset == MAPPER5_ADDR_SCANLINE_IRQ_STATUS_OFFSET) {
+		// reading acknowledges the irq
+		m->mem[offset] = m->scanline_irq_status;
+		m->scanline_irq_status &= ~0x80;
+		nes->mapper_irq = false;
+		return m->mem + offset;
+	}
+	if (offset == MAPPER5_ADDR_MULT0_OFFSET || offset == MAPPER5_ADDR_MULT1_OFFSET) {
+		product = m->mult[0] * m->mult[1];
+		m->mem[offset] = (offset == MAPPER5_ADDR_MULT0_OFFSET) ? (uint8_t)product : (uint8_t)(product >> 8);
+		return m->mem + offset;
+	}
+	return NULL;
+}
+
+bool mapper5_init(nessys_t* nes)
+{
+	struct mapper5_data* data;
+	uint i;
+
+	if (nes->ppu.chr_rom_base == NULL) return false;
+	data = alloc_aux(nes, sizeof(struct mapper5_data));
+	if (data == NULL) return false;
+	memset(data, 0, sizeof(struct mapper5_data));
+	data->prg_mode = 3;
+	data->chr_mode = 3;
+	data->prg_bank[4] = 0xff;
+	for (i = 0; i < 8; i++) data->chr_bank[i] = i;
+	data->ntb_map = (nes->ppu.name_tbl_vert_mirror) ? 0x44 : 0x50;
+	nes->mapper_data = data;
+	nes->mapper_read = mapper5_read;
+	nes->mapper_write = mapper5_write;
+	nes->mapper_bg_setup = mapper5_bg_setup;
+	nes->mapper_update = mapper5_line_start;
+	nes->mapper_event = mapper5_irq_event;
+	mapper5_update_prg(nes, data);
+	mapper5_map_chr(nes, data);
+	mapper5_map_ntb(nes, data);
+	mapper5_update_fill(data, 0, 0);
+	mapper5_update_attrib_mode(nes, data);
+	return true;
+}
+
+// the pulse and pcm registers at 0x5000-0x5015 are accepted but not played
+bool mapper5_write(nessys_t* nes, uint16_t addr, uint8_t data)
+{
+	struct mapper5_data* m = (struct mapper5_data*)nes->mapper_data;
+	uint32_t offset;
+	uint b;
+
+	if (addr >= NESSYS_PRG_ROM_START) {
+		// prg ram can be mapped into the rom windows
+		b = addr >> NESSYS_PRG_BANK_SIZE_LOG2;
+		if (m->prg_ram_windows & (1 << (b - NESSYS_PRG_ROM_START_BANK))) {
+			*((uint8_t*)nes->prg_rom_bank[b] + (addr & nes->prg_rom_bank_mask[b])) = data;
+			nessave_mark(nes->prg_rom_bank[b] + (addr & nes->prg_rom_bank_mask[b]));
+		}
+		return false;
+	}
+
+	offset = addr - NESSYS_APU_WIN_MIN;
+	if (offset >= MAPPER5_ADDR_EXP_RAM_START_OFFSET) {
+		if (m->exp_ram_mode != 3) m->mem[offset] = data;
+		return false;
+	}
+	if (offset >= MAPPER5_ADDR_CHR_BANK0_OFFSET && offset <= MAPPER5_ADDR_CHR_BANKB_OFFSET) {
+		m->chr_bank[offset - MAPPER5_ADDR_CHR_BANK0_OFFSET] = data | ((m->msb_chr_bank & 0x3) << 8);
+		m->upper_reg_touched = (offset >= MAPPER5_ADDR_CHR_BANK8_OFFSET);
+		if (mapper5_map_chr(nes, m)) mapper_chr_changed(nes);
+		return true;
+	}
+	if (offset >= MAPPER5_ADDR_PRG_BANK0_OFFSET && offset <= MAPPER5_ADDR_PRG_BANK4_OFFSET) {
+		// 0x5113 selects the prg ram bank at 0x6000, followed by the 4 prg bank registers
+		m->prg_bank[offset - MAPPER5_ADDR_PRG_BANK0_OFFSET] = data;
+		mapper5_update_prg(nes, m);
+		return true;
+	}
+	if (offset == MAPPER5_ADDR_PRG_MODE_OFFSET) {
+		m->prg_mode = data & 0x3;
+		mapper5_update_prg(nes, m);
+	} else if (offset == MAPPER5_ADDR_CHR_MODE_OFFSET) {
+		m->chr_mode = data & 0x3;
+		if (mapper5_map_chr(nes, m)) mapper_chr_changed(nes);
+	} else if (offset == MAPPER5_ADDR_PRG_RAM_PROTECT1_OFFSET) {
+		// kept, but writes aren't blocked
+		m->prg_ram_protect1 = data;
+	} else if (offset == MAPPER5_ADDR_PRG_RAM_PROTECT2_OFFSET) {
+		m->prg_ram_protect2 = data;
+	} else if (offset == MAPPER5_ADDR_EXP_RAM_MODE_OFFSET) {
+		m->exp_ram_mode = data & 0x3;
+		mapper5_update_attrib_mode(nes, m);
+	} else if (offset == MAPPER5_ADDR_NTB_MAP_OFFSET) {
+		m->ntb_map = data;
+		mapper5_map_ntb(nes, m);
+	} else if (offset == MAPPER5_ADDR_FILL_MODE_TILE_OFFSET) {
+		m->mem[offset] = data;
+		mapper5_update_fill(m, data, m->mem[MAPPER5_ADDR_FILL_MODE_COLOR_OFFSET]);
+	} else if (offset == MAPPER5_ADDR_FILL_MODE_COLOR_OFFSET) {
+		m->mem[offset] = data;
+		mapper5_update_fill(m, m->mem[MAPPER5_ADDR_FILL_MODE_TILE_OFFSET], data);
+	} else if (offset == MAPPER5_ADDR_UPPER_CHR_BANK_OFFSET) {
+		m->msb_chr_bank = data & 0x3;
+	} else if (offset == MAPPER5_ADDR_VSPLIT_MODE_OFFSET) {
+		m->vsplit_mode = data;
+		mapper5_update_attrib_mode(nes, m);
+	} else if (offset == MAPPER5_ADDR_VSPLIT_SCROLL_OFFSET) {
+		m->vsplit_scroll = data;
+	} else if (offset == MAPPER5_ADDR_VSPLIT_BANK_OFFSET) {
+		m->vsplit_bank = data;
+	} else if (offset == MAPPER5_ADDR_SCANLINE_IRQ_CMP_OFFSET) {
+		m->scanline_irq_cmp = data;
+	} else if (offset == MAPPER5_ADDR_SCANLINE_IRQ_STATUS_OFFSET) {
+		m->scanline_irq_enable = data & 0x80;
+		nes->mapper_irq = m->scanline_irq_enable && (m->scanline_irq_status & 0x80);
+		nessys_update_events(nes);
+	} else if (offset == MAPPER5_ADDR_MULT0_OFFSET) {
+		m->mult[0] = data;
+	} else if (offset == MAPPER5_ADDR_MULT1_OFFSET) {
+		m->mult[1] = data;
+	}
+	return false;
+}
+
+// ------------------------------------------------------------
+// mapper 9 (MMC2)
+
+// maps each 4KB pattern table from the bank its latch selects; returns whether a window moved
+static bool mapper9_map_chr(nessys_t* nes, struct mapper9_data* m)
+{
+	uint half;
+	bool moved = false;
+
+	for (half = 0; half < 2; half++) {
+		moved |= mapper_map_chr_window(nes, NESSYS_CHR_ROM_START_BANK + 4 * half, 4,
+			(uint32_t)(m->chr_bank[2 * half + m->latch[half]] & MAPPER9_CHR_BANK_BITS) << MAPPER9_CHR_BANK_SIZE_LOG2);
+	}
+	return moved;
+}
+
+// the latch flips when the ppu fetches tile $FD or $FE, which would mean a check on every pattern fetch;
+// instead, find the latch tiles in the row's nametable entries, and generate the row in segments between them
+static bool mapper9_bg_setup(nessys_t* nes, uint y)
+{
+	struct mapper9_data* m = (struct mapper9_data*)nes->mapper_data;
+	uint half = (nes->ppu.reg[0] & 0x10) ? 1 : 0;
+	uint tile_base_addr, tile_addr, tile_x, tile_y;
+	uint x, tile, first = 0;
+
+	// same scrolled nametable addressing as nessys_gen_ntb_tile_range
+	tile_x = nes->ppu.scroll[0];
+	tile_y = nes->ppu.scroll_y + y;
+	if (nes->ppu.scroll_y < NESSYS_PPU_SCANLINES_RENDERED && tile_y > NESSYS_PPU_SCANLINES_RENDERED) {
+		tile_y += 16;
+	}
+	tile_x |= (nes->ppu.reg[0] << 8) & 0x100;
+	tile_y |= (nes->ppu.reg[0] << 7) & 0x100;
+	tile_x &= 0x1f8;
+	tile_y &= 0x1f8;
+	tile_base_addr = NESSYS_CHR_NTB_WIN_MIN | ((tile_y << 3) & 0x800) | ((tile_y & 0xf8) << 2);
+
+	for (x = 0; x < NESSYS_PPU_TILES_PER_ROW; x++) {
+		tile_addr = tile_base_addr | ((tile_x & 0xf8) >> 3);
+		tile_addr += ((tile_x << 2) & 0x400);
+		tile = *nessys_ppu_mem(nes, tile_addr);
+		if ((tile == 0xfd || tile == 0xfe) && m->latch[half] != tile - 0xfd) {
+			// the latch tile itself is fetched from the old bank; the switch applies from the next tile
+			nessys_gen_ntb_tile_range(nes, y, first, x + 1);
+			m->latch[half] = tile - 0xfd;
+			mapper9_map_chr(nes, m);
+			first = x + 1;
+		}
+		tile_x += 8;
+	}
+	if (first < NESSYS_PPU_TILES_PER_ROW) nessys_gen_ntb_tile_range(nes, y, first, NESSYS_PPU_TILES_PER_ROW);
+	// sprite pixels fetched from this pattern table need regenerating too
+	if (first && half == ((nes->ppu.reg[0] >> 3) & 0x1)) mapper_chr_changed(nes);
+	return true;
+}
+
+bool mapper9_init(nessys_t* nes)
+{
+	struct mapper9_data* data = alloc_aux(nes, sizeof(struct mapper9_data));
+	if (data == NULL) return false;
+	memset(data, 0, sizeof(struct mapper9_data));
+	data->latch[0] = 1;
+	data->latch[1] = 1;
+	nes->mapper_data = data;
+	nes->mapper_write = mapper9_write;
+	nes->mapper_bg_setup = mapper9_bg_setup;
+	// 0xA000-0xFFFF stay fixed to the last 3 banks of the default map
+	mapper_map_prg(nes, NESSYS_PRG_ROM_START_BANK, 0);
+	mapper9_map_chr(nes, data);
+	return true;
+}
+
+bool mapper9_write(nessys_t* nes, uint16_t addr, uint8_t data)
+{
+	struct mapper9_data* m = (struct mapper9_data*)nes->mapper_data;
+
+	addr &= MAPPER9_ADDR_MASK;
+	if (addr == MAPPER9_ADDR_PRG_ROM_BANK) {
+		m->prg_bank = data & MAPPER9_PRG_BANK_BITS;
+		mapper_map_prg(nes, NESSYS_PRG_ROM_START_BANK, (uint32_t)m->prg_bank << MAPPER9_PRG_BANK_SIZE_LOG2);
+	} else if (addr >= MAPPER9_ADDR_CHR_ROM_BANK0 && addr <= MAPPER9_ADDR_CHR_ROM_BANK3) {
+		m->chr_bank[(addr - MAPPER9_ADDR_CHR_ROM_BANK0) >> 12] = data & MAPPER9_CHR_BANK_BITS;
+		if (mapper9_map_chr(nes, m)) mapper_chr_changed(nes);
+	} else if (addr == MAPPER9_ADDR_MIRROR) {
+		m->mirror = data & MAPPER9_MIRROR_BITS;
+		mapper_map_ntb(nes, (m->mirror == MAPPER9_MIRROR_MODE_HORIZONTAL) ? MAPPER_MIRROR_HORIZ : MAPPER_MIRROR_VERT);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// ------------------------------------------------------------
+// mapper 69 (Sunsoft FME-7, and the 5B audio it's paired with)
+
+// 5B volume steps are 3dB apart; all 3 channels at full scale add ~12300 onto the 65535 apu mix, a little more than
+// one apu pulse channel at full volume, and nessys_gen_sound saturates the sum
+static const int16_t MAPPER69_AUDIO_VOLUME[16] = {
+	0, 32, 45, 64, 90, 128, 181, 256, 362, 512, 724, 1024, 1448, 2048, 2896, 4095
+};
+
+// bit 6 of the 0x6000 bank selects ram over rom; bit 7 enables the ram
+static void mapper69_map_prg0(nessys_t* nes, struct mapper69_data* m)
+{
+	uint8_t bank = m->prg_bank[0];
+	uint32_t offset = (uint32_t)(bank & MAPPER69_PRG_BANK_BITS) << MAPPER69_PRG_BANK_SIZE_LOG2;
+
+	if (bank & MAPPER69_PRG_BANK0_RAM_SELECT) {
+		mapper_map_prg_ram(nes, NESSYS_PRG_RAM_START_BANK, offset, (bank & MAPPER69_PRG_BANK0_RAM_ENABLE) != 0);
+		nes->mapper_flags &= ~NESSYS_MAPPER_FLAG_PRG_RAM_READ_ONLY;
+	} else {
+		// stores to 0x6000 normally go straight through the bank pointer, which must not reach rom
+		mapper_map_prg(nes, NESSYS_PRG_RAM_START_BANK, offset);
+		nes->mapper_flags |= NESSYS_MAPPER_FLAG_PRG_RAM_READ_ONLY;
+	}
+}
+
+// the irq counter is decremented every cpu clock; rather than doing that per instruction, the ppu clock it will
+// underflow at is kept, and the counter value is only worked out when it's written
+static inline uint32_t mapper69_now(nessys_t* nes)
+{
+	return nes->line_start_clk + nes->scan_clk;
+}
+
+// brings irq_counter up to date, if the counter is running
+static void mapper69_sync_counter(nessys_t* nes, struct mapper69_data* m)
+{
+	int32_t dt;
+	if (!(m->flags & MAPPER69_FLAGS_IRQ_COUNTER_ENABLE)) return;
+	dt = (int32_t)(m->irq_clk - mapper69_now(nes));
+	// an underflow due in the middle of the current instruction hasn't been processed yet
+	if (dt < 0) dt = 0;
+	m->irq_counter = (uint16_t)(dt / NESSYS_PPU_PER_CPU_CLK - 1);
+}
+
+// schedules the irq event if the underflow lands in the current scan line
+static bool mapper69_schedule(nessys_t* nes, struct mapper69_data* m)
+{
+	int32_t dt;
+
+	nes->mapper_event_scan_clk = ~0;
+	if (!(m->flags & MAPPER69_FLAGS_IRQ_COUNTER_ENABLE)) return false;
+	dt = (int32_t)(m->irq_clk - nes->line_start_clk);
+	if (dt >= NESSYS_PPU_CLK_PER_SCANLINE) return false;
+	nes->mapper_event_scan_clk = (dt < 0) ? 0 : dt;
+	return true;
+}
+
+static bool mapper69_line_start(nessys_t* nes)
+{
+	return mapper69_schedule(nes, (struct mapper69_data*)nes->mapper_data);
+}
+
+static void mapper69_irq_event(nessys_t* nes)
+{
+	struct mapper69_data* m = (struct mapper69_data*)nes->mapper_data;
+
+	if (m->flags & MAPPER69_FLAGS_IRQ_ENABLE) nes->mapper_irq = true;
+	// the counter wraps around to 0xFFFF and keeps going
+	m->irq_clk += 0x10000 * NESSYS_PPU_PER_CPU_CLK;
+	mapper69_schedule(nes, m);
+}
+
+// generates one sample of the 3 tone channels; called from nessys_gen_sound, and steps by the same
+// fixed point cpu clocks per sample as the apu channels
+static int16_t mapper69_gen_sound(nessys_t* nes)
+{
+	struct mapper69_data* m = (struct mapper69_data*)nes->mapper_data;
+	mapper69_square_t* sq;
+	uint32_t step;
+	int32_t out = 0;
+	uint c;
+
+	for (c = 0; c < MAPPER69_AUDIO_CHANNELS; c++) {
+		sq = &m->square[c];
+		// a period of 0 behaves like 1
+		step = ((uint32_t)(sq->period ? sq->period : 1)) << (NESSYS_SND_APU_FRAC_LOG2 + MAPPER69_AUDIO_TONE_CLK_LOG2);
+		sq->cur_time_frac += nes->apu.cpu_frac_per_sample;
+		while (sq->cur_time_frac >= step) {
+			sq->cur_time_frac -= step;
+			sq->phase ^= 1;
+		}
+		// mixer bits are active low tone enables; a disabled tone holds its output high
+		if (sq->phase || (m->audio_mixer & (1 << c))) out += MAPPER69_AUDIO_VOLUME[sq->volume];
+	}
+	return (int16_t)out;
+}
+
+static void mapper69_audio_write(nessys_t* nes, struct mapper69_data* m, uint8_t data)
+{
+	uint8_t r = m->audio_select;
+	mapper69_square_t* sq;
+
+	// play out the samples due before the change
+	nessys_gen_sound(nes);
+	if (r < 2 * MAPPER69_AUDIO_CHANNELS) {
+		sq = &m->square[r >> 1];
+		if (r & 0x1) {
+			sq->period = (sq->period & 0x0FF) | ((uint16_t)(data & 0xF) << 8);
+		} else {
+			sq->period = (sq->period & 0xF00) | data;
+		}
+	} else if (r == MAPPER69_AUDIO_REG_MIXER) {
+		m->audio_mixer = data;
+	} else if (r >= MAPPER69_AUDIO_REG_VOLUME && r < MAPPER69_AUDIO_REG_VOLUME + MAPPER69_AUDIO_CHANNELS) {
+		m->square[r - MAPPER69_AUDIO_REG_VOLUME].volume = data & MAPPER69_AUDIO_VOLUME_BITS;
+	}
+	// the noise and envelope registers are accepted, but not emulated
+}
+
+bool mapper69_init(nessys_t* nes)
+{
+	struct mapper69_data* data = alloc_aux(nes, sizeof(struct mapper69_data));
+	if (data == NULL) return false;
+	memset(data, 0, sizeof(struct mapper69_data));
+	// tones start disabled
+	data->audio_mixer = 0xFF;
+	nes->mapper_data = data;
+	nes->mapper_write = mapper69_write;
+	nes->mapper_update = mapper69_line_start;
+	nes->mapper_event = mapper69_irq_event;
+	nes->mapper_gen_sound = mapper69_gen_sound;
+	// 0x8000-0xFFFF start from the default map; 0xE000 stays fixed to the last bank
+	mapper69_map_prg0(nes, data);
+	return true;
+}
+
+bool mapper69_write(nessys_t* nes, uint16_t addr, uint8_t data)
+{
+	struct mapper69_data* m = (struct mapper69_data*)nes->mapper_data;
+	uint8_t cmd;
+
+	addr &= MAPPER69_ADDR_MASK;
+	if (addr == MAPPER69_ADDR_COMMAND) {
+		m->command = data & 0xF;
+	} else if (addr == MAPPER69_ADDR_PARAMETER) {
+		cmd = m->command;
+		if (cmd < MAPPER69_COMMAND_PRG_BANK0) {
+			m->chr_bank[cmd] = data;
+			if (mapper_map_chr(nes, NESSYS_CHR_ROM_START_BANK + cmd, (uint32_t)data << MAPPER69_CHR_BANK_SIZE_LOG2)) mapper_chr_changed(nes);
+		} else if (cmd == MAPPER69_COMMAND_PRG_BANK0) {
+			m->prg_bank[0] = data;
+			mapper69_map_prg0(nes, m);
+		} else if (cmd < MAPPER69_COMMAND_MIRROR) {
+			m->prg_bank[cmd - MAPPER69_COMMAND_PRG_BANK0] = data;
+			mapper_map_prg(nes, NESSYS_PRG_RAM_START_BANK + cmd - MAPPER69_COMMAND_PRG_BANK0,
+				(uint32_t)(data & MAPPER69_PRG_BANK_BITS) << MAPPER69_PRG_BANK_SIZE_LOG2);
+		} else if (cmd == MAPPER69_COMMAND_MIRROR) {
+			m->flags = (m->flags & ~MAPPER69_FLAGS_MIRROR_MODE) | ((data & 0x3) << MAPPER69_MIRROR_MODE_SHIFT);
+			// vertical, horizontal, lower, upper; the common modes are in the order lower, upper, vertical, horizontal
+			mapper_map_ntb(nes, (data + 2) & 0x3);
+		} else {
+			// counter and irq control; work out where the counter is before changing it
+			mapper69_sync_counter(nes, m);
+			if (cmd == MAPPER69_COMMAND_IRQ_CONTROL) {
+				m->flags = (m->flags & MAPPER69_FLAGS_MIRROR_MODE) |
+					(data & (MAPPER69_FLAGS_IRQ_ENABLE | MAPPER69_FLAGS_IRQ_COUNTER_ENABLE));
+				// any write acknowledges a pending irq
+				nes->mapper_irq = false;
+			} else if (cmd == MAPPER69_COMMAND_IRQ_COUNTER_LOW) {
+				m->irq_counter = (m->irq_counter & 0xFF00) | data;
+			} else {
+				m->irq_counter = (m->irq_counter & 0x00FF) | ((uint16_t)data << 8);
+			}
+			m->irq_clk = mapper69_now(nes) + ((uint32_t)m->irq_counter + 1) * NESSYS_PPU_PER_CPU_CLK;
+			mapper69_schedule(nes, m);
+			nessys_update_events(nes);
+		}
+	} else if (addr == MAPPER69_ADDR_AUDIO_SELECT) {
+		m->audio_select = data & 0xF;
+	} else {
+		mapper69_audio_write(nes, m, data);
+	}
+	return true;
+}
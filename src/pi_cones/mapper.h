@@ -24,6 +24,25 @@ inline uint8_t nes_get_mask(uint8_t n)
 	return mask;
 }
 
+// ------------------------------------------------------------
+// common mapper helpers
+
+// nametable arrangements selectable by mappers
+#define MAPPER_MIRROR_ONE_LOWER 0
+#define MAPPER_MIRROR_ONE_UPPER 1
+#define MAPPER_MIRROR_VERT 2
+#define MAPPER_MIRROR_HORIZ 3
+// set by mappers that lay out the nametables themselves, so the next mapper_map_ntb isn't skipped
+#define MAPPER_MIRROR_NONE 0xFF
+
+void mapper_map_prg(nessys_t* nes, uint b, uint32_t offset);
+void mapper_map_prg_window(nessys_t* nes, uint b, uint count, uint32_t offset);
+void mapper_map_prg_ram(nessys_t* nes, uint b, uint32_t offset, bool enable);
+bool mapper_map_chr(nessys_t* nes, uint b, uint32_t offset);
+bool mapper_map_chr_window(nessys_t* nes, uint b, uint count, uint32_t offset);
+void mapper_map_ntb(nessys_t* nes, uint8_t mirror);
+void mapper_chr_changed(nessys_t* nes);
+
 // ------------------------------------------------------------
 // mapper 1 structs/constants
 
@@ -45,6 +64,7 @@ static const uint8_t MAPPER1_SHIFT_REG_RESET = 0x10;
 struct mapper1_data {
 	uint8_t shift_reg;
 	uint8_t pad0[3];
+	uint32_t write_clk;  // ppu clock (same base as line_start_clk) of the last register write
 	uint8_t control;
 	uint8_t chr_bank0;
 	uint8_t chr_bank1;
@@ -52,26 +72,41 @@ struct mapper1_data {
 	uint8_t prg_ram_bank;
 };
 
-// ------------------------------------------------------------
-// mapper 2 structs/constants
-
-static const uint8_t MAPPER2_PRG_BANK_SIZE_LOG2 = 14;
-static const uint32_t MAPPER2_PRG_BANK_MASK = (1 << MAPPER2_PRG_BANK_SIZE_LOG2) - 1;
-
-struct mapper2_data {
-	uint8_t prg_bank;
-};
+bool mapper1_init(nessys_t* nes);
+bool mapper1_write(nessys_t* nes, uint16_t addr, uint8_t data);
 
 // ------------------------------------------------------------
-// mapper 3 structs/constants
-
-static const uint8_t MAPPER3_CHR_BANK_SIZE_LOG2 = 13;
-static const uint32_t MAPPER3_CHR_BANK_MASK = (1 << MAPPER3_CHR_BANK_SIZE_LOG2) - 1;
-
-struct mapper3_data {
-	uint8_t chr_bank;
+// discrete logic mappers (2, 3, 7, 71, 180)
+// these only latch a written value to select which bank fills a fixed size window, so one engine driven
+// by a descriptor per mapper handles all of them
+
+#define MAPPER_DISCRETE_MAX_REGS 2
+
+typedef struct {
+	uint16_t addr_mask;      // register is written when (addr & addr_mask) == addr_match
+	uint16_t addr_match;
+	uint8_t bank_bits;       // data bits selecting the bank, 0 for a mirroring only register
+	uint8_t bank_size_log2;  // size of the switched window
+	uint8_t window;          // first bank table entry (8KB prg, or 1KB chr) of the window
+	uint8_t chr;             // window is in the ppu pattern tables instead of prg
+	uint8_t mirror_bit;      // data bit selecting one screen upper/lower, 0 if the register doesn't control mirroring
+} mapper_discrete_reg_t;
+
+typedef struct {
+	uint16_t mapper_id;
+	uint8_t num_regs;
+	uint8_t fixed_first;     // 16KB prg window fixed to the first bank, 0 if none (otherwise the last 32KB stays mapped)
+	mapper_discrete_reg_t reg[MAPPER_DISCRETE_MAX_REGS];
+} mapper_discrete_t;
+
+struct mapper_discrete_data {
+	const mapper_discrete_t* desc;
+	uint8_t value[MAPPER_DISCRETE_MAX_REGS];
 };
 
+bool mapper_discrete_init(nessys_t* nes, uint16_t mapper_id);
+bool mapper_discrete_write(nessys_t* nes, uint16_t addr, uint8_t data);
+
 // ------------------------------------------------------------
 // mapper 4 struct/constants
 
@@ -106,6 +141,14 @@ struct mapper4_data {
 	uint8_t last_upper_ppu_addr;
 };
 
+// the irq counter is clocked by ppu A12 rising; rather than watching pattern fetches, the edge is placed once per
+// rendered scan line at the dot it happens for the table layout selected in $2000
+static const uint MAPPER4_IRQ_SCAN_CLK_SPRITE_FETCH = 260;  // bg at $0000, sprites at $1000
+static const uint MAPPER4_IRQ_SCAN_CLK_BG_FETCH = 324;      // bg at $1000, sprites at $0000; next line's tile prefetch
+
+bool mapper4_init(nessys_t* nes);
+bool mapper4_write(nessys_t* nes, uint16_t addr, uint8_t data);
+
 // ------------------------------------------------------------
 // mapper 5 struct/constants
 
@@ -214,8 +257,9 @@ static const uint32_t MAPPER5_ADDR_EXP_RAM_START = NESSYS_APU_WIN_MIN + MAPPER5_
 
 static const uint32_t MAPPER5_EXP_RAM_SIZE = 0x400;
 
-static const uint32_t MAPPER5_MEM_SIZE_LOG2 = 13;  // 8 KB
-static const uint32_t MAPPER5_MEM_SIZE = 1 << MAPPER5_MEM_SIZE_LOG2;
+// defines, since C needs a constant expression for the array size
+#define MAPPER5_MEM_SIZE_LOG2 13  // 8 KB
+#define MAPPER5_MEM_SIZE (1 << MAPPER5_MEM_SIZE_LOG2)
 
 static const uint32_t MAPPER5_PRG_BANK_BASE_SIZE_LOG2 = 13;  // 8 KB
 static const uint32_t MAPPER5_CHR_BANK_BASE_SIZE_LOG2 = 10;  // 1 KB
@@ -253,20 +297,15 @@ struct mapper5_data {
 	uint16_t scroll_save_y;
 	nessys_apu_pulse_t pulse[2];
 	bool exp_surf_dirty;
+	uint8_t scanline_irq_enable;
+	uint8_t prg_ram_windows;  // bit per 8KB window at 0x8000-0xFFFF that maps prg ram
 };
 
-// ------------------------------------------------------------
-// mapper 7 struct/constants
-
-static const uint8_t MAPPER7_PRG_BANK_SIZE_LOG2 = 15;
-static const uint32_t MAPPER7_PRG_BANK_MASK = (1 << MAPPER7_PRG_BANK_SIZE_LOG2) - 1;
+// scan_clk at which the scanline irq fires on the matching line
+static const uint MAPPER5_IRQ_SCAN_CLK = 4;
 
-static const uint8_t MAPPER7_PRG_BANK_BITS = 0x7;
-static const uint8_t MAPPER7_NTB_SELECT = 0x10;
-
-struct mapper7_data {
-	uint8_t bank;
-};
+bool mapper5_init(nessys_t* nes);
+bool mapper5_write(nessys_t* nes, uint16_t addr, uint8_t data);
 
 // ------------------------------------------------------------
 // mapper 9 struct/constants
@@ -296,8 +335,12 @@ struct mapper9_data {
 	uint8_t prg_bank;
 	uint8_t chr_bank[4];
 	uint8_t mirror;
+	uint8_t latch[2];  // per 4KB pattern table; 0 after fetching tile $FD, 1 after $FE
 };
 
+bool mapper9_init(nessys_t* nes);
+bool mapper9_write(nessys_t* nes, uint16_t addr, uint8_t data);
+
 // ------------------------------------------------------------
 // mapper 69 struct/constants
 
@@ -322,42 +365,46 @@ static const uint8_t MAPPER69_MIRROR_MODE_ONE_SCREEN_LOWER = 0x20;
 static const uint8_t MAPPER69_MIRROR_MODE_ONE_SCREEN_UPPER = 0x30;
 
 static const uint8_t MAPPER69_PRG_BANK0_RAM_SELECT = 0x40;
+static const uint8_t MAPPER69_PRG_BANK0_RAM_ENABLE = 0x80;
+static const uint8_t MAPPER69_PRG_BANK_BITS = 0x3F;
+
+static const uint8_t MAPPER69_COMMAND_PRG_BANK0 = 0x8;
+static const uint8_t MAPPER69_COMMAND_MIRROR = 0xC;
+static const uint8_t MAPPER69_COMMAND_IRQ_CONTROL = 0xD;
+static const uint8_t MAPPER69_COMMAND_IRQ_COUNTER_LOW = 0xE;
+static const uint8_t MAPPER69_COMMAND_IRQ_COUNTER_HIGH = 0xF;
+
+// 5B audio (a YM2149F subset); register select at 0xC000, data at 0xE000
+static const uint16_t MAPPER69_ADDR_AUDIO_SELECT = 0xC000;
+static const uint16_t MAPPER69_ADDR_AUDIO_DATA = 0xE000;
+
+#define MAPPER69_AUDIO_CHANNELS 3
+static const uint8_t MAPPER69_AUDIO_REG_MIXER = 0x07;
+static const uint8_t MAPPER69_AUDIO_REG_VOLUME = 0x08;
+static const uint8_t MAPPER69_AUDIO_VOLUME_BITS = 0x0F;
+// each tone output flips every 16 * period cpu clocks
+static const uint8_t MAPPER69_AUDIO_TONE_CLK_LOG2 = 4;
+
+typedef struct {
+	uint16_t period;
+	uint8_t volume;
+	uint8_t phase;
+	uint32_t cur_time_frac;  // cpu clocks since the last flip, in the apu's fixed point
+} mapper69_square_t;
 
 struct mapper69_data {
 	uint8_t command;
 	uint8_t flags;
-	uint16_t irq_counter;
+	uint16_t irq_counter;  // only current while the counter is stopped; see irq_clk
+	uint32_t irq_clk;      // ppu clock (same base as line_start_clk) the running counter underflows at
 	uint8_t prg_bank[4];
 	uint8_t chr_bank[8];
+	uint8_t audio_select;
+	uint8_t audio_mixer;
+	mapper69_square_t square[MAPPER69_AUDIO_CHANNELS];
 };
 
-// ------------------------------------------------------------
-// mapper 71 structs/constants
-
-static const uint16_t MAPPER71_ADDR_MASK = 0xF000;
-
-static const uint16_t MAPPER71_ADDR_MIRROR = 0x9000;
-static const uint16_t MAPPER71_ADDR_BANK_SEL0 = 0xC000;
-static const uint16_t MAPPER71_ADDR_BANK_SEL1 = 0xD000;
-static const uint16_t MAPPER71_ADDR_BANK_SEL2 = 0xE000;
-static const uint16_t MAPPER71_ADDR_BANK_SEL3 = 0xF000;
-
-static const uint8_t MAPPER71_PRG_BANK_SIZE_LOG2 = 14;
-static const uint32_t MAPPER71_PRG_BANK_MASK = (1 << MAPPER71_PRG_BANK_SIZE_LOG2) - 1;
-
-struct mapper71_data {
-	uint8_t mirror;
-	uint8_t prg_bank;
-};
-
-// ------------------------------------------------------------
-// mapper 180 structs/constants
-
-static const uint8_t MAPPER180_PRG_BANK_SIZE_LOG2 = 14;
-static const uint32_t MAPPER180_PRG_BANK_MASK = (1 << MAPPER2_PRG_BANK_SIZE_LOG2) - 1;
-
-struct mapper180_data {
-	uint8_t prg_bank;
-};
+bool mapper69_init(nessys_t* nes);
+bool mapper69_write(nessys_t* nes, uint16_t addr, uint8_t data);
 
 #endif
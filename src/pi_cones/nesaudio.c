@@ -0,0 +1,358 @@
+// nesaudio.c
+// audio output backends, and frame pacing driven by the ring fill level
+
+#ifdef WIN32
+#include <windows.h>
+#include <timeapi.h>
+#else
+#include "hardware/sync.h"
+#include "hardware/dma.h"
+#include "hardware/pwm.h"
+#include "hardware/irq.h"
+#include "hardware/clocks.h"
+#endif
+#include "nesaudio.h"
+
+nesaudio_stats_t nesaudio_stats;
+
+static nessys_snd_ring_t* nesaudio_ring = NULL;
+static uint32_t nesaudio_last_time = 0;
+
+// played when the emulator falls behind, rather than a partially written buffer
+static nessys_snd_sample_t nesaudio_silence[NESSYS_SND_SAMPLES_PER_BUFFER];
+
+#ifdef WIN32
+static CRITICAL_SECTION nesaudio_lock;
+static CONDITION_VARIABLE nesaudio_drained;
+static HANDLE nesaudio_thread = NULL;
+static volatile bool nesaudio_running = false;
+static LARGE_INTEGER nesaudio_qpc_freq;
+static FILE* nesaudio_wav = NULL;
+static uint32_t nesaudio_wav_bytes = 0;
+// data size the header was last written with
+static uint32_t nesaudio_wav_header_bytes = 0;
+// ring position the wav file has the samples up to
+static uint32_t nesaudio_wav_pos = 0;
+
+static uint32_t nesaudio_time_us()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return (uint32_t)((t.QuadPart * 1000000) / nesaudio_qpc_freq.QuadPart);
+}
+#else
+static const uint nesaudio_dma_chan[2] = { NESAUDIO_DMA_CHAN_A, NESAUDIO_DMA_CHAN_B };
+// whether each channel is playing a ring buffer (true), or silence (false)
+static bool nesaudio_dma_ring[2];
+// ring position of the next buffer to hand to dma
+static uint32_t nesaudio_queue_pos;
+
+static uint32_t nesaudio_time_us()
+{
+	return time_us_32();
+}
+#endif
+
+uint32_t nesaudio_fill()
+{
+	if (nesaudio_ring == NULL) return 0;
+	return nessys_snd_ring_distance(nesaudio_ring->write_pos, nesaudio_ring->read_pos);
+}
+
+#ifdef WIN32
+static void nesaudio_wav_header(uint32_t data_bytes)
+{
+	uint32_t u32;
+	uint16_t u16;
+
+	fseek(nesaudio_wav, 0, SEEK_SET);
+	fwrite("RIFF", 1, 4, nesaudio_wav);
+	u32 = 36 + data_bytes;
+	fwrite(&u32, 4, 1, nesaudio_wav);
+	fwrite("WAVEfmt ", 1, 8, nesaudio_wav);
+	u32 = 16;
+	fwrite(&u32, 4, 1, nesaudio_wav);
+	u16 = 1;  // pcm
+	fwrite(&u16, 2, 1, nesaudio_wav);
+	u16 = 1;  // mono
+	fwrite(&u16, 2, 1, nesaudio_wav);
+	u32 = NESSYS_SND_SAMPLES_PER_SECOND;
+	fwrite(&u32, 4, 1, nesaudio_wav);
+	u32 = NESSYS_SND_SAMPLES_PER_SECOND * sizeof(nessys_snd_sample_t);
+	fwrite(&u32, 4, 1, nesaudio_wav);
+	u16 = sizeof(nessys_snd_sample_t);
+	fwrite(&u16, 2, 1, nesaudio_wav);
+	u16 = NESSYS_SND_BITS_PER_SAMPLE;
+	fwrite(&u16, 2, 1, nesaudio_wav);
+	fwrite("data", 1, 4, nesaudio_wav);
+	fwrite(&data_bytes, 4, 1, nesaudio_wav);
+	fseek(nesaudio_wav, 0, SEEK_END);
+}
+
+static void nesaudio_open_wav(const char* wav_path)
+{
+	nesaudio_wav_bytes = 0;
+	nesaudio_wav_header_bytes = 0;
+	nesaudio_wav_pos = 0;
+	nesaudio_wav = (wav_path) ? fopen(wav_path, "wb") : NULL;
+	if (nesaudio_wav) nesaudio_wav_header(0);
+}
+
+// Appends the count samples after nesaudio_wav_pos to the wav file; the sizes are rewritten once a second of audio,
+// so a run that never gets to close the file loses at most the last second
+static void nesaudio_wav_write(uint32_t count)
+{
+	uint32_t index = nessys_snd_ring_index(nesaudio_wav_pos);
+	// the samples may wrap around the end of the ring
+	uint32_t first = (index + count > NESSYS_SND_RING_SAMPLES) ? NESSYS_SND_RING_SAMPLES - index : count;
+
+	fwrite(nesaudio_ring->sample + index, sizeof(nessys_snd_sample_t), first, nesaudio_wav);
+	fwrite(nesaudio_ring->sample, sizeof(nessys_snd_sample_t), count - first, nesaudio_wav);
+	nesaudio_wav_bytes += count * sizeof(nessys_snd_sample_t);
+	nesaudio_wav_pos = nessys_snd_ring_advance(nesaudio_wav_pos, count);
+	if (nesaudio_wav_bytes - nesaudio_wav_header_bytes >= NESSYS_SND_SAMPLES_PER_SECOND * sizeof(nessys_snd_sample_t)) {
+		nesaudio_wav_header(nesaudio_wav_bytes);
+		nesaudio_wav_header_bytes = nesaudio_wav_bytes;
+		fflush(nesaudio_wav);
+	}
+}
+
+// writes the samples generated since the last call to the wav file
+static void nesaudio_wav_catch_up()
+{
+	// this runs every buffer period, and the emulator is paced to stay well within a ring of read_pos, so none of
+	// these have been overwritten since they were generated
+	if (nesaudio_wav) nesaudio_wav_write(nessys_snd_ring_distance(nesaudio_ring->write_pos, nesaudio_wav_pos));
+}
+
+// Writer thread; consumes one buffer per buffer period, standing in for the audio device
+// A buffer is only released if it's been completely generated; otherwise it counts as an underrun
+DWORD WINAPI nesaudio_thread_entry(LPVOID d)
+{
+	LARGE_INTEGER now, next;
+	int64_t period = (nesaudio_qpc_freq.QuadPart * NESSYS_SND_SAMPLES_PER_BUFFER) / NESSYS_SND_SAMPLES_PER_SECOND;
+	int64_t wait_ms;
+	bool ready;
+
+	QueryPerformanceCounter(&next);
+	while (nesaudio_running) {
+		next.QuadPart += period;
+		QueryPerformanceCounter(&now);
+		wait_ms = ((next.QuadPart - now.QuadPart) * 1000) / nesaudio_qpc_freq.QuadPart;
+		if (wait_ms > 0) Sleep((DWORD)wait_ms);
+		// the file gets what was generated, not what's consumed, so falling behind doesn't put silence in it
+		nesaudio_wav_catch_up();
+
+		ready = (nesaudio_fill() >= NESSYS_SND_SAMPLES_PER_BUFFER);
+		EnterCriticalSection(&nesaudio_lock);
+		if (ready) {
+			nesaudio_ring->read_pos = nessys_snd_ring_advance(nesaudio_ring->read_pos, NESSYS_SND_SAMPLES_PER_BUFFER);
+		} else {
+			nesaudio_ring->underruns++;
+		}
+		LeaveCriticalSection(&nesaudio_lock);
+		WakeConditionVariable(&nesaudio_drained);
+	}
+	return 0;
+}
+#else
+// Points a dma channel at the next buffer to play; it starts when the other channel finishes
+static void nesaudio_queue(uint i)
+{
+	nessys_snd_ring_t* ring = nesaudio_ring;
+	if (nessys_snd_ring_distance(ring->write_pos, nesaudio_queue_pos) >= NESSYS_SND_SAMPLES_PER_BUFFER) {
+		dma_channel_set_read_addr(nesaudio_dma_chan[i], ring->sample + nessys_snd_ring_index(nesaudio_queue_pos), false);
+		nesaudio_queue_pos = nessys_snd_ring_advance(nesaudio_queue_pos, NESSYS_SND_SAMPLES_PER_BUFFER);
+		nesaudio_dma_ring[i] = true;
+	} else {
+		dma_channel_set_read_addr(nesaudio_dma_chan[i], nesaudio_silence, false);
+		nesaudio_dma_ring[i] = false;
+		ring->underruns++;
+	}
+}
+
+static void nesaudio_dma_irq_handler()
+{
+	uint i;
+	for (i = 0; i < 2; i++) {
+		if (dma_channel_get_irq1_status(nesaudio_dma_chan[i])) {
+			dma_channel_acknowledge_irq1(nesaudio_dma_chan[i]);
+			// the buffer this channel just played can be reused
+			if (nesaudio_dma_ring[i]) {
+				nesaudio_ring->read_pos = nessys_snd_ring_advance(nesaudio_ring->read_pos, NESSYS_SND_SAMPLES_PER_BUFFER);
+			}
+			nesaudio_queue(i);
+		}
+	}
+	// wake up core 0 if it's waiting on the ring to drain
+	__sev();
+}
+
+static void nesaudio_pwm_init()
+{
+	uint i;
+	uint slice = pwm_gpio_to_slice_num(NESAUDIO_PWM_PIN);
+	pwm_config pcfg = pwm_get_default_config();
+	dma_channel_config dcfg;
+	uint32_t clk_div;
+
+	// pwm carrier at the full system clock, with the duty cycle set by each sample
+	gpio_set_function(NESAUDIO_PWM_PIN, GPIO_FUNC_PWM);
+	pwm_config_set_wrap(&pcfg, (1 << NESSYS_SND_PWM_BITS) - 1);
+	pwm_init(slice, &pcfg, true);
+
+	// dma timer paces the transfers at the sample rate; rate control absorbs the rounding error
+	clk_div = (clock_get_hz(clk_sys) + NESSYS_SND_SAMPLES_PER_SECOND / 2) / NESSYS_SND_SAMPLES_PER_SECOND;
+	dma_timer_set_fraction(NESAUDIO_DMA_TIMER, 1, clk_div);
+
+	for (i = 0; i < 2; i++) {
+		dcfg = dma_channel_get_default_config(nesaudio_dma_chan[i]);
+		// 16 bit writes are replicated to both halves of the compare register, so either pwm output can be used
+		channel_config_set_transfer_data_size(&dcfg, DMA_SIZE_16);
+		channel_config_set_read_increment(&dcfg, true);
+		channel_config_set_write_increment(&dcfg, false);
+		channel_config_set_dreq(&dcfg, dma_get_timer_dreq(NESAUDIO_DMA_TIMER));
+		channel_config_set_chain_to(&dcfg, nesaudio_dma_chan[i ^ 1]);
+		dma_channel_configure(nesaudio_dma_chan[i], &dcfg, &pwm_hw->slice[slice].cc, nesaudio_silence,
+			NESSYS_SND_SAMPLES_PER_BUFFER, false);
+		nesaudio_dma_ring[i] = false;
+		dma_channel_set_irq1_enabled(nesaudio_dma_chan[i], true);
+	}
+	irq_set_exclusive_handler(NESAUDIO_DMA_IRQ, nesaudio_dma_irq_handler);
+	irq_set_enabled(NESAUDIO_DMA_IRQ, true);
+
+	// both channels start on silence; as each finishes, it's refilled from the ring
+	dma_channel_start(nesaudio_dma_chan[0]);
+}
+#endif
+
+void nesaudio_init(nessys_snd_ring_t* ring, const char* wav_path)
+{
+	uint i;
+	nesaudio_ring = ring;
+	memset(ring, 0, sizeof(nessys_snd_ring_t));
+	for (i = 0; i < NESSYS_SND_SAMPLES_PER_BUFFER; i++) {
+		nesaudio_silence[i] = NESSYS_SND_SAMPLE(0);
+	}
+	nesaudio_reset_stats();
+#ifdef WIN32
+	QueryPerformanceFrequency(&nesaudio_qpc_freq);
+	nesaudio_open_wav(wav_path);
+	// 1 ms sleep granularity for the writer thread
+	timeBeginPeriod(1);
+	InitializeCriticalSection(&nesaudio_lock);
+	InitializeConditionVariable(&nesaudio_drained);
+	nesaudio_running = true;
+	nesaudio_thread = CreateThread(NULL, 0, nesaudio_thread_entry, NULL, 0, NULL);
+#else
+	nesaudio_queue_pos = 0;
+	nesaudio_pwm_init();
+#endif
+	nesaudio_last_time = nesaudio_time_us();
+}
+
+#ifdef WIN32
+void nesaudio_init_offline(nessys_snd_ring_t* ring, const char* wav_path)
+{
+	nesaudio_ring = ring;
+	memset(ring, 0, sizeof(nessys_snd_ring_t));
+	nesaudio_reset_stats();
+	QueryPerformanceFrequency(&nesaudio_qpc_freq);
+	nesaudio_open_wav(wav_path);
+	nesaudio_last_time = nesaudio_time_us();
+}
+
+uint32_t nesaudio_drain()
+{
+	uint32_t fill = nesaudio_fill();
+
+	// nothing else reads the ring, so the file is always up to read_pos
+	if (nesaudio_wav) nesaudio_wav_write(fill);
+	nesaudio_ring->read_pos = nessys_snd_ring_advance(nesaudio_ring->read_pos, fill);
+	return fill;
+}
+#endif
+
+uint32_t nesaudio_pace()
+{
+	uint32_t fill, cur_time, frame_time;
+	int32_t delta;
+
+	if (nesaudio_ring == NULL) return NESSYS_SND_RATE_ONE;
+
+	// sleep until the consumer has drained the ring down to the target
+#ifdef WIN32
+	EnterCriticalSection(&nesaudio_lock);
+	while (nesaudio_fill() > NESAUDIO_TARGET_FILL) {
+		SleepConditionVariableCS(&nesaudio_drained, &nesaudio_lock, INFINITE);
+	}
+	LeaveCriticalSection(&nesaudio_lock);
+#else
+	while (nesaudio_fill() > NESAUDIO_TARGET_FILL) {
+		__wfe();
+	}
+#endif
+	fill = nesaudio_fill();
+
+	// if the ring is below target, generate slightly more samples per frame, and fewer if above
+	// the deviation is bounded, so the pitch change is inaudible
+	delta = ((int32_t)NESAUDIO_TARGET_FILL - (int32_t)fill) * NESSYS_SND_RATE_MAX_DELTA / (int32_t)NESAUDIO_TARGET_FILL;
+	if (delta > NESSYS_SND_RATE_MAX_DELTA) delta = NESSYS_SND_RATE_MAX_DELTA;
+	if (delta < -NESSYS_SND_RATE_MAX_DELTA) delta = -NESSYS_SND_RATE_MAX_DELTA;
+
+	cur_time = nesaudio_time_us();
+	frame_time = cur_time - nesaudio_last_time;
+	nesaudio_last_time = cur_time;
+
+	nesaudio_stats.frames++;
+	nesaudio_stats.frame_us_sum += frame_time;
+	if (frame_time < nesaudio_stats.frame_us_min) nesaudio_stats.frame_us_min = frame_time;
+	if (frame_time > nesaudio_stats.frame_us_max) nesaudio_stats.frame_us_max = frame_time;
+	if (fill < nesaudio_stats.fill_min) nesaudio_stats.fill_min = fill;
+	if (fill > nesaudio_stats.fill_max) nesaudio_stats.fill_max = fill;
+	nesaudio_stats.rate = NESSYS_SND_RATE_ONE + delta;
+	nesaudio_stats.underruns = nesaudio_ring->underruns;
+	nesaudio_stats.overruns = nesaudio_ring->overruns;
+
+	return nesaudio_stats.rate;
+}
+
+void nesaudio_reset_stats()
+{
+	nesaudio_stats.frames = 0;
+	nesaudio_stats.frame_us_sum = 0;
+	nesaudio_stats.frame_us_min = ~0;
+	nesaudio_stats.frame_us_max = 0;
+	nesaudio_stats.fill_min = ~0;
+	nesaudio_stats.fill_max = 0;
+}
+
+void nesaudio_cleanup()
+{
+#ifdef WIN32
+	if (nesaudio_thread) {
+		nesaudio_running = false;
+		WaitForSingleObject(nesaudio_thread, INFINITE);
+		CloseHandle(nesaudio_thread);
+		nesaudio_thread = NULL;
+		DeleteCriticalSection(&nesaudio_lock);
+		timeEndPeriod(1);
+	}
+	if (nesaudio_wav) {
+		// write what the thread hadn't got to yet, and fill in the final sizes
+		nesaudio_wav_catch_up();
+		nesaudio_wav_header(nesaudio_wav_bytes);
+		fclose(nesaudio_wav);
+		nesaudio_wav = NULL;
+	}
+#else
+	uint i;
+	irq_set_enabled(NESAUDIO_DMA_IRQ, false);
+	for (i = 0; i < 2; i++) {
+		dma_channel_set_irq1_enabled(nesaudio_dma_chan[i], false);
+		dma_channel_abort(nesaudio_dma_chan[i]);
+	}
+	pwm_set_enabled(pwm_gpio_to_slice_num(NESAUDIO_PWM_PIN), false);
+#endif
+	nesaudio_ring = NULL;
+}
@@ -0,0 +1,60 @@
+// Project:     pi_cones
+// File:        nesaudio.h
+// Author:      Kamal Pillai
+// Date:        10/18/2026
+// Description:	Audio ring buffer consumer and audio clocked frame pacing
+
+#ifndef __NESAUDIO_H
+#define __NESAUDIO_H
+
+#include "nessys.h"
+
+// the producer waits until the ring has drained to this level before emulating the next frame
+#define NESAUDIO_TARGET_FILL (NESSYS_SND_RING_SAMPLES / 2)
+
+// time it takes the consumer to play one buffer
+#define NESAUDIO_BUFFER_TIME_US ((1000000ull * NESSYS_SND_SAMPLES_PER_BUFFER) / NESSYS_SND_SAMPLES_PER_SECOND)
+
+#ifndef WIN32
+// pwm audio output; buffers are sent to the pwm compare register by two dma channels chained to each other
+// channel 1 is used by the lcd
+#define NESAUDIO_PWM_PIN 26
+#define NESAUDIO_DMA_CHAN_A 2
+#define NESAUDIO_DMA_CHAN_B 3
+#define NESAUDIO_DMA_TIMER 0
+#define NESAUDIO_DMA_IRQ DMA_IRQ_1
+#endif
+
+// pacing statistics, accumulated from the last nesaudio_reset_stats
+typedef struct {
+	uint32_t frames;
+	uint32_t frame_us_sum;
+	uint32_t frame_us_min;
+	uint32_t frame_us_max;
+	uint32_t fill_min;
+	uint32_t fill_max;
+	uint32_t rate;  // last rate control ratio (16.16)
+	uint32_t underruns;
+	uint32_t overruns;
+} nesaudio_stats_t;
+
+extern nesaudio_stats_t nesaudio_stats;
+
+// starts consuming buffers from the ring at the output sample rate; the pico plays them through pwm
+// on win32, the samples the emulator generates are written to wav_path if it is not NULL, by the writer thread,
+// rather than what the output consumed, so falling behind doesn't put silence in the file
+void nesaudio_init(nessys_snd_ring_t* ring, const char* wav_path);
+#ifdef WIN32
+// offline rendering; opens the wav file, but doesn't start the writer thread, so nothing is consumed in real time
+void nesaudio_init_offline(nessys_snd_ring_t* ring, const char* wav_path);
+// writes everything in the ring to the wav file, and returns the samples written
+uint32_t nesaudio_drain();
+#endif
+// number of samples generated but not yet consumed
+uint32_t nesaudio_fill();
+// sleeps until the ring has room for the next frame, and returns the rate control ratio for that frame
+uint32_t nesaudio_pace();
+void nesaudio_reset_stats();
+void nesaudio_cleanup();
+
+#endif
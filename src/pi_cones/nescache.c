@@ -0,0 +1,287 @@
+// nescache.c
+// sram copies of the most used rom banks
+// rom is read through the bank pointer tables, so a copied bank costs nothing extra per access; the pointers of a
+// window are redirected to the copy when the bank is switched in, and back to flash when its slot is taken
+
+#include "nescache.h"
+
+#if NESSYS_FLASH_SIM
+bool nescache_flash_sim = false;
+static uint32_t nescache_sim_tag[NESCACHE_SIM_XIP_SETS][2];
+static uint8_t nescache_sim_lru[NESCACHE_SIM_XIP_SETS];  // way to replace next
+#endif
+
+#if NESCACHE_ENABLE
+void nescache_init(nessys_t* nes)
+{
+	nescache_t* c;
+	uint32_t room;
+	uint i;
+
+	nes->cache = NULL;
+	// the slots follow the bookkeeping, with each allocation rounded up to at most 8 bytes
+	room = nes->aux_size - nes->aux_used;
+	if (room < sizeof(nescache_t) + 8 + NESSYS_CHR_BANK_SIZE) return;
+	room -= sizeof(nescache_t) + 8;
+	c = alloc_aux(nes, sizeof(nescache_t));
+	memset(c, 0, sizeof(nescache_t));
+	c->enable = true;
+	c->num_prg_slots = (uint8_t)((room >> NESSYS_PRG_BANK_SIZE_LOG2 < NESCACHE_PRG_SLOTS) ? room >> NESSYS_PRG_BANK_SIZE_LOG2 : NESCACHE_PRG_SLOTS);
+	room -= (uint32_t)c->num_prg_slots << NESSYS_PRG_BANK_SIZE_LOG2;
+	c->num_chr_slots = (uint8_t)((room >> NESSYS_CHR_BANK_SIZE_LOG2 < NESCACHE_CHR_SLOTS) ? room >> NESSYS_CHR_BANK_SIZE_LOG2 : NESCACHE_CHR_SLOTS);
+	if (c->num_prg_slots) c->prg_mem = alloc_aux(nes, (uint32_t)c->num_prg_slots << NESSYS_PRG_BANK_SIZE_LOG2);
+	if (c->num_chr_slots) c->chr_mem = alloc_aux(nes, (uint32_t)c->num_chr_slots << NESSYS_CHR_BANK_SIZE_LOG2);
+	for (i = 0; i < NESSYS_PRG_NUM_BANKS; i++) c->prg_window[i] = NESCACHE_NO_BANK;
+	for (i = 0; i <= NESSYS_CHR_ROM_END_BANK; i++) c->chr_window[i] = NESCACHE_NO_BANK;
+	for (i = 0; i < NESCACHE_PRG_SLOTS; i++) c->prg[i].rom_bank = NESCACHE_NO_BANK;
+	for (i = 0; i < NESCACHE_CHR_SLOTS; i++) c->chr[i].rom_bank = NESCACHE_NO_BANK;
+#if NESSYS_FLASH_SIM
+	memset(nescache_sim_tag, 0, sizeof(nescache_sim_tag));
+#endif
+	nes->cache = c;
+	// the mapper set up its windows before there was a cache
+	nescache_remap(nes);
+}
+
+void nescache_release(nessys_t* nes)
+{
+	nes->cache = NULL;
+}
+
+uint32_t nescache_arena_size(nessys_t* nes)
+{
+	const nescache_t* c = nes->cache;
+	if (c == NULL) return 0;
+	return (uint32_t)(c->num_prg_slots << NESSYS_PRG_BANK_SIZE_LOG2) + (uint32_t)(c->num_chr_slots << NESSYS_CHR_BANK_SIZE_LOG2) +
+		((sizeof(nescache_t) + 7) & ~7);
+}
+
+// finds the slot holding a rom bank; if there is none, the bank takes the slot with the least used bank,
+// provided it's been used more; returns -1 if the bank stays in flash
+static int nescache_find(nessys_t* nes, bool chr, uint16_t bank)
+{
+	nescache_t* c = nes->cache;
+	nescache_slot_t* slot = (chr) ? c->chr : c->prg;
+	uint num_slots = (chr) ? c->num_chr_slots : c->num_prg_slots;
+	const uint16_t* count = (chr) ? c->chr_count : c->prg_count;
+	const uint16_t* window = (chr) ? c->chr_window : c->prg_window;
+	uint num_windows = (chr) ? NESSYS_CHR_ROM_END_BANK + 1 : NESSYS_PRG_NUM_BANKS;
+	uint size_log2 = (chr) ? NESSYS_CHR_BANK_SIZE_LOG2 : NESSYS_PRG_BANK_SIZE_LOG2;
+	const uint8_t* rom = (chr) ? nes->ppu.chr_rom_base : nes->prg_rom_base;
+	uint8_t* mem = (chr) ? c->chr_mem : c->prg_mem;
+	int victim = -1;
+	uint32_t victim_count = ~0;
+	uint32_t n;
+	uint i, b;
+
+	for (i = 0; i < num_slots; i++) {
+		if (slot[i].rom_bank == bank) return i;
+		n = (slot[i].rom_bank == NESCACHE_NO_BANK) ? 0 : count[slot[i].rom_bank];
+		if (n < victim_count) {
+			victim = i;
+			victim_count = n;
+		}
+	}
+	if (victim < 0 || count[bank] < NESCACHE_MIN_COUNT || count[bank] <= victim_count) return -1;
+
+	// windows still using the old copy go back to flash
+	if (slot[victim].rom_bank != NESCACHE_NO_BANK) {
+		for (b = 0; b < num_windows; b++) {
+			if (window[b] != slot[victim].rom_bank) continue;
+			if (chr) {
+				nes->ppu.chr_rom_bank[b] = rom + ((uint32_t)window[b] << size_log2);
+			} else {
+				nes->prg_rom_bank[b] = rom + ((uint32_t)window[b] << size_log2);
+			}
+		}
+	}
+	memcpy(mem + (victim << size_log2), rom + ((uint32_t)bank << size_log2), 1 << size_log2);
+	slot[victim].rom_bank = bank;
+	slot[victim].fills++;
+	return victim;
+}
+
+const uint8_t* nescache_map_prg(nessys_t* nes, uint b, uint32_t offset)
+{
+	nescache_t* c = nes->cache;
+	uint16_t bank = offset >> NESSYS_PRG_BANK_SIZE_LOG2;
+	int s;
+
+	if (c == NULL) return nes->prg_rom_base + offset;
+	c->prg_window[b] = NESCACHE_NO_BANK;
+	if (!c->enable || (offset & NESSYS_PRG_MEM_MASK) || bank >= NESCACHE_MAX_PRG_BANKS) return nes->prg_rom_base + offset;
+	c->prg_window[b] = bank;
+	s = nescache_find(nes, false, bank);
+	if (s < 0) {
+		c->prg_misses++;
+		return nes->prg_rom_base + offset;
+	}
+	c->prg[s].hits++;
+	return c->prg_mem + ((uint32_t)s << NESSYS_PRG_BANK_SIZE_LOG2);
+}
+
+const uint8_t* nescache_map_chr(nessys_t* nes, uint b, uint32_t offset)
+{
+	nescache_t* c = nes->cache;
+	uint16_t bank = offset >> NESSYS_CHR_BANK_SIZE_LOG2;
+	int s;
+
+	if (c == NULL) return nes->ppu.chr_rom_base + offset;
+	c->chr_window[b] = NESCACHE_NO_BANK;
+	if (!c->enable || (offset & NESSYS_CHR_MEM_MASK) || bank >= NESCACHE_MAX_CHR_BANKS) return nes->ppu.chr_rom_base + offset;
+	c->chr_window[b] = bank;
+	s = nescache_find(nes, true, bank);
+	if (s < 0) {
+		c->chr_misses++;
+		return nes->ppu.chr_rom_base + offset;
+	}
+	c->chr[s].hits++;
+	return c->chr_mem + ((uint32_t)s << NESSYS_CHR_BANK_SIZE_LOG2);
+}
+
+void nescache_unmap_prg(nessys_t* nes, uint b)
+{
+	if (nes->cache) nes->cache->prg_window[b] = NESCACHE_NO_BANK;
+}
+
+void nescache_unmap_chr(nessys_t* nes, uint b)
+{
+	if (nes->cache) nes->cache->chr_window[b] = NESCACHE_NO_BANK;
+}
+
+void nescache_remap(nessys_t* nes)
+{
+	uint b;
+
+	for (b = 0; b < NESSYS_PRG_NUM_BANKS; b++) {
+		if (nes->prg_bank_src[b] & NESSYS_BANK_SRC_RAM) {
+			nescache_unmap_prg(nes, b);
+		} else {
+			nes->prg_rom_bank[b] = nescache_map_prg(nes, b, nes->prg_bank_src[b]);
+		}
+	}
+	for (b = 0; b <= NESSYS_CHR_ROM_END_BANK; b++) {
+		if (nes->ppu.chr_ram_base || nes->ppu.chr_bank_src[b] == NESSYS_BANK_SRC_NONE) {
+			nescache_unmap_chr(nes, b);
+		} else {
+			nes->ppu.chr_rom_bank[b] = nescache_map_chr(nes, b, nes->ppu.chr_bank_src[b]);
+		}
+	}
+}
+
+static inline void nescache_count(uint16_t* count, uint16_t bank)
+{
+	if (bank != NESCACHE_NO_BANK && count[bank] < 0xFFFF) count[bank]++;
+}
+
+void nescache_sample(nessys_t* nes)
+{
+	nescache_t* c = nes->cache;
+	uint b, bg, sp;
+
+	if (c == NULL || !c->enable) return;
+	// the bank the cpu is running from stands in for all its prg reads
+	nescache_count(c->prg_count, c->prg_window[nes->reg.pc >> NESSYS_PRG_BANK_SIZE_LOG2]);
+	// rendered lines read from the background and sprite pattern tables
+	if (nes->scan_line < NESSYS_PPU_SCANLINES_START_RENDER || !(nes->ppu.reg[1] & 0x18)) return;
+	bg = (nes->ppu.reg[0] & 0x10) ? 4 : 0;
+	sp = (nes->ppu.reg[0] & 0x08) ? 4 : 0;
+	for (b = 0; b < 4; b++) {
+		nescache_count(c->chr_count, c->chr_window[bg + b]);
+		// 8x16 sprites pick a table per tile; the 8x8 table select is close enough
+		if (sp != bg) nescache_count(c->chr_count, c->chr_window[sp + b]);
+	}
+}
+
+void nescache_end_frame(nessys_t* nes)
+{
+	nescache_t* c = nes->cache;
+	uint i;
+	int s;
+
+	if (c == NULL || !c->enable) return;
+	if (++c->decay_frame >= NESCACHE_DECAY_FRAMES) {
+		c->decay_frame = 0;
+		for (i = 0; i < NESCACHE_MAX_PRG_BANKS; i++) c->prg_count[i] >>= 1;
+		for (i = 0; i < NESCACHE_MAX_CHR_BANKS; i++) c->chr_count[i] >>= 1;
+	}
+
+	// carts that never switch banks, or banks that got hot while mapped, only get copied here
+	for (i = 0; i < NESSYS_PRG_NUM_BANKS; i++) {
+		if (c->prg_window[i] == NESCACHE_NO_BANK) continue;
+		s = nescache_find(nes, false, c->prg_window[i]);
+		if (s >= 0) nes->prg_rom_bank[i] = c->prg_mem + ((uint32_t)s << NESSYS_PRG_BANK_SIZE_LOG2);
+	}
+	for (i = 0; i <= NESSYS_CHR_ROM_END_BANK; i++) {
+		if (c->chr_window[i] == NESCACHE_NO_BANK) continue;
+		s = nescache_find(nes, true, c->chr_window[i]);
+		if (s >= 0) nes->ppu.chr_rom_bank[i] = c->chr_mem + ((uint32_t)s << NESSYS_CHR_BANK_SIZE_LOG2);
+	}
+}
+
+#ifdef WIN32
+void nescache_print_stats(nessys_t* nes)
+{
+	const nescache_t* c = nes->cache;
+	uint i;
+
+	if (c == NULL) {
+		printf("  no room for the cache in the cart arena\n");
+		return;
+	}
+	printf("  prg: %d slots, %d bank switches left in flash\n", c->num_prg_slots, c->prg_misses);
+	for (i = 0; i < c->num_prg_slots; i++) {
+		if (c->prg[i].rom_bank == NESCACHE_NO_BANK) continue;
+		printf("    slot %d: bank %3d, %d hits, %d fills\n", i, c->prg[i].rom_bank, c->prg[i].hits, c->prg[i].fills);
+	}
+	printf("  chr: %d slots, %d bank switches left in flash\n", c->num_chr_slots, c->chr_misses);
+	for (i = 0; i < c->num_chr_slots; i++) {
+		if (c->chr[i].rom_bank == NESCACHE_NO_BANK) continue;
+		printf("    slot %d: bank %3d, %d hits, %d fills\n", i, c->chr[i].rom_bank, c->chr[i].hits, c->chr[i].fills);
+	}
+}
+#endif
+#endif
+
+#if NESSYS_FLASH_SIM
+// counts a rom read against the model of the xip cache; reads from sram, including cached banks, are free
+// the model is of one instance's reads, so the benches using it run just the one
+void nescache_flash_sim_read(const nessys_t* nes, const uint8_t* p)
+{
+	uint32_t addr, line, set;
+	bool chr;
+
+	if (p >= nes->prg_rom_base && p < nes->prg_rom_base + nes->prg_rom_size) {
+		addr = (uint32_t)(p - nes->prg_rom_base);
+		chr = false;
+	} else if (nes->ppu.chr_rom_base && p >= nes->ppu.chr_rom_base && p < nes->ppu.chr_rom_base + nes->ppu.chr_rom_size) {
+		// chr rom follows prg rom in flash
+		addr = nes->prg_rom_size + (uint32_t)(p - nes->ppu.chr_rom_base);
+		chr = true;
+	} else {
+		return;
+	}
+	// tags are offset by 1, so 0 is an empty line
+	line = (addr >> NESCACHE_SIM_XIP_LINE_LOG2) + 1;
+	set = line & (NESCACHE_SIM_XIP_SETS - 1);
+	if (nescache_sim_tag[set][0] == line) {
+		nescache_sim_lru[set] = 1;
+		return;
+	}
+	if (nescache_sim_tag[set][1] == line) {
+		nescache_sim_lru[set] = 0;
+		return;
+	}
+	nescache_sim_tag[set][nescache_sim_lru[set]] = line;
+	nescache_sim_lru[set] ^= 1;
+#if NESCACHE_ENABLE
+	if (nes->cache == NULL) return;
+	if (chr) {
+		nes->cache->sim_chr_misses++;
+	} else {
+		nes->cache->sim_prg_misses++;
+	}
+	nes->cache->sim_stall_cycles += NESCACHE_SIM_MISS_CYCLES;
+#endif
+}
+#endif
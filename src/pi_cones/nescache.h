@@ -0,0 +1,107 @@
+// Project:     pi_cones
+// File:        nescache.h
+// Author:      Kamal Pillai
+// Date:        10/18/2026
+// Description:	SRAM copies of the most used rom banks, to keep hot code and patterns out of the XIP flash cache
+
+#ifndef __NESCACHE_H
+#define __NESCACHE_H
+
+#include "nessys.h"
+
+// each instance's cache is carved out of what its cart arena has left once the cart is loaded; set to 0 to leave all
+// rom in flash
+#ifndef NESCACHE_ENABLE
+#define NESCACHE_ENABLE 1
+#endif
+
+// most 8KB prg and 1KB chr rom banks held in sram; a cart gets as many as fit, prg first
+#ifndef NESCACHE_PRG_SLOTS
+#define NESCACHE_PRG_SLOTS 2
+#endif
+#ifndef NESCACHE_CHR_SLOTS
+#define NESCACHE_CHR_SLOTS 8
+#endif
+
+// access counters cover up to 1MB of prg rom, and 512KB of chr rom; banks past that always stay in flash
+#define NESCACHE_MAX_PRG_BANKS 128
+#define NESCACHE_MAX_CHR_BANKS 512
+#define NESCACHE_NO_BANK 0xFFFF
+
+// counters are halved this often, so the cache follows the game from one area to the next
+#define NESCACHE_DECAY_FRAMES 16
+// a bank needs at least this many samples to be worth copying
+#define NESCACHE_MIN_COUNT 64
+
+// win32 model of the pico's xip cache, built in with NESSYS_FLASH_SIM; 16KB, 2 way, 8 byte lines, of which about half
+// is assumed to hold emulator code
+#define NESCACHE_SIM_XIP_SIZE 8192
+#define NESCACHE_SIM_XIP_LINE_LOG2 3
+#define NESCACHE_SIM_XIP_SETS ((NESCACHE_SIM_XIP_SIZE >> NESCACHE_SIM_XIP_LINE_LOG2) / 2)
+// sys clocks the core stalls on a miss; a qspi read of one line at half the sys clock
+#define NESCACHE_SIM_MISS_CYCLES 48
+#define NESCACHE_SIM_SYS_CLK_MHZ 250
+
+typedef struct {
+	uint16_t rom_bank;  // NESCACHE_NO_BANK if empty
+	uint32_t hits;      // bank switches served from the sram copy
+	uint32_t fills;     // times the slot was loaded from flash
+} nescache_slot_t;
+
+typedef struct nescache_s {
+	bool enable;
+	uint8_t decay_frame;
+	uint8_t num_prg_slots;
+	uint8_t num_chr_slots;
+	uint8_t* prg_mem;  // num_prg_slots banks, in the cart arena
+	uint8_t* chr_mem;
+	uint16_t prg_window[NESSYS_PRG_NUM_BANKS];  // rom bank mapped in each 8KB cpu window, or NESCACHE_NO_BANK
+	uint16_t chr_window[NESSYS_CHR_ROM_END_BANK + 1];  // rom bank mapped in each 1KB pattern window
+	uint16_t prg_count[NESCACHE_MAX_PRG_BANKS];  // per scan line samples of each rom bank's use
+	uint16_t chr_count[NESCACHE_MAX_CHR_BANKS];
+	nescache_slot_t prg[NESCACHE_PRG_SLOTS];
+	nescache_slot_t chr[NESCACHE_CHR_SLOTS];
+	uint32_t prg_misses;  // bank switches left in flash
+	uint32_t chr_misses;
+	uint32_t sim_prg_misses;  // win32 simulated xip cache misses on rom reads
+	uint32_t sim_chr_misses;
+	uint64_t sim_stall_cycles;
+} nescache_t;
+
+#if NESCACHE_ENABLE
+// sets up the cache in the space left in the cart arena, once the cart has allocated everything else, and routes the
+// mapped rom windows through it; carts that leave no room for a slot run without one
+void nescache_init(nessys_t* nes);
+// drops the cache along with the cart arena
+void nescache_release(nessys_t* nes);
+// bytes of the cart arena the cache takes
+uint32_t nescache_arena_size(nessys_t* nes);
+// return the pointer a window should use for a rom offset, and record which rom bank it holds
+const uint8_t* nescache_map_prg(nessys_t* nes, uint b, uint32_t offset);
+const uint8_t* nescache_map_chr(nessys_t* nes, uint b, uint32_t offset);
+// record that a window holds something other than rom
+void nescache_unmap_prg(nessys_t* nes, uint b);
+void nescache_unmap_chr(nessys_t* nes, uint b);
+// samples which rom banks are in use; called at the start of every scan line
+void nescache_sample(nessys_t* nes);
+// decays the counters, and moves banks that became hot without being switched in into sram
+void nescache_end_frame(nessys_t* nes);
+// points every rom window back through the cache, after they were set straight to flash, as by a state load
+void nescache_remap(nessys_t* nes);
+#ifdef WIN32
+void nescache_print_stats(nessys_t* nes);
+#endif
+#else
+static inline void nescache_init(nessys_t* nes) {}
+static inline void nescache_release(nessys_t* nes) {}
+static inline uint32_t nescache_arena_size(nessys_t* nes) { return 0; }
+static inline const uint8_t* nescache_map_prg(nessys_t* nes, uint b, uint32_t offset) { return nes->prg_rom_base + offset; }
+static inline const uint8_t* nescache_map_chr(nessys_t* nes, uint b, uint32_t offset) { return nes->ppu.chr_rom_base + offset; }
+static inline void nescache_unmap_prg(nessys_t* nes, uint b) {}
+static inline void nescache_unmap_chr(nessys_t* nes, uint b) {}
+static inline void nescache_sample(nessys_t* nes) {}
+static inline void nescache_end_frame(nessys_t* nes) {}
+static inline void nescache_remap(nessys_t* nes) {}
+#endif
+
+#endif
@@ -0,0 +1,224 @@
+// nesenv.c
+// environment api for training agents on the host
+// each environment is an instance of its own, with no ppu thread, so it renders on the thread that steps it, and any
+// number of them can be stepped at once from different threads; frames and ram are handed back in place
+// vector environments step many in lockstep, each worker thread taking a fixed slice of them
+
+#include "nesenv.h"
+
+#ifdef WIN32
+pi_cones_env_t* pi_cones_env_create(const void* rom, uint obs_type, uint8_t* index_frame)
+{
+	pi_cones_env_t* env = calloc(1, sizeof(pi_cones_env_t));
+	if (env == NULL) return NULL;
+	env->obs_type = obs_type;
+	if (obs_type == PI_CONES_ENV_OBS_INDEX) {
+		env->own_index_frame = (index_frame == NULL);
+		env->index_frame = (index_frame) ? index_frame : calloc(PI_CONES_ENV_PIXELS, 1);
+	}
+	if (obs_type != PI_CONES_ENV_OBS_INDEX || env->index_frame) env->nes = nes_instance_create();
+	if (env->nes == NULL) {
+		pi_cones_env_destroy(env);
+		return NULL;
+	}
+	// environments leave the save alone, and there may be many of them
+	env->nes->save_enable = false;
+	env->nes->sram_budget_report = false;
+	env->nes->render_inline = true;
+	// frames a step doesn't render only need what the game reads back
+	env->nes->logic_only = true;
+	env->nes->index_frame = env->index_frame;
+	if (!ines_load_cart(env->nes, rom)) {
+		nes_instance_destroy(env->nes);
+		env->nes = NULL;
+		pi_cones_env_destroy(env);
+		return NULL;
+	}
+	env->obs.ram = env->nes->sysmem;
+	if (obs_type == PI_CONES_ENV_OBS_RGB565) env->obs.frame = env->nes->draw_frame;
+	if (obs_type == PI_CONES_ENV_OBS_INDEX) env->obs.frame = env->index_frame;
+	if (!pi_cones_env_snapshot(env)) {
+		pi_cones_env_destroy(env);
+		return NULL;
+	}
+	return env;
+}
+
+void pi_cones_env_destroy(pi_cones_env_t* env)
+{
+	if (env->nes) {
+		ines_unload_cart(env->nes);
+		nes_instance_destroy(env->nes);
+	}
+	if (env->own_index_frame) free(env->index_frame);
+	free(env->snapshot);
+	free(env);
+}
+
+const pi_cones_env_obs_t* pi_cones_env_step(pi_cones_env_t* env, uint8_t action, uint frames)
+{
+	nessys_t* nes = env->nes;
+	uint i;
+
+	nes->apu.joypad[0] = action;
+	for (i = 0; i < frames; i++) {
+		nes->frame_delta_time = (i == frames - 1 && env->obs_type != PI_CONES_ENV_OBS_RAM) ? 0 : 1;
+		nessys_apu_start_frame(nes, NESSYS_SND_RATE_ONE);
+		emulate_frame(nes);
+		nes->frame++;
+	}
+	env->obs.frame_number = nes->frame - env->snapshot_frame;
+	return &env->obs;
+}
+
+const pi_cones_env_obs_t* pi_cones_env_reset(pi_cones_env_t* env)
+{
+	nesstate_load(env->nes, env->snapshot, env->snapshot_size);
+	env->obs.frame_number = 0;
+	return &env->obs;
+}
+
+bool pi_cones_env_snapshot(pi_cones_env_t* env)
+{
+	uint32_t size = nesstate_size(env->nes);
+
+	if (size != env->snapshot_size) {
+		free(env->snapshot);
+		env->snapshot_size = 0;
+		env->snapshot = malloc(size);
+		if (env->snapshot == NULL) return false;
+		env->snapshot_size = size;
+	}
+	env->snapshot_frame = env->nes->frame;
+	return nesstate_save(env->nes, env->snapshot, size);
+}
+
+// steps the worker's slice of the envs a frame
+static void pi_cones_vec_env_run(pi_cones_vec_worker_t* w)
+{
+	pi_cones_vec_env_t* vec = w->vec;
+	uint i;
+
+	for (i = w->first; i < w->end; i++) pi_cones_env_step(vec->env[i], vec->actions[i], 1);
+}
+
+static DWORD WINAPI pi_cones_vec_env_thread(LPVOID param)
+{
+	pi_cones_vec_worker_t* w = (pi_cones_vec_worker_t*)param;
+	pi_cones_vec_env_t* vec = w->vec;
+	uint32_t generation = 0;
+	bool quit;
+
+	while (1) {
+		EnterCriticalSection(&vec->lock);
+		while (vec->generation == generation && !vec->quit) SleepConditionVariableCS(&vec->start, &vec->lock, INFINITE);
+		generation = vec->generation;
+		quit = vec->quit;
+		LeaveCriticalSection(&vec->lock);
+		if (quit) return 0;
+
+		pi_cones_vec_env_run(w);
+
+		EnterCriticalSection(&vec->lock);
+		if (--vec->busy == 0) WakeConditionVariable(&vec->done);
+		LeaveCriticalSection(&vec->lock);
+	}
+}
+
+pi_cones_vec_env_t* pi_cones_vec_env_create(const void* rom, uint num_envs, uint num_workers)
+{
+	pi_cones_vec_env_t* vec;
+	SYSTEM_INFO si;
+	uint i;
+
+	if (num_workers == 0) {
+		GetSystemInfo(&si);
+		num_workers = si.dwNumberOfProcessors;
+	}
+	if (num_workers > num_envs) num_workers = num_envs;
+	if (num_workers == 0) return NULL;
+	vec = calloc(1, sizeof(pi_cones_vec_env_t));
+	if (vec == NULL) return NULL;
+	vec->env = calloc(num_envs, sizeof(pi_cones_env_t*));
+	vec->frames = calloc(num_envs, PI_CONES_ENV_PIXELS);
+	vec->worker = calloc(num_workers, sizeof(pi_cones_vec_worker_t));
+	vec->thread = calloc(num_workers, sizeof(HANDLE));
+	if (vec->env == NULL || vec->frames == NULL || vec->worker == NULL || vec->thread == NULL) {
+		pi_cones_vec_env_destroy(vec);
+		return NULL;
+	}
+	// set up one at a time
+	for (vec->num_envs = 0; vec->num_envs < num_envs; vec->num_envs++) {
+		vec->env[vec->num_envs] = pi_cones_env_create(rom, PI_CONES_ENV_OBS_INDEX,
+			vec->frames + vec->num_envs * PI_CONES_ENV_PIXELS);
+		if (vec->env[vec->num_envs] == NULL) {
+			pi_cones_vec_env_destroy(vec);
+			return NULL;
+		}
+	}
+
+	InitializeCriticalSection(&vec->lock);
+	InitializeConditionVariable(&vec->start);
+	InitializeConditionVariable(&vec->done);
+	for (i = 0; i < num_workers; i++) {
+		vec->worker[i].vec = vec;
+		vec->worker[i].first = i * num_envs / num_workers;
+		vec->worker[i].end = (i + 1) * num_envs / num_workers;
+	}
+	for (vec->num_workers = 1; vec->num_workers < num_workers; vec->num_workers++) {
+		vec->thread[vec->num_workers] = CreateThread(NULL, 0, pi_cones_vec_env_thread, &vec->worker[vec->num_workers], 0, NULL);
+		if (vec->thread[vec->num_workers] == NULL) {
+			pi_cones_vec_env_destroy(vec);
+			return NULL;
+		}
+	}
+	return vec;
+}
+
+void pi_cones_vec_env_destroy(pi_cones_vec_env_t* vec)
+{
+	uint i;
+
+	if (vec->num_workers > 1) {
+		EnterCriticalSection(&vec->lock);
+		vec->quit = true;
+		LeaveCriticalSection(&vec->lock);
+		WakeAllConditionVariable(&vec->start);
+		WaitForMultipleObjects(vec->num_workers - 1, vec->thread + 1, TRUE, INFINITE);
+		for (i = 1; i < vec->num_workers; i++) CloseHandle(vec->thread[i]);
+	}
+	if (vec->num_workers) DeleteCriticalSection(&vec->lock);
+	for (i = 0; i < vec->num_envs; i++) pi_cones_env_destroy(vec->env[i]);
+	free(vec->env);
+	free(vec->frames);
+	free(vec->worker);
+	free(vec->thread);
+	free(vec);
+}
+
+const uint8_t* pi_cones_vec_env_step(pi_cones_vec_env_t* vec, const uint8_t* actions)
+{
+	vec->actions = actions;
+	if (vec->num_workers > 1) {
+		EnterCriticalSection(&vec->lock);
+		vec->busy = vec->num_workers - 1;
+		vec->generation++;
+		LeaveCriticalSection(&vec->lock);
+		WakeAllConditionVariable(&vec->start);
+	}
+	pi_cones_vec_env_run(&vec->worker[0]);
+	if (vec->num_workers > 1) {
+		EnterCriticalSection(&vec->lock);
+		while (vec->busy) SleepConditionVariableCS(&vec->done, &vec->lock, INFINITE);
+		LeaveCriticalSection(&vec->lock);
+	}
+	return vec->frames;
+}
+
+void pi_cones_vec_env_reset(pi_cones_vec_env_t* vec)
+{
+	uint i;
+
+	for (i = 0; i < vec->num_envs; i++) pi_cones_env_reset(vec->env[i]);
+}
+#endif
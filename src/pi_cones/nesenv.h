@@ -0,0 +1,104 @@
+// Project:     pi_cones
+// File:        nesenv.h
+// Author:      Kamal Pillai
+// Date:        10/18/2026
+// Description:	Environment API for training agents on the host; steps an instance with a joypad action, and hands
+//              back its frame and ram in place
+
+#ifndef __NESENV_H
+#define __NESENV_H
+
+#include "nesstate.h"
+
+#ifdef WIN32
+#include <windows.h>
+
+#define PI_CONES_ENV_WIDTH 256
+#define PI_CONES_ENV_HEIGHT 240
+#define PI_CONES_ENV_PIXELS (PI_CONES_ENV_WIDTH * PI_CONES_ENV_HEIGHT)
+
+// what a step renders
+#define PI_CONES_ENV_OBS_RAM 0     // no pixels, the fastest; frame is NULL
+#define PI_CONES_ENV_OBS_RGB565 1  // uint16_t rgb565 pixels
+#define PI_CONES_ENV_OBS_INDEX 2   // uint8_t nes colour of each pixel, 0 to 63
+
+// joypad buttons, for the action
+#define PI_CONES_ENV_A 0x01
+#define PI_CONES_ENV_B 0x02
+#define PI_CONES_ENV_SELECT 0x04
+#define PI_CONES_ENV_START 0x08
+#define PI_CONES_ENV_UP 0x10
+#define PI_CONES_ENV_DOWN 0x20
+#define PI_CONES_ENV_LEFT 0x40
+#define PI_CONES_ENV_RIGHT 0x80
+
+// what the agent sees; points into the instance, and is only good until the next step or reset
+typedef struct {
+	const void* frame;   // PI_CONES_ENV_WIDTH x PI_CONES_ENV_HEIGHT, row major, or NULL
+	const uint8_t* ram;  // the NESSYS_RAM_SIZE bytes of system ram
+	uint32_t frame_number;  // frames emulated since the snapshot was taken
+} pi_cones_env_obs_t;
+
+typedef struct {
+	nessys_t* nes;
+	uint obs_type;
+	pi_cones_env_obs_t obs;
+	uint8_t* index_frame;   // PI_CONES_ENV_PIXELS, for PI_CONES_ENV_OBS_INDEX
+	uint8_t* snapshot;      // state reset goes back to
+	uint32_t snapshot_size;
+	uint32_t snapshot_frame;
+	bool own_index_frame;
+} pi_cones_env_t;
+
+// Makes an environment running the ines image in rom, which it uses in place, so it must outlive it; the
+// snapshot reset goes back to is taken at power on. index_frame is where an PI_CONES_ENV_OBS_INDEX environment
+// renders, or NULL to allocate it. Returns NULL if the cart can't be loaded
+pi_cones_env_t* pi_cones_env_create(const void* rom, uint obs_type, uint8_t* index_frame);
+void pi_cones_env_destroy(pi_cones_env_t* env);
+
+// Holds action on joypad 0 for frames frames, rendering only the last, and returns what it shows
+const pi_cones_env_obs_t* pi_cones_env_step(pi_cones_env_t* env, uint8_t action, uint frames);
+// Goes back to the snapshot; the frame isn't rendered again until the next step
+const pi_cones_env_obs_t* pi_cones_env_reset(pi_cones_env_t* env);
+// Takes the snapshot reset goes back to from the current state, such as once past the title screen
+bool pi_cones_env_snapshot(pi_cones_env_t* env);
+
+// Lockstep environments, all running the same cart; each call steps every one of them a frame, split across a fixed
+// pool of worker threads. Their frames are colour indices, laid out one after the other, so the batch can be handed
+// on as a num_envs x PI_CONES_ENV_HEIGHT x PI_CONES_ENV_WIDTH array as it is
+struct pi_cones_vec_env_s;
+
+typedef struct {
+	struct pi_cones_vec_env_s* vec;
+	uint first;  // envs this worker steps
+	uint end;
+} pi_cones_vec_worker_t;
+
+typedef struct pi_cones_vec_env_s {
+	uint num_envs;
+	pi_cones_env_t** env;
+	uint8_t* frames;          // num_envs * PI_CONES_ENV_PIXELS
+	const uint8_t* actions;   // of the step running
+	// the calling thread steps the first worker's envs itself, so there's a thread for each of the others
+	uint num_workers;
+	pi_cones_vec_worker_t* worker;
+	HANDLE* thread;
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE start;
+	CONDITION_VARIABLE done;
+	uint32_t generation;  // counts steps, so workers know when there's a new one
+	uint busy;            // workers still stepping
+	bool quit;
+} pi_cones_vec_env_t;
+
+// Makes num_envs environments, with num_workers threads stepping them, or one per processor if 0; returns NULL if
+// any can't be made
+pi_cones_vec_env_t* pi_cones_vec_env_create(const void* rom, uint num_envs, uint num_workers);
+void pi_cones_vec_env_destroy(pi_cones_vec_env_t* vec);
+// Steps every environment a frame, env i with actions[i]; returns the frames, which stay put until the next step
+const uint8_t* pi_cones_vec_env_step(pi_cones_vec_env_t* vec, const uint8_t* actions);
+// Resets every environment to its snapshot
+void pi_cones_vec_env_reset(pi_cones_vec_env_t* vec);
+#endif
+
+#endif
@@ -0,0 +1,203 @@
+// nesmovie.c
+// input movies
+// a movie is the state it starts from, and the joypads of each frame after it; games hold the same buttons for many
+// frames, so the joypads are stored as runs
+
+#include "nesmovie.h"
+
+#ifdef WIN32
+nesmovie_t nesmovie;
+
+uint32_t nesmovie_frame_hash(nessys_t* nes)
+{
+	const uint8_t* p[5] = { (const uint8_t*)&nes->reg, nes->sysmem, nes->ppu.mem, nes->ppu.oam, nes->prg_ram_base };
+	uint32_t size[5] = { sizeof(nes->reg), NESSYS_RAM_SIZE, NESSYS_PPU_MEM_SIZE, NESSYS_PPU_OAM_SIZE, nes->prg_ram_size };
+	uint32_t h = 0x811C9DC5;
+	uint i, j;
+
+	for (i = 0; i < 5; i++) {
+		for (j = 0; j < size[i]; j++) h = (h ^ p[i][j]) * 0x01000193;
+	}
+	return h;
+}
+
+void nesmovie_close()
+{
+	free(nesmovie.input);
+	free(nesmovie.rate);
+	free(nesmovie.hash);
+	free(nesmovie.start_state);
+	memset(&nesmovie, 0, sizeof(nesmovie_t));
+}
+
+bool nesmovie_record_start(nessys_t* nes)
+{
+	nesmovie_close();
+	nesmovie.start_size = nesstate_size(nes);
+	nesmovie.start_state = malloc(nesmovie.start_size);
+	if (nesmovie.start_state == NULL || !nesstate_save(nes, nesmovie.start_state, nesmovie.start_size)) {
+		printf("Can't save the state to start the movie from\n");
+		nesmovie_close();
+		return false;
+	}
+	nesmovie.recording = true;
+	return true;
+}
+
+void nesmovie_record_frame(nessys_t* nes)
+{
+	uint32_t n;
+
+	if (!nesmovie.recording) return;
+	if (nesmovie.frame >= nesmovie.alloc_frames) {
+		n = nesmovie.alloc_frames + NESMOVIE_ALLOC_FRAMES;
+		uint16_t* input = realloc(nesmovie.input, n * sizeof(uint16_t));
+		int16_t* rate = realloc(nesmovie.rate, n * sizeof(int16_t));
+		uint32_t* hash = realloc(nesmovie.hash, n * sizeof(uint32_t));
+		if (input) nesmovie.input = input;
+		if (rate) nesmovie.rate = rate;
+		if (hash) nesmovie.hash = hash;
+		if (input == NULL || rate == NULL || hash == NULL) {
+			printf("Out of memory at movie frame %d, recording stopped\n", nesmovie.frame);
+			nesmovie.recording = false;
+			return;
+		}
+		nesmovie.alloc_frames = n;
+	}
+	nesmovie.input[nesmovie.frame] = (nes->apu.joypad[1] << 8) | nes->apu.joypad[0];
+	nesmovie.rate[nesmovie.frame] = (int16_t)((int32_t)nes->apu.rate - NESSYS_SND_RATE_ONE);
+	nesmovie.hash[nesmovie.frame] = nesmovie_frame_hash(nes);
+	nesmovie.frame++;
+	nesmovie.frames = nesmovie.frame;
+}
+
+bool nesmovie_record_stop(nessys_t* nes, const char* path)
+{
+	nesmovie_header_t hdr;
+	uint8_t run[3];
+	uint32_t i, j;
+	FILE* f;
+
+	if (!nesmovie.recording && !nesmovie.frames) return false;
+	nesmovie.recording = false;
+	f = fopen(path, "wb");
+	if (f == NULL) {
+		printf("Can't write %s\n", path);
+		return false;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = NESMOVIE_MAGIC;
+	hdr.version = NESMOVIE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.cart_id = nes->cart_id;
+	hdr.frames = nesmovie.frames;
+	hdr.state_size = nesmovie.start_size;
+	hdr.flags = NESMOVIE_FLAG_HASHES | NESMOVIE_FLAG_RATES;
+	// the header is written again once the size of the runs is known
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(nesmovie.start_state, 1, nesmovie.start_size, f);
+	for (i = 0; i < nesmovie.frames; i = j) {
+		for (j = i + 1; j < nesmovie.frames && j - i < NESMOVIE_MAX_RUN && nesmovie.input[j] == nesmovie.input[i]; j++);
+		run[0] = (uint8_t)(j - i - 1);
+		run[1] = (uint8_t)nesmovie.input[i];
+		run[2] = (uint8_t)(nesmovie.input[i] >> 8);
+		fwrite(run, 1, sizeof(run), f);
+		hdr.input_size += sizeof(run);
+	}
+	fwrite(nesmovie.rate, sizeof(int16_t), nesmovie.frames, f);
+	fwrite(nesmovie.hash, sizeof(uint32_t), nesmovie.frames, f);
+	fseek(f, 0, SEEK_SET);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fclose(f);
+	printf("Movie %s: %d frames, %d bytes of input\n", path, nesmovie.frames, hdr.input_size);
+	return true;
+}
+
+bool nesmovie_play_start(nessys_t* nes, const char* path)
+{
+	nesmovie_header_t hdr;
+	uint8_t* runs = NULL;
+	uint32_t i, j, n;
+	bool ok = false;
+	FILE* f;
+
+	nesmovie_close();
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		printf("Can't open %s\n", path);
+		return false;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != NESMOVIE_MAGIC || hdr.version != NESMOVIE_VERSION) {
+		printf("%s isn't a movie this build can play\n", path);
+	} else if (hdr.cart_id != nes->cart_id) {
+		printf("%s was recorded on another cart\n", path);
+	} else {
+		fseek(f, hdr.header_size, SEEK_SET);
+		nesmovie.start_size = hdr.state_size;
+		nesmovie.start_state = malloc(hdr.state_size);
+		runs = malloc(hdr.input_size);
+		nesmovie.input = malloc(hdr.frames * sizeof(uint16_t));
+		if (hdr.flags & NESMOVIE_FLAG_RATES) nesmovie.rate = malloc(hdr.frames * sizeof(int16_t));
+		if (hdr.flags & NESMOVIE_FLAG_HASHES) nesmovie.hash = malloc(hdr.frames * sizeof(uint32_t));
+		ok = nesmovie.start_state && runs && nesmovie.input && (nesmovie.rate || !(hdr.flags & NESMOVIE_FLAG_RATES)) &&
+			(nesmovie.hash || !(hdr.flags & NESMOVIE_FLAG_HASHES)) &&
+			fread(nesmovie.start_state, 1, hdr.state_size, f) == hdr.state_size &&
+			fread(runs, 1, hdr.input_size, f) == hdr.input_size &&
+			(!nesmovie.rate || fread(nesmovie.rate, sizeof(int16_t), hdr.frames, f) == hdr.frames) &&
+			(!nesmovie.hash || fread(nesmovie.hash, sizeof(uint32_t), hdr.frames, f) == hdr.frames);
+		// expand the runs, which must cover the frames exactly
+		for (i = 0, j = 0; ok && i + 3 <= hdr.input_size; i += 3) {
+			for (n = runs[i] + 1; n > 0 && j < hdr.frames; n--) nesmovie.input[j++] = (runs[i + 2] << 8) | runs[i + 1];
+			ok = (n == 0);
+		}
+		ok = ok && j == hdr.frames && nesstate_load(nes, nesmovie.start_state, nesmovie.start_size);
+		if (!ok) printf("%s is damaged\n", path);
+	}
+	fclose(f);
+	free(runs);
+	if (!ok) {
+		nesmovie_close();
+		return false;
+	}
+	nesmovie.frames = hdr.frames;
+	nesmovie.alloc_frames = hdr.frames;
+	nesmovie.playing = true;
+	return true;
+}
+
+bool nesmovie_play_input(nessys_t* nes)
+{
+	if (!nesmovie.playing) return false;
+	if (nesmovie.frame >= nesmovie.frames) {
+		nesmovie.playing = false;
+		if (!nesmovie.hash) {
+			printf("Movie played %d frames\n", nesmovie.frames);
+		} else if (nesmovie.mismatches) {
+			printf("Movie played %d frames; %d differ from the recording, the first at frame %d\n", nesmovie.frames,
+				nesmovie.mismatches, nesmovie.first_mismatch);
+		} else {
+			printf("Movie played %d frames; every frame matches the recording\n", nesmovie.frames);
+		}
+		return false;
+	}
+	nes->apu.joypad[0] = (uint8_t)nesmovie.input[nesmovie.frame];
+	nes->apu.joypad[1] = (uint8_t)(nesmovie.input[nesmovie.frame] >> 8);
+	return true;
+}
+
+uint32_t nesmovie_play_rate(uint32_t rate)
+{
+	if (!nesmovie.playing || !nesmovie.rate || nesmovie.frame >= nesmovie.frames) return rate;
+	return NESSYS_SND_RATE_ONE + nesmovie.rate[nesmovie.frame];
+}
+
+void nesmovie_play_check(nessys_t* nes)
+{
+	if (!nesmovie.playing) return;
+	if (nesmovie.hash && nesmovie.hash[nesmovie.frame] != nesmovie_frame_hash(nes)) {
+		if (!nesmovie.mismatches) nesmovie.first_mismatch = nesmovie.frame;
+		nesmovie.mismatches++;
+	}
+	nesmovie.frame++;
+}
+#endif
@@ -0,0 +1,93 @@
+// Project:     pi_cones
+// File:        nesmovie.h
+// Author:      Kamal Pillai
+// Date:        10/18/2026
+// Description:	Input movies; the joypads of every frame from a start state, to replay gameplay exactly on the host
+
+#ifndef __NESMOVIE_H
+#define __NESMOVIE_H
+
+#include "nesstate.h"
+
+#ifdef WIN32
+// Movie format, version 2
+// Replay is exact as long as the emulation is; the frame hashes, if present, find the first frame it isn't
+// The apu is clocked per sample generated, so each frame's sound rate is kept too, as the game can see its timing
+//
+//   offset  size  contents
+//   0       4     magic, "NMOV"
+//   4       2     version
+//   6       2     header size
+//   8       4     cart id, from nessys_cart_id(); a movie only replays on the cart that recorded it
+//   12      4     number of frames
+//   16      4     size of the start state
+//   20      4     size of the input runs
+//   24      4     flags
+//   28      4     reserved, 0
+//   32      ...   start state, from nesstate_save
+//   ...     3*n   input runs; the number of frames in the run less 1, then joypad 0 and joypad 1
+//   ...     2*n   the sound rate of each frame, less NESSYS_SND_RATE_ONE, if NESMOVIE_FLAG_RATES is set
+//   ...     4*n   a hash of each frame, from nesmovie_frame_hash, if NESMOVIE_FLAG_HASHES is set
+#define NESMOVIE_MAGIC 0x564F4D4E  // "NMOV"
+#define NESMOVIE_VERSION 2
+#define NESMOVIE_FLAG_HASHES 0x1
+#define NESMOVIE_FLAG_RATES 0x2
+#define NESMOVIE_MAX_RUN 256
+// recording grows its buffers this many frames at a time
+#define NESMOVIE_ALLOC_FRAMES 4096
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t cart_id;
+	uint32_t frames;
+	uint32_t state_size;
+	uint32_t input_size;
+	uint32_t flags;
+	uint32_t reserved;
+} nesmovie_header_t;
+
+typedef struct {
+	bool recording;
+	bool playing;
+	uint32_t frame;   // next frame recorded or played
+	uint32_t frames;  // frames in the movie
+	uint32_t alloc_frames;
+	uint16_t* input;  // joypad 1 << 8 | joypad 0, for each frame
+	int16_t* rate;    // apu.rate - NESSYS_SND_RATE_ONE, for each frame; NULL if the movie has no rates
+	uint32_t* hash;   // NULL if the movie has no hashes
+	uint8_t* start_state;
+	uint32_t start_size;
+	// replay checks
+	uint32_t mismatches;
+	uint32_t first_mismatch;
+} nesmovie_t;
+
+// one per process, for the session instance (nessys_t.session)
+extern nesmovie_t nesmovie;
+
+// hash of what the game can see: cpu registers, system ram, ppu memory, oam and prg ram
+uint32_t nesmovie_frame_hash(nessys_t* nes);
+
+// starts recording from the current state; between frames
+bool nesmovie_record_start(nessys_t* nes);
+// records the joypads the frame just emulated ran with, and its hash
+void nesmovie_record_frame(nessys_t* nes);
+// writes the movie recorded so far, and stops recording
+bool nesmovie_record_stop(nessys_t* nes, const char* path);
+
+// reads a movie, and loads its start state; fails if it's for another cart
+bool nesmovie_play_start(nessys_t* nes, const char* path);
+// sets the joypads for the next frame; returns false, and stops, at the end of the movie
+bool nesmovie_play_input(nessys_t* nes);
+// the sound rate the next frame was recorded with, while playing; otherwise rate
+uint32_t nesmovie_play_rate(uint32_t rate);
+// compares the frame just emulated with the movie's hash
+void nesmovie_play_check(nessys_t* nes);
+
+// frees the movie
+void nesmovie_close();
+#endif
+
+#endif
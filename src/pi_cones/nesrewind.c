@@ -0,0 +1,222 @@
+// nesrewind.c
+// rewind history
+// each frame, the state is saved and XORed against the last frame's; most of it doesn't change, so the delta is
+// long runs of zero words, which are run length encoded into a ring. XOR is its own inverse, so the newest entry
+// takes the last frame's state straight back to the frame before it, decoding in place, with nothing allocated
+
+#include "nesrewind.h"
+
+#if NESREWIND_ENABLE
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+nesrewind_t nesrewind;
+
+// the budget holds the 2 states first, then the ring
+static uint32_t nesrewind_mem[NESREWIND_BUFFER_SIZE / 4];
+static uint32_t* nesrewind_ref;      // state of the last frame pushed
+static uint32_t* nesrewind_scratch;  // state being pushed
+static uint32_t* nesrewind_ring;
+
+#ifdef WIN32
+static LARGE_INTEGER nesrewind_qpc_freq;
+
+static uint32_t nesrewind_time_us()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return (uint32_t)((t.QuadPart * 1000000) / nesrewind_qpc_freq.QuadPart);
+}
+#else
+static uint32_t nesrewind_time_us()
+{
+	return time_us_32();
+}
+#endif
+
+// a payload is never more than twice the state, when every other word changes
+static inline uint32_t nesrewind_max_entry_words()
+{
+	return 2 * nesrewind.state_words + 2;
+}
+
+void nesrewind_reset(nessys_t* nes)
+{
+	uint32_t state_words;
+
+	memset(&nesrewind, 0, sizeof(nesrewind));
+#ifdef WIN32
+	QueryPerformanceFrequency(&nesrewind_qpc_freq);
+#endif
+	state_words = (nesstate_size(nes) + 3) >> 2;
+	if (4 * state_words + 2 > NESREWIND_BUFFER_SIZE / 4) {
+		printf("Rewind needs more than %d bytes for this cart, and is off\n", NESREWIND_BUFFER_SIZE);
+		return;
+	}
+	nesrewind.state_words = state_words;
+	nesrewind_ref = nesrewind_mem;
+	nesrewind_scratch = nesrewind_mem + state_words;
+	nesrewind_ring = nesrewind_mem + 2 * state_words;
+	nesrewind.ring_words = NESREWIND_BUFFER_SIZE / 4 - 2 * state_words;
+	// nesstate_save never writes the padding at the end of the last word, so it stays zero in both states
+	nesrewind_ref[state_words - 1] = 0;
+	nesrewind_scratch[state_words - 1] = 0;
+	nesrewind.enable = true;
+}
+
+// encodes cur ^ ref into out, or just cur if ref is NULL; returns the words written
+static uint32_t nesrewind_encode(uint32_t* out, const uint32_t* cur, const uint32_t* ref, uint32_t words)
+{
+	uint32_t i = 0, start, n = 0;
+
+	while (i < words) {
+		start = i;
+		while (i < words && cur[i] == (ref ? ref[i] : 0)) i++;
+		if (i > start) out[n++] = i - start;
+		if (i == words) break;
+		start = i;
+		n++;
+		while (i < words && cur[i] != (ref ? ref[i] : 0)) {
+			out[n++] = cur[i] ^ (ref ? ref[i] : 0);
+			i++;
+		}
+		out[n - (i - start) - 1] = NESREWIND_LITERAL_BIT | (i - start);
+	}
+	return n;
+}
+
+// applies a payload to state; a key frame replaces it
+static void nesrewind_decode(uint32_t* state, const uint32_t* in, uint32_t n, bool key)
+{
+	uint32_t i = 0, j, count;
+	const uint32_t* end = in + n;
+
+	while (in < end) {
+		count = *in & NESREWIND_COUNT_MASK;
+		if (*in++ & NESREWIND_LITERAL_BIT) {
+			if (key) {
+				for (j = 0; j < count; j++) state[i + j] = in[j];
+			} else {
+				for (j = 0; j < count; j++) state[i + j] ^= in[j];
+			}
+			in += count;
+		} else if (key) {
+			for (j = 0; j < count; j++) state[i + j] = 0;
+		}
+		i += count;
+	}
+}
+
+// makes room for an entry of up to need words at head, dropping the oldest entries
+static void nesrewind_make_room(uint32_t need)
+{
+	while (1) {
+		if (nesrewind.entries == 0) {
+			nesrewind.head = nesrewind.tail = 0;
+			nesrewind.wrapped = false;
+			return;
+		}
+		if (!nesrewind.wrapped) {
+			if (nesrewind.ring_words - nesrewind.head >= need) return;
+			// no room before the end of the ring; carry on from the start, over the oldest entries
+			nesrewind.wrap = nesrewind.head;
+			nesrewind.head = 0;
+			nesrewind.wrapped = true;
+		}
+		if (nesrewind.tail - nesrewind.head >= need) return;
+		nesrewind.tail += (nesrewind_ring[nesrewind.tail] & NESREWIND_COUNT_MASK) + 2;
+		nesrewind.entries--;
+		if (nesrewind.tail >= nesrewind.wrap) {
+			nesrewind.tail = 0;
+			nesrewind.wrapped = false;
+		}
+	}
+}
+
+void nesrewind_push(nessys_t* nes)
+{
+	uint32_t start_us, us, n, hdr;
+	uint32_t* entry;
+	uint32_t* t;
+	bool key;
+
+	if (!nesrewind.enable) return;
+	start_us = nesrewind_time_us();
+	nesstate_save(nes, (uint8_t*)nesrewind_scratch, 4 * nesrewind.state_words);
+	if (nesrewind.have_ref) {
+		// the entry takes this frame back to the last one; a key entry holds the last frame whole
+		key = (++nesrewind.frames_since_key >= NESREWIND_KEY_INTERVAL);
+		if (key) nesrewind.frames_since_key = 0;
+		nesrewind_make_room(nesrewind_max_entry_words());
+		entry = nesrewind_ring + nesrewind.head;
+		n = key ? nesrewind_encode(entry + 1, nesrewind_ref, NULL, nesrewind.state_words) :
+			nesrewind_encode(entry + 1, nesrewind_scratch, nesrewind_ref, nesrewind.state_words);
+		hdr = n | (key ? NESREWIND_KEY_BIT : 0);
+		entry[0] = hdr;
+		entry[n + 1] = hdr;
+		nesrewind.head += n + 2;
+		nesrewind.entries++;
+		nesrewind.raw_bytes += 4 * nesrewind.state_words;
+		nesrewind.stored_bytes += 4 * (n + 2);
+	}
+	t = nesrewind_ref;
+	nesrewind_ref = nesrewind_scratch;
+	nesrewind_scratch = t;
+	nesrewind.have_ref = true;
+
+	us = nesrewind_time_us() - start_us;
+	nesrewind.pushes++;
+	nesrewind.push_us_total += us;
+	if (us > nesrewind.push_us_max) nesrewind.push_us_max = us;
+}
+
+bool nesrewind_pop(nessys_t* nes)
+{
+	uint32_t start_us, us, hdr, n;
+
+	if (!nesrewind.enable || nesrewind.entries == 0) return false;
+	start_us = nesrewind_time_us();
+	if (nesrewind.head == 0 && nesrewind.wrapped) {
+		// the newest entries end where the ring wrapped
+		nesrewind.head = nesrewind.wrap;
+		nesrewind.wrapped = false;
+	}
+	hdr = nesrewind_ring[nesrewind.head - 1];
+	n = hdr & NESREWIND_COUNT_MASK;
+	nesrewind_decode(nesrewind_ref, nesrewind_ring + nesrewind.head - n - 1, n, (hdr & NESREWIND_KEY_BIT) != 0);
+	nesrewind.head -= n + 2;
+	nesrewind.entries--;
+	if (nesrewind.entries == 0) {
+		nesrewind.head = nesrewind.tail = 0;
+		nesrewind.wrapped = false;
+	}
+	if (nesrewind.frames_since_key) nesrewind.frames_since_key--;
+	nesstate_load(nes, (const uint8_t*)nesrewind_ref, nesstate_size(nes));
+
+	us = nesrewind_time_us() - start_us;
+	nesrewind.pops++;
+	nesrewind.pop_us_total += us;
+	if (us > nesrewind.pop_us_max) nesrewind.pop_us_max = us;
+	return true;
+}
+
+#ifdef WIN32
+void nesrewind_print_stats()
+{
+	printf("  %d frames held (%0.1f s) in %d KB, %d byte states\n", nesrewind.entries, nesrewind.entries / 60.0f,
+		NESREWIND_BUFFER_SIZE / 1024, 4 * nesrewind.state_words);
+	if (nesrewind.stored_bytes) {
+		printf("  %0.1f bytes stored per frame, %0.1f:1 compression\n",
+			(float)nesrewind.stored_bytes * 4 * nesrewind.state_words / nesrewind.raw_bytes,
+			(float)nesrewind.raw_bytes / nesrewind.stored_bytes);
+	}
+	if (nesrewind.pushes) {
+		printf("  push %0.1f us (max %d us)\n", (float)nesrewind.push_us_total / nesrewind.pushes, nesrewind.push_us_max);
+	}
+	if (nesrewind.pops) {
+		printf("  pop %0.1f us (max %d us)\n", (float)nesrewind.pop_us_total / nesrewind.pops, nesrewind.pop_us_max);
+	}
+}
+#endif
+#endif
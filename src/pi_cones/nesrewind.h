@@ -0,0 +1,80 @@
+// Project:     pi_cones
+// File:        nesrewind.h
+// Author:      Kamal Pillai
+// Date:        10/18/2026
+// Description:	Rewind history; a ring of per frame save state deltas, XORed against the previous frame and run length encoded
+
+#ifndef __NESREWIND_H
+#define __NESREWIND_H
+
+#include "nesstate.h"
+
+// the double buffered framebuffer takes most of the pico's sram, so rewind is only on by default on win32
+#ifndef NESREWIND_ENABLE
+#ifdef WIN32
+#define NESREWIND_ENABLE 1
+#else
+#define NESREWIND_ENABLE 0
+#endif
+#endif
+
+// fixed budget for the history, including the 2 uncompressed states it works from
+#ifndef NESREWIND_BUFFER_SIZE
+#define NESREWIND_BUFFER_SIZE (4 * 1024 * 1024)
+#endif
+
+// every this many frames, an entry holds a whole state instead of a delta, so an error can't carry back further
+#define NESREWIND_KEY_INTERVAL 60
+
+// entries start and end with a word holding the payload size in words, and this bit for key frames; the payload is
+// a run of tokens, each a word with the number of words it covers, and this bit if those words follow it;
+// without it, the words are unchanged (zero in a key frame)
+#define NESREWIND_KEY_BIT 0x80000000
+#define NESREWIND_LITERAL_BIT 0x80000000
+#define NESREWIND_COUNT_MASK 0x7FFFFFFF
+
+typedef struct {
+	bool enable;
+	bool have_ref;  // ref holds the state of the last frame pushed
+	bool wrapped;   // entries run from tail to wrap, then from the start of the ring to head
+	uint32_t state_words;  // size of a state, rounded up to whole words
+	uint32_t ring_words;
+	uint32_t head;  // word offsets in the ring
+	uint32_t tail;
+	uint32_t wrap;
+	uint32_t entries;
+	uint32_t frames_since_key;
+	// statistics
+	uint32_t pushes;
+	uint32_t pops;
+	uint64_t raw_bytes;     // uncompressed size of the states pushed
+	uint64_t stored_bytes;  // bytes of the entries made for them
+	uint32_t push_us_total;
+	uint32_t push_us_max;
+	uint32_t pop_us_total;
+	uint32_t pop_us_max;
+} nesrewind_t;
+
+#if NESREWIND_ENABLE
+// one per process, for the session instance (nessys_t.session)
+extern nesrewind_t nesrewind;
+
+// clears the history, and sizes it for the loaded cart; called when a cart is loaded
+void nesrewind_reset(nessys_t* nes);
+// records the frame just emulated; called between frames
+void nesrewind_push(nessys_t* nes);
+// goes back one frame, decoding the newest entry in place; returns false when there's no more history
+bool nesrewind_pop(nessys_t* nes);
+// frames of history held
+static inline uint32_t nesrewind_frames() { return nesrewind.entries; }
+#ifdef WIN32
+void nesrewind_print_stats();
+#endif
+#else
+static inline void nesrewind_reset(nessys_t* nes) {}
+static inline void nesrewind_push(nessys_t* nes) {}
+static inline bool nesrewind_pop(nessys_t* nes) { return false; }
+static inline uint32_t nesrewind_frames() { return 0; }
+#endif
+
+#endif
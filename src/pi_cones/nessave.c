@@ -0,0 +1,345 @@
+// nessave.c
+// battery backed prg ram persistence
+// stores only mark their 256 byte page dirty; once the game has stopped writing for a while, a few dirty pages are
+// written out each vblank. on win32 they go to a save file; on the pico, to a journal of pages that runs round the
+// last sectors of flash, so every sector is erased equally often
+
+#include "nessave.h"
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+nessave_t nessave;
+
+#ifdef WIN32
+// the save file is a header, followed by the ram
+typedef struct {
+	uint32_t magic;
+	uint32_t cart_id;
+	uint32_t ram_size;
+	uint32_t reserved;
+} nessave_file_header_t;
+
+static FILE* nessave_file = NULL;
+static LARGE_INTEGER nessave_qpc_freq;
+
+static uint32_t nessave_time_us()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return (uint32_t)((t.QuadPart * 1000000) / nessave_qpc_freq.QuadPart);
+}
+#else
+// how long core 1 may take to reach its lockout handler
+#define NESSAVE_LOCKOUT_MS 10
+
+// flash can only be programmed from sram
+static uint8_t nessave_page_buf[FLASH_PAGE_SIZE];
+
+static uint32_t nessave_time_us()
+{
+	return time_us_32();
+}
+#endif
+
+static inline uint nessave_num_pages()
+{
+	return (nessave.size + NESSAVE_PAGE_SIZE - 1) >> NESSAVE_PAGE_SIZE_LOG2;
+}
+
+// bytes of ram in a page; only the last page of a ram smaller than a page is short
+static inline uint nessave_page_bytes(uint page)
+{
+	uint32_t left = nessave.size - (page << NESSAVE_PAGE_SIZE_LOG2);
+	return (left < NESSAVE_PAGE_SIZE) ? left : NESSAVE_PAGE_SIZE;
+}
+
+#ifndef WIN32
+// ------------------------------------------------------------
+// flash journal
+// each sector starts with a header page, listing the ram page held in each of the remaining slots; a slot's entry is
+// programmed after its data, so an interrupted write leaves the entry blank. sectors are replayed in sequence order,
+// so the latest copy of a page wins. the sector after the head is erased before it's started, and the live pages of
+// the sector after that, the oldest, are copied into it, so the oldest can be erased as the next spare
+
+static inline uint32_t nessave_sector_offset(uint s)
+{
+	return NESSAVE_FLASH_OFFSET + s * FLASH_SECTOR_SIZE;
+}
+
+static inline const uint8_t* nessave_flash_ptr(uint32_t offset)
+{
+	return (const uint8_t*)(XIP_BASE + offset);
+}
+
+static inline const nessave_sector_header_t* nessave_sector_header(uint s)
+{
+	return (const nessave_sector_header_t*)nessave_flash_ptr(nessave_sector_offset(s));
+}
+
+static inline uint32_t nessave_slot_offset(uint s, uint slot)
+{
+	return nessave_sector_offset(s) + (slot + 1) * FLASH_PAGE_SIZE;
+}
+
+static bool nessave_sector_valid(uint s)
+{
+	const nessave_sector_header_t* hdr = nessave_sector_header(s);
+	return hdr->magic == NESSAVE_MAGIC && hdr->cart_id == nessave.cart_id && hdr->ram_size == nessave.size;
+}
+
+static bool nessave_blank(uint32_t offset, uint32_t size)
+{
+	const uint32_t* p = (const uint32_t*)nessave_flash_ptr(offset);
+	uint32_t i;
+	for (i = 0; i < size / 4; i++) {
+		if (p[i] != 0xFFFFFFFF) return false;
+	}
+	return true;
+}
+
+static void nessave_erase(uint s)
+{
+	if (nessave_blank(nessave_sector_offset(s), FLASH_SECTOR_SIZE)) return;
+	flash_range_erase(nessave_sector_offset(s), FLASH_SECTOR_SIZE);
+	nessave.erases++;
+}
+
+// writes a page into the next slot of the head sector, which must have room
+static void nessave_program_slot(uint page)
+{
+	uint s = nessave.head_sector;
+	uint slot = nessave.head_slot++;
+	nessave_sector_header_t* hdr = (nessave_sector_header_t*)nessave_page_buf;
+
+	memset(nessave_page_buf, 0xFF, FLASH_PAGE_SIZE);
+	memcpy(nessave_page_buf, nessave.ram + (page << NESSAVE_PAGE_SIZE_LOG2), nessave_page_bytes(page));
+	flash_range_program(nessave_slot_offset(s, slot), nessave_page_buf, FLASH_PAGE_SIZE);
+	// then commit it; programming only clears bits, so the rest of the header is left as it is with 1s
+	memset(nessave_page_buf, 0xFF, FLASH_PAGE_SIZE);
+	hdr->page[slot] = page;
+	flash_range_program(nessave_sector_offset(s), nessave_page_buf, FLASH_PAGE_SIZE);
+	nessave.loc[page] = (s << 4) | slot;
+	nessave.pages_written++;
+}
+
+// starts the sector after the head, and frees the one after that
+static void nessave_advance()
+{
+	uint s = (nessave.head_sector + 1) % NESSAVE_FLASH_SECTORS;
+	uint oldest = (s + 1) % NESSAVE_FLASH_SECTORS;
+	nessave_sector_header_t* hdr = (nessave_sector_header_t*)nessave_page_buf;
+	uint p;
+
+	// the spare only holds live pages if a flush was cut short; they're still in ram, so write them again later
+	for (p = 0; p < NESSAVE_MAX_PAGES; p++) {
+		if (nessave.loc[p] != NESSAVE_NO_LOC && (nessave.loc[p] >> 4) == s) {
+			nessave.loc[p] = NESSAVE_NO_LOC;
+			nessave.dirty[p >> 5] |= 1u << (p & 0x1f);
+		}
+	}
+	nessave_erase(s);
+	memset(nessave_page_buf, 0xFF, FLASH_PAGE_SIZE);
+	hdr->magic = NESSAVE_MAGIC;
+	hdr->seq = ++nessave.head_seq;
+	hdr->cart_id = nessave.cart_id;
+	hdr->ram_size = nessave.size;
+	flash_range_program(nessave_sector_offset(s), nessave_page_buf, FLASH_PAGE_SIZE);
+	nessave.head_sector = s;
+	nessave.head_slot = 0;
+
+	// a sector has as many slots as the oldest can have live pages, so they always fit
+	for (p = 0; p < NESSAVE_MAX_PAGES; p++) {
+		if (nessave.loc[p] != NESSAVE_NO_LOC && (nessave.loc[p] >> 4) == oldest) nessave_program_slot(p);
+	}
+	if (!nessave_blank(nessave_sector_offset(oldest), FLASH_SECTOR_SIZE)) {
+		// invalidate the header first, in case the erase is cut short
+		memset(nessave_page_buf, 0xFF, FLASH_PAGE_SIZE);
+		hdr->magic = 0;
+		flash_range_program(nessave_sector_offset(oldest), nessave_page_buf, FLASH_PAGE_SIZE);
+		nessave_erase(oldest);
+	}
+}
+
+static void nessave_write_page(uint page)
+{
+	if (nessave.head_slot >= NESSAVE_SECTOR_SLOTS) nessave_advance();
+	nessave_program_slot(page);
+}
+
+// rebuilds the ram, and the location of each page, from the journal
+static void nessave_journal_load()
+{
+	const nessave_sector_header_t* hdr;
+	uint32_t seq = 0, next_seq;
+	int next;
+	uint s, i, page;
+
+	for (i = 0; i < NESSAVE_MAX_PAGES; i++) nessave.loc[i] = NESSAVE_NO_LOC;
+	// with nothing saved, the first write starts sector 0
+	nessave.head_sector = NESSAVE_FLASH_SECTORS - 1;
+	nessave.head_slot = NESSAVE_SECTOR_SLOTS;
+	nessave.head_seq = 0;
+
+	while (1) {
+		// find the valid sector that follows seq
+		next = -1;
+		next_seq = ~0;
+		for (s = 0; s < NESSAVE_FLASH_SECTORS; s++) {
+			hdr = nessave_sector_header(s);
+			if (nessave_sector_valid(s) && hdr->seq > seq && hdr->seq < next_seq) {
+				next = s;
+				next_seq = hdr->seq;
+			}
+		}
+		if (next < 0) break;
+
+		hdr = nessave_sector_header(next);
+		for (i = 0; i < NESSAVE_SECTOR_SLOTS; i++) {
+			page = hdr->page[i];
+			if (page >= nessave_num_pages()) continue;
+			memcpy(nessave.ram + (page << NESSAVE_PAGE_SIZE_LOG2), nessave_flash_ptr(nessave_slot_offset(next, i)), nessave_page_bytes(page));
+			nessave.loc[page] = (next << 4) | i;
+		}
+		// writes carry on after the last slot used; one programmed without its entry can't be reused
+		for (i = NESSAVE_SECTOR_SLOTS; i > 0 && hdr->page[i - 1] == 0xFFFF; i--);
+		while (i < NESSAVE_SECTOR_SLOTS && !nessave_blank(nessave_slot_offset(next, i), FLASH_PAGE_SIZE)) i++;
+		nessave.head_sector = next;
+		nessave.head_slot = i;
+		nessave.head_seq = seq = next_seq;
+	}
+}
+#endif
+
+// writes up to max_pages dirty pages
+static void nessave_write_dirty(uint max_pages)
+{
+	uint p, n = 0;
+
+	for (p = 0; p < nessave_num_pages() && n < max_pages; p++) {
+		if (!(nessave.dirty[p >> 5] & (1u << (p & 0x1f)))) continue;
+		nessave.dirty[p >> 5] &= ~(1u << (p & 0x1f));
+#ifdef WIN32
+		fseek(nessave_file, sizeof(nessave_file_header_t) + (p << NESSAVE_PAGE_SIZE_LOG2), SEEK_SET);
+		fwrite(nessave.ram + (p << NESSAVE_PAGE_SIZE_LOG2), 1, nessave_page_bytes(p), nessave_file);
+		nessave.pages_written++;
+#else
+		nessave_write_page(p);
+#endif
+		n++;
+	}
+}
+
+#ifndef WIN32
+// runs with core 1 paused and interrupts off
+static void nessave_flash_flush(void* param)
+{
+	nessave_write_dirty(*(uint*)param);
+}
+#endif
+
+static bool nessave_any_dirty()
+{
+	uint i;
+	for (i = 0; i < NESSAVE_MAX_PAGES / 32; i++) {
+		if (nessave.dirty[i]) return true;
+	}
+	return false;
+}
+
+// writes dirty pages out, and reports how long the emulator stalled for it
+static void nessave_flush(uint max_pages)
+{
+	uint32_t start = nessave_time_us();
+	uint32_t pages = nessave.pages_written;
+	uint32_t erases = nessave.erases;
+
+#ifdef WIN32
+	if (nessave_file == NULL) return;
+	nessave_write_dirty(max_pages);
+	fflush(nessave_file);
+#else
+	if (flash_safe_execute(nessave_flash_flush, &max_pages, NESSAVE_LOCKOUT_MS) != PICO_OK) {
+		// the pages are still dirty, and are tried again next time
+		printf("Save flush couldn't lock out core 1\n");
+		return;
+	}
+#endif
+	nessave.last_flush_us = nessave_time_us() - start;
+	if (nessave.last_flush_us > nessave.max_flush_us) nessave.max_flush_us = nessave.last_flush_us;
+	nessave.flushes++;
+	printf("Save flush: %d pages, %d erases, %dus stall (max %dus)\n", nessave.pages_written - pages,
+		nessave.erases - erases, nessave.last_flush_us, nessave.max_flush_us);
+}
+
+void nessave_load(nessys_t* nes, const char* path)
+{
+	memset(&nessave, 0, sizeof(nessave_t));
+	nessave.size = (nes->prg_ram_size < NESSAVE_MAX_PAGES * NESSAVE_PAGE_SIZE) ? nes->prg_ram_size : NESSAVE_MAX_PAGES * NESSAVE_PAGE_SIZE;
+	nessave.cart_id = nes->cart_id;
+	nessave.ram = nes->prg_ram_base;
+
+#ifdef WIN32
+	nessave_file_header_t hdr;
+	bool restored = false;
+
+	QueryPerformanceFrequency(&nessave_qpc_freq);
+	nessave_file = fopen(path, "r+b");
+	if (nessave_file) {
+		restored = fread(&hdr, sizeof(hdr), 1, nessave_file) == 1 && hdr.magic == NESSAVE_MAGIC &&
+			hdr.cart_id == nessave.cart_id && hdr.ram_size == nessave.size &&
+			fread(nessave.ram, 1, nessave.size, nessave_file) == nessave.size;
+	} else {
+		nessave_file = fopen(path, "w+b");
+	}
+	if (nessave_file == NULL) {
+		printf("Can't open %s, the game won't be saved\n", path);
+		nessave.size = 0;
+		return;
+	}
+	if (!restored) {
+		// a new save, or one from another cart; start the file over from what's in ram
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = NESSAVE_MAGIC;
+		hdr.cart_id = nessave.cart_id;
+		hdr.ram_size = nessave.size;
+		fseek(nessave_file, 0, SEEK_SET);
+		fwrite(&hdr, sizeof(hdr), 1, nessave_file);
+		fwrite(nessave.ram, 1, nessave.size, nessave_file);
+		fflush(nessave_file);
+	}
+#else
+	nessave_journal_load();
+#endif
+}
+
+void nessave_end_frame()
+{
+	if (!nessave.size) return;
+	if (nessave.written) {
+		nessave.written = false;
+		nessave.idle_frames = 0;
+		return;
+	}
+	if (nessave.idle_frames < NESSAVE_IDLE_FRAMES) {
+		nessave.idle_frames++;
+		return;
+	}
+	if (nessave_any_dirty()) nessave_flush(NESSAVE_FLUSH_PAGES);
+}
+
+void nessave_flush_all()
+{
+	if (nessave.size && nessave_any_dirty()) nessave_flush(NESSAVE_MAX_PAGES);
+}
+
+void nessave_close()
+{
+	nessave_flush_all();
+#ifdef WIN32
+	if (nessave_file) fclose(nessave_file);
+	nessave_file = NULL;
+#endif
+	nessave.size = 0;
+	nessave.ram = NULL;
+}
@@ -0,0 +1,88 @@
+// Project:     pi_cones
+// File:        nessave.h
+// Author:      Kamal Pillai
+// Date:        10/18/2026
+// Description:	Battery backed prg ram persistence, flushing only the 256 byte pages that changed
+
+#ifndef __NESSAVE_H
+#define __NESSAVE_H
+
+#include "nessys.h"
+#ifndef WIN32
+#include "hardware/flash.h"
+#include "pico/flash.h"
+#endif
+
+#define NESSAVE_PAGE_SIZE_LOG2 8
+#define NESSAVE_PAGE_SIZE (1 << NESSAVE_PAGE_SIZE_LOG2)
+// up to 32KB of battery backed ram is persisted
+#define NESSAVE_MAX_PAGES 128
+#define NESSAVE_MAGIC 0x5653454E  // "NESV"
+
+// games write their save over several frames; wait for the writes to stop before flushing
+#define NESSAVE_IDLE_FRAMES 30
+// pages written per vblank flush, to bound the stall
+#define NESSAVE_FLUSH_PAGES 4
+
+#ifndef WIN32
+// wear levelled journal in the last sectors of flash; the first flash page of each sector is its header,
+// and every other page holds one ram page
+#define NESSAVE_FLASH_SECTORS 16
+#define NESSAVE_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - NESSAVE_FLASH_SECTORS * FLASH_SECTOR_SIZE)
+#define NESSAVE_SECTOR_SLOTS (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE - 1)
+#define NESSAVE_NO_LOC 0xFFFF
+
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;  // one more than the sector written before it; the highest is the journal head
+	uint32_t cart_id;
+	uint32_t ram_size;
+	uint16_t page[NESSAVE_SECTOR_SLOTS];  // ram page held in each slot; programmed after the slot, 0xFFFF until then
+} nessave_sector_header_t;
+#endif
+
+typedef struct {
+	uint8_t* ram;   // prg ram of the instance being persisted; other instances' stores are never in it
+	uint32_t size;  // bytes of prg ram persisted; 0 if the cart has no battery
+	uint32_t cart_id;
+	uint32_t dirty[NESSAVE_MAX_PAGES / 32];
+	bool written;  // a store dirtied a page since the last frame
+	uint16_t idle_frames;
+	// flush statistics
+	uint32_t flushes;
+	uint32_t pages_written;
+	uint32_t erases;
+	uint32_t last_flush_us;
+	uint32_t max_flush_us;
+#ifndef WIN32
+	uint16_t loc[NESSAVE_MAX_PAGES];  // sector << 4 | slot of each page's latest copy
+	uint8_t head_sector;
+	uint8_t head_slot;
+	uint32_t head_seq;  // 0 if the journal is empty
+#endif
+} nessave_t;
+
+// one per process, for the session instance (nessys_t.session)
+extern nessave_t nessave;
+
+// restores the battery backed prg ram of the loaded cart, and starts tracking writes to it
+// path is the save file on win32, and ignored on the pico
+void nessave_load(nessys_t* nes, const char* path);
+// counts quiet frames, and flushes a few dirty pages once the game stops writing; called every vblank
+void nessave_end_frame();
+// flushes every dirty page; for pauses, and unloading
+void nessave_flush_all();
+// flushes, and stops tracking
+void nessave_close();
+
+// marks the page holding p dirty, if p is in persisted prg ram
+static inline void nessave_mark(const uint8_t* p)
+{
+	uint32_t o = (uint32_t)(p - nessave.ram);
+	if (o < nessave.size) {
+		nessave.dirty[o >> (NESSAVE_PAGE_SIZE_LOG2 + 5)] |= 1u << ((o >> NESSAVE_PAGE_SIZE_LOG2) & 0x1f);
+		nessave.written = true;
+	}
+}
+
+#endif
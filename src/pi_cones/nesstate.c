@@ -0,0 +1,223 @@
+// nesstate.c
+// save states
+// the emulator's state is a few plain blocks: nessys_t, the cart's ram, and the mapper's state, so a state is a
+// handful of memcpys; only the pointers in nessys_t need translating, to and from (region, offset) pairs
+
+#include "nesstate.h"
+#include "nescache.h"
+#include "nessave.h"
+
+// marks a pointer that isn't in any region; the state can't be written
+#define NESSTATE_BAD_PTR 0xFFFFFFFF
+
+// ranges of nessys_t that belong to the running cart or the frontend rather than the game; kept on load
+typedef struct {
+	uint32_t start;
+	uint32_t end;
+} nesstate_range_t;
+
+#define NESSTATE_LIVE(first, last) { offsetof(nessys_t, first), offsetof(nessys_t, last) + sizeof(((nessys_t*)0)->last) }
+
+static const nesstate_range_t NESSTATE_LIVE_FIELDS[] = {
+	NESSTATE_LIVE(mapper_bg_setup, mapper_data),
+	NESSTATE_LIVE(rendered_frames, frame_delta_time),
+	NESSTATE_LIVE(c1_render_done, c1_parked),
+	NESSTATE_LIVE(snd_ring, snd_ring),
+	NESSTATE_LIVE(ppu.chr_rom_size, ppu.chr_ram_base),
+	NESSTATE_LIVE(ppu.mem_4screen, ppu.mem_4screen),
+	NESSTATE_LIVE(prg_rom_size, cart_id),
+	NESSTATE_LIVE(prg_rom_base, prg_ram_base),
+	NESSTATE_LIVE(framebuffer, cache),
+};
+
+// lists the pointers that are relocated; for rom windows, also where in rom they point, since the bank cache
+// may have them pointing at an sram copy
+static void nesstate_ptrs(nessys_t* nes, void** ptr[NESSTATE_NUM_PTRS], uint32_t rom_src[NESSTATE_NUM_PTRS])
+{
+	bool chr_rom = nes->ppu.chr_rom_base && !nes->ppu.chr_ram_base;
+	uint b, n = 0;
+
+	for (b = 0; b < NESSYS_PRG_NUM_BANKS; b++) {
+		if (rom_src) rom_src[n] = (nes->prg_bank_src[b] & NESSYS_BANK_SRC_RAM) ? NESSTATE_BAD_PTR :
+			(NESSTATE_REGION_PRG_ROM << 24) | nes->prg_bank_src[b];
+		ptr[n++] = (void**)&nes->prg_rom_bank[b];
+	}
+	for (b = 0; b < NESSYS_CHR_NUM_BANKS; b++) {
+		if (rom_src) rom_src[n] = (chr_rom && b <= NESSYS_CHR_ROM_END_BANK && nes->ppu.chr_bank_src[b] != NESSYS_BANK_SRC_NONE) ?
+			(NESSTATE_REGION_CHR_ROM << 24) | nes->ppu.chr_bank_src[b] : NESSTATE_BAD_PTR;
+		ptr[n++] = (void**)&nes->ppu.chr_rom_bank[b];
+	}
+	for (b = 0; b < NESSYS_CHR_NUM_BANKS; b++) {
+		if (rom_src) rom_src[n] = NESSTATE_BAD_PTR;
+		ptr[n++] = (void**)&nes->ppu.chr_ram_bank[b];
+	}
+	if (rom_src) {
+		for (b = n; b < NESSTATE_NUM_PTRS; b++) rom_src[b] = NESSTATE_BAD_PTR;
+	}
+	ptr[n++] = (void**)&nes->ppu.draw_tile_pix;
+	ptr[n++] = (void**)&nes->ppu.disp_tile_pix;
+	ptr[n++] = (void**)&nes->ppu.draw_attrib_pix;
+	ptr[n++] = (void**)&nes->ppu.disp_attrib_pix;
+	ptr[n++] = (void**)&nes->apu.reg;
+}
+
+static const uint8_t* nesstate_region_base(nessys_t* nes, uint region)
+{
+	switch (region) {
+	case NESSTATE_REGION_NES: return (const uint8_t*)nes;
+	case NESSTATE_REGION_PRG_ROM: return nes->prg_rom_base;
+	case NESSTATE_REGION_PRG_RAM: return nes->prg_ram_base;
+	case NESSTATE_REGION_CHR_ROM: return nes->ppu.chr_rom_base;
+	case NESSTATE_REGION_CHR_RAM: return nes->ppu.chr_ram_base;
+	case NESSTATE_REGION_4SCREEN: return nes->ppu.mem_4screen;
+	case NESSTATE_REGION_MAPPER: return nes->mapper_data;
+	}
+	return NULL;
+}
+
+static uint32_t nesstate_region_size(nessys_t* nes, uint region)
+{
+	switch (region) {
+	case NESSTATE_REGION_NES: return sizeof(nessys_t);
+	case NESSTATE_REGION_PRG_ROM: return nes->prg_rom_size;
+	case NESSTATE_REGION_PRG_RAM: return nes->prg_ram_size;
+	case NESSTATE_REGION_CHR_ROM: return nes->ppu.chr_rom_size;
+	case NESSTATE_REGION_CHR_RAM: return nes->ppu.chr_ram_size;
+	case NESSTATE_REGION_4SCREEN: return (nes->ppu.mem_4screen) ? NESSYS_PPU_MEM_SIZE : 0;
+	case NESSTATE_REGION_MAPPER: return nessys_mapper_state_size(nes);
+	}
+	return 0;
+}
+
+static uint32_t nesstate_encode(nessys_t* nes, const void* p, uint32_t rom_src)
+{
+	const uint8_t* base;
+	uint region;
+
+	if (p == NULL) return NESSTATE_REGION_NULL << 24;
+	for (region = NESSTATE_REGION_NES; region <= NESSTATE_REGION_MAPPER; region++) {
+		base = nesstate_region_base(nes, region);
+		if (base && (const uint8_t*)p >= base && (const uint8_t*)p < base + nesstate_region_size(nes, region)) {
+			return (region << 24) | (uint32_t)((const uint8_t*)p - base);
+		}
+	}
+	// a rom bank the bank cache copied into sram
+	return rom_src;
+}
+
+static bool nesstate_valid(nessys_t* nes, uint32_t reloc)
+{
+	uint region = reloc >> 24;
+	if (region == NESSTATE_REGION_NULL) return true;
+	return nesstate_region_base(nes, region) && (reloc & NESSTATE_OFFSET_MASK) < nesstate_region_size(nes, region);
+}
+
+static void* nesstate_decode(nessys_t* nes, uint32_t reloc)
+{
+	const uint8_t* base = nesstate_region_base(nes, reloc >> 24);
+	return (base) ? (void*)(base + (reloc & NESSTATE_OFFSET_MASK)) : NULL;
+}
+
+uint32_t nesstate_size(nessys_t* nes)
+{
+	return sizeof(nesstate_header_t) + sizeof(nessys_t) + NESSTATE_NUM_PTRS * sizeof(uint32_t) +
+		nes->prg_ram_size + nes->ppu.chr_ram_size + ((nes->ppu.mem_4screen) ? NESSYS_PPU_MEM_SIZE : 0) + nessys_mapper_state_size(nes);
+}
+
+uint32_t nesstate_save(nessys_t* nes, uint8_t* buf, uint32_t buf_size)
+{
+	nesstate_header_t* hdr = (nesstate_header_t*)buf;
+	void** ptr[NESSTATE_NUM_PTRS];
+	uint32_t rom_src[NESSTATE_NUM_PTRS];
+	uint32_t reloc, size = nesstate_size(nes);
+	uint8_t* pos;
+	uint i;
+
+	if (buf_size < size) return 0;
+	hdr->magic = NESSTATE_MAGIC;
+	hdr->version = NESSTATE_VERSION;
+	hdr->header_size = sizeof(nesstate_header_t);
+	hdr->cart_id = nes->cart_id;
+	hdr->size = size;
+	hdr->nes_size = sizeof(nessys_t);
+	hdr->num_relocs = NESSTATE_NUM_PTRS;
+	hdr->mapper_size = nessys_mapper_state_size(nes);
+	hdr->reserved = 0;
+	pos = buf + sizeof(nesstate_header_t);
+
+	memcpy(pos, nes, sizeof(nessys_t));
+	pos += sizeof(nessys_t);
+	nesstate_ptrs(nes, ptr, rom_src);
+	for (i = 0; i < NESSTATE_NUM_PTRS; i++) {
+		reloc = nesstate_encode(nes, *ptr[i], rom_src[i]);
+		if (reloc == NESSTATE_BAD_PTR) return 0;
+		memcpy(pos, &reloc, sizeof(uint32_t));
+		pos += sizeof(uint32_t);
+	}
+
+	memcpy(pos, nes->prg_ram_base, nes->prg_ram_size);
+	pos += nes->prg_ram_size;
+	memcpy(pos, nes->ppu.chr_ram_base, nes->ppu.chr_ram_size);
+	pos += nes->ppu.chr_ram_size;
+	if (nes->ppu.mem_4screen) {
+		memcpy(pos, nes->ppu.mem_4screen, NESSYS_PPU_MEM_SIZE);
+		pos += NESSYS_PPU_MEM_SIZE;
+	}
+	if (hdr->mapper_size) memcpy(pos, nes->mapper_data, hdr->mapper_size);
+	return size;
+}
+
+bool nesstate_load(nessys_t* nes, const uint8_t* buf, uint32_t size)
+{
+	nesstate_header_t hdr;
+	void** ptr[NESSTATE_NUM_PTRS];
+	uint32_t reloc[NESSTATE_NUM_PTRS];
+	uint32_t start, fixed, n, i;
+	const uint8_t* image;
+	const uint8_t* pos;
+
+	if (size < sizeof(nesstate_header_t)) return false;
+	memcpy(&hdr, buf, sizeof(nesstate_header_t));
+	if (hdr.magic != NESSTATE_MAGIC || hdr.version != NESSTATE_VERSION || hdr.header_size != sizeof(nesstate_header_t) ||
+		hdr.cart_id != nes->cart_id || hdr.size != nesstate_size(nes) || size < hdr.size || hdr.nes_size != sizeof(nessys_t) ||
+		hdr.num_relocs != NESSTATE_NUM_PTRS || hdr.mapper_size != nessys_mapper_state_size(nes)) return false;
+	image = buf + sizeof(nesstate_header_t);
+	pos = image + sizeof(nessys_t);
+	memcpy(reloc, pos, sizeof(reloc));
+	pos += sizeof(reloc);
+	for (i = 0; i < NESSTATE_NUM_PTRS; i++) {
+		if (!nesstate_valid(nes, reloc[i])) return false;
+	}
+
+	// copy the image around the live fields, then point the relocated pointers into this cart's memory
+	start = 0;
+	for (i = 0; i < sizeof(NESSTATE_LIVE_FIELDS) / sizeof(nesstate_range_t); i++) {
+		memcpy((uint8_t*)nes + start, image + start, NESSTATE_LIVE_FIELDS[i].start - start);
+		start = NESSTATE_LIVE_FIELDS[i].end;
+	}
+	memcpy((uint8_t*)nes + start, image + start, sizeof(nessys_t) - start);
+	nesstate_ptrs(nes, ptr, NULL);
+	for (i = 0; i < NESSTATE_NUM_PTRS; i++) *ptr[i] = nesstate_decode(nes, reloc[i]);
+
+	// battery backed pages are only saved again if the state changed them
+	for (i = 0; i < nes->prg_ram_size; i += n) {
+		n = (nes->prg_ram_size - i < NESSAVE_PAGE_SIZE) ? nes->prg_ram_size - i : NESSAVE_PAGE_SIZE;
+		if (memcmp(nes->prg_ram_base + i, pos + i, n)) {
+			memcpy(nes->prg_ram_base + i, pos + i, n);
+			nessave_mark(nes->prg_ram_base + i);
+		}
+	}
+	pos += nes->prg_ram_size;
+	memcpy(nes->ppu.chr_ram_base, pos, nes->ppu.chr_ram_size);
+	pos += nes->ppu.chr_ram_size;
+	if (nes->ppu.mem_4screen) {
+		memcpy(nes->ppu.mem_4screen, pos, NESSYS_PPU_MEM_SIZE);
+		pos += NESSYS_PPU_MEM_SIZE;
+	}
+	fixed = nessys_mapper_state_fixed(nes);
+	if (hdr.mapper_size > fixed) memcpy((uint8_t*)nes->mapper_data + fixed, pos + fixed, hdr.mapper_size - fixed);
+
+	// rom windows were restored pointing at flash; hand them back to the bank cache
+	nescache_remap(nes);
+	return true;
+}
@@ -0,0 +1,67 @@
+// Project:     pi_cones
+// File:        nesstate.h
+// Author:      Kamal Pillai
+// Date:        10/18/2026
+// Description:	Save states; bulk copies of the emulator's state, with its pointers stored as (region, offset) pairs
+
+#ifndef __NESSTATE_H
+#define __NESSTATE_H
+
+#include "nessys.h"
+
+// State format, version 1
+// States are taken between frames. Fields are in the byte order of the build that wrote the state, and since the
+// nessys_t image is copied as it is, a state only loads into a build with the same nessys_t layout
+//
+//   offset  size  contents
+//   0       4     magic, "NSTA"
+//   4       2     version
+//   6       2     header size
+//   8       4     cart id, from nessys_cart_id(); a state only loads into the cart that wrote it
+//   12      4     total size of the state, header included
+//   16      4     size of the nessys_t image
+//   20      4     number of relocations
+//   24      4     size of the mapper state
+//   28      4     reserved, 0
+//   32      ...   nessys_t image; its pointers, and fields that belong to the running cart or the frontend
+//                 (mapper callbacks, rom and ram bases, sound ring, frame pacing), are not restored
+//   ...     4*n   relocations, one for each pointer listed by nesstate_ptrs, in that order; region << 24 | offset
+//   ...     ...   prg ram, chr ram and 4 screen nametables, each only if the cart has it, at the cart's size
+//   ...     ...   mapper state
+#define NESSTATE_MAGIC 0x4154534E  // "NSTA"
+#define NESSTATE_VERSION 1
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t cart_id;
+	uint32_t size;
+	uint32_t nes_size;
+	uint32_t num_relocs;
+	uint32_t mapper_size;
+	uint32_t reserved;
+} nesstate_header_t;
+
+// regions a relocated pointer can point into
+#define NESSTATE_REGION_NULL 0
+#define NESSTATE_REGION_NES 1      // anywhere in nessys_t itself: sysmem, ppu memory, registers, the junk location
+#define NESSTATE_REGION_PRG_ROM 2
+#define NESSTATE_REGION_PRG_RAM 3
+#define NESSTATE_REGION_CHR_ROM 4
+#define NESSTATE_REGION_CHR_RAM 5
+#define NESSTATE_REGION_4SCREEN 6
+#define NESSTATE_REGION_MAPPER 7   // the mapper's state, such as MMC5 expansion ram mapped as a nametable
+#define NESSTATE_OFFSET_MASK 0xFFFFFF
+
+// bank tables, the ppu's tile and attribute buffers, and the apu register pointer
+#define NESSTATE_NUM_PTRS (NESSYS_PRG_NUM_BANKS + 2 * NESSYS_CHR_NUM_BANKS + 5)
+
+// bytes a state of the loaded cart takes
+uint32_t nesstate_size(nessys_t* nes);
+// writes a state of the loaded cart into buf; returns the bytes written, or 0 if buf is too small
+uint32_t nesstate_save(nessys_t* nes, uint8_t* buf, uint32_t buf_size);
+// restores a state written by nesstate_save; returns false, leaving the emulator as it was, if it doesn't fit the cart
+bool nesstate_load(nessys_t* nes, const uint8_t* buf, uint32_t size);
+
+#endif
@@ -2,268 +2,702 @@
 // system emulation of NES
 
 #include "nessys.h"
+#include "mapper.h"
+#include "nescache.h"
 
-void nessys_init()
-{
-	memset(&nes, 0, sizeof(nessys_t));
-	nes.apu.reg = nes.apu.reg_mem;
-	nes.apu.pulse[0].env.flags = NESSYS_APU_PULSE_FLAG_SWEEP_ONES_COMP;
-	nes.apu.noise.shift_reg = 0x01;
-	nes.apu.dmc.period = NESSYS_APU_DMC_PERIOD_TABLE[0];
-	nes.ppu.draw_tile_pix = nes.ppu.tile_pix;
-	nes.ppu.disp_tile_pix = nes.ppu.tile_pix + NESSYS_PPU_TILE_PIXEL_SIZE;
-	nes.ppu.draw_attrib_pix = nes.ppu.attrib_pix;
-	nes.ppu.disp_attrib_pix = nes.ppu.attrib_pix + NESSYS_PPU_ATTRIB_BYTES_PER_ROW;
-}
-
-void nessys_apu_reset()
-{
-	nes.apu.pulse[0].length = 0;
-	nes.apu.pulse[1].length = 0;
-	nes.apu.triangle.length = 0;
-	nes.apu.noise.length = 0;
-	nes.apu.noise.shift_reg = 0x01;
-	nes.apu.dmc.length = 0;
-	nes.apu.dmc.bytes_remaining = 0;
-	nes.apu.dmc.bits_remaining = 0;
-	nes.apu.dmc.flags = 0;
-}
-
-void nessys_power_cycle()
-{
-	nes.reg.p = 0x34;
-	nes.reg.a = 0;
-	nes.reg.x = 0;
-	nes.reg.y = 0;
-	nes.reg.s = 0xfd;
-	nes.apu.reg[0x17] = 0x0;
-	nes.apu.reg[0x15] = 0x0;
-	memset(nes.apu.reg, 0, 14); // regs 0x0 to 0x13
-	memset(nes.ppu.reg, 0, 8);  // clear all 8 regs
-	memset(nes.sysmem, 0, NESSYS_RAM_SIZE);
-	uint16_t bank, offset;
-	nes.reg.pc = *((uint16_t*)nessys_mem(NESSYS_RST_VECTOR, &bank, &offset));
-	nessys_apu_reset();
+// nonlinear mixer lookup tables, scaled to 16 bits
+#define NESSYS_APU_PULSE_MIX_SIZE 31
+#define NESSYS_APU_TND_MIX_SIZE 203
+static uint16_t nessys_apu_pulse_mix[NESSYS_APU_PULSE_MIX_SIZE];
+static uint16_t nessys_apu_tnd_mix[NESSYS_APU_TND_MIX_SIZE];
+
+static const uint8_t NESSYS_APU_TRIANGLE_SEQUENCE[32] = {
+	15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+};
+
+void nessys_init(nessys_t* nes)
+{
+	uint i;
+	memset(nes, 0, offsetof(nessys_t, framebuffer));
+	nes->apu.reg = nes->apu.reg_mem;
+	nes->apu.pulse[0].env.flags = NESSYS_APU_PULSE_FLAG_SWEEP_ONES_COMP;
+	nes->apu.noise.shift_reg = 0x01;
+	// the generators step through their periods, so they must never be 0, even before the game writes them
+	nes->apu.noise.period = NESSYS_APU_NOISE_PERIOD_TABLE[0];
+	nes->apu.dmc.period = NESSYS_APU_DMC_PERIOD_TABLE[0];
+	nes->apu.rate = NESSYS_SND_RATE_ONE;
+	nessys_apu_start_frame(nes, NESSYS_SND_RATE_ONE);
+	// pulse and tnd outputs add up to just under 1.0
+	nessys_apu_pulse_mix[0] = 0;
+	for (i = 1; i < NESSYS_APU_PULSE_MIX_SIZE; i++) {
+		nessys_apu_pulse_mix[i] = (uint16_t)(65535.0f * 95.52f / (8128.0f / i + 100.0f));
+	}
+	nessys_apu_tnd_mix[0] = 0;
+	for (i = 1; i < NESSYS_APU_TND_MIX_SIZE; i++) {
+		nessys_apu_tnd_mix[i] = (uint16_t)(65535.0f * 163.67f / (24329.0f / i + 100.0f));
+	}
+	nes->ppu.draw_tile_pix = nes->ppu.tile_pix;
+	nes->ppu.disp_tile_pix = nes->ppu.tile_pix + NESSYS_PPU_TILE_PIXEL_SIZE;
+	nes->ppu.draw_attrib_pix = nes->ppu.attrib_pix;
+	nes->ppu.disp_attrib_pix = nes->ppu.attrib_pix + NESSYS_PPU_ATTRIB_BYTES_PER_ROW;
+	nes->mapper_event_scan_clk = ~0;
 }
 
-void nessys_reset()
+void nessys_apu_reset(nessys_t* nes)
 {
-	nes.reg.s -= 3;
-	nes.reg.p |= 0x04;
-	nes.apu.reg[0x15] = 0x0;
-	nes.ppu.reg[0x0] = 0x0;
-	nes.ppu.reg[0x1] = 0x0;
-	nes.ppu.reg[0x5] = 0x0;
-	nes.ppu.reg[0x6] = 0x0;
-	nes.ppu.reg[0x7] = 0x0;
-	uint16_t bank, offset;
-	nes.reg.pc = *((uint16_t*)nessys_mem(NESSYS_RST_VECTOR, &bank, &offset));
-	nessys_apu_reset();
+	nes->apu.pulse[0].length = 0;
+	nes->apu.pulse[1].length = 0;
+	nes->apu.triangle.length = 0;
+	nes->apu.noise.length = 0;
+	nes->apu.noise.shift_reg = 0x01;
+	nes->apu.dmc.length = 0;
+	nes->apu.dmc.bytes_remaining = 0;
+	nes->apu.dmc.bits_remaining = 0;
+	nes->apu.dmc.flags = 0;
 }
 
-bool nessys_load_cart(const void* cart)
+void nessys_apu_env_tick(nessys_apu_envelope_t* envelope)
 {
-	bool success;
-	nessys_unload_cart();
-	success = ines_load_cart(cart);
-	if (success) {
-		nessys_default_memmap();
-		success = nessys_init_mapper();
-	}
-	if (success) {
-		nessys_power_cycle();
+	if (envelope->flags & NESSYS_APU_PULSE_FLAG_ENV_START) {
+		envelope->flags &= ~NESSYS_APU_PULSE_FLAG_ENV_START;
+		envelope->decay = 15;
+		envelope->divider = envelope->volume;
+	} else if (envelope->divider == 0) {
+		envelope->divider = envelope->volume;
+		if (envelope->decay) {
+			envelope->decay--;
+		} else if (envelope->flags & NESSYS_APU_PULSE_FLAG_HALT_LENGTH) {
+			// halt length also acts as the envelope loop flag
+			envelope->decay = 15;
+		}
 	} else {
-		nessys_unload_cart();
+		envelope->divider--;
 	}
+}
 
-	return success;
+void nessys_apu_tri_linear_tick(nessys_apu_triangle_t* triangle)
+{
+	if (triangle->flags & NESSYS_APU_TRIANGLE_FLAG_RELOAD) {
+		triangle->linear = triangle->reload;
+	} else if (triangle->linear) {
+		triangle->linear--;
+	}
+	if (!(triangle->flags & NESSYS_APU_TRIANGLE_FLAG_CONTROL)) {
+		triangle->flags &= ~NESSYS_APU_TRIANGLE_FLAG_RELOAD;
+	}
+}
+
+void nessys_apu_tri_length_tick(nessys_apu_triangle_t* triangle)
+{
+	if (triangle->length && !(triangle->flags & NESSYS_APU_TRIANGLE_FLAG_CONTROL)) {
+		triangle->length--;
+	}
 }
 
-void nessys_default_memmap()
+void nessys_apu_noise_length_tick(nessys_apu_noise_t* noise)
 {
-	nes.prg_rom_bank[NESSYS_SYS_RAM_START_BANK] = nes.sysmem;
-	nes.prg_rom_bank_mask[NESSYS_SYS_RAM_START_BANK] = NESSYS_RAM_MASK;
+	if (noise->length && !(noise->env.flags & NESSYS_APU_PULSE_FLAG_HALT_LENGTH)) {
+		noise->length--;
+	}
+}
 
-	nes.prg_rom_bank[NESSYS_PPU_REG_START_BANK] = nes.ppu.reg;
-	nes.prg_rom_bank_mask[NESSYS_PPU_REG_START_BANK] = NESSYS_PPU_REG_MASK;
+void nessys_apu_pulse_length_tick(nessys_apu_pulse_t* pulse)
+{
+	if (pulse->length && !(pulse->env.flags & NESSYS_APU_PULSE_FLAG_HALT_LENGTH)) {
+		pulse->length--;
+	}
+}
 
-	nes.prg_rom_bank[NESSYS_APU_REG_START_BANK] = nes.apu.reg;
-	nes.prg_rom_bank_mask[NESSYS_APU_REG_START_BANK] = NESSYS_APU_MASK;
+// returns the period the sweep unit would set the pulse to
+static inline uint16_t nessys_apu_sweep_target(nessys_apu_pulse_t* pulse)
+{
+	uint16_t change = pulse->period >> pulse->sweep_shift;
+	if (pulse->env.flags & NESSYS_APU_PULSE_FLAG_SWEEP_NEGATE) {
+		// pulse 0 uses ones complement, so subtracts an extra 1
+		change += (pulse->env.flags & NESSYS_APU_PULSE_FLAG_SWEEP_ONES_COMP);
+		return (change > pulse->period) ? 0 : pulse->period - change;
+	}
+	return pulse->period + change;
+}
 
-	if (nes.ppu.chr_ram_base) {
-		nes.prg_rom_bank[NESSYS_PRG_RAM_START_BANK] = nes.ppu.chr_ram_base;
-		nes.prg_rom_bank_mask[NESSYS_PRG_RAM_START_BANK] = NESSYS_PRG_MEM_MASK;
+void nessys_apu_sweep_tick(nessys_apu_pulse_t* pulse)
+{
+	uint16_t target = nessys_apu_sweep_target(pulse);
+	if (pulse->sweep_divider == 0 && (pulse->env.flags & NESSYS_APU_PULSE_FLAG_SWEEP_EN) &&
+		pulse->sweep_shift && pulse->period >= 8 && target <= 0x7ff) {
+		pulse->period = target;
+	}
+	if (pulse->sweep_divider == 0 || (pulse->env.flags & NESSYS_APU_PULSE_FLAG_SWEEP_RELOAD)) {
+		pulse->sweep_divider = pulse->sweep_period;
+		pulse->env.flags &= ~NESSYS_APU_PULSE_FLAG_SWEEP_RELOAD;
 	} else {
-		// point to some junk location
-		nes.prg_rom_bank[NESSYS_PRG_RAM_START_BANK] = &nes.reg.pad0;
-		nes.prg_rom_bank_mask[NESSYS_PRG_RAM_START_BANK] = 0x0;
+		pulse->sweep_divider--;
 	}
+}
 
-	int b;
-	uint32_t mem_offset = 0;
-	if (nes.prg_rom_base) {
-		// map the last 32KB of rom data
-		// if rom is less than 32KB, then map from the beggining, and wrap the addresses
-		mem_offset = (nes.prg_rom_size <= NESSYS_PRG_ADDR_SPACE - NESSYS_PRG_ROM_START) ?
-			0 : (nes.prg_rom_size - (NESSYS_PRG_ADDR_SPACE - NESSYS_PRG_ROM_START));
-		for (b = NESSYS_PRG_ROM_START_BANK; b < NESSYS_PRG_NUM_BANKS; b++) {
-			nes.prg_rom_bank[b] = nes.prg_rom_base + mem_offset;
-			nes.prg_rom_bank_mask[b] = NESSYS_PRG_MEM_MASK;
-			mem_offset += NESSYS_PRG_BANK_SIZE;
-			if (mem_offset >= nes.prg_rom_size) mem_offset -= nes.prg_rom_size;
+uint8_t nessys_apu_gen_pulse(nessys_t* nes, nessys_apu_pulse_t* pulse)
+{
+	// sequencer steps every 2 * (period + 1) cpu clocks
+	uint32_t step = ((uint32_t)pulse->period + 1) << (NESSYS_SND_APU_FRAC_LOG2 + 1);
+	pulse->cur_time_frac += nes->apu.cpu_frac_per_sample;
+	while (pulse->cur_time_frac >= step) {
+		pulse->cur_time_frac -= step;
+		pulse->duty_phase = (pulse->duty_phase + 1) & 0x7;
+	}
+	if (pulse->length == 0 || pulse->period < 8 || nessys_apu_sweep_target(pulse) > 0x7ff) return 0;
+	if (!((NESSYS_APU_PULSE_DUTY_TABLE[pulse->duty] >> pulse->duty_phase) & 0x1)) return 0;
+	return (pulse->env.flags & NESSYS_APU_PULSE_FLAG_CONST_VOLUME) ? pulse->env.volume : pulse->env.decay;
+}
+
+uint8_t nessys_apu_gen_triangle(nessys_t* nes, nessys_apu_triangle_t* triangle)
+{
+	// sequencer steps every (period + 1) cpu clocks, and only while both counters are non-zero
+	// very low periods are ultrasonic, so just hold the current output
+	uint32_t step = ((uint32_t)triangle->period + 1) << NESSYS_SND_APU_FRAC_LOG2;
+	if (triangle->length && triangle->linear && triangle->period >= 2) {
+		triangle->cur_time_frac += nes->apu.cpu_frac_per_sample;
+		while (triangle->cur_time_frac >= step) {
+			triangle->cur_time_frac -= step;
+			triangle->sequence = (triangle->sequence + 1) & 0x1f;
 		}
+	}
+	return NESSYS_APU_TRIANGLE_SEQUENCE[triangle->sequence];
+}
+
+uint8_t nessys_apu_gen_noise(nessys_t* nes, nessys_apu_noise_t* noise)
+{
+	uint32_t step = ((uint32_t)noise->period) << NESSYS_SND_APU_FRAC_LOG2;
+	uint16_t feedback;
+	// mode flag selects a tap on bit 6 instead of bit 1, for the short sequence
+	uint8_t tap = (noise->env.flags & NESSYS_APU_NOISE_FLAG_MODE) ? 6 : 1;
+	noise->cur_time_frac += nes->apu.cpu_frac_per_sample;
+	while (noise->cur_time_frac >= step) {
+		noise->cur_time_frac -= step;
+		feedback = (noise->shift_reg ^ (noise->shift_reg >> tap)) & 0x1;
+		noise->shift_reg = (noise->shift_reg >> 1) | (feedback << 14);
+	}
+	if (noise->length == 0 || (noise->shift_reg & 0x1)) return 0;
+	return (noise->env.flags & NESSYS_APU_PULSE_FLAG_CONST_VOLUME) ? noise->env.volume : noise->env.decay;
+}
+
+// Applies the next delta bit to the dmc output level
+static inline void nessys_apu_dmc_bit(nessys_apu_dmc_t* dmc)
+{
+	if (dmc->delta_buffer & 0x1) {
+		if (dmc->output <= 125) dmc->output += 2;
 	} else {
-		for (b = NESSYS_PRG_ROM_START_BANK; b < NESSYS_PRG_NUM_BANKS; b++) {
-			nes.prg_rom_bank[b] = &nes.reg.pad0;
-			nes.prg_rom_bank_mask[b] = 0x0;
+		if (dmc->output >= 2) dmc->output -= 2;
+	}
+	dmc->delta_buffer >>= 1;
+	dmc->bits_remaining--;
+}
+
+uint8_t nessys_apu_gen_dmc(nessys_t* nes)
+{
+	nessys_apu_dmc_t* dmc = &nes->apu.dmc;
+	uint32_t step = ((uint32_t)dmc->period) << NESSYS_SND_APU_FRAC_LOG2;
+	// bytes are loaded by nessys_dmc_fetch; this just plays out their bits
+	dmc->cur_time_frac += nes->apu.cpu_frac_per_sample;
+	while (dmc->cur_time_frac >= step) {
+		dmc->cur_time_frac -= step;
+		if (dmc->bits_remaining) nessys_apu_dmc_bit(dmc);
+	}
+	return dmc->output;
+}
+
+// Loads the next dmc sample byte, and schedules the following fetch
+// Called from nessys_process_events when the fetch is due
+static void nessys_dmc_fetch(nessys_t* nes)
+{
+	nessys_apu_dmc_t* dmc = &nes->apu.dmc;
+	uint16_t bank, offset;
+
+	// play out the last byte up to now; any bit sample timing didn't reach is applied right away,
+	// so the output level doesn't drift
+	nessys_gen_sound(nes);
+	while (dmc->bits_remaining) nessys_apu_dmc_bit(dmc);
+
+	dmc->delta_buffer = *nessys_mem(nes, dmc->cur_addr, &bank, &offset);
+	dmc->bits_remaining = 8;
+	dmc->cur_time_frac = 0;
+	dmc->cur_addr = (dmc->cur_addr == 0xFFFF) ? 0x8000 : dmc->cur_addr + 1;
+	dmc->bytes_remaining--;
+
+	// the cpu is stalled while the dma reads memory
+	nes->scan_clk += NESSYS_PPU_PER_CPU_CLK * NESSYS_APU_DMC_FETCH_CYCLES;
+	dmc->fetch_clk += NESSYS_PPU_PER_CPU_CLK * 8 * dmc->period;
+
+	if (dmc->bytes_remaining == 0) {
+		if (dmc->flags & NESSYS_APU_DMC_FLAG_LOOP) {
+			dmc->cur_addr = dmc->start_addr;
+			dmc->bytes_remaining = dmc->length;
+		} else if (dmc->flags & NESSYS_APU_DMC_FLAG_IRQ_ENABLE) {
+			nes->dmc_irq = true;
 		}
 	}
-	if (nes.prg_ram_base) {
-		mem_offset = 0;
-		for (b = NESSYS_PRG_RAM_START_BANK; b <= NESSYS_PRM_RAM_END_BANK; b++) {
-			nes.prg_rom_bank[b] = nes.prg_ram_base + mem_offset;
-			nes.prg_rom_bank_mask[b] = NESSYS_PRG_MEM_MASK;
-			mem_offset += NESSYS_PRG_BANK_SIZE;
+}
+
+static void nessys_apu_quarter_frame(nessys_t* nes)
+{
+	nessys_apu_env_tick(&nes->apu.pulse[0].env);
+	nessys_apu_env_tick(&nes->apu.pulse[1].env);
+	nessys_apu_env_tick(&nes->apu.noise.env);
+	nessys_apu_tri_linear_tick(&nes->apu.triangle);
+}
+
+static void nessys_apu_half_frame(nessys_t* nes)
+{
+	nessys_apu_pulse_length_tick(&nes->apu.pulse[0]);
+	nessys_apu_pulse_length_tick(&nes->apu.pulse[1]);
+	nessys_apu_tri_length_tick(&nes->apu.triangle);
+	nessys_apu_noise_length_tick(&nes->apu.noise);
+	nessys_apu_sweep_tick(&nes->apu.pulse[0]);
+	nessys_apu_sweep_tick(&nes->apu.pulse[1]);
+}
+
+// Generates all samples due up to the current cpu position in the frame
+// Called before any apu register changes, and at the end of every frame
+void nessys_gen_sound(nessys_t* nes)
+{
+	uint32_t frame_clk = nes->scan_line * NESSYS_PPU_CLK_PER_SCANLINE + nes->scan_clk;
+	uint32_t due;
+	uint32_t mix;
+	uint8_t pulse0, pulse1, triangle, noise, dmc;
+	int32_t sample;
+	nessys_snd_ring_t* ring = nes->snd_ring;
+
+	due = (frame_clk >= NESSYS_PPU_SCANLINES_PER_FRAME_CLKS) ? nes->apu.frame_samples_frac :
+		(uint32_t)(((uint64_t)nes->apu.frame_samples_frac * frame_clk) / NESSYS_PPU_SCANLINES_PER_FRAME_CLKS);
+
+	while (nes->apu.sample_frac_generated + NESSYS_SND_SAMPLES_FRAC <= due) {
+		// frame sequencer; 4 quarter frame steps per frame in 4 step mode
+		nes->apu.frame_frac_counter += nes->apu.frame_frac_per_sample;
+		if (nes->apu.frame_frac_counter >= NESSYS_SND_FRAME_FRAC) {
+			nes->apu.frame_frac_counter -= NESSYS_SND_FRAME_FRAC;
+			if (nes->apu.frame_counter & 0x80) {
+				// 5 step mode: quarter frame on steps 0, 1, 2, 4; half frame on steps 1, 4
+				if (nes->apu.frame_step != 3) nessys_apu_quarter_frame(nes);
+				if (nes->apu.frame_step == 1 || nes->apu.frame_step == 4) nessys_apu_half_frame(nes);
+				nes->apu.frame_step = (nes->apu.frame_step >= 4) ? 0 : nes->apu.frame_step + 1;
+			} else {
+				nessys_apu_quarter_frame(nes);
+				if (nes->apu.frame_step & 0x1) nessys_apu_half_frame(nes);
+				if (nes->apu.frame_step == 3 && !(nes->apu.frame_counter & 0x40)) nes->frame_irq = true;
+				nes->apu.frame_step = (nes->apu.frame_step + 1) & 0x3;
+			}
 		}
-	} else {
-		for (b = NESSYS_PRG_RAM_START_BANK; b <= NESSYS_PRM_RAM_END_BANK; b++) {
-			nes.prg_rom_bank[b] = &nes.reg.pad0;
-			nes.prg_rom_bank_mask[b] = 0x0;
+
+		NESSYS_SND_PROFILE_GEN(NESSYS_SND_PROFILE_PULSE0, pulse0, nessys_apu_gen_pulse(nes, &nes->apu.pulse[0]));
+		NESSYS_SND_PROFILE_GEN(NESSYS_SND_PROFILE_PULSE1, pulse1, nessys_apu_gen_pulse(nes, &nes->apu.pulse[1]));
+		NESSYS_SND_PROFILE_GEN(NESSYS_SND_PROFILE_TRIANGLE, triangle, nessys_apu_gen_triangle(nes, &nes->apu.triangle));
+		NESSYS_SND_PROFILE_GEN(NESSYS_SND_PROFILE_NOISE, noise, nessys_apu_gen_noise(nes, &nes->apu.noise));
+		NESSYS_SND_PROFILE_GEN(NESSYS_SND_PROFILE_DMC, dmc, nessys_apu_gen_dmc(nes));
+		mix = nessys_apu_pulse_mix[pulse0 + pulse1];
+		mix += nessys_apu_tnd_mix[3 * triangle + 2 * noise + dmc];
+		// expansion audio on the cart, saturated to the full scale of the apu mix
+		if (nes->mapper_gen_sound) {
+			mix += nes->mapper_gen_sound(nes);
+			if (mix > 0xFFFF) mix = 0xFFFF;
+		}
+
+		// remove the dc offset with a slow moving average
+		nes->apu.dc_level += ((int32_t)mix - nes->apu.dc_level) >> 8;
+		sample = (int32_t)mix - nes->apu.dc_level;
+		sample = (sample > 32767) ? 32767 : (sample < -32768) ? -32768 : sample;
+
+		if (ring) {
+			if (nessys_snd_ring_distance(ring->write_pos, ring->read_pos) < NESSYS_SND_RING_SAMPLES) {
+				ring->sample[ring->write_index] = NESSYS_SND_SAMPLE(sample);
+				ring->write_index = (ring->write_index + 1 >= NESSYS_SND_RING_SAMPLES) ? 0 : ring->write_index + 1;
+				ring->write_pos = nessys_snd_ring_advance(ring->write_pos, 1);
+			} else {
+				ring->overruns++;
+			}
 		}
+		nes->apu.sample_frac_generated += NESSYS_SND_SAMPLES_FRAC;
 	}
-	if (nes.ppu.chr_rom_base || nes.ppu.chr_ram_base) {
-		mem_offset = 0;
-		const uint8_t* base = (nes.ppu.chr_ram_base) ? nes.ppu.chr_ram_base : nes.ppu.chr_rom_base;
-		uint32_t size = (nes.ppu.chr_ram_base) ? nes.ppu.chr_ram_size : nes.ppu.chr_rom_size;
-		for (b = 0; b <= NESSYS_CHR_ROM_END_BANK; b++) {
-			nes.ppu.chr_rom_bank[b] = base + mem_offset;
-			nes.ppu.chr_rom_bank_mask[b] = NESSYS_CHR_MEM_MASK;
-			if (nes.ppu.chr_ram_base) {
-				nes.ppu.chr_ram_bank[b] = nes.ppu.chr_ram_base + mem_offset;
-				nes.ppu.chr_ram_bank_mask[b] = NESSYS_CHR_MEM_MASK;
+}
+
+// Sets up sample generation for the next frame
+// rate scales the number of samples generated, to keep the output ring centered
+void nessys_apu_start_frame(nessys_t* nes, uint32_t rate)
+{
+	uint32_t samples_frac = (uint32_t)((NESSYS_SND_FRAME_SAMPLES_FRAC * rate) >> NESSYS_SND_RATE_FRAC_LOG2);
+	// carry over the fraction of a sample not generated in the last frame
+	nes->apu.frame_samples_frac -= nes->apu.sample_frac_generated;
+	nes->apu.frame_samples_frac += samples_frac;
+	nes->apu.sample_frac_generated = 0;
+	nes->apu.rate = rate;
+	nes->apu.cpu_frac_per_sample = (uint32_t)(((uint64_t)NESSYS_SND_CPU_CLKS_PER_FRAME << (NESSYS_SND_APU_FRAC_LOG2 + NESSYS_SND_SAMPLES_FRAC_LOG2)) / samples_frac);
+	nes->apu.frame_frac_per_sample = (uint32_t)(((uint64_t)4 << (NESSYS_SND_FRAME_FRAC_LOG2 + NESSYS_SND_SAMPLES_FRAC_LOG2)) / samples_frac);
+}
+
+// Applies a cpu write to an apu register
+// The written value is already in the register memory (or status/frame counter for 0x15/0x17)
+void nessys_apu_write(nessys_t* nes, uint8_t offset)
+{
+	uint8_t data = nes->apu.reg[offset];
+	nessys_apu_pulse_t* pulse = &nes->apu.pulse[(offset >> 2) & 0x1];
+
+	// generate sound up to this point, with the old register state
+	nessys_gen_sound(nes);
+
+	switch (offset) {
+	case 0x00:
+	case 0x04:
+		pulse->duty = data >> 6;
+		pulse->env.volume = data & 0xf;
+		pulse->env.flags &= ~(NESSYS_APU_PULSE_FLAG_HALT_LENGTH | NESSYS_APU_PULSE_FLAG_CONST_VOLUME);
+		pulse->env.flags |= data & (NESSYS_APU_PULSE_FLAG_HALT_LENGTH | NESSYS_APU_PULSE_FLAG_CONST_VOLUME);
+		break;
+	case 0x01:
+	case 0x05:
+		pulse->sweep_period = (data >> 4) & 0x7;
+		pulse->sweep_shift = data & 0x7;
+		pulse->env.flags &= ~(NESSYS_APU_PULSE_FLAG_SWEEP_EN | NESSYS_APU_PULSE_FLAG_SWEEP_NEGATE);
+		pulse->env.flags |= data & (NESSYS_APU_PULSE_FLAG_SWEEP_EN | NESSYS_APU_PULSE_FLAG_SWEEP_NEGATE);
+		pulse->env.flags |= NESSYS_APU_PULSE_FLAG_SWEEP_RELOAD;
+		break;
+	case 0x02:
+	case 0x06:
+		pulse->period = (pulse->period & 0x700) | data;
+		break;
+	case 0x03:
+	case 0x07:
+		pulse->period = (pulse->period & 0x0ff) | ((data & 0x7) << 8);
+		if (nes->apu.status & (0x1 << ((offset >> 2) & 0x1))) pulse->length = NESSYS_APU_PULSE_LENGTH_TABLE[data >> 3];
+		pulse->duty_phase = 0;
+		pulse->env.flags |= NESSYS_APU_PULSE_FLAG_ENV_START;
+		break;
+	case 0x08:
+		nes->apu.triangle.reload = data & 0x7f;
+		nes->apu.triangle.flags &= ~NESSYS_APU_TRIANGLE_FLAG_CONTROL;
+		nes->apu.triangle.flags |= data & NESSYS_APU_TRIANGLE_FLAG_CONTROL;
+		break;
+	case 0x0A:
+		nes->apu.triangle.period = (nes->apu.triangle.period & 0x700) | data;
+		break;
+	case 0x0B:
+		nes->apu.triangle.period = (nes->apu.triangle.period & 0x0ff) | ((data & 0x7) << 8);
+		if (nes->apu.status & 0x4) nes->apu.triangle.length = NESSYS_APU_PULSE_LENGTH_TABLE[data >> 3];
+		nes->apu.triangle.flags |= NESSYS_APU_TRIANGLE_FLAG_RELOAD;
+		break;
+	case 0x0C:
+		nes->apu.noise.env.volume = data & 0xf;
+		nes->apu.noise.env.flags &= ~(NESSYS_APU_PULSE_FLAG_HALT_LENGTH | NESSYS_APU_PULSE_FLAG_CONST_VOLUME);
+		nes->apu.noise.env.flags |= data & (NESSYS_APU_PULSE_FLAG_HALT_LENGTH | NESSYS_APU_PULSE_FLAG_CONST_VOLUME);
+		break;
+	case 0x0E:
+		nes->apu.noise.period = NESSYS_APU_NOISE_PERIOD_TABLE[data & 0xf];
+		nes->apu.noise.env.flags &= ~NESSYS_APU_NOISE_FLAG_MODE;
+		nes->apu.noise.env.flags |= data & NESSYS_APU_NOISE_FLAG_MODE;
+		break;
+	case 0x0F:
+		if (nes->apu.status & 0x8) nes->apu.noise.length = NESSYS_APU_PULSE_LENGTH_TABLE[data >> 3];
+		nes->apu.noise.env.flags |= NESSYS_APU_PULSE_FLAG_ENV_START;
+		break;
+	case 0x10:
+		nes->apu.dmc.flags = data & (NESSYS_APU_DMC_FLAG_IRQ_ENABLE | NESSYS_APU_DMC_FLAG_LOOP);
+		nes->apu.dmc.period = NESSYS_APU_DMC_PERIOD_TABLE[data & 0xf];
+		if (!(data & NESSYS_APU_DMC_FLAG_IRQ_ENABLE)) nes->dmc_irq = false;
+		break;
+	case 0x11:
+		nes->apu.dmc.output = data & 0x7f;
+		break;
+	case 0x12:
+		nes->apu.dmc.start_addr = 0xC000 | ((uint16_t)data << 6);
+		break;
+	case 0x13:
+		nes->apu.dmc.length = ((uint16_t)data << 4) + 1;
+		break;
+	case NESSYS_APU_STATUS_OFFSET:
+		data = nes->apu.status;
+		if (!(data & 0x1)) nes->apu.pulse[0].length = 0;
+		if (!(data & 0x2)) nes->apu.pulse[1].length = 0;
+		if (!(data & 0x4)) nes->apu.triangle.length = 0;
+		if (!(data & 0x8)) nes->apu.noise.length = 0;
+		if (!(data & 0x10)) {
+			nes->apu.dmc.bytes_remaining = 0;
+		} else if (nes->apu.dmc.bytes_remaining == 0) {
+			nes->apu.dmc.cur_addr = nes->apu.dmc.start_addr;
+			nes->apu.dmc.bytes_remaining = nes->apu.dmc.length;
+			// if the sample buffer is empty, the first byte is fetched right away
+			if (nes->apu.dmc.bits_remaining == 0) {
+				nes->apu.dmc.fetch_clk = nes->line_start_clk + nes->scan_clk;
 			} else {
-				nes.ppu.chr_ram_bank[b] = &nes.reg.pad0;
-				nes.ppu.chr_ram_bank_mask[b] = 0x0;
+				nes->apu.dmc.fetch_clk = nes->line_start_clk + nes->scan_clk +
+					NESSYS_PPU_PER_CPU_CLK * nes->apu.dmc.bits_remaining * nes->apu.dmc.period;
 			}
-			mem_offset += NESSYS_CHR_BANK_SIZE;
-			if (mem_offset >= size) mem_offset -= size;
 		}
+		nes->dmc_irq = false;
+		nessys_update_events(nes);
+		break;
+	case NESSYS_APU_FRAME_COUNTER_OFFSET:
+		data = nes->apu.frame_counter;
+		if (data & 0x40) nes->frame_irq = false;
+		// writing the frame counter restarts the sequence; 5 step mode clocks everything immediately
+		nes->apu.frame_frac_counter = 0;
+		nes->apu.frame_step = 0;
+		if (data & 0x80) {
+			nessys_apu_quarter_frame(nes);
+			nessys_apu_half_frame(nes);
+		}
+		break;
+	}
+}
+
+// Value read back from $4015; reading it clears the frame irq
+uint8_t nessys_apu_status(nessys_t* nes)
+{
+	uint8_t status;
+	nessys_gen_sound(nes);
+	status = (nes->apu.pulse[0].length) ? 0x1 : 0x0;
+	status |= (nes->apu.pulse[1].length) ? 0x2 : 0x0;
+	status |= (nes->apu.triangle.length) ? 0x4 : 0x0;
+	status |= (nes->apu.noise.length) ? 0x8 : 0x0;
+	status |= (nes->apu.dmc.bytes_remaining) ? 0x10 : 0x0;
+	status |= (nes->frame_irq) ? 0x40 : 0x0;
+	status |= (nes->dmc_irq) ? 0x80 : 0x0;
+	nes->frame_irq = false;
+	return status;
+}
+
+void nessys_power_cycle(nessys_t* nes)
+{
+	nes->reg.p = 0x34;
+	nes->reg.a = 0;
+	nes->reg.x = 0;
+	nes->reg.y = 0;
+	nes->reg.s = 0xfd;
+	nes->apu.reg[0x17] = 0x0;
+	nes->apu.reg[0x15] = 0x0;
+	memset(nes->apu.reg, 0, 14); // regs 0x0 to 0x13
+	memset(nes->ppu.reg, 0, 8);  // clear all 8 regs
+	memset(nes->sysmem, 0, NESSYS_RAM_SIZE);
+	uint16_t bank, offset;
+	nes->reg.pc = *((uint16_t*)nessys_mem(nes, NESSYS_RST_VECTOR, &bank, &offset));
+	nessys_apu_reset(nes);
+}
+
+void nessys_reset(nessys_t* nes)
+{
+	nes->reg.s -= 3;
+	nes->reg.p |= 0x04;
+	nes->apu.reg[0x15] = 0x0;
+	nes->ppu.reg[0x0] = 0x0;
+	nes->ppu.reg[0x1] = 0x0;
+	nes->ppu.reg[0x5] = 0x0;
+	nes->ppu.reg[0x6] = 0x0;
+	nes->ppu.reg[0x7] = 0x0;
+	uint16_t bank, offset;
+	nes->reg.pc = *((uint16_t*)nessys_mem(nes, NESSYS_RST_VECTOR, &bank, &offset));
+	nessys_apu_reset(nes);
+}
+
+bool nessys_load_cart(nessys_t* nes, const void* cart)
+{
+	bool success;
+	nessys_unload_cart(nes);
+	success = ines_load_cart(nes, cart);
+	if (success) {
+		nessys_default_memmap(nes);
+		success = nessys_init_mapper(nes);
+	}
+	if (success) {
+		nessys_power_cycle(nes);
+	} else {
+		nessys_unload_cart(nes);
+	}
+
+	return success;
+}
+
+void nessys_default_memmap(nessys_t* nes)
+{
+	uint b;
+
+	// nothing is mapped yet, so none of the remaps below are skipped
+	for (b = 0; b < NESSYS_PRG_NUM_BANKS; b++) nes->prg_bank_src[b] = NESSYS_BANK_SRC_NONE;
+	for (b = 0; b <= NESSYS_CHR_ROM_END_BANK; b++) nes->ppu.chr_bank_src[b] = NESSYS_BANK_SRC_NONE;
+	nes->ppu.ntb_mirror = MAPPER_MIRROR_NONE;
+
+	nes->prg_rom_bank[NESSYS_SYS_RAM_START_BANK] = nes->sysmem;
+	nes->prg_rom_bank_mask[NESSYS_SYS_RAM_START_BANK] = NESSYS_RAM_MASK;
+
+	nes->prg_rom_bank[NESSYS_PPU_REG_START_BANK] = nes->ppu.reg;
+	nes->prg_rom_bank_mask[NESSYS_PPU_REG_START_BANK] = NESSYS_PPU_REG_MASK;
+
+	nes->prg_rom_bank[NESSYS_APU_REG_START_BANK] = nes->apu.reg;
+	nes->prg_rom_bank_mask[NESSYS_APU_REG_START_BANK] = NESSYS_APU_MASK;
+
+	if (nes->prg_rom_base) {
+		// map the last 32KB of rom data
+		// if rom is less than 32KB, then map from the beggining, and wrap the addresses
+		mapper_map_prg_window(nes, NESSYS_PRG_ROM_START_BANK, NESSYS_PRG_NUM_BANKS - NESSYS_PRG_ROM_START_BANK,
+			(nes->prg_rom_size <= NESSYS_PRG_ADDR_SPACE - NESSYS_PRG_ROM_START) ? 0 : (nes->prg_rom_size - (NESSYS_PRG_ADDR_SPACE - NESSYS_PRG_ROM_START)));
 	} else {
-		for (b = 0; b <= NESSYS_CHR_ROM_END_BANK; b++) {
-			nes.ppu.chr_rom_bank[b] = &nes.reg.pad0;
-			nes.ppu.chr_rom_bank_mask[b] = 0x0;
-			nes.ppu.chr_ram_bank[b] = &nes.reg.pad0;
-			nes.ppu.chr_ram_bank_mask[b] = 0x0;
+		for (b = NESSYS_PRG_ROM_START_BANK; b < NESSYS_PRG_NUM_BANKS; b++) {
+			nes->prg_rom_bank[b] = &nes->reg.pad0;
+			nes->prg_rom_bank_mask[b] = 0x0;
 		}
 	}
+	// with no ram, this points to some junk location
+	for (b = NESSYS_PRG_RAM_START_BANK; b <= NESSYS_PRM_RAM_END_BANK; b++) {
+		mapper_map_prg_ram(nes, b, (b - NESSYS_PRG_RAM_START_BANK) << NESSYS_PRG_BANK_SIZE_LOG2, true);
+	}
+	for (b = 0; b <= NESSYS_CHR_ROM_END_BANK; b++) {
+		nes->ppu.chr_rom_bank[b] = &nes->reg.pad0;
+		nes->ppu.chr_rom_bank_mask[b] = (nes->ppu.chr_rom_base || nes->ppu.chr_ram_base) ? NESSYS_CHR_MEM_MASK : 0x0;
+		// only chr ram is writeable
+		nes->ppu.chr_ram_bank[b] = &nes->reg.pad0;
+		nes->ppu.chr_ram_bank_mask[b] = (nes->ppu.chr_ram_base) ? NESSYS_CHR_MEM_MASK : 0x0;
+	}
+	mapper_map_chr_window(nes, NESSYS_CHR_ROM_START_BANK, NESSYS_CHR_ROM_END_BANK + 1, 0);
 	// map name table
-	if (nes.ppu.mem_4screen) {
+	if (nes->ppu.mem_4screen) {
 		// if we allocated space for 4 screens, then directly map address space
-		nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 0] = nes.ppu.mem;
-		nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 1] = nes.ppu.mem + 0x400;
-		nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 2] = nes.ppu.mem_4screen;
-		nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 3] = nes.ppu.mem_4screen + 0x400;
-		nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 0] = nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 0];
-		nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 1] = nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 1];
-		nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 2] = nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 2];
-		nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 3] = nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 3];
-	} else {
-		nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 0] = nes.ppu.mem;
-		nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 3] = nes.ppu.mem + 0x400;
-		nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 0] = nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 0];
-		nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 3] = nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 3];
-		if (nes.ppu.name_tbl_vert_mirror) {
-			nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 1] = nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 3];
-			nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 2] = nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 0];
-			nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 1] = nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 3];
-			nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 2] = nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 0];
-		} else {
-			nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 1] = nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 0];
-			nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 2] = nes.ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 3];
-			nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 1] = nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 0];
-			nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 2] = nes.ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 3];
+		nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 0] = nes->ppu.mem;
+		nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 1] = nes->ppu.mem + 0x400;
+		nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 2] = nes->ppu.mem_4screen;
+		nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 3] = nes->ppu.mem_4screen + 0x400;
+		nes->ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 0] = nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 0];
+		nes->ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 1] = nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 1];
+		nes->ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 2] = nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 2];
+		nes->ppu.chr_rom_bank[NESSYS_CHR_NTB_START_BANK + 3] = nes->ppu.chr_ram_bank[NESSYS_CHR_NTB_START_BANK + 3];
+		for (b = NESSYS_CHR_NTB_START_BANK + 4; b <= NESSYS_CHR_NTB_END_BANK; b++) {
+			nes->ppu.chr_ram_bank[b] = nes->ppu.chr_ram_bank[b - 4];
+			nes->ppu.chr_rom_bank[b] = nes->ppu.chr_rom_bank[b - 4];
 		}
-	}
-	for (b = NESSYS_CHR_NTB_START_BANK + 4; b <= NESSYS_CHR_NTB_END_BANK; b++) {
-		nes.ppu.chr_ram_bank[b] = nes.ppu.chr_ram_bank[b - 4];
-		nes.ppu.chr_rom_bank[b] = nes.ppu.chr_rom_bank[b - 4];
+	} else {
+		mapper_map_ntb(nes, (nes->ppu.name_tbl_vert_mirror) ? MAPPER_MIRROR_VERT : MAPPER_MIRROR_HORIZ);
 	}
 	for (b = NESSYS_CHR_NTB_START_BANK; b <= NESSYS_CHR_NTB_END_BANK; b++) {
-		nes.ppu.chr_ram_bank_mask[b] = NESSYS_CHR_MEM_MASK;
-		nes.ppu.chr_rom_bank_mask[b] = NESSYS_CHR_MEM_MASK;
+		nes->ppu.chr_ram_bank_mask[b] = NESSYS_CHR_MEM_MASK;
+		nes->ppu.chr_rom_bank_mask[b] = NESSYS_CHR_MEM_MASK;
 	}
 }
 
-void nessys_irq(uint16_t irq_vector, uint8_t clear_flag)
+void nessys_irq(nessys_t* nes, uint16_t irq_vector, uint8_t clear_flag)
 {
 	uint8_t* ram_ptr;
 	uint16_t bank, offset;
 	// get the stack base
-	ram_ptr = nessys_ram(0x100);
-	*(ram_ptr + nes.reg.s) = nes.reg.pc >> 8;         nes.reg.s--;
-	*(ram_ptr + nes.reg.s) = nes.reg.pc & 0xFF;       nes.reg.s--;
-	*(ram_ptr + nes.reg.s) = nes.reg.p & ~clear_flag; nes.reg.s--;
+	ram_ptr = nessys_ram(nes, 0x100);
+	*(ram_ptr + nes->reg.s) = nes->reg.pc >> 8;         nes->reg.s--;
+	*(ram_ptr + nes->reg.s) = nes->reg.pc & 0xFF;       nes->reg.s--;
+	*(ram_ptr + nes->reg.s) = nes->reg.p & ~clear_flag; nes->reg.s--;
 #ifdef _DEBUG
 	// TODO: fix the stack tracing code
-	nes.stack_trace[nes.stack_trace_entry].scanline = nes.scanline;
-	nes.stack_trace[nes.stack_trace_entry].scanline_cycle = nes.scanline_cycle;
-	nes.stack_trace[nes.stack_trace_entry].frame = nes.frame;
-	nes.stack_trace[nes.stack_trace_entry].return_addr = nes.reg.pc;
+	nes->stack_trace[nes->stack_trace_entry].scanline = nes->scanline;
+	nes->stack_trace[nes->stack_trace_entry].scanline_cycle = nes->scanline_cycle;
+	nes->stack_trace[nes->stack_trace_entry].frame = nes->frame;
+	nes->stack_trace[nes->stack_trace_entry].return_addr = nes->reg.pc;
 #endif
-	nes.reg.pc = *((uint16_t*)nessys_mem(irq_vector, &bank, &offset));
+	nes->reg.pc = *((uint16_t*)nessys_mem(nes, irq_vector, &bank, &offset));
+	nes->reg.p |= C6502_P_I;
 	if (irq_vector == NESSYS_NMI_VECTOR) {
-		nes.reg.p |= C6502_P_I;
-		nes.in_nmi++;
-		//nes.ppu.old_status = (nes.ppu.status & 0xe0);
-		//nes.ppu.old_status |= (nes.ppu.reg[2] & 0x1f);
+		nes->in_nmi++;
+		//nes->ppu.old_status = (nes->ppu.status & 0xe0);
+		//nes->ppu.old_status |= (nes->ppu.reg[2] & 0x1f);
 	}
 #ifdef _DEBUG
 			// TODO: fix irq tracing code
-	nes.stack_trace[nes.stack_trace_entry].jump_addr = nes.reg.pc;
-	nes.irq_trace[nes.irq_trace_entry] = nes.stack_trace[nes.stack_trace_entry];
-	nes.stack_trace_entry++;
-	if (nes.stack_trace_entry >= NESSYS_STACK_TRACE_ENTRIES) nes.stack_trace_entry = 0;
-	nes.irq_trace_entry++;
-	if (nes.irq_trace_entry >= NESSYS_STACK_TRACE_ENTRIES) nes.irq_trace_entry = 0;
+	nes->stack_trace[nes->stack_trace_entry].jump_addr = nes->reg.pc;
+	nes->irq_trace[nes->irq_trace_entry] = nes->stack_trace[nes->stack_trace_entry];
+	nes->stack_trace_entry++;
+	if (nes->stack_trace_entry >= NESSYS_STACK_TRACE_ENTRIES) nes->stack_trace_entry = 0;
+	nes->irq_trace_entry++;
+	if (nes->irq_trace_entry >= NESSYS_STACK_TRACE_ENTRIES) nes->irq_trace_entry = 0;
 #endif
 
 }
 
-void nessys_gen_oam_pix(uint8_t sprite_index)
+// Sets event_scan_clk to the earliest thing scheduled on the current scan line
+// Must be called whenever a deadline changes, and at the start of every scan line
+void nessys_update_events(nessys_t* nes)
+{
+	uint event = nes->sprite0_hit_scan_clk;
+	int32_t dt;
+
+	event = (nes->mapper_event_scan_clk < event) ? nes->mapper_event_scan_clk : event;
+	if (nes->apu.dmc.bytes_remaining) {
+		dt = (int32_t)(nes->apu.dmc.fetch_clk - nes->line_start_clk);
+		dt = (dt < 0) ? 0 : dt;
+		event = ((uint)dt < event) ? (uint)dt : event;
+	}
+	// a pending irq is taken as soon as the cpu allows it
+	if ((nes->frame_irq || nes->dmc_irq || nes->mapper_irq) && !(nes->reg.p & C6502_P_I)) {
+		event = 0;
+	}
+	nes->event_scan_clk = event;
+}
+
+// Handles everything scheduled at or before the current scan_clk
+// Returns true if an irq was taken, in which case the cpu pc has changed
+bool nessys_process_events(nessys_t* nes)
+{
+	bool took_irq = false;
+
+	if (nes->scan_clk >= nes->sprite0_hit_scan_clk) {
+		nes->ppu.reg[2] |= 0x40;
+		nes->sprite0_hit_scan_clk = ~0;
+	}
+	// fetch every dmc byte that is due in one go
+	while (nes->apu.dmc.bytes_remaining && (int32_t)(nes->line_start_clk + nes->scan_clk - nes->apu.dmc.fetch_clk) >= 0) {
+		nessys_dmc_fetch(nes);
+	}
+	// the mapper event may raise mapper_irq, which is then taken below
+	if (nes->scan_clk >= nes->mapper_event_scan_clk) {
+		nes->mapper_event_scan_clk = ~0;
+		nes->mapper_event(nes);
+	}
+	if ((nes->frame_irq || nes->dmc_irq || nes->mapper_irq) && !(nes->reg.p & C6502_P_I) && !nes->iflag_delay) {
+		nessys_irq(nes, NESSYS_IRQ_VECTOR, C6502_P_B);
+		took_irq = true;
+	}
+	// cli and plp only let an irq through after the following instruction
+	nes->iflag_delay = 0;
+
+	nessys_update_events(nes);
+	return took_irq;
+}
+
+void nessys_gen_oam_pix(nessys_t* nes, uint8_t sprite_index)
 {
 	uint y, sprite_y;
-	uint max_y = (nes.ppu.reg[0] & 0x10) ? 16 : 8;
+	uint max_y = (nes->ppu.reg[0] & 0x10) ? 16 : 8;
 	uint pat_addr;
 	uint32_t pat_planes;
-	pat_addr = nes.ppu.oam[4 * sprite_index + 1];
+	pat_addr = nes->ppu.oam[4 * sprite_index + 1];
 	// for 8x16 sprites, lsb is the bank select
 	// otherwise, bank select is bit 3 ppu reg0
-	pat_addr |= 0x100 & (((pat_addr << 8) & (((uint16_t)nes.ppu.reg[0]) << 3)) |
-		((((uint16_t)nes.ppu.reg[0]) << 5) & ~(((uint16_t)nes.ppu.reg[0]) << 3)));
+	pat_addr |= 0x100 & (((pat_addr << 8) & (((uint16_t)nes->ppu.reg[0]) << 3)) |
+		((((uint16_t)nes->ppu.reg[0]) << 5) & ~(((uint16_t)nes->ppu.reg[0]) << 3)));
 	// clear out lsb for 8x16, and fill it in based on whether sprite y is 8 or above
-	pat_addr &= 0xfffe | ~(((uint16_t)nes.ppu.reg[0]) >> 5);
-	//pat_addr |= (((uint16_t)nes.ppu.reg[0]) >> 5) & (sprite_y >= 8);
+	pat_addr &= 0xfffe | ~(((uint16_t)nes->ppu.reg[0]) >> 5);
+	//pat_addr |= (((uint16_t)nes->ppu.reg[0]) >> 5) & (sprite_y >= 8);
 	// shift up the address and fill in the y offset
 	pat_addr <<= 4;
-	bool v_flip = ((nes.ppu.oam[4 * sprite_index + 2] & 0x80) != 0);
-	bool h_flip = ((nes.ppu.oam[4 * sprite_index + 2] & 0x40) != 0);
+	bool v_flip = ((nes->ppu.oam[4 * sprite_index + 2] & 0x80) != 0);
+	bool h_flip = ((nes->ppu.oam[4 * sprite_index + 2] & 0x40) != 0);
 	sprite_y = (v_flip) ? max_y - 2 : 0;
-	uint32_t* oam_pix = (uint32_t*)(nes.ppu.oam_pix + NESSYS_PPU_OAM_PIXEL_ROWS * sprite_index + sprite_y);
+	uint32_t* oam_pix = (uint32_t*)(nes->ppu.oam_pix + NESSYS_PPU_OAM_PIXEL_ROWS * sprite_index + sprite_y);
 	for (y = 0; y < max_y; y+=2) {
 		// for y >= 8, set bit 4 of pat_addr; only applies to 8x16 sprites
 		pat_addr |= (y << 1) & 0x10;
 
 		// get the pattern plane bits
 		if (v_flip) {
-			pat_planes = (*(nessys_ppu_mem(pat_addr)) << 16);
-			pat_planes |= (*(nessys_ppu_mem(pat_addr | 0x8)) << 24);
-			pat_planes |= (*(nessys_ppu_mem(pat_addr | 0x1)));
-			pat_planes |= (*(nessys_ppu_mem(pat_addr | 0x9)) << 8);
+			pat_planes = (*(nessys_ppu_mem(nes, pat_addr)) << 16);
+			pat_planes |= (*(nessys_ppu_mem(nes, pat_addr | 0x8)) << 24);
+			pat_planes |= (*(nessys_ppu_mem(nes, pat_addr | 0x1)));
+			pat_planes |= (*(nessys_ppu_mem(nes, pat_addr | 0x9)) << 8);
 		} else {
-			pat_planes = *(nessys_ppu_mem(pat_addr));
-			pat_planes |= (*(nessys_ppu_mem(pat_addr | 0x8)) << 8);
-			pat_planes |= (*(nessys_ppu_mem(pat_addr | 0x1)) << 16);
-			pat_planes |= (*(nessys_ppu_mem(pat_addr | 0x9)) << 24);
+			pat_planes = *(nessys_ppu_mem(nes, pat_addr));
+			pat_planes |= (*(nessys_ppu_mem(nes, pat_addr | 0x8)) << 8);
+			pat_planes |= (*(nessys_ppu_mem(nes, pat_addr | 0x1)) << 16);
+			pat_planes |= (*(nessys_ppu_mem(nes, pat_addr | 0x9)) << 24);
 		}
 
 		// interleave and reverse the the 2 bytes
@@ -280,7 +714,7 @@ void nessys_gen_oam_pix(uint8_t sprite_index)
 
 		*oam_pix = pat_planes;
 		if (v_flip) oam_pix--; else oam_pix++;
-		//nes.ppu.oam_pix[NESSYS_PPU_OAM_PIXEL_ROWS * sprite_index + y] = pat_planes;
+		//nes->ppu.oam_pix[NESSYS_PPU_OAM_PIXEL_ROWS * sprite_index + y] = pat_planes;
 
 		pat_addr+=2;
 		pat_addr &= 0xfff7;
@@ -288,33 +722,50 @@ void nessys_gen_oam_pix(uint8_t sprite_index)
 	}
 }
 
+void nessys_gen_tile_pix(nessys_t* nes, uint y)
+{
+	// some mappers change where background tiles and attributes come from
+	if (nes->mapper_bg_setup && nes->mapper_bg_setup(nes, y)) return;
+	nessys_gen_ntb_tile_pix(nes, y);
+}
+
+// generates a row of tile pixels and attributes straight from the nametables
+void nessys_gen_ntb_tile_pix(nessys_t* nes, uint y)
+{
+	nessys_gen_ntb_tile_range(nes, y, 0, NESSYS_PPU_TILES_PER_ROW);
+}
+
+// generates tiles first to last-1 of a row; mappers that switch pattern banks part way through a row
+// generate it in segments, switching banks in between
 //#ifdef WIN32
-void nessys_gen_tile_pix(uint y)
+void nessys_gen_ntb_tile_range(nessys_t* nes, uint y, uint first, uint last)
 //#else
-//void __no_inline_not_in_flash_func(nessys_gen_tile_pix)(uint y)
+//void __no_inline_not_in_flash_func(nes, nessys_gen_ntb_tile_range)(uint y, uint first, uint last)
 //#endif
 {
 	uint tile_base_addr, tile_addr;
 	uint tile_x, tile_y;
-	uint x;
+	uint x, attr_x_offset;
 	uint pat_addr, last_pat_addr;
 	uint32_t pat_planes;
 
-	tile_x = nes.ppu.scroll[0];
-	tile_y = nes.ppu.scroll_y;
+	tile_x = nes->ppu.scroll[0];
+	tile_y = nes->ppu.scroll_y;
 
 	tile_y += y;
 
-	if (nes.ppu.scroll_y < NESSYS_PPU_SCANLINES_RENDERED && tile_y > NESSYS_PPU_SCANLINES_RENDERED) {
+	if (nes->ppu.scroll_y < NESSYS_PPU_SCANLINES_RENDERED && tile_y > NESSYS_PPU_SCANLINES_RENDERED) {
 		// skip over attribute section of table
 		tile_y += 16;
 	}
 
-	tile_x |= (nes.ppu.reg[0] << 8) & 0x100;
-	tile_y |= (nes.ppu.reg[0] << 7) & 0x100;
+	tile_x |= (nes->ppu.reg[0] << 8) & 0x100;
+	tile_y |= (nes->ppu.reg[0] << 7) & 0x100;
 
 	tile_x &= 0x1f8;
 	tile_y &= 0x1f8;
+	attr_x_offset = nes->ppu.scroll[0] & 0x18;
+	tile_x += first << 3;
 
 	tile_base_addr = NESSYS_CHR_NTB_WIN_MIN;
 	// if top y bit is set, add 0x800
@@ -324,26 +775,25 @@ void nessys_gen_tile_pix(uint y)
 
 	// regenerate attribute bits if we're on the first scanline, or first row of a 32x32 block
 	bool gen_attr = (y == 0) || ((tile_y & 0x1f) == 0);
-	uint attr_base_addr, attr_addr, attr_x;
-	uint32_t* tile_pix = (uint32_t*)nes.ppu.draw_tile_pix;
-	//uint8_t* attr_pix = nes.ppu.attrib_pix;
+	uint attr_base_addr, attr_addr;
+	uint32_t* tile_pix = (uint32_t*)(nes->ppu.draw_tile_pix + first * NESSYS_PPU_PIXEL_ROW_PER_TILE);
+	//uint8_t* attr_pix = nes->ppu.attrib_pix;
 	if (gen_attr) {
 		// compute attr base address, using the y coordinate
 		attr_base_addr = 0x3c0 | ((tile_y & 0xe0) >> 2);
 		attr_base_addr |= ((tile_y << 3) & 0x800);
 		attr_base_addr |= NESSYS_CHR_NTB_WIN_MIN;
-		attr_x = 0;
 	}
 
 	last_pat_addr = ~0;
-	for (x = 0; x < NESSYS_PPU_TILES_PER_ROW; x++) {
+	for (x = first; x < last; x++) {
 		// this takes the all but the top bit and bottom 3 bits of x and y, moves them into place
 		// to form a linear address within each page
 		tile_addr = tile_base_addr | ((tile_x & 0xf8) >> 3);
 		// Select the page - if the top x bit is set, add 0x400
 		tile_addr += ((tile_x << 2) & 0x400);
 
-		pat_addr = (*(nessys_ppu_mem(tile_addr)) << 4) | ((nes.ppu.reg[0] & 0x10) << 8);
+		pat_addr = (*(nessys_ppu_mem(nes, tile_addr)) << 4) | ((nes->ppu.reg[0] & 0x10) << 8);
 		if (pat_addr == last_pat_addr) {
 			for (y = 0; y < 8; y += 2) {
 				*tile_pix = *(tile_pix - 4);
@@ -351,10 +801,10 @@ void nessys_gen_tile_pix(uint y)
 			}
 		} else {
 			for (y = 0; y < 8; y += 2) {
-				pat_planes = *(nessys_ppu_mem(pat_addr | y));
-				pat_planes |= (*(nessys_ppu_mem(pat_addr | y | 0x8)) << 8);
-				pat_planes |= (*(nessys_ppu_mem(pat_addr | y | 0x1)) << 16);
-				pat_planes |= (*(nessys_ppu_mem(pat_addr | y | 0x9)) << 24);
+				pat_planes = *(nessys_ppu_mem(nes, pat_addr | y));
+				pat_planes |= (*(nessys_ppu_mem(nes, pat_addr | y | 0x8)) << 8);
+				pat_planes |= (*(nessys_ppu_mem(nes, pat_addr | y | 0x1)) << 16);
+				pat_planes |= (*(nessys_ppu_mem(nes, pat_addr | y | 0x9)) << 24);
 
 				// interleave and reverse the the 2 bytes
 				pat_planes = (pat_planes & 0x0ff00ff0) | ((pat_planes & 0xf000f000) >> 12) | ((pat_planes & 0x000f000f) << 12);
@@ -362,7 +812,7 @@ void nessys_gen_tile_pix(uint y)
 				pat_planes = (pat_planes & 0x66666666) | ((pat_planes & 0x88888888) >> 3) | ((pat_planes & 0x11111111) << 3);
 				pat_planes = ((pat_planes & 0xaaaaaaaa) >> 1) | ((pat_planes & 0x55555555) << 1);
 
-				//nes.ppu.tile_pix[NESSYS_PPU_PIXEL_ROW_PER_TILE * x + y] = pat_planes;
+				//nes->ppu.tile_pix[NESSYS_PPU_PIXEL_ROW_PER_TILE * x + y] = pat_planes;
 				*tile_pix = pat_planes;
 				tile_pix++;
 			}
@@ -370,12 +820,12 @@ void nessys_gen_tile_pix(uint y)
 		}
 
 		// compute attribute bits if on the first pixel of scan line or on the beginning of every 32x32 tile
-		if (gen_attr && ((x == 0) || ((tile_x & 0x1f) == 0))){
+		if (gen_attr && ((x == first) || ((tile_x & 0x1f) == 0))){
 			attr_addr = attr_base_addr | ((tile_x & 0xe0) >> 5);
 			attr_addr |= ((tile_x << 2) & 0x400);
-			pat_planes = *(nessys_ppu_mem(attr_addr));
-			nes.ppu.draw_attrib_pix[attr_x] = pat_planes;
-			attr_x++;
+			pat_planes = *(nessys_ppu_mem(nes, attr_addr));
+			// each attribute byte covers 32 pixels, starting from the 32 pixel boundary at or before the scroll
+			nes->ppu.draw_attrib_pix[(attr_x_offset + (x << 3)) >> 5] = pat_planes;
 			//*attr_pix = pat_planes;
 			//attr_pix++;
 		}
@@ -384,14 +834,74 @@ void nessys_gen_tile_pix(uint y)
 
 }
 
-void nessys_unload_cart()
+// whether the background pixel at screen x, y is opaque; the same scrolled nametable addressing as
+// nessys_gen_ntb_tile_range, for one pixel
+static bool nessys_bg_opaque(nessys_t* nes, uint x, uint y)
+{
+	uint tile_x, tile_y, tile_addr, pat_addr;
+	uint8_t planes;
+
+	tile_x = (nes->ppu.scroll[0] | ((nes->ppu.reg[0] << 8) & 0x100)) + x;
+	tile_y = nes->ppu.scroll_y + y;
+	if (nes->ppu.scroll_y < NESSYS_PPU_SCANLINES_RENDERED && tile_y > NESSYS_PPU_SCANLINES_RENDERED) {
+		// skip over attribute section of table
+		tile_y += 16;
+	}
+	tile_y |= (nes->ppu.reg[0] << 7) & 0x100;
+	tile_x &= 0x1ff;
+	tile_y &= 0x1ff;
+
+	tile_addr = NESSYS_CHR_NTB_WIN_MIN | ((tile_y << 3) & 0x800) | ((tile_y & 0xf8) << 2);
+	tile_addr |= ((tile_x & 0xf8) >> 3) + ((tile_x << 2) & 0x400);
+	pat_addr = (*(nessys_ppu_mem(nes, tile_addr)) << 4) | ((nes->ppu.reg[0] & 0x10) << 8) | (tile_y & 0x7);
+	planes = *(nessys_ppu_mem(nes, pat_addr)) | *(nessys_ppu_mem(nes, pat_addr | 0x8));
+	return (planes << (tile_x & 0x7)) & 0x80;
+}
+
+// Sprite evaluation of line y for what the cpu can see in the status register: overflow, and sprite 0 hit, which also
+// needs the background under sprite 0; for every frame, whether it's rendered, skipped or logic only
+// Only sprite 0's pixels need to be current; overflow is only scanned for if asked, as drawn lines find it themselves
+void nessys_sprite_status(nessys_t* nes, uint y, bool overflow)
 {
-	nessys_cleanup_mapper();
-	ines_unload_cart();
-	nes.prg_rom_base = NULL;
-	nes.prg_rom_size = 0;
-	nes.ppu.chr_rom_base = NULL;
-	nes.ppu.chr_rom_size = 0;
+	uint sp_height = (nes->ppu.reg[0] & 0x20) ? 16 : 8;
+	uint i, n, sprite_y, sp_x, x;
+	uint32_t sp_planes;
+
+	// sprites aren't evaluated for the post render line
+	if (!(nes->ppu.reg[1] & 0x18) || y >= NESSYS_PPU_SCANLINES_RENDERED) return;
+	// a ninth sprite in range; the hardware's buggy scan after the eighth isn't modelled
+	if (overflow && !(nes->ppu.reg[2] & 0x20)) {
+		for (i = 0, n = 0; i < NESSYS_PPU_NUM_SPRITES; i++) {
+			if (y - nes->ppu.oam[4 * i] < sp_height) n++;
+		}
+		if (n > NESSYS_PPU_MAX_SPRITES_PER_SCAN_LINE) nes->ppu.reg[2] |= 0x20;
+	}
+
+	// sprite 0 hits need both the background and sprites on, and only happen once a frame
+	if ((nes->ppu.reg[1] & 0x18) != 0x18 || (nes->ppu.reg[2] & 0x40) || nes->sprite0_hit_scan_clk != ~0) return;
+	sprite_y = y - nes->ppu.oam[0];
+	if (sprite_y >= sp_height) return;
+	sp_planes = nes->ppu.oam_pix[sprite_y];
+	sp_x = nes->ppu.oam[3];
+	// never at x = 255, nor in the left 8 pixels if either is clipped there
+	for (x = sp_x; x < sp_x + 8 && x < 255; x++, sp_planes >>= 2) {
+		if (!(sp_planes & 0x3)) continue;
+		if (x < 8 && (nes->ppu.reg[1] & 0x6) != 0x6) continue;
+		if (nessys_bg_opaque(nes, x, y)) {
+			nes->sprite0_hit_scan_clk = x;
+			return;
+		}
+	}
+}
+
+void nessys_unload_cart(nessys_t* nes)
+{
+	nessys_cleanup_mapper(nes);
+	ines_unload_cart(nes);
+	nes->prg_rom_base = NULL;
+	nes->prg_rom_size = 0;
+	nes->ppu.chr_rom_base = NULL;
+	nes->ppu.chr_rom_size = 0;
 }
 
 void nessys_cleanup()
@@ -399,40 +909,129 @@ void nessys_cleanup()
 
 }
 
-bool nessys_init_mapper()
+static bool nessys_init_discrete(nessys_t* nes)
+{
+	return mapper_discrete_init(nes, nes->mapper_id);
+}
+
+#define NESSYS_MAPPER_DISCRETE(id) { id, CPU_LOOP_DISCRETE, nessys_init_discrete, sizeof(struct mapper_discrete_data), \
+	offsetof(struct mapper_discrete_data, value), 0 }
+
+static const nessys_mapper_t NESSYS_MAPPERS[] = {
+	{ 0, CPU_LOOP_NROM, NULL, 0, 0, 0 },
+	{ 1, CPU_LOOP_MMC1, mapper1_init, sizeof(struct mapper1_data), 0, 0x2000 },
+	NESSYS_MAPPER_DISCRETE(2),
+	NESSYS_MAPPER_DISCRETE(3),
+	{ 4, CPU_LOOP_MMC3, mapper4_init, sizeof(struct mapper4_data), 0, 0x2000 },
+	{ 5, CPU_LOOP_MMC5, mapper5_init, sizeof(struct mapper5_data), 0, 0x2000 },
+	NESSYS_MAPPER_DISCRETE(7),
+	{ 9, CPU_LOOP_MMC2, mapper9_init, sizeof(struct mapper9_data), 0, 0 },
+	{ 69, CPU_LOOP_FME7, mapper69_init, sizeof(struct mapper69_data), 0, 0x2000 },
+	NESSYS_MAPPER_DISCRETE(71),
+	NESSYS_MAPPER_DISCRETE(180),
+};
+
+const nessys_mapper_t* nessys_mapper_find(uint32_t mapper_id)
 {
-	return true;
+	uint i;
+	for (i = 0; i < sizeof(NESSYS_MAPPERS) / sizeof(nessys_mapper_t); i++) {
+		if (NESSYS_MAPPERS[i].mapper_id == mapper_id) return &NESSYS_MAPPERS[i];
+	}
+	return NULL;
 }
 
-void nessys_cleanup_mapper()
+bool nessys_init_mapper(nessys_t* nes)
 {
+	const nessys_mapper_t* mapper = nessys_mapper_find(nes->mapper_id);
+
+	nes->mapper_read = NULL;
+	nes->mapper_write = NULL;
+	nes->mapper_bg_setup = NULL;
+	nes->mapper_update = NULL;
+	nes->mapper_event = NULL;
+	nes->mapper_event_scan_clk = ~0;
+	nes->mapper_gen_sound = NULL;
+	nes->mapper_flags &= ~NESSYS_MAPPER_FLAG_PRG_RAM_READ_ONLY;
+	nes->mapper_irq = false;
+	nes->ppu.attrib_per_row = false;
+	nes->mapper_data = NULL;
+	// few games get far on the default memory map, so a mapper that isn't implemented fails rather than running from it
+	if (mapper == NULL) return false;
+	return (mapper->init) ? mapper->init(nes) : true;
+}
 
+// Whether the mapper is implemented; carts with any other fail to load
+bool nessys_mapper_supported(uint32_t mapper_id)
+{
+	return nessys_mapper_find(mapper_id) != NULL;
+}
+
+// Bytes of cart arena the mapper's state takes
+uint32_t nessys_mapper_state_size(nessys_t* nes)
+{
+	const nessys_mapper_t* mapper = nessys_mapper_find(nes->mapper_id);
+	return (mapper) ? mapper->state_size : 0;
+}
+
+// Bytes at the start of the mapper's state that only depend on the cart, such as descriptor pointers; save states
+// keep the running cart's copy of them
+uint32_t nessys_mapper_state_fixed(nessys_t* nes)
+{
+	const nessys_mapper_t* mapper = nessys_mapper_find(nes->mapper_id);
+	return (mapper) ? mapper->state_fixed : 0;
+}
+
+// fnv-1a hash of the cart's prg and chr rom, so saves and states are only restored into the cart that wrote them
+uint32_t nessys_cart_id(nessys_t* nes)
+{
+	uint32_t h = 0x811C9DC5;
+	uint32_t i;
+	for (i = 0; i < nes->prg_rom_size; i++) h = (h ^ nes->prg_rom_base[i]) * 0x01000193;
+	for (i = 0; i < nes->ppu.chr_rom_size; i++) h = (h ^ nes->ppu.chr_rom_base[i]) * 0x01000193;
+	return h;
+}
+
+void nessys_cleanup_mapper(nessys_t* nes)
+{
+	// mapper data lives in the aux memory, which is released with the cart
+	nescache_release(nes);
+	nes->mapper_read = NULL;
+	nes->mapper_write = NULL;
+	nes->mapper_bg_setup = NULL;
+	nes->mapper_update = NULL;
+	nes->mapper_event = NULL;
+	nes->mapper_event_scan_clk = ~0;
+	nes->mapper_gen_sound = NULL;
+	nes->mapper_flags &= ~NESSYS_MAPPER_FLAG_PRG_RAM_READ_ONLY;
+	nes->mapper_irq = false;
+	nes->ppu.attrib_per_row = false;
+	nes->mapper_data = NULL;
 }
 
-//uint8_t* nessys_ram(uint16_t addr)
+//uint8_t* nessys_ram(nes, uint16_t addr)
 //{
-//	return nes.sysmem + (addr & NESSYS_RAM_MASK);
+//	return nes->sysmem + (addr & NESSYS_RAM_MASK);
 //}
 //
-//const uint8_t* nessys_mem(uint16_t addr, uint16_t* bank, uint16_t* offset)
+//const uint8_t* nessys_mem(nes, uint16_t addr, uint16_t* bank, uint16_t* offset)
 //{
 //	uint16_t b = addr >> NESSYS_PRG_BANK_SIZE_LOG2;
-//	uint16_t o = addr & nes.prg_rom_bank_mask[b];
+//	uint16_t o = addr & nes->prg_rom_bank_mask[b];
 //	*bank = b;
 //	*offset = o;
-//	return nes.prg_rom_bank[b] + o;
+//	return nes->prg_rom_bank[b] + o;
 //}
 //
-//const uint8_t* nessys_ppu_mem(uint16_t addr)
+//const uint8_t* nessys_ppu_mem(nes, uint16_t addr)
 //{
-//	if (addr >= NESSYS_CHR_PAL_WIN_MIN) return nes.ppu.pal + (addr & NESSYS_PPU_PAL_MASK);
+//	if (addr >= NESSYS_CHR_PAL_WIN_MIN) return nes->ppu.pal + (addr & NESSYS_PPU_PAL_MASK);
 //	uint16_t b = addr >> NESSYS_CHR_BANK_SIZE_LOG2;
-//	return nes.ppu.chr_rom_bank[b] + (addr & nes.ppu.chr_rom_bank_mask[b]);
+//	return nes->ppu.chr_rom_bank[b] + (addr & nes->ppu.chr_rom_bank_mask[b]);
 //}
 //
-//uint8_t* nessys_ppu_ram(uint16_t addr)
+//uint8_t* nessys_ppu_ram(nes, uint16_t addr)
 //{
-//	if (addr >= NESSYS_CHR_PAL_WIN_MIN) return nes.ppu.pal + (addr & NESSYS_PPU_PAL_MASK);
+//	if (addr >= NESSYS_CHR_PAL_WIN_MIN) return nes->ppu.pal + (addr & NESSYS_PPU_PAL_MASK);
 //	uint16_t b = addr >> NESSYS_CHR_BANK_SIZE_LOG2;
-//	return nes.ppu.chr_ram_bank[b] + (addr & nes.ppu.chr_ram_bank_mask[b]);
+//	return nes->ppu.chr_ram_bank[b] + (addr & nes->ppu.chr_ram_bank_mask[b]);
 //}
@@ -10,6 +10,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #ifdef WIN32
 #include <stdlib.h>
 #include <stdbool.h>
@@ -118,12 +119,20 @@ typedef unsigned int uint;
 #define NESSYS_CHR_ROM_END_BANK (NESSYS_CHR_ROM_WIN_MAX / NESSYS_CHR_BANK_SIZE)
 #define NESSYS_CHR_NTB_END_BANK (NESSYS_CHR_NTB_WIN_MAX / NESSYS_CHR_BANK_SIZE)
 
+// what each bank window was last mapped to, so remapping a window to where it already is costs a compare
+// rom windows hold their rom offset; ram windows, the ram offset with NESSYS_BANK_SRC_RAM set
+#define NESSYS_BANK_SRC_RAM 0x80000000
+#define NESSYS_BANK_SRC_NONE 0xFFFFFFFF
+
 // interrupt table addresses
 #define NESSYS_NMI_VECTOR 0xFFFA
 #define NESSYS_RST_VECTOR 0xFFFC
 // also used for BRK
 #define NESSYS_IRQ_VECTOR 0xFFFE
 
+// cpu cycles stolen from the cpu for each dmc sample fetch
+#define NESSYS_APU_DMC_FETCH_CYCLES 4
+
 // ppu timing - ntsc
 #define NESSYS_PPU_PER_CPU_CLK 3
 #define NESSYS_PPU_PER_APU_CLK (2 * NESSYS_PPU_PER_CPU_CLK)
@@ -210,9 +219,20 @@ static const uint16_t NESSYS_PPU_PALETTE[] = {
 #define NESSYS_STD_CONTROLLER_BUTTON_LEFT_MASK   (1 << NESSYS_STD_CONTROLLER_BUTTON_LEFT)
 #define NESSYS_STD_CONTROLLER_BUTTON_RIGHT_MASK  (1 << NESSYS_STD_CONTROLLER_BUTTON_RIGHT)
 
+// ntsc frame rate is 39375000 / 655171 (~60.0988 Hz)
+#define NESSYS_NTSC_FRAME_RATE_NUM 39375000
+#define NESSYS_NTSC_FRAME_RATE_DEN 655171
+#define NESSYS_NTSC_FRAME_TIME_US ((1000000ull * NESSYS_NTSC_FRAME_RATE_DEN) / NESSYS_NTSC_FRAME_RATE_NUM)
+
+#ifdef WIN32
 #define NESSYS_SND_SAMPLES_PER_SECOND 44100
-#define NESSYS_SND_BITS_PER_SAMPLE 16
 #define NESSYS_SND_BUFFERS 16
+#else
+// SRAM is tight on the pico, so use a lower rate and fewer buffers
+#define NESSYS_SND_SAMPLES_PER_SECOND 22050
+#define NESSYS_SND_BUFFERS 4
+#endif
+#define NESSYS_SND_BITS_PER_SAMPLE 16
 #define NESSYS_SND_SAMPLES ((NESSYS_SND_BUFFERS * NESSYS_SND_SAMPLES_PER_SECOND) / 60)
 #define NESSYS_SND_BYTES ((NESSYS_SND_BITS_PER_SAMPLE * NESSYS_SND_SAMPLES) / 8)
 #define NESSYS_SND_BYTES_SKEW 20
@@ -241,6 +261,51 @@ static const uint16_t NESSYS_PPU_PALETTE[] = {
 #define NESSYS_SND_FRAME_FRAC_MASK (NESSYS_SND_FRAME_FRAC - 1)
 #define NESSYS_SND_FRAME_FRAC_PER_SAMPLE ((4 << NESSYS_SND_FRAME_FRAC_LOG2) / NESSYS_SND_SAMPLES_PER_BUFFER)
 
+// samples generated per emulated frame at the true ntsc frame rate, in 12.20 fixed point
+// this is slightly less than a buffer, since buffers are sized for 60 Hz
+#define NESSYS_SND_FRAME_SAMPLES_FRAC ((((uint64_t)NESSYS_SND_SAMPLES_PER_SECOND * NESSYS_NTSC_FRAME_RATE_DEN) << NESSYS_SND_SAMPLES_FRAC_LOG2) / NESSYS_NTSC_FRAME_RATE_NUM)
+
+// samples in the output ring; consumers always take whole buffers
+#define NESSYS_SND_RING_SAMPLES (NESSYS_SND_BUFFERS * NESSYS_SND_SAMPLES_PER_BUFFER)
+// ring positions wrap at twice the ring size, so a full ring can be told from an empty one; the ring isn't a power
+// of 2, so free running counts would index it wrongly once they wrap
+#define NESSYS_SND_RING_WRAP (2 * NESSYS_SND_RING_SAMPLES)
+
+// dynamic rate control - the number of samples generated per frame is scaled by up to +/-0.5%
+// to keep the ring buffer centered; ratio is in 16.16 fixed point
+#define NESSYS_SND_RATE_FRAC_LOG2 16
+#define NESSYS_SND_RATE_ONE (1 << NESSYS_SND_RATE_FRAC_LOG2)
+#define NESSYS_SND_RATE_MAX_DELTA (NESSYS_SND_RATE_ONE / 200)
+
+// Set to 1 to accumulate the time spent in each channel generator (win32 only)
+#define NESSYS_SND_PROFILE 0
+
+#define NESSYS_SND_PROFILE_PULSE0 0
+#define NESSYS_SND_PROFILE_PULSE1 1
+#define NESSYS_SND_PROFILE_TRIANGLE 2
+#define NESSYS_SND_PROFILE_NOISE 3
+#define NESSYS_SND_PROFILE_DMC 4
+#define NESSYS_SND_PROFILE_CHANNELS 5
+
+#if NESSYS_SND_PROFILE
+#include <intrin.h>
+#define NESSYS_SND_PROFILE_GEN(ch, out, gen) { uint64_t t = __rdtsc(); out = gen; nes->apu.profile_ticks[ch] += __rdtsc() - t; }
+#else
+#define NESSYS_SND_PROFILE_GEN(ch, out, gen) out = gen
+#endif
+
+// Format of samples in the output ring; conversion happens as samples are generated, so the
+// output backend can send ring buffers straight to hardware
+#ifdef WIN32
+typedef int16_t nessys_snd_sample_t;
+#define NESSYS_SND_SAMPLE(s) ((int16_t)(s))
+#else
+// pwm duty cycle level, with silence at the midpoint
+#define NESSYS_SND_PWM_BITS 10
+typedef uint16_t nessys_snd_sample_t;
+#define NESSYS_SND_SAMPLE(s) ((uint16_t)(((s) + 32768) >> (16 - NESSYS_SND_PWM_BITS)))
+#endif
+
 // system structs
 typedef struct {
 	uint16_t pc;
@@ -295,6 +360,8 @@ static const uint16_t NESSYS_APU_NOISE_PERIOD_TABLE[16] = { 4, 8, 16, 32, 64, 96
 static const uint16_t NESSYS_APU_DMC_PERIOD_TABLE[16] = { 428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54 };
 
 #define NESSYS_MAPPER_FLAG_DATA_FROM_SOURCE 0x01
+// 0x6000-0x7FFF is mapped to rom, so stores there are dropped
+#define NESSYS_MAPPER_FLAG_PRG_RAM_READ_ONLY 0x02
 
 #define NESSYS_MAPPER_SETUP_DEFAULT 0x00
 #define NESSYS_MAPPER_SETUP_DRAW_INCOMPLETE 0x01
@@ -345,6 +412,7 @@ typedef struct {
 
 typedef struct {
 	uint32_t cur_time_frac;
+	uint32_t fetch_clk;  // ppu clock (same base as line_start_clk) of the next sample byte fetch
 	uint16_t start_addr;
 	uint16_t length;
 	uint16_t cur_addr;
@@ -362,11 +430,19 @@ typedef struct {
 	uint8_t joy_control;
 	uint8_t frame_counter;
 	uint8_t status;
-	uint8_t pad1;
+	uint8_t frame_step;
 	uint8_t joypad[2];
 	uint8_t latched_joypad[2];
 	uint32_t sample_frac_generated;
 	uint32_t frame_frac_counter;
+	uint32_t frame_samples_frac;     // samples to generate in this frame (12.20), including carry from the last frame
+	uint32_t cpu_frac_per_sample;    // cpu clocks per sample (22.10)
+	uint32_t frame_frac_per_sample;  // quarter frame steps per sample (12.20)
+	uint32_t rate;                   // current rate control ratio (16.16)
+	int32_t dc_level;
+#if NESSYS_SND_PROFILE
+	uint64_t profile_ticks[NESSYS_SND_PROFILE_CHANNELS];
+#endif
 	nessys_apu_pulse_t pulse[2];
 	nessys_apu_triangle_t triangle;
 	nessys_apu_noise_t noise;
@@ -374,6 +450,34 @@ typedef struct {
 	uint8_t* reg;
 } nessys_apu_regs_t;
 
+// ring of output samples, shared between the emulator (producer) and the audio backend (consumer)
+// positions run from 0 to NESSYS_SND_RING_WRAP; the consumer advances read_pos a whole buffer at a time
+typedef struct {
+	nessys_snd_sample_t sample[NESSYS_SND_RING_SAMPLES];
+	volatile uint32_t write_pos;
+	volatile uint32_t read_pos;
+	uint32_t write_index;
+	volatile uint32_t underruns;
+	uint32_t overruns;
+} nessys_snd_ring_t;
+
+static inline uint32_t nessys_snd_ring_advance(uint32_t pos, uint32_t count)
+{
+	pos += count;
+	return (pos >= NESSYS_SND_RING_WRAP) ? pos - NESSYS_SND_RING_WRAP : pos;
+}
+
+// samples from pos back to start
+static inline uint32_t nessys_snd_ring_distance(uint32_t pos, uint32_t start)
+{
+	return (pos >= start) ? pos - start : pos + NESSYS_SND_RING_WRAP - start;
+}
+
+static inline uint32_t nessys_snd_ring_index(uint32_t pos)
+{
+	return (pos >= NESSYS_SND_RING_SAMPLES) ? pos - NESSYS_SND_RING_SAMPLES : pos;
+}
+
 typedef struct {
 	uint8_t reg[NESSYS_PPU_REG_SIZE];
 	uint8_t status;
@@ -398,6 +502,8 @@ typedef struct {
 	uint8_t addr_toggle;
 	//uint8_t num_scan_line_oam;
 	bool scroll_y_changed;
+	bool oam_pix_dirty;  // pattern banks changed while rendering, so oam_pix must be regenerated
+	bool attrib_per_row;  // the mapper generates a palette for every tile of every row, 2 bits each, so swap them along with the tile pixels
 	bool name_tbl_vert_mirror;
 	uint32_t chr_rom_size;
 	uint32_t chr_ram_size;
@@ -407,6 +513,8 @@ typedef struct {
 	const uint8_t* chr_rom_bank[NESSYS_CHR_NUM_BANKS];
 	uint16_t chr_ram_bank_mask[NESSYS_CHR_NUM_BANKS];
 	uint8_t* chr_ram_bank[NESSYS_CHR_NUM_BANKS];
+	uint32_t chr_bank_src[NESSYS_CHR_ROM_END_BANK + 1];
+	uint8_t ntb_mirror;  // nametable arrangement last mapped, or MAPPER_MIRROR_NONE
 	uint8_t* mem_4screen;
 } nessys_ppu_t;
 
@@ -440,16 +548,17 @@ typedef struct {
 	bool sprite_background;
 } render_state_t;
 
-typedef struct {
+typedef struct nessys_s {
 	uint32_t mapper_id;
-	uint32_t (*mapper_bg_setup)(uint32_t phase);
-	uint32_t (*mapper_sprite_setup)(uint32_t phase);
-	void (*mapper_cpu_setup)();
-	void (*mapper_audio_tick)();
-	int16_t(*mapper_gen_sound)();
-	uint8_t* (*mapper_read)(uint16_t addr);
-	bool (*mapper_write)(uint16_t addr, uint8_t data);
-	bool (*mapper_update)();
+	bool (*mapper_bg_setup)(struct nessys_s* nes, uint y);  // generates the background tile row itself, if it returns true
+	uint32_t (*mapper_sprite_setup)(struct nessys_s* nes, uint32_t phase);
+	void (*mapper_cpu_setup)(struct nessys_s* nes);
+	void (*mapper_audio_tick)(struct nessys_s* nes);
+	int16_t(*mapper_gen_sound)(struct nessys_s* nes);
+	uint8_t* (*mapper_read)(struct nessys_s* nes, uint16_t addr);
+	bool (*mapper_write)(struct nessys_s* nes, uint16_t addr, uint8_t data);
+	bool (*mapper_update)(struct nessys_s* nes);  // called at the start of every scan line, to schedule the mapper's event
+	void (*mapper_event)(struct nessys_s* nes);   // called by nessys_process_events at mapper_event_scan_clk
 	void* mapper_data;
 	uint32_t cycle;
 	uint32_t frame;
@@ -462,14 +571,18 @@ typedef struct {
 	render_state_t c0_rstate;
 	render_state_t c1_rstate;
 	volatile bool c1_render_done;
+	bool c1_started;           // the ppu thread is running for this instance
+	volatile bool c1_park;     // set to stop the ppu thread at the top of its loop
+	volatile bool c1_parked;   // set by the ppu thread while it's stopped
 	uint sprite0_hit_scan_clk;
+	uint32_t line_start_clk;  // free running ppu clock at the start of the current scan line
+	uint32_t next_line_scan_clk;  // clocks carried over into the next scan line, from the prior line or an irq
+	uint event_scan_clk;      // scan_clk on this line at which nessys_process_events must run
+	uint mapper_event_scan_clk;  // scan_clk on this line of the mapper's next event, ~0 if none
 	bool vblank_irq;
 	bool mapper_irq;
 	bool frame_irq;
 	bool dmc_irq;
-	uint32_t dmc_bits_to_play;
-	uint32_t dmc_bit_timer;
-	uint32_t dmc_buffer_full;
 	int32_t scanline;  // scanline number
 	int32_t scanline_cycle;  // cycles after the start of current scanline
 	uint32_t cpu_cycle_inc;
@@ -479,14 +592,17 @@ typedef struct {
 	uint8_t pad0[1];
 	nessys_cpu_regs_t reg;
 	nessys_apu_regs_t apu;
+	nessys_snd_ring_t* snd_ring;  // if NULL, generated sound is discarded
 	nessys_ppu_t ppu;
 	uint32_t prg_rom_size;
 	uint32_t prg_ram_size;
+	uint32_t cart_id;  // from nessys_cart_id, when the cart is loaded
 	uint8_t sysmem[NESSYS_RAM_SIZE];
 	const uint8_t* prg_rom_base;
 	uint8_t* prg_ram_base;
 	uint16_t prg_rom_bank_mask[NESSYS_PRG_NUM_BANKS];
 	const uint8_t* prg_rom_bank[NESSYS_PRG_NUM_BANKS];
+	uint32_t prg_bank_src[NESSYS_PRG_NUM_BANKS];
 #ifdef _DEBUG
 	uint32_t backtrace_entry;
 	uint32_t stack_trace_entry;
@@ -498,80 +614,190 @@ typedef struct {
 	//nesmenu_data menu;
 	//uint32_t num_joy;
 	//nesjoy_data joy_data[2];
+	// the instance's own memory, handed to it by the frontend; last, since nessys_init and state loads keep it
+	uint16_t* framebuffer;  // FB_BUFFERS frames
+	uint16_t* draw_frame;
+	uint16_t* disp_frame;
+	void* tbox;             // TEXTBOX_T drawn over the frame, or NULL
+	uint8_t* index_frame;   // nes colour of each pixel, row major, written alongside the frame on the host, or NULL
+	bool render_inline;     // no ppu thread renders for it; the cpu thread renders each line whole, at its end
+	bool logic_only;        // frames that aren't rendered skip the tile and sprite pixels too; pays off when chr banks switch mid frame
+	bool lend_back_buffer;  // a cart that needs more than aux_mem may take the back framebuffer, for single buffering
+	bool session;           // the frontend's save, rewind, movie and turbo are process wide, and belong to this instance
+	bool save_enable;       // restores and persists the battery backed ram, if this is the session instance
+	bool sram_budget_report;  // prints where the sram goes when a cart loads
+	uint8_t* aux_mem;       // cart arena, used unless the cart is lent the back framebuffer
+	uint8_t* aux_base;
+	uint32_t aux_size;
+	uint32_t aux_used;
+	uint cpu_loop;          // cpu loop instance used for the loaded cart
+	uint8_t* run_ahead_state;  // NULL if run ahead is off for the loaded cart
+	uint32_t run_ahead_size;
+	struct nescache_s* cache;  // bank cache in the cart arena, NULL if the cart left no room for it
 } nessys_t;
 
 #include "c6502.h"
 #include "ines.h"
 #include "nesmenu.h"
 
-extern nessys_t nes;
-
+// cpu loop instances; each mapper family gets one, with its hooks called directly (see emulate_frame_loop in main.c)
+#define CPU_LOOP_GENERIC 0
+#define CPU_LOOP_NROM 1      // mapper 0, and mappers without hooks; no mapper calls at all
+#define CPU_LOOP_DISCRETE 2  // mappers 2, 3, 7, 71, 180
+#define CPU_LOOP_MMC1 3
+#define CPU_LOOP_MMC3 4
+#define CPU_LOOP_MMC5 5
+#define CPU_LOOP_MMC2 6
+#define CPU_LOOP_FME7 7
+#define CPU_LOOP_COUNT 8
+
+// Everything about a mapper that's needed before its cart is running; a mapper is supported if it's in the table
+typedef struct {
+	uint16_t mapper_id;
+	uint8_t cpu_loop;
+	bool (*init)(nessys_t* nes);  // sets up the state and hooks; NULL if the mapper runs from the default memory map
+	uint32_t state_size;   // bytes of cart arena the state takes
+	uint32_t state_fixed;  // bytes at the start of the state that only depend on the cart; save states keep the running cart's copy
+	uint32_t prg_ram_default;  // prg ram of an ines 1.0 cart that gives no size and has no battery; 0 for boards without any
+} nessys_mapper_t;
+
+// Everything takes the instance it works on, and instances share only constant tables, so each can be stepped on a
+// thread of its own. Setting one up, from nessys_init through loading its cart, is done one instance at a time.
+// Each instance has its own bank cache, in its cart arena. Battery saves, rewind and movies each serve a single
+// instance; the others run without them
 void nessys_apu_env_tick(nessys_apu_envelope_t* envelope);
 void nessys_apu_tri_linear_tick(nessys_apu_triangle_t* triangle);
 void nessys_apu_tri_length_tick(nessys_apu_triangle_t* triangle);
 void nessys_apu_noise_length_tick(nessys_apu_noise_t* noise);
 void nessys_apu_sweep_tick(nessys_apu_pulse_t* pulse);
+void nessys_apu_pulse_length_tick(nessys_apu_pulse_t* pulse);
+void nessys_apu_write(nessys_t* nes, uint8_t offset);
+uint8_t nessys_apu_status(nessys_t* nes);
+void nessys_apu_start_frame(nessys_t* nes, uint32_t rate);
 void nessys_gen_sound(nessys_t* nes);
 
-uint8_t nessys_apu_gen_pulse(nessys_apu_pulse_t* pulse);
-uint8_t nessys_apu_gen_triangle(nessys_apu_triangle_t* triangle);
-uint8_t nessys_apu_gen_noise(nessys_apu_noise_t* noise);
+uint8_t nessys_apu_gen_pulse(nessys_t* nes, nessys_apu_pulse_t* pulse);
+uint8_t nessys_apu_gen_triangle(nessys_t* nes, nessys_apu_triangle_t* triangle);
+uint8_t nessys_apu_gen_noise(nessys_t* nes, nessys_apu_noise_t* noise);
 uint8_t nessys_apu_gen_dmc(nessys_t* nes);
 
-void nessys_init();
-void nessys_power_cycle();
-void nessys_reset();
-bool nessys_load_cart(const void* cart);
-bool nessys_init_mapper();
-void nessys_default_memmap();
-void nessys_irq(uint16_t irq_vector, uint8_t clear_flag);
-void nessys_gen_oam_pix(uint8_t sprite_index);
-void nessys_gen_tile_pix(uint y);
-void nessys_cleanup_mapper();
-void nessys_unload_cart();
+void nessys_init(nessys_t* nes);
+void nessys_power_cycle(nessys_t* nes);
+void nessys_reset(nessys_t* nes);
+bool nessys_load_cart(nessys_t* nes, const void* cart);
+const nessys_mapper_t* nessys_mapper_find(uint32_t mapper_id);
+bool nessys_init_mapper(nessys_t* nes);
+bool nessys_mapper_supported(uint32_t mapper_id);
+uint32_t nessys_mapper_state_size(nessys_t* nes);
+uint32_t nessys_mapper_state_fixed(nessys_t* nes);
+uint32_t nessys_cart_id(nessys_t* nes);
+void nessys_default_memmap(nessys_t* nes);
+void nessys_irq(nessys_t* nes, uint16_t irq_vector, uint8_t clear_flag);
+void nessys_update_events(nessys_t* nes);
+bool nessys_process_events(nessys_t* nes);
+void nessys_gen_oam_pix(nessys_t* nes, uint8_t sprite_index);
+void nessys_gen_tile_pix(nessys_t* nes, uint y);
+void nessys_gen_ntb_tile_pix(nessys_t* nes, uint y);
+void nessys_gen_ntb_tile_range(nessys_t* nes, uint y, uint first, uint last);
+void nessys_sprite_status(nessys_t* nes, uint y, bool overflow);
+void nessys_cleanup_mapper(nessys_t* nes);
+void nessys_unload_cart(nessys_t* nes);
 void nessys_cleanup();
 
-void process_ppu();
+// cart memory allocator, released when the cart is unloaded
+void* alloc_aux(nessys_t* nes, uint32_t size);
+
+// renders the scan line the cpu is on, as far as it has run; loops forever on core 1 with PPU_MULTI_THREAD
+void process_ppu(nessys_t* nes);
+// runs the cpu and ppu for one frame, with the cpu loop picked for the cart; pixels are rendered if
+// frame_delta_time <= 0
+void emulate_frame(nessys_t* nes);
+
+#ifdef WIN32
+// host frontend, in main.c
+nessys_t* nes_instance_create();
+void nes_instance_destroy(nessys_t* nes);
+uint8_t* load_rom_file(const char* rom_file);
+#endif
 
 //uint8_t* nessys_ram(uint16_t addr);
 //const uint8_t* nessys_mem(uint16_t addr, uint16_t* bank, uint16_t* offset);
 //const uint8_t* nessys_ppu_mem(uint16_t addr);
 //uint8_t* nessys_ppu_ram(uint16_t addr);
 
-static inline uint8_t* nessys_ram(uint16_t addr)
+// Set to 1 to build in the model of the pico's xip flash cache, which counts misses on rom reads, for
+// -bank_cache_bench (win32 only); see nescache.c
+#ifndef NESSYS_FLASH_SIM
+#define NESSYS_FLASH_SIM 0
+#endif
+
+#if NESSYS_FLASH_SIM
+extern bool nescache_flash_sim;
+void nescache_flash_sim_read(const nessys_t* nes, const uint8_t* p);
+#define NESSYS_FLASH_SIM_READ(p) do { if (nescache_flash_sim) nescache_flash_sim_read(nes, p); } while (0)
+#else
+#define NESSYS_FLASH_SIM_READ(p) do { } while (0)
+#endif
+
+static inline uint8_t* nessys_ram(nessys_t* nes, uint16_t addr)
 {
-	return nes.sysmem + (addr & NESSYS_RAM_MASK);
+	return nes->sysmem + (addr & NESSYS_RAM_MASK);
 }
 
-static inline const uint8_t* nessys_mem(uint16_t addr, uint16_t* bank, uint16_t* offset)
+static inline const uint8_t* nessys_mem(nessys_t* nes, uint16_t addr, uint16_t* bank, uint16_t* offset)
 {
 	uint16_t b = addr >> NESSYS_PRG_BANK_SIZE_LOG2;
-	uint16_t o = addr & nes.prg_rom_bank_mask[b];
+	uint16_t o = addr & nes->prg_rom_bank_mask[b];
 	*bank = b;
 	*offset = o;
-	return nes.prg_rom_bank[b] + o;
+	NESSYS_FLASH_SIM_READ(nes->prg_rom_bank[b] + o);
+	return nes->prg_rom_bank[b] + o;
 }
 
-static inline const uint8_t* nessys_ppu_mem(uint16_t addr)
+static inline const uint8_t* nessys_ppu_mem(nessys_t* nes, uint16_t addr)
 {
-	if (addr >= NESSYS_CHR_PAL_WIN_MIN) return nes.ppu.pal + (addr & NESSYS_PPU_PAL_MASK);
+	if (addr >= NESSYS_CHR_PAL_WIN_MIN) return nes->ppu.pal + (addr & NESSYS_PPU_PAL_MASK);
 	uint16_t b = addr >> NESSYS_CHR_BANK_SIZE_LOG2;
-	return nes.ppu.chr_rom_bank[b] + (addr & nes.ppu.chr_rom_bank_mask[b]);
+	NESSYS_FLASH_SIM_READ(nes->ppu.chr_rom_bank[b] + (addr & nes->ppu.chr_rom_bank_mask[b]));
+	return nes->ppu.chr_rom_bank[b] + (addr & nes->ppu.chr_rom_bank_mask[b]);
 }
 
-static inline uint8_t* nessys_ppu_ram(uint16_t addr)
+static inline uint8_t* nessys_ppu_ram(nessys_t* nes, uint16_t addr)
 {
-	if (addr >= NESSYS_CHR_PAL_WIN_MIN) return nes.ppu.pal + (addr & NESSYS_PPU_PAL_MASK);
+	if (addr >= NESSYS_CHR_PAL_WIN_MIN) return nes->ppu.pal + (addr & NESSYS_PPU_PAL_MASK);
 	uint16_t b = addr >> NESSYS_CHR_BANK_SIZE_LOG2;
-	return nes.ppu.chr_ram_bank[b] + (addr & nes.ppu.chr_ram_bank_mask[b]);
+	return nes->ppu.chr_ram_bank[b] + (addr & nes->ppu.chr_ram_bank_mask[b]);
+}
+
+// Value read back from a joypad port; the buttons shift out one per read, A first, then 1s
+// While the strobe is high, the buttons are reloaded on every read
+static inline uint8_t nessys_joypad_read(nessys_t* nes, uint j)
+{
+	uint8_t bit;
+	if (nes->apu.joy_control & 0x1) nes->apu.latched_joypad[j] = nes->apu.joypad[j];
+	bit = nes->apu.latched_joypad[j] & 0x1;
+	nes->apu.latched_joypad[j] = (nes->apu.latched_joypad[j] >> 1) | 0x80;
+	// the upper bits are open bus, which is the high byte of the address
+	return bit | 0x40;
+}
+
+// Side effects of the cpu reading apu register offset, from any instruction or addressing mode that reads it; the
+// value read is left in apu.reg
+static inline void nessys_apu_read(nessys_t* nes, uint16_t offset)
+{
+	if (offset == NESSYS_APU_STATUS_OFFSET) {
+		nes->apu.reg[NESSYS_APU_STATUS_OFFSET] = nessys_apu_status(nes);
+	} else if (offset >= NESSYS_APU_JOYPAD0_OFFSET && offset <= NESSYS_APU_JOYPAD1_OFFSET) {
+		nes->apu.reg[offset] = nessys_joypad_read(nes, offset - NESSYS_APU_JOYPAD0_OFFSET);
+	}
 }
 
-static inline uint8_t nessys_get_scan_position()
+static inline uint8_t nessys_get_scan_position(nessys_t* nes)
 {
-	uint32_t position = nes.scanline_cycle + 28;
+	uint32_t position = nes->scanline_cycle + 28;
 	position &= ~0x7;
-	position -= nes.ppu.scroll[0];
-	if (position >= 256 || nes.scanline < 0) position = 0;
+	position -= nes->ppu.scroll[0];
+	if (position >= 256 || nes->scanline < 0) position = 0;
 	return (uint8_t)position;
 }
 